@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Measures allocation on the pooled allocator.
+#
+# For each program it prints the best "Run Time" of RUNS runs (default 3)
+# from `apeslang run --stats`, the allocation rate of that run in millions of
+# allocations per second, and the largest resident set size of any run in
+# KB. There is no malloc build to compare against any more: the malloc path
+# went away with the mark bitmaps.
+#
+# Usage: ./bench/alloc.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+RUNS="${RUNS:-3}"
+OUT="$(mktemp -d)"
+
+make -C "$ROOT" >/dev/null 2>&1
+BIN="$ROOT/apeslang"
+
+printf "%-18s %8s %8s %8s\n" "program" "ms" "M/s" "RSS KB"
+
+for source in "$BENCH_DIR"/*.ape; do
+    program="$(basename "$source" .ape)"
+    cp "$source" "$OUT/"
+    (cd "$OUT" && "$BIN" compile "$program.ape" >/dev/null)
+    best="" rate="" rss=0
+    for _ in $(seq "$RUNS"); do
+        line=$(cd "$OUT" && "$BIN" run --stats "$program.apb" </dev/null 2>/dev/null || true)
+        ms=$(echo "$line" | sed -n 's/^Run Time: \([0-9.]*\) ms$/\1/p')
+        kb=$(echo "$line" | sed -n 's/^Max RSS: \([0-9]*\) KB$/\1/p')
+        if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+            best=$ms
+            rate=$(echo "$line" | sed -n 's/^Allocation Rate: \([0-9.]*\) M.*$/\1/p')
+        fi
+        if [ "${kb:-0}" -gt "$rss" ]; then
+            rss=$kb
+        fi
+    done
+    printf "%-18s %8s %8s %8s\n" "$program" "$best" "${rate:--}" "$rss"
+done
+
+rm -rf "$OUT"
@@ -0,0 +1,54 @@
+#!/bin/bash
+#
+# Compares `apeslang run` (with the JIT) against the same programs compiled
+# ahead of time (`apeslang aot` and then cc -O2 against libaperuntime.a).
+#
+# A compiled program prints no stats, so both columns are the wall time of
+# the whole process, start-up included (best of RUNS runs, default 3).
+#
+# Usage: ./bench/aot.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+RUNS="${RUNS:-3}"
+CC="${CC:-cc}"
+OUT="$(mktemp -d)"
+
+make -C "$ROOT" clean >/dev/null 2>&1
+make -C "$ROOT" >/dev/null 2>&1
+BIN="$ROOT/apeslang"
+
+# Prints the best wall time in ms of running the given command in `dir`.
+measure() {
+    local dir="$1" best="" start end ms
+    shift
+    for _ in $(seq "$RUNS"); do
+        start=$(date +%s%N)
+        (cd "$dir" && "$@" </dev/null >/dev/null 2>&1 || true)
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+printf "%-18s %10s %10s\n" "program" "run ms" "aot ms"
+
+for source in "$BENCH_DIR"/*.ape; do
+    dir="$(dirname "$source")"
+    program="$(basename "$source" .ape)"
+    (cd "$dir" && "$BIN" compile "$program.ape" >/dev/null)
+    (cd "$dir" && "$BIN" aot "$program.apb" -o "$OUT/$program.c" >/dev/null)
+    "$CC" -O2 -I"$ROOT/src" "$OUT/$program.c" "$ROOT/libaperuntime.a" \
+        -lm -pthread -o "$OUT/$program"
+    run_ms=$(measure "$dir" "$BIN" run "$program.apb")
+    aot_ms=$(measure "$dir" "$OUT/$program")
+    printf "%-18s %10s %10s\n" "$program" "$run_ms" "$aot_ms"
+done
+
+rm -rf "$OUT"
+rm -f "$BENCH_DIR"/*.apb
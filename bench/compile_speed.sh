@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Measures parse and compile throughput on a large generated source file.
+#
+# The generated program repeats a block of tribes, loops, conditionals,
+# literals and calls with fresh names, so every global, constant and tribe
+# table grows with it. Reports the best of RUNS (default 3) compile times.
+#
+# Usage:
+#   ./bench/compile_speed.sh                  # 20000 blocks, ~300k lines
+#   BLOCKS=5000 ./bench/compile_speed.sh      # at most 21845 (global slots)
+#   ./bench/compile_speed.sh path/to/apeslang # time another build
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BIN="${1:-$ROOT/apeslang}"
+BLOCKS="${BLOCKS:-20000}"
+RUNS="${RUNS:-3}"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+awk -v blocks="$BLOCKS" 'BEGIN {
+    for (i = 0; i < blocks; i++) {
+        printf "tribe step%d(n, acc) {\n", i
+        printf "  ape i = 0\n"
+        printf "  banana (i < n) {\n"
+        printf "    acc = acc ooh i eek 2 aah (acc ook 3)\n"
+        printf "    if (acc >= 100 ripe i != 7) { acc = acc aah 100 } else { acc = acc ooh 1 }\n"
+        printf "    i = i ooh 1\n"
+        printf "  }\n"
+        printf "  give acc\n"
+        printf "}\n"
+        printf "ape g%d = step%d(3, %d)\n", i, i, i
+        printf "ape s%d = {\"k%d\": \"v%d\", \"list\": [1, 2, g%d]}\n", i, i, i, i
+        printf "swing 2 { s%d[\"k%d\"] = graft(s%d[\"k%d\"], \"!\") }\n", i, i, i, i
+        printf "tumble { tree s%d[\"list\"][2] } catch (e) { tree e }\n", i
+    }
+}' > "$WORK/big.ape"
+
+lines=$(wc -l < "$WORK/big.ape")
+bytes=$(wc -c < "$WORK/big.ape")
+best=""
+for _ in $(seq "$RUNS"); do
+    start=$(date +%s%N)
+    (cd "$WORK" && "$BIN" compile big.ape >/dev/null)
+    end=$(date +%s%N)
+    elapsed=$(( (end - start) / 1000000 ))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+        best=$elapsed
+    fi
+done
+
+echo "source: $lines lines, $bytes bytes"
+echo "compile: $best ms ($(( lines * 1000 / (best > 0 ? best : 1) )) lines/s)"
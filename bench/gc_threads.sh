@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Times major collections on gc_nested.ape, the biggest heap among the
+# benchmarks, with the marking and sweeping shared among 1, 2, 4 and 8 gc
+# threads (APE_GC_THREADS). SETTINGS lists the APE_GC_SLICE:APE_GC_SHARE_MIN
+# pairs to try, by default:
+#
+#   1000000000:65536  every slice is big enough to share, so each
+#                     collection runs in a pause or two
+#   4096:4096         the default incremental slices, all shared
+#   600:1             small slices. The VM raises APE_GC_SHARE_MIN to 256
+#                     units per thread, so only 2 threads share them.
+#
+# Prints, for the run with the least collection time out of RUNS (default 5),
+# how many slices were shared, the total and the longest major collection
+# pause and the run time, all in ms. THREADS overrides the thread counts
+# tried. With more threads than CPUs the threads take turns, so those rows
+# show overhead, not scaling.
+#
+# Usage: ./bench/gc_threads.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+RUNS="${RUNS:-5}"
+THREADS="${THREADS:-1 2 4 8}"
+SETTINGS="${SETTINGS:-1000000000:65536 4096:4096 600:1}"
+PROGRAM="gc_nested"
+
+make -C "$ROOT" >/dev/null 2>&1
+BIN="$ROOT/apeslang"
+(cd "$BENCH_DIR" && "$BIN" compile -O "$PROGRAM.ape" >/dev/null)
+
+CPUS=$(nproc)
+echo "$PROGRAM on $CPUS CPUs"
+
+for setting in $SETTINGS; do
+    slice="${setting%%:*}"
+    share_min="${setting#*:}"
+    echo
+    echo "APE_GC_SLICE=$slice APE_GC_SHARE_MIN=$share_min"
+    printf "%-8s %8s %10s %12s %10s\n" "threads" "shared" "major ms" "longest ms" "run ms"
+    for threads in $THREADS; do
+        best=""
+        for _ in $(seq "$RUNS"); do
+            stats=$(cd "$BENCH_DIR" && APE_GC_THREADS=$threads \
+                APE_GC_SLICE=$slice APE_GC_SHARE_MIN=$share_min \
+                "$BIN" run --stats "$PROGRAM.apb")
+            major=$(echo "$stats" | sed -n 's/^Major GCs: .*slices, \([0-9.]*\) ms, longest slice \([0-9.]*\) ms.*/\1 \2/p')
+            run=$(echo "$stats" | sed -n 's/^Run Time: \([0-9.]*\) ms/\1/p')
+            shared=$(echo "$stats" | sed -n 's/^GC Threads: .*(\([0-9]*\) slices shared)/\1/p')
+            if [ -z "$best" ] || awk "BEGIN { exit !(${major% *} < ${best%% *}) }"; then
+                best="$major $run ${shared:-0}"
+            fi
+        done
+        read -r major longest run shared <<< "$best"
+        note=""
+        if [ "$threads" -gt "$CPUS" ]; then
+            note="overhead only: more threads than CPUs"
+        fi
+        printf "%-8s %8s %10s %12s %10s  %s\n" "$threads" "$shared" "$major" \
+            "$longest" "$run" "$note"
+    done
+done
+
+rm -f "$BENCH_DIR/$PROGRAM.apb"
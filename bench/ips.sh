@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Reports instructions per second for the computed-goto and switch
+# dispatch loops.
+#
+# Instruction counts come from a PROFILE=1 build; wall times come from
+# regular builds of each dispatch mode, using the "Run Time" line of
+# `apeslang run --stats` (best of RUNS runs, default 3). Both run with
+# --no-jit, so every instruction goes through the dispatch loop.
+#
+# Usage: ./bench/ips.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+BIN_DIR="$BENCH_DIR/bin"
+RUNS="${RUNS:-3}"
+
+mkdir -p "$BIN_DIR"
+
+build() {
+    make -C "$ROOT" clean >/dev/null 2>&1
+    # shellcheck disable=SC2086
+    make -C "$ROOT" $2 >/dev/null 2>&1
+    cp "$ROOT/apeslang" "$BIN_DIR/apeslang-$1"
+}
+
+build profile "PROFILE=1"
+build goto "COMPUTED_GOTO=1"
+build switch "COMPUTED_GOTO=0"
+make -C "$ROOT" clean >/dev/null 2>&1
+make -C "$ROOT" >/dev/null 2>&1
+
+# Example programs read from stdin; feed them something sensible.
+input_for() {
+    case "$1" in
+        calc)      printf '1\n2\n3\n3\n4\n5\n0\n' ;;
+        factorial) printf '10\n' ;;
+        fibonacci) printf '30\n' ;;
+        nsum)      printf '1000\n' ;;
+        secret)    printf '3\n9\n7\n' ;;
+        test)      printf 'Koko\n' ;;
+    esac
+}
+
+# Prints "<instructions> <best run time in ms>" for one program.
+measure() {
+    local bin="$1" dir="$2" program="$3" line
+    (cd "$dir" && "$bin" compile "$program.ape" >/dev/null)
+    local count best=""
+    for _ in $(seq "$RUNS"); do
+        line=$(cd "$dir" && input_for "$program" | "$bin" run --stats --no-jit "$program.apb" 2>/dev/null || true)
+        local ms
+        ms=$(echo "$line" | sed -n 's/^Run Time: \([0-9.]*\) ms$/\1/p')
+        count=$(echo "$line" | sed -n 's/^Instructions: \([0-9]*\)$/\1/p')
+        if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+            best=$ms
+        fi
+    done
+    echo "${count:--} $best"
+}
+
+printf "%-18s %14s %12s %12s %12s %12s\n" "program" "instructions" \
+    "goto ms" "goto Mi/s" "switch ms" "switch Mi/s"
+
+for source in "$BENCH_DIR"/*.ape "$ROOT"/example/*.ape; do
+    dir="$(dirname "$source")"
+    program="$(basename "$source" .ape)"
+    read -r count _ < <(measure "$BIN_DIR/apeslang-profile" "$dir" "$program")
+    read -r _ goto_ms < <(measure "$BIN_DIR/apeslang-goto" "$dir" "$program")
+    read -r _ switch_ms < <(measure "$BIN_DIR/apeslang-switch" "$dir" "$program")
+    awk -v p="$program" -v n="$count" -v g="$goto_ms" -v s="$switch_ms" 'BEGIN {
+        gi = (g > 0 && n != "-") ? sprintf("%.0f", n / g / 1000) : "-";
+        si = (s > 0 && n != "-") ? sprintf("%.0f", n / s / 1000) : "-";
+        printf "%-18s %14s %12s %12s %12s %12s\n", p, n, g, gi, s, si
+    }'
+done
+
+rm -f "$BENCH_DIR"/*.apb "$ROOT"/example/*.apb
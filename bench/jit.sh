@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Compares the stack VM with and without the JIT (`apeslang run --no-jit`).
+#
+# Wall times come from a regular build, using the "Run Time" line of
+# `apeslang run --stats` (best of RUNS runs, default 3); the JIT column also
+# shows how many tribes were compiled.
+#
+# Usage: ./bench/jit.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+RUNS="${RUNS:-3}"
+
+make -C "$ROOT" clean >/dev/null 2>&1
+make -C "$ROOT" >/dev/null 2>&1
+BIN="$ROOT/apeslang"
+
+# Prints "<tribes compiled> <best run time in ms>" for one program.
+measure() {
+    local dir="$1" program="$2" flags="$3" line
+    local compiled best=""
+    for _ in $(seq "$RUNS"); do
+        # shellcheck disable=SC2086
+        line=$(cd "$dir" && "$BIN" run --stats $flags "$program.apb" </dev/null 2>/dev/null || true)
+        local ms
+        ms=$(echo "$line" | sed -n 's/^Run Time: \([0-9.]*\) ms$/\1/p')
+        compiled=$(echo "$line" | sed -n 's/^JIT: \([0-9]*\) tribes.*$/\1/p')
+        if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+            best=$ms
+        fi
+    done
+    echo "${compiled:--} $best"
+}
+
+printf "%-18s %10s %10s %8s\n" "program" "interp ms" "jit ms" "tribes"
+
+for source in "$BENCH_DIR"/*.ape; do
+    dir="$(dirname "$source")"
+    program="$(basename "$source" .ape)"
+    (cd "$dir" && "$BIN" compile "$program.ape" >/dev/null)
+    read -r _ interp_ms < <(measure "$dir" "$program" "--no-jit")
+    read -r compiled jit_ms < <(measure "$dir" "$program" "")
+    printf "%-18s %10s %10s %8s\n" "$program" "$interp_ms" "$jit_ms" "$compiled"
+done
+
+rm -f "$BENCH_DIR"/*.apb
@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# Compares the stack VM with the register VM (`apeslang compile --registers`).
+#
+# Instruction counts come from a PROFILE=1 build; wall times come from a
+# regular build, using the "Run Time" line of `apeslang run --stats` (best of
+# RUNS runs, default 3). The JIT is off, so both modes are interpreted.
+#
+# Usage: ./bench/registers.sh
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+BIN_DIR="$BENCH_DIR/bin"
+RUNS="${RUNS:-3}"
+
+mkdir -p "$BIN_DIR"
+
+build() {
+    make -C "$ROOT" clean >/dev/null 2>&1
+    # shellcheck disable=SC2086
+    make -C "$ROOT" $2 >/dev/null 2>&1
+    cp "$ROOT/apeslang" "$BIN_DIR/apeslang-$1"
+}
+
+build profile "PROFILE=1"
+build default ""
+
+# The two globals-only examples, with inputs large enough to time.
+input_for() {
+    case "$1" in
+        fibonacci) printf '1000000\n' ;;
+        nsum)      printf '1000000\n' ;;
+    esac
+}
+
+# Prints "<instructions> <best run time in ms>" for one program.
+measure() {
+    local bin="$1" dir="$2" program="$3" flags="$4" line
+    # shellcheck disable=SC2086
+    (cd "$dir" && "$bin" compile $flags "$program.ape" >/dev/null)
+    local count best=""
+    for _ in $(seq "$RUNS"); do
+        line=$(cd "$dir" && input_for "$program" | "$bin" run --stats --no-jit "$program.apb" 2>/dev/null || true)
+        local ms
+        ms=$(echo "$line" | sed -n 's/^Run Time: \([0-9.]*\) ms$/\1/p')
+        count=$(echo "$line" | sed -n 's/^Instructions: \([0-9]*\)$/\1/p')
+        if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+            best=$ms
+        fi
+    done
+    echo "${count:--} $best"
+}
+
+printf "%-18s %14s %14s %10s %10s\n" "program" "stack instrs" \
+    "register instrs" "stack ms" "register ms"
+
+for source in "$BENCH_DIR"/*.ape "$ROOT"/example/fibonacci.ape "$ROOT"/example/nsum.ape; do
+    dir="$(dirname "$source")"
+    program="$(basename "$source" .ape)"
+    read -r stack_count _ < <(measure "$BIN_DIR/apeslang-profile" "$dir" "$program" "")
+    read -r register_count _ < <(measure "$BIN_DIR/apeslang-profile" "$dir" "$program" "--registers")
+    read -r _ stack_ms < <(measure "$BIN_DIR/apeslang-default" "$dir" "$program" "")
+    read -r _ register_ms < <(measure "$BIN_DIR/apeslang-default" "$dir" "$program" "--registers")
+    printf "%-18s %14s %14s %10s %10s\n" "$program" "$stack_count" \
+        "$register_count" "$stack_ms" "$register_ms"
+done
+
+rm -f "$BENCH_DIR"/*.apb "$ROOT"/example/*.apb
@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Builds apeslang in one or more configurations and times every benchmark
+# program in bench/ with each of them.
+#
+# Usage:
+#   ./bench/run.sh                               # default configurations
+#   ./bench/run.sh "tagged:" "nanbox:NAN_BOXING=1"
+#
+# Each configuration is "<name>:<make variables>". Programs run RUNS times
+# (default 3) and the best wall time is reported in milliseconds, together
+# with the peak heap size the VM reports in its stats.
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BENCH_DIR="$ROOT/bench"
+BIN_DIR="$BENCH_DIR/bin"
+RUNS="${RUNS:-3}"
+
+if [ $# -eq 0 ]; then
+    set -- "tagged:" "nanbox:NAN_BOXING=1"
+fi
+
+mkdir -p "$BIN_DIR"
+
+build_config() {
+    local name="$1"
+    local vars="$2"
+    echo "🛠️  Building '$name' ($vars)" >&2
+    make -C "$ROOT" clean >/dev/null 2>&1
+    # shellcheck disable=SC2086
+    make -C "$ROOT" $vars >/dev/null 2>&1
+    cp "$ROOT/apeslang" "$BIN_DIR/apeslang-$name"
+}
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+time_program() {
+    local bin="$1"
+    local apb="$2"
+    local best=""
+    local peak=""
+    for _ in $(seq "$RUNS"); do
+        local start end output
+        start=$(now_ms)
+        output=$("$bin" run "$apb" </dev/null)
+        end=$(now_ms)
+        local elapsed=$(( end - start ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        peak=$(echo "$output" | sed -n 's/^Peak Memory: \([0-9]*\) bytes$/\1/p')
+    done
+    echo "$best ${peak:--}"
+}
+
+names=()
+for config in "$@"; do
+    name="${config%%:*}"
+    vars="${config#*:}"
+    build_config "$name" "$vars"
+    names+=("$name")
+done
+
+# Leave a default build behind for whoever runs `make` next.
+make -C "$ROOT" clean >/dev/null 2>&1
+make -C "$ROOT" >/dev/null 2>&1
+
+printf "%-22s" "program"
+for name in "${names[@]}"; do
+    printf "%22s" "$name ms / peak B"
+done
+printf "\n"
+
+for source in "$BENCH_DIR"/*.ape; do
+    program="$(basename "$source" .ape)"
+    printf "%-22s" "$program"
+    for name in "${names[@]}"; do
+        bin="$BIN_DIR/apeslang-$name"
+        (cd "$BENCH_DIR" && "$bin" compile "$program.ape" >/dev/null)
+        read -r ms peak < <(cd "$BENCH_DIR" && time_program "$bin" "$program.apb")
+        printf "%22s" "$ms / $peak"
+    done
+    printf "\n"
+done
+
+rm -f "$BENCH_DIR"/*.apb
@@ -0,0 +1,463 @@
+#include "bytecode.h"
+
+static bool readU16(const uint8_t** cursor, const uint8_t* end, uint16_t* out) {
+    if (end - *cursor < (long)sizeof(uint16_t)) return false;
+    memcpy(out, *cursor, sizeof(uint16_t));
+    *cursor += sizeof(uint16_t);
+    return true;
+}
+
+static bool readU32(const uint8_t** cursor, const uint8_t* end, uint32_t* out) {
+    if (end - *cursor < (long)sizeof(uint32_t)) return false;
+    memcpy(out, *cursor, sizeof(uint32_t));
+    *cursor += sizeof(uint32_t);
+    return true;
+}
+
+static bool readGlobals(const uint8_t* data, uint32_t length, ApbModule* module) {
+    const uint8_t* cursor = data;
+    const uint8_t* end = data + length;
+    uint16_t count;
+    if (!readU16(&cursor, end, &count)) return false;
+
+    module->globals = (ApbName*)malloc(sizeof(ApbName) * (count > 0 ? count : 1));
+    if (module->globals == NULL) return false;
+    module->globalCount = count;
+
+    for (int i = 0; i < count; i++) {
+        if (cursor >= end) return false;
+        uint8_t nameLength = *cursor++;
+        if (end - cursor < nameLength) return false;
+        module->globals[i].chars = (const char*)cursor;
+        module->globals[i].length = nameLength;
+        cursor += nameLength;
+    }
+    return true;
+}
+
+static bool readConstants(const uint8_t* data, uint32_t length, ApbModule* module) {
+    const uint8_t* cursor = data;
+    const uint8_t* end = data + length;
+    uint16_t count;
+    if (!readU16(&cursor, end, &count)) return false;
+
+    module->constants = (ApbConstant*)malloc(sizeof(ApbConstant) * (count > 0 ? count : 1));
+    if (module->constants == NULL) return false;
+    module->constantCount = count;
+
+    for (int i = 0; i < count; i++) {
+        if (cursor >= end) return false;
+        uint8_t kind = *cursor++;
+        if (kind != APB_CONSTANT_STRING) return false;
+        uint32_t stringLength;
+        if (!readU32(&cursor, end, &stringLength)) return false;
+        if ((uint32_t)(end - cursor) < stringLength) return false;
+        module->constants[i].kind = APB_CONSTANT_STRING;
+        module->constants[i].chars = (const char*)cursor;
+        module->constants[i].length = stringLength;
+        cursor += stringLength;
+    }
+    return true;
+}
+
+static bool readFunctions(const uint8_t* data, uint32_t length, ApbModule* module) {
+    const uint8_t* cursor = data;
+    const uint8_t* end = data + length;
+    uint16_t count;
+    if (!readU32(&cursor, end, &module->stack)) return false;
+    if (!readU16(&cursor, end, &count)) return false;
+
+    module->functions = (ApbFunction*)malloc(sizeof(ApbFunction) * (count > 0 ? count : 1));
+    if (module->functions == NULL) return false;
+    module->functionCount = count;
+
+    for (int i = 0; i < count; i++) {
+        ApbFunction* function = &module->functions[i];
+        if (cursor >= end) return false;
+        function->arity = *cursor++;
+        if (!readU32(&cursor, end, &function->address)) return false;
+        if (!readU32(&cursor, end, &function->stack)) return false;
+        if (cursor >= end) return false;
+        uint8_t nameLength = *cursor++;
+        if (end - cursor < nameLength) return false;
+        function->name.chars = (const char*)cursor;
+        function->name.length = nameLength;
+        cursor += nameLength;
+    }
+    return true;
+}
+
+static bool readHandlers(const uint8_t* data, uint32_t length, ApbModule* module) {
+    const uint8_t* cursor = data;
+    const uint8_t* end = data + length;
+    uint32_t count;
+    if (!readU32(&cursor, end, &count)) return false;
+    if ((uint32_t)(end - cursor) / (4 * sizeof(uint32_t) + 2) < count) return false;
+
+    module->handlers = (TumbleHandler*)malloc(sizeof(TumbleHandler) * (count > 0 ? count : 1));
+    if (module->handlers == NULL) return false;
+    module->handlerCount = (int)count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        TumbleHandler* handler = &module->handlers[i];
+        readU32(&cursor, end, &handler->function);
+        readU32(&cursor, end, &handler->start);
+        readU32(&cursor, end, &handler->end);
+        readU32(&cursor, end, &handler->target);
+        handler->depth = *cursor++;
+        handler->slot = *cursor++;
+    }
+    return true;
+}
+
+bool readApb(const uint8_t* data, size_t size, ApbModule* module) {
+    module->flags = 0;
+    module->stack = 0;
+    module->globalCount = 0;
+    module->globals = NULL;
+    module->constantCount = 0;
+    module->constants = NULL;
+    module->functionCount = 0;
+    module->functions = NULL;
+    module->handlerCount = 0;
+    module->handlers = NULL;
+    module->code = NULL;
+    module->codeSize = 0;
+
+    if (size < 5 || memcmp(data, APB_MAGIC, 3) != 0 || data[3] != APB_VERSION ||
+        (data[4] & ~APB_FLAG_REGISTERS) != 0) {
+        return false;
+    }
+    module->flags = data[4];
+
+    const uint8_t* cursor = data + 5;
+    const uint8_t* end = data + size;
+    while (cursor < end) {
+        uint8_t tag = *cursor++;
+        uint32_t length;
+        if (!readU32(&cursor, end, &length)) goto malformed;
+        if ((size_t)(end - cursor) < length) goto malformed;
+
+        switch (tag) {
+            case APB_SECTION_GLOBALS:
+                if (!readGlobals(cursor, length, module)) goto malformed;
+                break;
+            case APB_SECTION_CONSTANTS:
+                if (!readConstants(cursor, length, module)) goto malformed;
+                break;
+            case APB_SECTION_FUNCTIONS:
+                if (!readFunctions(cursor, length, module)) goto malformed;
+                break;
+            case APB_SECTION_HANDLERS:
+                if (!readHandlers(cursor, length, module)) goto malformed;
+                break;
+            case APB_SECTION_CODE:
+                module->code = cursor;
+                module->codeSize = length;
+                break;
+            default:
+                goto malformed;
+        }
+        cursor += length;
+    }
+
+    if (module->code == NULL) goto malformed;
+    for (int i = 0; i < module->handlerCount; i++) {
+        TumbleHandler* handler = &module->handlers[i];
+        if (handler->start > handler->end || handler->end > module->codeSize ||
+            handler->target >= module->codeSize || handler->depth > handler->slot) {
+            goto malformed;
+        }
+    }
+    return true;
+
+malformed:
+    freeApb(module);
+    return false;
+}
+
+void freeApb(ApbModule* module) {
+    free(module->globals);
+    module->globals = NULL;
+    module->globalCount = 0;
+    free(module->constants);
+    module->constants = NULL;
+    module->constantCount = 0;
+    free(module->functions);
+    module->functions = NULL;
+    module->functionCount = 0;
+    free(module->handlers);
+    module->handlers = NULL;
+    module->handlerCount = 0;
+}
+
+void writeApbHeader(FILE* out, uint8_t flags) {
+    uint8_t version = APB_VERSION;
+    fwrite(APB_MAGIC, sizeof(char), 3, out);
+    fwrite(&version, sizeof(uint8_t), 1, out);
+    fwrite(&flags, sizeof(uint8_t), 1, out);
+}
+
+void writeApbSection(FILE* out, ApbSection tag, const void* data, uint32_t length) {
+    uint8_t tagByte = (uint8_t)tag;
+    fwrite(&tagByte, sizeof(uint8_t), 1, out);
+    fwrite(&length, sizeof(uint32_t), 1, out);
+    if (length > 0) fwrite(data, sizeof(uint8_t), length, out);
+}
+
+const TumbleHandler* findHandler(const TumbleHandler* handlers, int count,
+                                 uint32_t offset) {
+    for (int i = 0; i < count; i++) {
+        if (handlers[i].start <= offset && offset < handlers[i].end) return &handlers[i];
+    }
+    return NULL;
+}
+
+int instructionLength(const uint8_t* code, int offset) {
+    switch (code[offset]) {
+        case OP_PUSH:
+            // Only numbers are pushed inline: type byte, then the double
+            return 2 + sizeof(double);
+        case OP_CONSTANT:
+        case OP_FUNCTION:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT_POP:
+            return 1 + sizeof(uint16_t);
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILD_BUNCH:
+        case OP_BUILD_CANOPY:
+            return 2;
+        case OP_GET_LOCAL_PAIR:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP:
+        case OP_LOOP:
+            return 3;
+        case OP_SWING_COUNT:
+        case OP_SWING_RANGE:
+        case OP_SWING_STEP:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+bool stackEffect(const uint8_t* code, int offset, int* pops, int* pushes) {
+    const uint8_t* at = &code[offset];
+    *pops = 0;
+    *pushes = 0;
+    switch (at[0]) {
+        case OP_PUSH: case OP_CONSTANT: case OP_FUNCTION: case OP_NIL:
+        case OP_TRUE: case OP_FALSE: case OP_ASK: case OP_GET_GLOBAL_SLOT:
+        case OP_GET_LOCAL:
+            *pushes = 1;
+            break;
+        case OP_GET_LOCAL_PAIR:
+            *pushes = 2;
+            break;
+        case OP_POP: case OP_PRINT: case OP_SET_GLOBAL_SLOT_POP:
+        case OP_SET_LOCAL_POP: case OP_POP_JUMP_IF_FALSE: case OP_RETURN:
+            *pops = 1;
+            break;
+        case OP_NOT: case OP_SET_GLOBAL_SLOT: case OP_SET_LOCAL: case OP_SUMMON:
+        case OP_FORAGE: case OP_SHED: case OP_STRLEN:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_EQUAL:
+        case OP_GREATER: case OP_LESS: case OP_NOT_EQUAL: case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL: case OP_GET_SUBSCRIPT: case OP_INSCRIBE:
+        case OP_GRAFT: case OP_SCAN:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_SLICE: case OP_SET_SUBSCRIPT:
+            *pops = 3;
+            *pushes = 1;
+            break;
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+            *pops = 2;
+            break;
+        case OP_CALL:
+            *pops = at[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_TAIL_CALL:
+            *pops = at[1] + 1;
+            break;
+        case OP_BUILD_BUNCH:
+            *pops = at[1];
+            *pushes = 1;
+            break;
+        case OP_BUILD_CANOPY:
+            *pops = 2 * at[1];
+            *pushes = 1;
+            break;
+        case OP_JUMP_IF_FALSE: case OP_JUMP: case OP_LOOP: case OP_SWING_COUNT:
+        case OP_SWING_RANGE: case OP_SWING_STEP:
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Records that `target` is reached with `depth` slots in use, and queues it
+// to be walked again if that is more than it was reached with before.
+static bool reachDepth(int* depths, uint32_t size, long target, int depth,
+                       uint32_t* worklist, int* pending, bool* queued) {
+    if (target < 0 || target >= (long)size || depth > STACK_DEPTH_MAX) return false;
+    if (depths[target] >= depth) return true;
+    depths[target] = depth;
+    if (!queued[target]) {
+        queued[target] = true;
+        worklist[(*pending)++] = (uint32_t)target;
+    }
+    return true;
+}
+
+int stackDepth(const uint8_t* code, uint32_t size, uint32_t entry, int arity,
+               const TumbleHandler* handlers, int handlerCount) {
+    int* depths = (int*)malloc(sizeof(int) * (size + 1));
+    uint32_t* worklist = (uint32_t*)malloc(sizeof(uint32_t) * (size + 1));
+    bool* queued = (bool*)calloc(size + 1, sizeof(bool));
+    if (depths == NULL || worklist == NULL || queued == NULL) exit(1);
+    for (uint32_t i = 0; i < size; i++) depths[i] = -1;
+    int pending = 0;
+    int deepest = arity + 1;
+    bool ok = reachDepth(depths, size, entry, arity + 1, worklist, &pending, queued);
+
+    while (ok && pending > 0) {
+        uint32_t offset = worklist[--pending];
+        queued[offset] = false;
+        const uint8_t* at = &code[offset];
+        int depth = depths[offset];
+        uint32_t next = offset + instructionLength(code, offset);
+        int pops, pushes;
+        if (next > size || !stackEffect(code, offset, &pops, &pushes)) {
+            ok = false;
+            break;
+        }
+        // A failure anywhere in a tumble block lands in its catch block with
+        // the catch variable on top.
+        for (int i = 0; ok && i < handlerCount; i++) {
+            const TumbleHandler* handler = &handlers[i];
+            if (handler->function != entry || handler->start > offset ||
+                offset >= handler->end) {
+                continue;
+            }
+            if (handler->slot + 1 > deepest) deepest = handler->slot + 1;
+            ok = reachDepth(depths, size, handler->target, handler->slot + 1,
+                            worklist, &pending, queued);
+        }
+        int after = depth - pops < 0 ? 0 : depth - pops;
+        after += pushes;
+        if (depth > deepest) deepest = depth;
+        if (after > deepest) deepest = after;
+        // Jumps push nothing, so they land with the depth after them.
+        uint16_t jump = next - offset >= 3 ? (uint16_t)(at[1] << 8 | at[2]) : 0;
+        bool falls = true;
+        switch (at[0]) {
+            case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_EQUAL: case OP_SWING_RANGE:
+                ok = reachDepth(depths, size, (long)next + jump, after, worklist,
+                                &pending, queued);
+                break;
+            case OP_JUMP:
+                falls = false;
+                ok = reachDepth(depths, size, (long)next + jump, after, worklist,
+                                &pending, queued);
+                break;
+            case OP_SWING_COUNT: case OP_SWING_STEP:
+                ok = reachDepth(depths, size, (long)next - jump, after, worklist,
+                                &pending, queued);
+                break;
+            case OP_LOOP:
+                falls = false;
+                ok = reachDepth(depths, size, (long)next - jump, after, worklist,
+                                &pending, queued);
+                break;
+            case OP_RETURN: case OP_TAIL_CALL:
+                falls = false;
+                break;
+        }
+        if (ok && falls) {
+            ok = reachDepth(depths, size, next, after, worklist, &pending, queued);
+        }
+    }
+    free(depths);
+    free(worklist);
+    free(queued);
+    return ok ? deepest : -1;
+}
+
+int registerInstructionLength(const uint8_t* code, int offset) {
+    switch (code[offset]) {
+        case R_NUMBER:
+            return 2 + sizeof(double);
+        case R_CONSTANT:
+        case R_FUNCTION:
+        case R_GET_GLOBAL:
+        case R_SET_GLOBAL:
+            return 2 + sizeof(uint16_t);
+        case R_ENTER:
+        case R_NIL:
+        case R_TRUE:
+        case R_FALSE:
+        case R_PRINT:
+        case R_ASK:
+        case R_RETURN:
+        case R_SUMMON:
+            return 2;
+        case R_MOVE:
+        case R_NOT:
+        case R_JUMP:
+        case R_LOOP:
+        case R_CALL:
+        case R_TAIL_CALL:
+        case R_FORAGE:
+        case R_SLICE:
+        case R_GRAFT:
+        case R_SCAN:
+        case R_SHED:
+        case R_STRLEN:
+            return 3;
+        case R_ADD:
+        case R_SUB:
+        case R_MUL:
+        case R_DIV:
+        case R_EQUAL:
+        case R_NOT_EQUAL:
+        case R_GREATER:
+        case R_GREATER_EQUAL:
+        case R_LESS:
+        case R_LESS_EQUAL:
+        case R_BUILD_BUNCH:
+        case R_BUILD_CANOPY:
+        case R_GET_SUBSCRIPT:
+        case R_SET_SUBSCRIPT:
+        case R_INSCRIBE:
+        case R_JUMP_IF_FALSE:
+        case R_JUMP_IF_TRUE:
+        case R_SWING_COUNT:
+        case R_SWING_RANGE:
+        case R_SWING_STEP:
+            return 4;
+        case R_JUMP_IF_NOT_LESS:
+        case R_JUMP_IF_NOT_GREATER:
+        case R_JUMP_IF_NOT_EQUAL:
+            return 5;
+        default:
+            return 1;
+    }
+}
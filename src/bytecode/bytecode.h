@@ -0,0 +1,118 @@
+#ifndef APE_BYTECODE_H
+#define APE_BYTECODE_H
+
+#include "../common.h"
+
+// A compiled .apb file is a small header followed by tagged sections:
+//
+//   'A' 'P' 'B' version:u8 flags:u8
+//   tag:u8 length:u32 payload[length]     (repeated)
+//
+// Sections:
+//   APB_SECTION_GLOBALS  count:u16, then count x (length:u8 name)
+//                        Global slot N in the code refers to name N.
+//   APB_SECTION_CONSTANTS
+//                        count:u16, then count x (kind:u8 payload). The only
+//                        kind so far is APB_CONSTANT_STRING, whose payload is
+//                        length:u32 chars. OP_CONSTANT N refers to entry N.
+//   APB_SECTION_FUNCTIONS
+//                        stack:u32 count:u16, then count x (arity:u8
+//                        address:u32 stack:u32 length:u8 name), one
+//                        prototype per tribe declaration. OP_FUNCTION N
+//                        refers to entry N. Each stack is the most value
+//                        slots the code uses at once, counted from its callee
+//                        slot; the first one is the top-level code's.
+//   APB_SECTION_HANDLERS count:u32, then count x (function:u32 start:u32
+//                        end:u32 target:u32 depth:u8 slot:u8), one entry per
+//                        tumble block (see TumbleHandler). Optional; entries
+//                        of one function are listed innermost block first.
+//   APB_SECTION_CODE     the bytecode itself. Code addresses (function
+//                        bodies, handler offsets) are offsets into it.
+//
+// APB_FLAG_REGISTERS in the flags byte marks code in the register
+// instruction set (REGISTER_OPCODE_LIST) rather than the stack one. Every
+// function in such a file, the top-level code at address 0 included, starts
+// with an R_ENTER that gives the size of its frame.
+//
+// Multi-byte integers are stored in host byte order, except the 16-bit jump
+// offsets inside the code, which are big-endian.
+#define APB_MAGIC "APB"
+#define APB_VERSION 9
+
+#define APB_FLAG_REGISTERS 0x01
+
+typedef enum {
+    APB_SECTION_GLOBALS = 'G',
+    APB_SECTION_CONSTANTS = 'K',
+    APB_SECTION_FUNCTIONS = 'F',
+    APB_SECTION_HANDLERS = 'H',
+    APB_SECTION_CODE = 'C',
+} ApbSection;
+
+typedef struct {
+    const char* chars;
+    int length;
+} ApbName;
+
+typedef enum {
+    APB_CONSTANT_STRING = 's',
+} ApbConstantKind;
+
+typedef struct {
+    ApbConstantKind kind;
+    const char* chars;
+    uint32_t length;
+} ApbConstant;
+
+typedef struct {
+    int arity;
+    uint32_t address;
+    uint32_t stack;
+    ApbName name;
+} ApbFunction;
+
+// A parsed view of an .apb image. Names, constants and code point into the
+// image; the handler table is a copy.
+typedef struct {
+    uint8_t flags;
+    uint32_t stack; // of the top-level code
+    int globalCount;
+    ApbName* globals;
+    int constantCount;
+    ApbConstant* constants;
+    int functionCount;
+    ApbFunction* functions;
+    int handlerCount;
+    TumbleHandler* handlers;
+    const uint8_t* code;
+    uint32_t codeSize;
+} ApbModule;
+
+bool readApb(const uint8_t* data, size_t size, ApbModule* module);
+void freeApb(ApbModule* module);
+
+void writeApbHeader(FILE* out, uint8_t flags);
+void writeApbSection(FILE* out, ApbSection tag, const void* data, uint32_t length);
+
+// The first of one function's `handlers` whose block holds the instruction
+// at `offset`, which is the innermost one, or NULL.
+const TumbleHandler* findHandler(const TumbleHandler* handlers, int count,
+                                 uint32_t offset);
+
+// Size in bytes of the instruction starting at code[offset].
+int instructionLength(const uint8_t* code, int offset);
+// How many values the stack instruction at code[offset] pops and then
+// pushes. Returns false for an opcode the compiler never writes.
+bool stackEffect(const uint8_t* code, int offset, int* pops, int* pushes);
+// The stack a function of the stack instruction set needs: the most value
+// slots, counted from its callee slot, that the code starting at `entry`
+// has in use at once, a catch block's included. `handlers` may hold other
+// functions' entries too. Returns -1 when the code runs off its end, uses an
+// unknown instruction or would need more than STACK_DEPTH_MAX slots.
+#define STACK_DEPTH_MAX UINT16_MAX
+int stackDepth(const uint8_t* code, uint32_t size, uint32_t entry, int arity,
+               const TumbleHandler* handlers, int handlerCount);
+// The same for code in the register instruction set.
+int registerInstructionLength(const uint8_t* code, int offset);
+
+#endif
@@ -10,74 +10,247 @@
 #include <ctype.h>
 
 
+// Every opcode the VM understands, in bytecode order. The list is expanded
+// into the OpCode enum below and into the interpreter's dispatch table, so a
+// new instruction only has to be added here.
+#define OPCODE_LIST(X)                      \
+    /* Constants, Literals */               \
+    X(OP_PUSH)                              \
+    X(OP_CONSTANT)      /* u16 constant */  \
+    X(OP_FUNCTION)      /* u16 prototype */ \
+    X(OP_NIL)                               \
+    X(OP_TRUE)                              \
+    X(OP_FALSE)                             \
+    X(OP_POP)                               \
+    /* Unary */                             \
+    X(OP_NOT)                               \
+    /* Binary Arithmetic */                 \
+    X(OP_ADD)                               \
+    X(OP_SUB)                               \
+    X(OP_MUL)                               \
+    X(OP_DIV)                               \
+    /* Binary Comparison */                 \
+    X(OP_EQUAL)                             \
+    X(OP_GREATER)                           \
+    X(OP_LESS)                              \
+    /* Control Flow */                      \
+    X(OP_JUMP_IF_FALSE)                     \
+    X(OP_JUMP)                              \
+    X(OP_SWING_COUNT) /* u16 back, slot */  \
+    X(OP_SWING_RANGE) /* u16 exit, slot */  \
+    X(OP_SWING_STEP)  /* u16 back, slot */  \
+    /* Statements */                        \
+    X(OP_PRINT)                             \
+    X(OP_ASK)                               \
+    X(OP_GET_GLOBAL_SLOT) /* u16 slot */    \
+    X(OP_SET_GLOBAL_SLOT) /* u16 slot */    \
+    X(OP_GET_LOCAL)                         \
+    X(OP_SET_LOCAL)                         \
+    /* Functions */                         \
+    X(OP_CALL)                              \
+    X(OP_TAIL_CALL)     /* give f(...) */   \
+    X(OP_RETURN)                            \
+                                            \
+    X(OP_BUILD_BUNCH)   /* arrays/lists */  \
+    X(OP_BUILD_CANOPY)  /* maps */          \
+    X(OP_GET_SUBSCRIPT)                     \
+    X(OP_SET_SUBSCRIPT)                     \
+                                            \
+    X(OP_SUMMON)        /* modules */       \
+                                            \
+    X(OP_LOOP)                              \
+                                            \
+    /* File I/O */                          \
+    X(OP_FORAGE)                            \
+    X(OP_INSCRIBE)                          \
+                                            \
+    X(OP_SLICE)                             \
+    X(OP_GRAFT)                             \
+    X(OP_SCAN)                              \
+    X(OP_SHED)                              \
+    X(OP_STRLEN)                            \
+                                            \
+    /* Superinstructions */                 \
+    X(OP_GET_LOCAL_PAIR)  /* u8 u8 */       \
+    X(OP_SET_LOCAL_POP)                     \
+    X(OP_SET_GLOBAL_SLOT_POP) /* u16 */     \
+    X(OP_NOT_EQUAL)                         \
+    X(OP_GREATER_EQUAL)                     \
+    X(OP_LESS_EQUAL)                        \
+    X(OP_POP_JUMP_IF_FALSE)                 \
+    X(OP_JUMP_IF_NOT_LESS)                  \
+    X(OP_JUMP_IF_NOT_GREATER)               \
+    X(OP_JUMP_IF_NOT_EQUAL)                 \
+                                            \
+    /* Quickened forms: written by the */   \
+    /* VM over generic instructions at */   \
+    /* run time, never by the compiler */   \
+    X(OP_ADD_NUM)                           \
+    X(OP_ADD_STR)                           \
+    X(OP_SUB_NUM)                           \
+    X(OP_MUL_NUM)                           \
+    X(OP_DIV_NUM)                           \
+    X(OP_EQUAL_NUM)                         \
+    X(OP_GREATER_NUM)                       \
+    X(OP_LESS_NUM)
+
 typedef enum {
-    // Constants, Literals
-    OP_PUSH,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    // Unary
-    OP_NOT,
-    // Binary Arithmetic
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    // Binary Comparison
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    // Control Flow
-    OP_JUMP_IF_FALSE,
-    OP_JUMP,
-    OP_JUMP_BACK,
-    OP_LOOP_START,
-    // Statements
-    OP_PRINT,
-    OP_ASK,
-    OP_GET_GLOBAL, 
-    OP_SET_GLOBAL, 
-    OP_GET_LOCAL,  
-    OP_SET_LOCAL,  
-    // Functions
-    OP_CALL,
-    OP_RETURN,
-
-    OP_BUILD_BUNCH,    //  arrays/lists
-    OP_BUILD_CANOPY,   //  maps/dictionaries
-    OP_GET_SUBSCRIPT,  
-    OP_SET_SUBSCRIPT,  
-
-    OP_TUMBLE_SETUP, //  try/catch
-    OP_TUMBLE_END,   //  try/catch
-    OP_SUMMON,       //  modules
-
-    OP_LOOP,
-    
-    // File I/O
-    OP_FORAGE,
-    OP_INSCRIBE,
-    
-    OP_SLICE,
-    OP_GRAFT,
-    OP_SCAN,
-    OP_SHED,
-    OP_STRLEN,
+#define OPCODE_ENUM(name) name,
+    OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    OP_COUNT
+} OpCode;
 
+// The instruction set of files compiled with `--registers`, run by a second
+// interpreter loop. Instead of pushing and popping, instructions name the
+// frame slots ("registers") they read and write: `R_ADD a b c` stores
+// r[b] + r[c] into r[a]. A frame's registers are its callee slot, then its
+// locals in declaration order, then temporaries. Registers are u8 operands;
+// the other operands are laid out as in the stack code, with 16-bit jump
+// offsets last so a jump lands relative to the end of its instruction.
+#define REGISTER_OPCODE_LIST(X)                                  \
+    X(R_ENTER)          /* n: registers the frame uses */       \
+    X(R_MOVE)           /* a b: a = b */                        \
+    X(R_NUMBER)         /* a f64 */                             \
+    X(R_CONSTANT)       /* a u16 constant */                    \
+    X(R_FUNCTION)       /* a u16 prototype */                   \
+    X(R_NIL)            /* a */                                 \
+    X(R_TRUE)           /* a */                                 \
+    X(R_FALSE)          /* a */                                 \
+    X(R_GET_GLOBAL)     /* a u16 slot: a = global */            \
+    X(R_SET_GLOBAL)     /* a u16 slot: global = a */            \
+    X(R_NOT)            /* a b */                               \
+    X(R_ADD)            /* a b c: a = b + c */                  \
+    X(R_SUB)                                                    \
+    X(R_MUL)                                                    \
+    X(R_DIV)                                                    \
+    X(R_EQUAL)                                                  \
+    X(R_NOT_EQUAL)                                              \
+    X(R_GREATER)                                                \
+    X(R_GREATER_EQUAL)                                          \
+    X(R_LESS)                                                   \
+    X(R_LESS_EQUAL)                                             \
+    X(R_JUMP)           /* offset */                            \
+    X(R_LOOP)           /* offset, backwards */                 \
+    X(R_JUMP_IF_FALSE)  /* a offset */                          \
+    X(R_JUMP_IF_TRUE)   /* a offset */                          \
+    X(R_JUMP_IF_NOT_LESS)    /* a b offset: unless a < b */     \
+    X(R_JUMP_IF_NOT_GREATER)                                    \
+    X(R_JUMP_IF_NOT_EQUAL)                                      \
+    X(R_SWING_COUNT)    /* a offset: swing count, backwards */  \
+    X(R_SWING_RANGE)    /* a offset: a from, a+1 to; exit */    \
+    X(R_SWING_STEP)     /* a offset: a += 1, backwards */       \
+    X(R_PRINT)          /* a */                                 \
+    X(R_ASK)            /* a */                                 \
+    X(R_CALL)           /* a argc: callee and arguments in */   \
+    X(R_TAIL_CALL)      /* a.., the result lands in a */        \
+    X(R_RETURN)         /* a */                                 \
+    X(R_BUILD_BUNCH)    /* a b n: a = [b .. b+n-1] */           \
+    X(R_BUILD_CANOPY)   /* a b n: n key/value pairs from b */   \
+    X(R_GET_SUBSCRIPT)  /* a b c: a = b[c] */                   \
+    X(R_SET_SUBSCRIPT)  /* a b c: a[b] = c */                   \
+    X(R_SUMMON)         /* a: path, then the module's result */ \
+    X(R_FORAGE)         /* a b */                               \
+    X(R_INSCRIBE)       /* a b c */                             \
+    X(R_SLICE)          /* a b: slice(b, b+1, b+2) */           \
+    X(R_GRAFT)          /* a b: graft(b, b+1) */                \
+    X(R_SCAN)           /* a b: scan(b, b+1) */                 \
+    X(R_SHED)           /* a b */                               \
+    X(R_STRLEN)         /* a b */
 
-} OpCode;
+typedef enum {
+#define OPCODE_ENUM(name) name,
+    REGISTER_OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    R_COUNT
+} RegisterOpCode;
 
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 typedef struct ObjFunction ObjFunction;
+typedef struct JitCode JitCode;
+
+// A tumble block costs nothing until something fails: instead of
+// instructions that enter and leave it, the compiler lists it in a table.
+// A runtime error raised by the code in [start, end) of the function that
+// starts at `function` continues at `target`, with slots depth..slot-1 of
+// the frame set to nil and the error message in slot `slot`, the catch
+// variable. Offsets are into the code section of the .apb; depth is how many
+// slots were in use at the start of the block.
+typedef struct {
+    uint32_t function;
+    uint32_t start;
+    uint32_t end;
+    uint32_t target;
+    uint8_t depth;
+    uint8_t slot;
+} TumbleHandler;
+
+// The inline cache of one call site: the callee it last called, the address
+// that callee's code starts at, and the VM's cache epoch when the entry was
+// filled. An entry from an older epoch is treated as empty.
+typedef struct {
+    Obj* callee;
+    uint8_t* entry;
+    uint32_t epoch;
+} CallCache;
+
+typedef struct VM VM;
 
 typedef struct ObjBunch ObjBunch;
 typedef struct ObjCanopy ObjCanopy;
 
 
 typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+
+#ifdef NAN_BOXING
+
+// Every Value is a single 64-bit word. Numbers are stored as plain doubles;
+// everything else hides inside the unused payload of a quiet NaN. Objects set
+// the sign bit and keep their pointer in the low 48 bits, while nil, true
+// and false are small tags in the lowest bits.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value)     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+// A NaN's payload could spell out any other Value, so every NaN becomes the
+// one quiet NaN, which no tag or pointer uses.
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    if (num != num) value = (uint64_t)0x7ff8000000000000;
+    return value;
+}
+
+#else
+
 typedef struct {
     ValueType type;
     union { bool boolean; double number; Obj* obj; } as;
@@ -95,6 +268,8 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 typedef enum {
     OBJ_STRING,
     OBJ_FUNCTION,
@@ -106,7 +281,10 @@ typedef enum {
 struct Obj {
     ObjType type;
 
-    bool isMarked; 
+    bool forwarded;    // a nursery object a minor collection has copied out
+    bool remembered;   // in the VM's remembered set (see writeBarrier())
+    // In a forwarded object, the copy. In a copy, the next one the minor
+    // collection has yet to scan.
     struct Obj* next;  
 
 };
@@ -128,6 +306,18 @@ struct ObjFunction {
     ObjString* name;
 
     bool isModule;
+    int registers;    // frame size of register code; 0 for stack code
+    int stack;        // value slots the code needs from its callee slot on
+    uint32_t hotness; // calls and loop iterations, counted towards the JIT
+    JitCode* jit;     // machine code once the JIT has compiled the tribe
+    bool (*native)(VM* vm); // C code of a program compiled by `apeslang aot`
+    // The function's tumble blocks, innermost first; a module owns the array
+    // its tribes point into.
+    TumbleHandler* handlers;
+    int handlerCount;
+    // A module's call-site caches, one per two bytes of its code, which its
+    // tribes share. NULL for tribes and compiled programs.
+    CallCache* calls;
 };
 
 struct ObjBunch { // Arrays/Lists
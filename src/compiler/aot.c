@@ -0,0 +1,1084 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../bytecode/bytecode.h"
+#include "../vm/vm.h"
+#include "aot.h"
+
+#define AOT_MODULES_MAX 256
+
+typedef struct {
+  char* path;          // the summon path, NULL for the script
+  uint8_t* image;
+  ApbModule apb;
+  int* globals;        // the program-wide index of each of its global slots
+  int firstConstant;   // vm->constants index of its constant 0; its tribes follow
+} AotModule;
+
+typedef struct {
+  AotModule modules[AOT_MODULES_MAX];
+  int moduleCount;
+  const char** globals; // names, pointing into the module images
+  int* globalLengths;
+  int globalCount;
+  int globalCapacity;
+  int constantCount;
+} Aot;
+
+// One function being translated: a tribe or a module's top-level code.
+typedef struct {
+  Aot* aot;
+  AotModule* module;
+  const uint8_t* code;
+  uint32_t size;
+  int arity;
+  TumbleHandler* handlers; // the function's, innermost first
+  int handlerCount;
+
+  // Filled in by analyse(), per code offset.
+  int* depth;         // stack depth before the instruction, -1 if unreachable
+  bool* label;        // whether anything jumps there
+  bool dynamic;       // the depth differs between paths somewhere
+  int maxDepth;
+
+  // Emission state. In static mode slot i of the frame lives in C local
+  // `si`; dirty[i] is set while that local is newer than fp[i].
+  FILE* out;
+  int d;
+  bool* dirty;
+  bool* used;         // whether the code names si at all
+  bool* written;      // whether si is ever newer than fp[i]
+  uint32_t offset;    // of the instruction being emitted
+  bool throws;        // something jumps to throw_
+  bool* catches;      // whether anything jumps to catch<i>, for handler i
+  int indent;
+} Function;
+
+static char* readBinaryFile(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+  fseek(file, 0L, SEEK_END);
+  *size = (size_t)ftell(file);
+  rewind(file);
+  char* buffer = (char*)malloc(*size > 0 ? *size : 1);
+  if (buffer == NULL) exit(1);
+  size_t bytesRead = fread(buffer, 1, *size, file);
+  fclose(file);
+  if (bytesRead < *size) {
+    free(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+static int programGlobal(Aot* aot, const char* name, int length) {
+  for (int i = 0; i < aot->globalCount; i++) {
+    if (aot->globalLengths[i] == length &&
+        memcmp(aot->globals[i], name, length) == 0) {
+      return i;
+    }
+  }
+  if (aot->globalCount == aot->globalCapacity) {
+    aot->globalCapacity = aot->globalCapacity < 16 ? 16 : aot->globalCapacity * 2;
+    aot->globals = (const char**)realloc(aot->globals,
+                                         sizeof(char*) * aot->globalCapacity);
+    aot->globalLengths = (int*)realloc(aot->globalLengths,
+                                       sizeof(int) * aot->globalCapacity);
+    if (aot->globals == NULL || aot->globalLengths == NULL) exit(1);
+  }
+  aot->globals[aot->globalCount] = name;
+  aot->globalLengths[aot->globalCount] = length;
+  return aot->globalCount++;
+}
+
+// Reads the .apb at `file` as the next module. Returns false after printing
+// a message.
+static bool addModule(Aot* aot, const char* file, const char* summonPath) {
+  if (aot->moduleCount == AOT_MODULES_MAX) {
+    fprintf(stderr, "Too many modules summoned from \"%s\".\n", file);
+    return false;
+  }
+  AotModule* module = &aot->modules[aot->moduleCount];
+  size_t size = 0;
+  module->image = (uint8_t*)readBinaryFile(file, &size);
+  if (module->image == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", file);
+    return false;
+  }
+  if (!readApb(module->image, size, &module->apb)) {
+    fprintf(stderr, "\"%s\" is not a valid ApesLang bytecode file.\n", file);
+    free(module->image);
+    return false;
+  }
+  if (module->apb.flags & APB_FLAG_REGISTERS) {
+    fprintf(stderr, "\"%s\" was compiled with --registers; apeslang aot "
+                    "translates stack code, so recompile it without.\n", file);
+    freeApb(&module->apb);
+    free(module->image);
+    return false;
+  }
+  module->path = summonPath != NULL ? strdup(summonPath) : NULL;
+  module->globals = (int*)malloc(sizeof(int) *
+                                 (module->apb.globalCount > 0 ? module->apb.globalCount : 1));
+  if (module->globals == NULL) exit(1);
+  for (int i = 0; i < module->apb.globalCount; i++) {
+    module->globals[i] = programGlobal(aot, module->apb.globals[i].chars,
+                                       module->apb.globals[i].length);
+  }
+  module->firstConstant = aot->constantCount;
+  aot->constantCount += module->apb.constantCount + module->apb.functionCount;
+  aot->moduleCount++;
+  return true;
+}
+
+// Adds the modules `module` summons by a constant path that aren't in the
+// program yet. One that can't be read is left out with a warning: running the
+// summon reports it, as the interpreter would.
+static void addSummoned(Aot* aot, AotModule* module) {
+  const uint8_t* code = module->apb.code;
+  for (uint32_t offset = 0; offset < module->apb.codeSize;
+       offset += instructionLength(code, offset)) {
+    uint32_t next = offset + instructionLength(code, offset);
+    if (code[offset] != OP_CONSTANT || next >= module->apb.codeSize ||
+        code[next] != OP_SUMMON) {
+      continue;
+    }
+    uint16_t index;
+    memcpy(&index, &code[offset + 1], sizeof(uint16_t));
+    if (index >= module->apb.constantCount) continue;
+    ApbConstant* constant = &module->apb.constants[index];
+    char path[1024];
+    if (constant->length <= 4 || constant->length >= sizeof(path) ||
+        memcmp(constant->chars + constant->length - 4, ".ape", 4) != 0) {
+      continue;
+    }
+    memcpy(path, constant->chars, constant->length);
+    path[constant->length] = '\0';
+
+    bool known = false;
+    for (int i = 1; i < aot->moduleCount; i++) {
+      if (strcmp(aot->modules[i].path, path) == 0) known = true;
+    }
+    if (known) continue;
+    char file[1024];
+    snprintf(file, sizeof(file), "%.*s.apb", (int)constant->length - 4, path);
+    if (!addModule(aot, file, path)) {
+      fprintf(stderr, "Warning: leaving \"%s\" out of the program.\n", path);
+    }
+  }
+}
+
+// Records that `target` is reached with stack depth `depth`.
+static bool reach(Function* fn, long target, int depth, uint32_t* worklist,
+                  int* pending) {
+  if (target < 0 || target >= (long)fn->size) return false;
+  if (fn->depth[target] == -1) {
+    fn->depth[target] = depth;
+    worklist[(*pending)++] = (uint32_t)target;
+  } else if (fn->depth[target] != depth) {
+    fn->dynamic = true;
+  }
+  return true;
+}
+
+static uint16_t readOffset(const uint8_t* at) {
+  return (uint16_t)(at[0] << 8 | at[1]);
+}
+
+// Finds the instructions of the function starting at `entry`, with the
+// stack depth at each. Returns false when the code does
+// something the translation can't follow.
+static bool analyse(Function* fn, uint32_t entry) {
+  uint32_t* worklist = (uint32_t*)malloc(sizeof(uint32_t) * fn->size);
+  if (worklist == NULL) exit(1);
+  int pending = 0;
+  bool ok = reach(fn, entry, fn->arity + 1, worklist, &pending);
+
+  while (ok && pending > 0) {
+    uint32_t offset = worklist[--pending];
+    const uint8_t* at = &fn->code[offset];
+    int depth = fn->depth[offset];
+    uint32_t next = offset + instructionLength(fn->code, offset);
+    if (next > fn->size) {
+      ok = false;
+      break;
+    }
+    if (depth > fn->maxDepth) fn->maxDepth = depth;
+    // A failure anywhere in a tumble block lands in its catch block, with
+    // the error in the catch variable; the block's first instruction stands
+    // for all of them.
+    for (int i = 0; ok && i < fn->handlerCount; i++) {
+      TumbleHandler* handler = &fn->handlers[i];
+      if (handler->start != offset || handler->start == handler->end) continue;
+      if (handler->slot + 1 > fn->maxDepth) fn->maxDepth = handler->slot + 1;
+      ok = reach(fn, handler->target, handler->slot + 1, worklist, &pending);
+    }
+    int pops, pushes;
+    if (!stackEffect(fn->code, offset, &pops, &pushes)) {
+      ok = false;
+      break;
+    }
+    bool falls = true;
+    switch (at[0]) {
+      case OP_GET_LOCAL:
+        if (at[1] >= depth) fn->dynamic = true;
+        break;
+      case OP_GET_LOCAL_PAIR:
+        if (at[1] >= depth || at[2] >= depth) fn->dynamic = true;
+        break;
+      case OP_SET_LOCAL: case OP_SET_LOCAL_POP:
+        if (at[1] >= depth - 1) fn->dynamic = true;
+        break;
+      case OP_JUMP_IF_FALSE:
+        ok = reach(fn, (long)next + readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_POP_JUMP_IF_FALSE:
+        ok = reach(fn, (long)next + readOffset(at + 1), depth - 1, worklist, &pending);
+        break;
+      case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_EQUAL:
+        ok = reach(fn, (long)next + readOffset(at + 1), depth - 2, worklist, &pending);
+        break;
+      case OP_JUMP:
+        falls = false;
+        ok = reach(fn, (long)next + readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_LOOP:
+        falls = false;
+        ok = reach(fn, (long)next - readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_SWING_COUNT:
+        if (at[3] >= depth) fn->dynamic = true;
+        ok = reach(fn, (long)next - readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_SWING_RANGE:
+        if (at[3] + 1 >= depth) fn->dynamic = true;
+        ok = reach(fn, (long)next + readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_SWING_STEP:
+        if (at[3] + 1 >= depth) fn->dynamic = true;
+        ok = reach(fn, (long)next - readOffset(at + 1), depth, worklist, &pending);
+        break;
+      case OP_RETURN: case OP_TAIL_CALL:
+        falls = false;
+        break;
+    }
+    if (depth - pops < 0) fn->dynamic = true;
+    int after = depth - pops;
+    if (after < 0) after = 0;
+    after += pushes;
+    if (after > fn->maxDepth) fn->maxDepth = after;
+    if (ok && falls) ok = reach(fn, next, after, worklist, &pending);
+  }
+  free(worklist);
+  return ok;
+}
+
+// Operands, for the templates below. top(fn, k) is the k-th value from the
+// top of the stack, 1 being the top and 0 the free slot past it; local(fn, i)
+// is frame slot i. The names are only good until the fourth call after.
+static const char* top(Function* fn, int k) {
+  static char names[4][24];
+  static int next = 0;
+  char* name = names[next++ & 3];
+  if (fn->dynamic) {
+    snprintf(name, sizeof(names[0]), "sp[%d]", -k);
+  } else {
+    snprintf(name, sizeof(names[0]), "s%d", fn->d - k);
+    fn->used[fn->d - k] = true;
+  }
+  return name;
+}
+
+static const char* local(Function* fn, int slot) {
+  static char names[4][24];
+  static int next = 0;
+  char* name = names[next++ & 3];
+  snprintf(name, sizeof(names[0]), fn->dynamic ? "fp[%d]" : "s%d", slot);
+  if (!fn->dynamic) fn->used[slot] = true;
+  return name;
+}
+
+// The address of top(fn, k) in the frame, where operations that take their
+// operands by pointer find them once they have been spilled. Operations
+// store their results at address(fn, 0), the free slot read by scratch().
+static const char* address(Function* fn, int k) {
+  static char names[2][24];
+  static int next = 0;
+  char* name = names[next++ & 1];
+  if (fn->dynamic) {
+    snprintf(name, sizeof(names[0]), "sp - %d", k);
+  } else {
+    snprintf(name, sizeof(names[0]), "fp + %d", fn->d - k);
+  }
+  return name;
+}
+
+static const char* scratch(Function* fn) {
+  static char name[24];
+  snprintf(name, sizeof(name), fn->dynamic ? "sp[0]" : "fp[%d]", fn->d);
+  return name;
+}
+
+// Writes one line of the function body, indented by the braces around it.
+static void line(Function* fn, const char* format, ...) {
+  size_t length = strlen(format);
+  if (format[0] == '}') fn->indent--;
+  fprintf(fn->out, "%*s", 2 * fn->indent, "");
+  va_list args;
+  va_start(args, format);
+  vfprintf(fn->out, format, args);
+  va_end(args);
+  fputc('\n', fn->out);
+  if (format[length - 1] == '{') fn->indent++;
+}
+
+static void wroteLocal(Function* fn, int slot) {
+  if (fn->dynamic) return;
+  fn->dirty[slot] = true;
+  fn->written[slot] = true;
+}
+
+static void wrote(Function* fn, int k) {
+  if (!fn->dynamic) wroteLocal(fn, fn->d - k);
+}
+
+static void adjust(Function* fn, int delta) {
+  if (!fn->dynamic) {
+    fn->d += delta;
+  } else if (delta != 0) {
+    line(fn, "sp += %d;", delta);
+  }
+}
+
+// Makes the frame in memory match the C locals and stores the stack top, so
+// the collector sees every live value and calls find their arguments.
+// `commit` is false on a path that leaves the straight-line code, which
+// must not change what the following instructions think is in memory.
+static void spill(Function* fn, bool commit) {
+  if (fn->dynamic) {
+    line(fn, "vm->stackTop = sp;");
+    return;
+  }
+  for (int i = 0; i < fn->d; i++) {
+    if (!fn->dirty[i]) continue;
+    line(fn, "fp[%d] = s%d;", i, i);
+    if (commit) fn->dirty[i] = false;
+  }
+  line(fn, "vm->stackTop = fp + %d;", fn->d);
+}
+
+// The rest of the frame after a call into the runtime that may have moved
+// the stack. `result` is the top-relative slot it left a value in, or -1.
+static void reload(Function* fn, int result) {
+  line(fn, "fp = vm->frames[frame].slots;");
+  if (fn->dynamic) {
+    line(fn, "sp = vm->stackTop;");
+  } else if (result >= 0) {
+    line(fn, "s%d = fp[%d];", fn->d - result, fn->d - result);
+    fn->dirty[fn->d - result] = false;
+  }
+}
+
+static void writeCString(FILE* out, const char* chars, int length, bool format) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c == '%' && format) {
+      fputs("%%", out);
+    } else if (c >= ' ' && c < 127 && c != '?') {
+      fputc(c, out);
+    } else {
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+// Where a failure of the instruction being emitted goes: the catch block of
+// the innermost tumble block it is in, or throw_, which leaves the function.
+static const char* thrown(Function* fn) {
+  static char name[24];
+  const TumbleHandler* handler =
+      findHandler(fn->handlers, fn->handlerCount, fn->offset);
+  if (handler == NULL || fn->depth[handler->target] == -1) {
+    fn->throws = true;
+    return "throw_";
+  }
+  int index = (int)(handler - fn->handlers);
+  fn->catches[index] = true;
+  snprintf(name, sizeof(name), "catch%d", index);
+  return name;
+}
+
+// Reports `message` as a runtime error and goes to the catch block that
+// takes it when `condition` holds.
+static void fail(Function* fn, const char* condition, const char* message) {
+  line(fn, "if (%s) {", condition);
+  spill(fn, false);
+  line(fn, "runtimeError(vm, \"%s\");", message);
+  line(fn, "goto %s;", thrown(fn));
+  line(fn, "}");
+}
+
+static void numberOperands(Function* fn) {
+  char condition[64];
+  snprintf(condition, sizeof(condition), "!IS_NUMBER(%s) || !IS_NUMBER(%s)",
+           top(fn, 1), top(fn, 2));
+  fail(fn, condition, "Operands must be numbers.");
+}
+
+static void number(Function* fn, int k, double value) {
+  if (isfinite(value)) {
+    line(fn, "%s = NUMBER_VAL(%a);", top(fn, k), value);
+  } else {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(double));
+    line(fn, "%s = NUMBER_VAL(nativeNumber(0x%016llxull));", top(fn, k),
+         (unsigned long long)bits);
+  }
+}
+
+// A call into a runtime operation with the signature of stringLength(): the
+// top `pops` values are replaced by the result it stores past the top.
+static void operation(Function* fn, const char* call, int pops) {
+  spill(fn, true);
+  line(fn, "if (!%s) goto %s;", call, thrown(fn));
+  line(fn, "%s = %s;", top(fn, pops), scratch(fn));
+  wrote(fn, pops);
+  adjust(fn, 1 - pops);
+}
+
+static void emitInstruction(Function* fn, uint32_t offset) {
+  const uint8_t* at = &fn->code[offset];
+  uint32_t next = offset + instructionLength(fn->code, offset);
+  char call[128];
+  switch (at[0]) {
+    case OP_PUSH: {
+      double value;
+      memcpy(&value, at + 2, sizeof(double));
+      number(fn, 0, value);
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    }
+    case OP_CONSTANT:
+    case OP_FUNCTION: {
+      uint16_t index;
+      memcpy(&index, at + 1, sizeof(uint16_t));
+      int constant = fn->module->firstConstant + index;
+      if (at[0] == OP_FUNCTION) constant += fn->module->apb.constantCount;
+      line(fn, "%s = vm->constants[%d];", top(fn, 0), constant);
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    }
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      line(fn, "%s = %s;", top(fn, 0),
+           at[0] == OP_NIL ? "NIL_VAL" : at[0] == OP_TRUE ? "BOOL_VAL(true)" : "BOOL_VAL(false)");
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    case OP_POP:
+      adjust(fn, -1);
+      break;
+    case OP_NOT:
+      line(fn, "%s = BOOL_VAL(isFalsey(%s));", top(fn, 1), top(fn, 1));
+      wrote(fn, 1);
+      break;
+    case OP_ADD:
+      line(fn, "if (IS_NUMBER(%s) && IS_NUMBER(%s)) {", top(fn, 2), top(fn, 1));
+      line(fn, "%s = NUMBER_VAL(AS_NUMBER(%s) + AS_NUMBER(%s));", top(fn, 2),
+           top(fn, 2), top(fn, 1));
+      line(fn, "} else if (IS_STRING(%s) && IS_STRING(%s)) {", top(fn, 1), top(fn, 2));
+      spill(fn, false);
+      line(fn, "%s = OBJ_VAL(joinStrings(vm, AS_STRING(%s), AS_STRING(%s)));",
+           top(fn, 2), top(fn, 2), top(fn, 1));
+      line(fn, "} else {");
+      spill(fn, false);
+      line(fn, "runtimeError(vm, \"Operands must be two numbers or two strings.\");");
+      line(fn, "goto %s;", thrown(fn));
+      line(fn, "}");
+      wrote(fn, 2);
+      adjust(fn, -1);
+      break;
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV: {
+      char op = at[0] == OP_SUB ? '-' : at[0] == OP_MUL ? '*' : '/';
+      numberOperands(fn);
+      line(fn, "%s = NUMBER_VAL(AS_NUMBER(%s) %c AS_NUMBER(%s));", top(fn, 2),
+           top(fn, 2), op, top(fn, 1));
+      wrote(fn, 2);
+      adjust(fn, -1);
+      break;
+    }
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL: {
+      // `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, as in run().
+      const char* test = at[0] == OP_GREATER         ? "%s = BOOL_VAL(AS_NUMBER(%s) > AS_NUMBER(%s));"
+                         : at[0] == OP_LESS          ? "%s = BOOL_VAL(AS_NUMBER(%s) < AS_NUMBER(%s));"
+                         : at[0] == OP_GREATER_EQUAL ? "%s = BOOL_VAL(!(AS_NUMBER(%s) < AS_NUMBER(%s)));"
+                                                     : "%s = BOOL_VAL(!(AS_NUMBER(%s) > AS_NUMBER(%s)));";
+      numberOperands(fn);
+      line(fn, test, top(fn, 2), top(fn, 2), top(fn, 1));
+      wrote(fn, 2);
+      adjust(fn, -1);
+      break;
+    }
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      line(fn, "%s = BOOL_VAL(%svaluesEqual(%s, %s));", top(fn, 2),
+           at[0] == OP_EQUAL ? "" : "!", top(fn, 2), top(fn, 1));
+      wrote(fn, 2);
+      adjust(fn, -1);
+      break;
+    case OP_JUMP_IF_FALSE:
+      line(fn, "if (isFalsey(%s)) goto L%u;", top(fn, 1), next + readOffset(at + 1));
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      int pops = at[0] == OP_POP_JUMP_IF_FALSE ? 1 : 2;
+      if (at[0] == OP_POP_JUMP_IF_FALSE) {
+        snprintf(call, sizeof(call), "isFalsey(%s)", top(fn, 1));
+      } else if (at[0] == OP_JUMP_IF_NOT_EQUAL) {
+        snprintf(call, sizeof(call), "!valuesEqual(%s, %s)", top(fn, 2), top(fn, 1));
+      } else {
+        numberOperands(fn);
+        snprintf(call, sizeof(call), "!(AS_NUMBER(%s) %c AS_NUMBER(%s))", top(fn, 2),
+                 at[0] == OP_JUMP_IF_NOT_LESS ? '<' : '>', top(fn, 1));
+      }
+      if (fn->dynamic) {
+        line(fn, "if (%s) {", call);
+        line(fn, "sp -= %d;", pops);
+        line(fn, "goto L%u;", next + readOffset(at + 1));
+        line(fn, "}");
+      } else {
+        line(fn, "if (%s) goto L%u;", call, next + readOffset(at + 1));
+      }
+      adjust(fn, -pops);
+      break;
+    }
+    case OP_JUMP:
+      line(fn, "goto L%u;", next + readOffset(at + 1));
+      break;
+    case OP_LOOP:
+      line(fn, "goto L%u;", next - readOffset(at + 1));
+      break;
+    // Swing state is in frame slots, so in static mode gcc can keep it in
+    // registers.
+    case OP_SWING_COUNT:
+      line(fn, "if (IS_NUMBER(%s) && AS_NUMBER(%s) > 1) {", local(fn, at[3]),
+           local(fn, at[3]));
+      line(fn, "%s = NUMBER_VAL(AS_NUMBER(%s) - 1);", local(fn, at[3]), local(fn, at[3]));
+      wroteLocal(fn, at[3]);
+      line(fn, "goto L%u;", next - readOffset(at + 1));
+      line(fn, "}");
+      break;
+    case OP_SWING_RANGE:
+      snprintf(call, sizeof(call), "!IS_NUMBER(%s) || !IS_NUMBER(%s)",
+               local(fn, at[3]), local(fn, at[3] + 1));
+      fail(fn, call, "Swing bounds must be numbers.");
+      line(fn, "if (!(AS_NUMBER(%s) <= AS_NUMBER(%s))) goto L%u;", local(fn, at[3]),
+           local(fn, at[3] + 1), next + readOffset(at + 1));
+      break;
+    case OP_SWING_STEP:
+      snprintf(call, sizeof(call), "!IS_NUMBER(%s)", local(fn, at[3]));
+      fail(fn, call, "Swing variable must be a number.");
+      line(fn, "%s = NUMBER_VAL(AS_NUMBER(%s) + 1);", local(fn, at[3]), local(fn, at[3]));
+      wroteLocal(fn, at[3]);
+      line(fn, "if (AS_NUMBER(%s) <= AS_NUMBER(%s)) {", local(fn, at[3]),
+           local(fn, at[3] + 1));
+      line(fn, "goto L%u;", next - readOffset(at + 1));
+      line(fn, "}");
+      break;
+    case OP_PRINT:
+      line(fn, "printValue(%s);", top(fn, 1));
+      line(fn, "printf(\"\\n\");");
+      adjust(fn, -1);
+      break;
+    case OP_ASK:
+      spill(fn, true);
+      line(fn, "%s = askLine(vm);", top(fn, 0));
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    case OP_GET_GLOBAL_SLOT: {
+      uint16_t slot;
+      memcpy(&slot, at + 1, sizeof(uint16_t));
+      int global = fn->module->globals[slot];
+      line(fn, "if (!vm->globals[%d].defined) {", global);
+      spill(fn, false);
+      fprintf(fn->out, "%*sruntimeError(vm, \"Undefined variable '%%s'.\", ",
+              2 * fn->indent, "");
+      writeCString(fn->out, fn->aot->globals[global], fn->aot->globalLengths[global], false);
+      fprintf(fn->out, ");\n");
+      line(fn, "goto %s;", thrown(fn));
+      line(fn, "}");
+      line(fn, "%s = vm->globals[%d].value;", top(fn, 0), global);
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    }
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_POP: {
+      uint16_t slot;
+      memcpy(&slot, at + 1, sizeof(uint16_t));
+      int global = fn->module->globals[slot];
+      line(fn, "vm->globals[%d].value = %s;", global, top(fn, 1));
+      line(fn, "vm->globals[%d].defined = true;", global);
+      if (at[0] == OP_SET_GLOBAL_SLOT_POP) adjust(fn, -1);
+      break;
+    }
+    case OP_GET_LOCAL:
+      line(fn, "%s = %s;", top(fn, 0), local(fn, at[1]));
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    case OP_GET_LOCAL_PAIR:
+      line(fn, "%s = %s;", top(fn, 0), local(fn, at[1]));
+      wrote(fn, 0);
+      adjust(fn, 1);
+      line(fn, "%s = %s;", top(fn, 0), local(fn, at[2]));
+      wrote(fn, 0);
+      adjust(fn, 1);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      line(fn, "%s = %s;", local(fn, at[1]), top(fn, 1));
+      wroteLocal(fn, at[1]);
+      if (at[0] == OP_SET_LOCAL_POP) adjust(fn, -1);
+      break;
+    case OP_CALL:
+      spill(fn, true);
+      line(fn, "if (!callNative(vm, %d)) goto %s;", at[1], thrown(fn));
+      reload(fn, at[1] + 1);
+      if (!fn->dynamic) fn->d -= at[1];
+      break;
+    case OP_TAIL_CALL:
+      spill(fn, true);
+      line(fn, "return tailCallNative(vm, %d);", at[1]);
+      break;
+    case OP_RETURN:
+      if (fn->dynamic) {
+        line(fn, "fp[0] = sp[-1];");
+      } else {
+        line(fn, "fp[0] = %s;", top(fn, 1));
+      }
+      line(fn, "vm->stackTop = fp + 1;");
+      line(fn, "vm->frameCount--;");
+      line(fn, "return true;");
+      break;
+    case OP_BUILD_BUNCH:
+    case OP_BUILD_CANOPY: {
+      int items = at[0] == OP_BUILD_BUNCH ? at[1] : 2 * at[1];
+      spill(fn, true);
+      line(fn, "%s = %s(vm, %s, %d);", top(fn, items),
+           at[0] == OP_BUILD_BUNCH ? "newBunch" : "newCanopy", address(fn, items), at[1]);
+      wrote(fn, items);
+      adjust(fn, 1 - items);
+      break;
+    }
+    case OP_GET_SUBSCRIPT:
+      line(fn, "if (IS_BUNCH(%s) && IS_NUMBER(%s)) {", top(fn, 2), top(fn, 1));
+      line(fn, "ObjBunch* bunch = AS_BUNCH(%s);", top(fn, 2));
+      line(fn, "int index = (int)AS_NUMBER(%s);", top(fn, 1));
+      line(fn, "%s = index < 0 || index >= bunch->count ? NIL_VAL : bunch->values[index];",
+           top(fn, 2));
+      line(fn, "} else {");
+      spill(fn, false);
+      line(fn, "if (!getSubscript(vm, %s, %s, %s)) goto %s;", top(fn, 2),
+           top(fn, 1), address(fn, 0), thrown(fn));
+      line(fn, "%s = %s;", top(fn, 2), scratch(fn));
+      line(fn, "}");
+      wrote(fn, 2);
+      adjust(fn, -1);
+      break;
+    case OP_SET_SUBSCRIPT:
+      line(fn, "if (IS_BUNCH(%s) && IS_NUMBER(%s) && AS_NUMBER(%s) >= 0 &&",
+           top(fn, 3), top(fn, 2), top(fn, 2));
+      line(fn, "    (int)AS_NUMBER(%s) < AS_BUNCH(%s)->count) {", top(fn, 2), top(fn, 3));
+      line(fn, "writeBarrier(vm, AS_OBJ(%s), %s);", top(fn, 3), top(fn, 1));
+      line(fn, "AS_BUNCH(%s)->values[(int)AS_NUMBER(%s)] = %s;", top(fn, 3),
+           top(fn, 2), top(fn, 1));
+      line(fn, "} else {");
+      spill(fn, false);
+      line(fn, "if (!setSubscript(vm, %s, %s, %s)) goto %s;", top(fn, 3),
+           top(fn, 2), top(fn, 1), thrown(fn));
+      line(fn, "}");
+      line(fn, "%s = %s;", top(fn, 3), top(fn, 1));
+      wrote(fn, 3);
+      adjust(fn, -2);
+      break;
+    case OP_SUMMON:
+      spill(fn, true);
+      line(fn, "if (!summonNative(vm)) goto %s;", thrown(fn));
+      reload(fn, 1);
+      break;
+    case OP_FORAGE:
+    case OP_SHED:
+    case OP_STRLEN:
+      snprintf(call, sizeof(call), "%s(vm, %s, %s)",
+               at[0] == OP_FORAGE ? "forage" : at[0] == OP_SHED ? "shedString" : "stringLength",
+               top(fn, 1), address(fn, 0));
+      operation(fn, call, 1);
+      break;
+    case OP_INSCRIBE:
+      snprintf(call, sizeof(call), "inscribe(vm, %s, %s, %s)", top(fn, 2),
+               top(fn, 1), address(fn, 0));
+      operation(fn, call, 2);
+      break;
+    case OP_GRAFT:
+    case OP_SCAN:
+      snprintf(call, sizeof(call), "%s(vm, %s, %s)",
+               at[0] == OP_GRAFT ? "graftStrings" : "scanString", address(fn, 2),
+               address(fn, 0));
+      operation(fn, call, 2);
+      break;
+    case OP_SLICE:
+      snprintf(call, sizeof(call), "sliceString(vm, %s, %s)", address(fn, 3),
+               address(fn, 0));
+      operation(fn, call, 3);
+      break;
+    case 255:
+      line(fn, "return true;");
+      break;
+  }
+}
+
+static void functionName(AotModule* modules, AotModule* module, int tribe,
+                         char* name, size_t size) {
+  int index = (int)(module - modules);
+  if (tribe < 0) {
+    snprintf(name, size, "module%d", index);
+    return;
+  }
+  int length = snprintf(name, size, "tribe%d_%d_", index, tribe);
+  ApbName* tribeName = &module->apb.functions[tribe].name;
+  for (int i = 0; i < tribeName->length && length < (int)size - 1; i++) {
+    char c = tribeName->chars[i];
+    name[length++] = isalnum((unsigned char)c) ? c : '_';
+  }
+  name[length] = '\0';
+}
+
+// Writes the C function for the tribe `tribe` of `module`, or for its
+// top-level code when `tribe` is -1.
+static bool translateFunction(Aot* aot, AotModule* module, int tribe, FILE* out) {
+  Function fn;
+  memset(&fn, 0, sizeof(fn));
+  fn.aot = aot;
+  fn.module = module;
+  fn.code = module->apb.code;
+  fn.size = module->apb.codeSize;
+  fn.arity = tribe < 0 ? 0 : module->apb.functions[tribe].arity;
+  uint32_t entry = tribe < 0 ? 0 : module->apb.functions[tribe].address;
+  fn.handlers = (TumbleHandler*)malloc(sizeof(TumbleHandler) *
+                                       (module->apb.handlerCount + 1));
+  fn.catches = (bool*)calloc(module->apb.handlerCount + 1, sizeof(bool));
+  fn.depth = (int*)malloc(sizeof(int) * fn.size);
+  fn.label = (bool*)calloc(fn.size, sizeof(bool));
+  if (fn.handlers == NULL || fn.catches == NULL || fn.depth == NULL ||
+      fn.label == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < module->apb.handlerCount; i++) {
+    if (module->apb.handlers[i].function == entry) {
+      fn.handlers[fn.handlerCount++] = module->apb.handlers[i];
+    }
+  }
+  for (uint32_t i = 0; i < fn.size; i++) fn.depth[i] = -1;
+
+  char name[96];
+  functionName(aot->modules, module, tribe, name, sizeof(name));
+  bool ok = fn.size > 0 && analyse(&fn, entry);
+  if (!ok) {
+    fprintf(stderr, "Cannot translate %s: its code is malformed or uses an "
+                    "instruction apeslang aot doesn't know.\n", name);
+  }
+
+  // Labels go where jumps land. Catch blocks get theirs as they are emitted.
+  for (uint32_t offset = 0; ok && offset < fn.size;
+       offset += instructionLength(fn.code, offset)) {
+    if (fn.depth[offset] == -1) continue;
+    const uint8_t* at = &fn.code[offset];
+    uint32_t next = offset + instructionLength(fn.code, offset);
+    switch (at[0]) {
+      case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE: case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP:
+      case OP_SWING_RANGE:
+        fn.label[next + readOffset(at + 1)] = true;
+        break;
+      case OP_LOOP: case OP_SWING_COUNT: case OP_SWING_STEP:
+        fn.label[next - readOffset(at + 1)] = true;
+        break;
+    }
+  }
+
+  // The body is generated twice. The first pass finds the slots that are
+  // ever written without being spilled; the second can then take every
+  // other slot to match the frame where jumps meet.
+  char* body = NULL;
+  size_t bodySize = 0;
+  fn.dirty = (bool*)calloc(fn.maxDepth + 2, sizeof(bool));
+  fn.used = (bool*)calloc(fn.maxDepth + 2, sizeof(bool));
+  fn.written = (bool*)calloc(fn.maxDepth + 2, sizeof(bool));
+  if (fn.dirty == NULL || fn.used == NULL || fn.written == NULL) exit(1);
+  for (int pass = 0; ok && pass < 2; pass++) {
+    free(body);
+    body = NULL;
+    fn.out = open_memstream(&body, &bodySize);
+    if (fn.out == NULL) exit(1);
+    memset(fn.dirty, 0, sizeof(bool) * (fn.maxDepth + 2));
+    memset(fn.used, 0, sizeof(bool) * (fn.maxDepth + 2));
+    fn.d = fn.arity + 1;
+    fn.indent = 1;
+    fn.throws = false;
+    memset(fn.catches, 0, sizeof(bool) * (fn.handlerCount + 1));
+    for (int i = 0; i < fn.handlerCount && !fn.dynamic; i++) {
+      // A catch block starts with its catch variable, and the locals of the
+      // tumble block before it, set from outside the code.
+      if (fn.depth[fn.handlers[i].target] == -1) continue;
+      for (int slot = fn.handlers[i].depth; slot <= fn.handlers[i].slot; slot++) {
+        fn.written[slot] = true;
+        fn.used[slot] = true;
+      }
+    }
+    for (uint32_t offset = 0; offset < fn.size;
+         offset += instructionLength(fn.code, offset)) {
+      if (fn.depth[offset] == -1) continue;
+      // A catch block is entered from its catch<i> code, which is only there
+      // when something in the tumble block, emitted by now, can fail. It
+      // starts at its own depth all the same.
+      bool caught = false, handled = false;
+      for (int i = 0; i < fn.handlerCount; i++) {
+        if (fn.handlers[i].target != offset) continue;
+        handled = true;
+        if (fn.catches[i]) caught = true;
+      }
+      if (fn.label[offset] || caught) fprintf(fn.out, "L%u:;\n", offset);
+      if ((fn.label[offset] || handled) && !fn.dynamic) {
+        fn.d = fn.depth[offset];
+        for (int i = 0; i < fn.d; i++) fn.dirty[i] = pass == 0 || fn.written[i];
+      }
+      fn.offset = offset;
+      emitInstruction(&fn, offset);
+    }
+    fclose(fn.out);
+  }
+
+  if (ok) {
+    fprintf(out, "static bool %s(VM* vm) {\n", name);
+    fprintf(out, "  int frame = vm->frameCount - 1;\n");
+    fprintf(out, "  Value* fp = vm->frames[frame].slots;\n");
+    // The code never goes deeper than the stack the function table gives
+    // it, so it only has to check once that the frame fits.
+    int needed = (int)(tribe < 0 ? module->apb.stack
+                                 : module->apb.functions[tribe].stack);
+    if (needed > fn.arity + 1) {
+      fprintf(out, "  if (vm->stackEnd - fp < %d) {\n", needed);
+      fprintf(out, "    vm->stackTop = fp + %d;\n", fn.arity + 1);
+      fprintf(out, "    if (!growStack(vm, %d)) {\n", needed - fn.arity - 1);
+      fprintf(out, "      runtimeError(vm, \"Stack overflow!\");\n");
+      fprintf(out, "      return false;\n");
+      fprintf(out, "    }\n");
+      fprintf(out, "    fp = vm->frames[frame].slots;\n");
+      fprintf(out, "  }\n");
+    }
+    if (fn.dynamic) {
+      fprintf(out, "  Value* sp = fp + %d;\n", fn.arity + 1);
+    } else {
+      for (int i = 0; i < fn.maxDepth; i++) {
+        if (!fn.used[i]) continue;
+        if (i <= fn.arity) {
+          fprintf(out, "  Value s%d = fp[%d];\n", i, i);
+        } else {
+          fprintf(out, "  Value s%d;\n", i);
+        }
+      }
+    }
+    fwrite(body, 1, bodySize, out);
+    // A failure in a tumble block drops the frames of the calls it was in,
+    // as the interpreter does when it unwinds to the block's frame.
+    for (int i = 0; i < fn.handlerCount; i++) {
+      if (!fn.catches[i]) continue;
+      TumbleHandler* handler = &fn.handlers[i];
+      fprintf(out, "catch%d:\n", i);
+      fprintf(out, "  vm->frameCount = frame + 1;\n");
+      fprintf(out, "  fp = vm->frames[frame].slots;\n");
+      if (fn.dynamic) {
+        fprintf(out, "  sp = fp + %d;\n", handler->depth);
+        for (int slot = handler->depth; slot < handler->slot; slot++) {
+          fprintf(out, "  *sp++ = NIL_VAL;\n");
+        }
+        fprintf(out, "  *sp++ = vm->lastError;\n");
+      } else {
+        for (int slot = handler->depth; slot < handler->slot; slot++) {
+          fprintf(out, "  s%d = NIL_VAL;\n", slot);
+        }
+        fprintf(out, "  s%d = vm->lastError;\n", handler->slot);
+      }
+      fprintf(out, "  goto L%u;\n", handler->target);
+    }
+    if (fn.throws) {
+      fprintf(out, "throw_:\n");
+      fprintf(out, "  return false;\n");
+    }
+    fprintf(out, "}\n\n");
+  }
+
+  free(body);
+  free(fn.dirty);
+  free(fn.used);
+  free(fn.written);
+  free(fn.depth);
+  free(fn.label);
+  free(fn.handlers);
+  free(fn.catches);
+  return ok;
+}
+
+static void writeTables(Aot* aot, FILE* out) {
+  if (aot->globalCount > 0) {
+    fprintf(out, "static const char* const globals[] = {\n");
+    for (int i = 0; i < aot->globalCount; i++) {
+      fprintf(out, "  ");
+      writeCString(out, aot->globals[i], aot->globalLengths[i], false);
+      fprintf(out, ",\n");
+    }
+    fprintf(out, "};\n\n");
+  }
+  for (int m = 0; m < aot->moduleCount; m++) {
+    AotModule* module = &aot->modules[m];
+    if (module->apb.constantCount > 0) {
+      fprintf(out, "static const NativeString constants%d[] = {\n", m);
+      for (int i = 0; i < module->apb.constantCount; i++) {
+        ApbConstant* constant = &module->apb.constants[i];
+        fprintf(out, "  {");
+        writeCString(out, constant->chars, (int)constant->length, false);
+        fprintf(out, ", %u},\n", constant->length);
+      }
+      fprintf(out, "};\n\n");
+    }
+    if (module->apb.functionCount > 0) {
+      fprintf(out, "static const NativeTribe tribes%d[] = {\n", m);
+      for (int i = 0; i < module->apb.functionCount; i++) {
+        ApbFunction* proto = &module->apb.functions[i];
+        char name[96];
+        functionName(aot->modules, module, i, name, sizeof(name));
+        fprintf(out, "  {");
+        writeCString(out, proto->name.chars, proto->name.length, false);
+        fprintf(out, ", %d, %s},\n", proto->arity, name);
+      }
+      fprintf(out, "};\n\n");
+    }
+  }
+  fprintf(out, "static const NativeModule modules[] = {\n");
+  for (int m = 0; m < aot->moduleCount; m++) {
+    AotModule* module = &aot->modules[m];
+    fprintf(out, "  {");
+    if (module->path == NULL) {
+      fprintf(out, "NULL");
+    } else {
+      writeCString(out, module->path, (int)strlen(module->path), false);
+    }
+    if (module->apb.constantCount > 0) {
+      fprintf(out, ", constants%d, %d", m, module->apb.constantCount);
+    } else {
+      fprintf(out, ", NULL, 0");
+    }
+    if (module->apb.functionCount > 0) {
+      fprintf(out, ", tribes%d, %d", m, module->apb.functionCount);
+    } else {
+      fprintf(out, ", NULL, 0");
+    }
+    fprintf(out, ", module%d},\n", m);
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "static const NativeProgram program = {%s, %d, modules, %d};\n\n",
+          aot->globalCount > 0 ? "globals" : "NULL", aot->globalCount,
+          aot->moduleCount);
+  fprintf(out, "int main(void) {\n");
+  fprintf(out, "  return runNativeProgram(&program);\n");
+  fprintf(out, "}\n");
+}
+
+bool aotTranslate(const char* path, const char* outputPath) {
+  Aot* aot = (Aot*)calloc(1, sizeof(Aot));
+  if (aot == NULL) exit(1);
+  bool ok = addModule(aot, path, NULL);
+  // Modules summoned by the ones added are appended as they are found.
+  for (int m = 0; ok && m < aot->moduleCount; m++) {
+    addSummoned(aot, &aot->modules[m]);
+  }
+  if (ok && aot->constantCount + aot->moduleCount > CONSTANTS_MAX) {
+    fprintf(stderr, "Too many constants in \"%s\" and the modules it summons.\n", path);
+    ok = false;
+  }
+  if (ok && aot->globalCount > GLOBALS_MAX) {
+    fprintf(stderr, "Too many global variables in \"%s\" and the modules it summons.\n", path);
+    ok = false;
+  }
+
+  char* functions = NULL;
+  size_t functionsSize = 0;
+  FILE* buffer = open_memstream(&functions, &functionsSize);
+  if (buffer == NULL) exit(1);
+  for (int m = 0; ok && m < aot->moduleCount; m++) {
+    ok = translateFunction(aot, &aot->modules[m], -1, buffer);
+    for (int i = 0; ok && i < aot->modules[m].apb.functionCount; i++) {
+      ok = translateFunction(aot, &aot->modules[m], i, buffer);
+    }
+  }
+  fclose(buffer);
+
+  FILE* out = ok ? fopen(outputPath, "w") : NULL;
+  if (ok && out == NULL) {
+    fprintf(stderr, "Could not open output file \"%s\".\n", outputPath);
+    ok = false;
+  }
+  if (ok) {
+    fprintf(out, "// Compiled by `apeslang aot` from %s.\n", path);
+    fprintf(out, "// Build: cc -O2 -I<apelang>/src %s <apelang>/libaperuntime.a -lm -pthread\n\n",
+            outputPath);
+#ifdef NAN_BOXING
+    fprintf(out, "#define NAN_BOXING\n");
+#endif
+    fprintf(out, "#include \"vm/native.h\"\n\n");
+    for (int m = 0; m < aot->moduleCount; m++) {
+      AotModule* module = &aot->modules[m];
+      for (int i = -1; i < module->apb.functionCount; i++) {
+        char name[96];
+        functionName(aot->modules, module, i, name, sizeof(name));
+        fprintf(out, "static bool %s(VM* vm);\n", name);
+      }
+    }
+    fprintf(out, "\n");
+    fwrite(functions, 1, functionsSize, out);
+    writeTables(aot, out);
+    fclose(out);
+  }
+
+  free(functions);
+  for (int m = 0; m < aot->moduleCount; m++) {
+    freeApb(&aot->modules[m].apb);
+    free(aot->modules[m].image);
+    free(aot->modules[m].path);
+    free(aot->modules[m].globals);
+  }
+  free(aot->globals);
+  free(aot->globalLengths);
+  free(aot);
+  return ok;
+}
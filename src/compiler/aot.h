@@ -0,0 +1,26 @@
+#ifndef APE_AOT_H
+#define APE_AOT_H
+
+#include "../common.h"
+
+// Ahead-of-time compilation: translates the stack code of a compiled .apb,
+// and of every module it summons by a constant path, into one C file that
+// builds with libaperuntime.a into a program running without the
+// interpreter (see vm/native.h).
+//
+// Each tribe and each module's top-level code becomes a C function, and each
+// jump a goto. Where a function's stack depth is the same at every
+// instruction on every path, as it is for all code that doesn't leave locals
+// behind in a branch or loop body, its stack slots become C locals: they are
+// written back to the frame only before calls into the runtime that can
+// allocate, call or fail. Other functions keep their operands on the value
+// stack.
+//
+// Summoned modules are read relative to the current directory, as `apeslang
+// run` reads them, and compiled into the program; summon then runs the
+// compiled module instead of reading the .apb.
+//
+// Returns false after reporting why `path` could not be translated.
+bool aotTranslate(const char* path, const char* outputPath);
+
+#endif
@@ -0,0 +1,72 @@
+#include "ast.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Nodes hold pointers and doubles, so that is all allocations are aligned for.
+typedef union {
+  void* pointer;
+  double number;
+} ArenaAlign;
+
+struct ArenaBlock {
+  ArenaBlock* next;
+  size_t used;
+  size_t size;
+  ArenaAlign data[];
+};
+
+void initArena(Arena* arena) { arena->blocks = NULL; }
+
+void freeArena(Arena* arena) {
+  ArenaBlock* block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+  size = (size + sizeof(ArenaAlign) - 1) & ~(sizeof(ArenaAlign) - 1);
+  ArenaBlock* block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL) exit(1);
+    block->next = arena->blocks;
+    block->used = 0;
+    block->size = capacity;
+    arena->blocks = block;
+  }
+  void* result = (char*)block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+void reportError(const Token* token, const char* message) {
+  fprintf(stderr, "[Error] ");
+  if (token->type == TOKEN_EOF) {
+    fprintf(stderr, "at end");
+  } else if (token->type != TOKEN_ERROR) {
+    fprintf(stderr, "at '%.*s'", token->length, token->start);
+  }
+  fprintf(stderr, ": %s\n", message);
+}
+
+Node* newNode(Arena* arena, NodeType type, Token token) {
+  Node* node = (Node*)arenaAlloc(arena, sizeof(Node));
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  node->token = token;
+  return node;
+}
+
+NodeList newNodeList(Arena* arena, Node** items, int count) {
+  NodeList list = {NULL, count};
+  if (count > 0) {
+    list.items = (Node**)arenaAlloc(arena, sizeof(Node*) * count);
+    memcpy(list.items, items, sizeof(Node*) * count);
+  }
+  return list;
+}
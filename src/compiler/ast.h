@@ -0,0 +1,103 @@
+#ifndef APE_AST_H
+#define APE_AST_H
+
+#include "../common.h"
+#include "../lexer/lexer.h"
+
+// The parser turns a source file into a tree of Nodes, which the code
+// generator in compiler.c walks to produce bytecode. Keeping the whole
+// program in memory lets later passes look at more than one instruction at a
+// time: folding constants, inlining tribes, allocating registers.
+//
+// Every node carries the token it was made from. Names, operators and
+// literals are read from it, and errors found after parsing are reported at
+// it.
+typedef enum {
+  // Expressions
+  NODE_NUMBER,
+  NODE_STRING,
+  NODE_TRUE,
+  NODE_FALSE,
+  NODE_NIL,
+  NODE_NOT,
+  NODE_BINARY,       // token.type is the operator
+  NODE_RIPE,         // logical and
+  NODE_YELLOW,       // logical or
+  NODE_VARIABLE,
+  NODE_ASSIGN,
+  NODE_CALL,
+  NODE_BUNCH,
+  NODE_CANOPY,       // items alternate key strings and values
+  NODE_SUBSCRIPT,
+  NODE_SET_SUBSCRIPT,
+  NODE_ASK,
+  NODE_FORAGE,
+  NODE_INSCRIBE,
+  NODE_STRING_OP,    // slice, graft, scan and shed; token.type says which
+  NODE_TALLY,
+  NODE_CONDITIONAL,  // made by inline.c; there is no syntax for it
+
+  // Statements
+  NODE_PRINT,
+  NODE_EXPRESSION,
+  NODE_GIVE,
+  NODE_IF,
+  NODE_SWING,
+  NODE_SWING_RANGE,  // token is the loop variable
+  NODE_BANANA,
+  NODE_BLOCK,        // `{ ... }` on its own, which opens a scope
+  NODE_TUMBLE,
+  NODE_SUMMON,
+  NODE_VAR,
+  NODE_TRIBE,
+} NodeType;
+
+typedef struct Node Node;
+
+typedef struct {
+  Node** items;
+  int count;
+} NodeList;
+
+struct Node {
+  NodeType type;
+  Token token;
+  union {
+    double number;
+    Node* operand;                                    // NOT, FORAGE, TALLY, PRINT,
+                                                      // EXPRESSION, GIVE, SUMMON
+    struct { Node* left; Node* right; } binary;       // BINARY, RIPE, YELLOW, INSCRIBE
+    Node* value;                                      // ASSIGN, VAR (may be NULL)
+    struct { Node* callee; NodeList arguments; } call;
+    NodeList items;                                   // BUNCH, CANOPY, STRING_OP
+    struct { Node* object; Node* index; Node* value; } subscript;
+    struct { Node* condition; Node* thenValue; Node* elseValue; } conditional;
+    struct { Node* condition; NodeList thenBranch; NodeList elseBranch; } ifStmt;
+    struct { Node* condition; NodeList body; } loop;  // SWING (count), BANANA
+    struct { Node* from; Node* to; NodeList body; } range;  // SWING_RANGE
+    NodeList statements;                              // BLOCK
+    struct { NodeList body; Token errorName; NodeList handler; } tumble;
+    struct { Token* params; int arity; NodeList body; } tribe;
+  } as;
+};
+
+// Nodes live in an arena that is freed in one go once code is generated.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  ArenaBlock* blocks;
+} Arena;
+
+void initArena(Arena* arena);
+void freeArena(Arena* arena);
+void* arenaAlloc(Arena* arena, size_t size);
+
+// Prints a compile error pointing at `token`, in the same format whether it
+// was found while parsing or while generating code.
+void reportError(const Token* token, const char* message);
+
+Node* newNode(Arena* arena, NodeType type, Token token);
+// Copies `count` nodes gathered while parsing into the arena.
+NodeList newNodeList(Arena* arena, Node** items, int count);
+
+#endif
@@ -2,531 +2,272 @@
 #include <stdlib.h>
 
 #include "compiler.h"
-#include "../lexer/lexer.h"
-
-typedef struct {
-  Token name;
-  int depth;
-} Local;
-
-typedef struct Compiler {
-  struct Compiler* enclosing;
-  Local locals[256];
-  int localCount;
-  int scopeDepth;
-} Compiler;
-
-typedef struct {
-  Lexer lexer;
-  Token current;
-  Token previous;
-  bool hadError;
-  FILE* outFile;
-  Compiler* compiler;
-  bool isRepl; // Flag to indicate if we are in REPL mode
-} Parser;
-
-typedef enum {
-  PREC_NONE,
-  PREC_ASSIGNMENT,
-  PREC_YELLOW,      // Logical OR
-  PREC_RIPE,        // Logical AND
-  PREC_EQUALITY,
-  PREC_COMPARISON,
-  PREC_TERM,
-  PREC_FACTOR,
-  PREC_UNARY,
-  PREC_CALL,
-  PREC_PRIMARY
-} Precedence;
-
-typedef void (*ParseFn)(Parser*, bool);
-
-typedef struct {
-  ParseFn prefix;
-  ParseFn infix;
-  Precedence precedence;
-} ParseRule;
-
-static void expression(Parser* p);
-static void statement(Parser* p);
-static void declaration(Parser* p);
-static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Parser* p, Precedence precedence);
-static void block(Parser* p);
-static void variable(Parser* p, bool canAssign);
-static void call(Parser* p, bool canAssign);
-static void bunchLiteral(Parser* p, bool canAssign);
-static void canopyLiteral(Parser* p, bool canAssign);
-static void subscript(Parser* p, bool canAssign);
-static void summonStatement(Parser* p);
-static void tumbleStatement(Parser* p);
-static void funDeclaration(Parser* p);
-static void varDeclaration(Parser* p);
-static void consume(Parser* p, TokenType type, const char* message);
-static void beginScope(Parser* p);
-static void endScope(Parser* p);
-static void declareVariable(Parser* p);
-static void bananaStatement(Parser* p);
-static void ripe_(Parser* p, bool canAssign);
-static void yellow_(Parser* p, bool canAssign);
-static void expressionStatement(Parser* p);
-static void forage(Parser* p, bool canAssign);
-static void inscribe(Parser* p, bool canAssign);
-static void stringOperation(Parser* p, bool canAssign);
-static void tally(Parser* p, bool canAssign);
-
-
-static void errorAt(Parser* p, Token* token, const char* message) {
-  if (p->hadError) return;
-  p->hadError = true;
-  fprintf(stderr, "[Error] ");
-  if (token->type == TOKEN_EOF) {
-    fprintf(stderr, "at end");
-  } else if (token->type != TOKEN_ERROR) {
-    fprintf(stderr, "at '%.*s'", token->length, token->start);
-  }
-  fprintf(stderr, ": %s\n", message);
-}
-static void error(Parser* p, const char* message) { errorAt(p, &p->previous, message); }
-static void emitByte(Parser* p, uint8_t byte) { fwrite(&byte, sizeof(uint8_t), 1, p->outFile); }
-static void emitBytes(Parser* p, uint8_t byte1, uint8_t byte2) {
-  emitByte(p, byte1);
-  emitByte(p, byte2);
-}
-static long emitJump(Parser* p, uint8_t instruction) {
-  emitByte(p, instruction);
-  emitByte(p, 0xff);
-  emitByte(p, 0xff);
-  return ftell(p->outFile) - 2;
-}
-static void patchJump(Parser* p, long offset) {
-  long jump = ftell(p->outFile) - offset - 2;
-  if (jump > UINT16_MAX) {
-    error(p, "Too much code to jump over.");
+#include "emitter.h"
+#include "fold.h"
+#include "inline.h"
+#include "parser.h"
+#include "peephole.h"
+#include "registers.h"
+#include "../bytecode/bytecode.h"
+
+// Code generation: walks the tree built by parser.c and writes the bytecode
+// and tables of one .apb file.
+
+static void expression(Emitter* e, Node* node);
+static void declarations(Emitter* e, NodeList list);
+
+void errorAt(Emitter* e, Token* token, const char* message) {
+  if (e->hadError) return;
+  e->hadError = true;
+  reportError(token, message);
+}
+static void error(Emitter* e, const char* message) { errorAt(e, &e->node->token, message); }
+
+void emitByte(Emitter* e, uint8_t byte) {
+  if (e->codeCount == e->codeCapacity) {
+    e->codeCapacity = e->codeCapacity < 256 ? 256 : e->codeCapacity * 2;
+    e->code = (uint8_t*)realloc(e->code, e->codeCapacity);
+    if (e->code == NULL) exit(1);
   }
-  fseek(p->outFile, offset, SEEK_SET);
-  emitByte(p, (jump >> 8) & 0xff);
-  emitByte(p, jump & 0xff);
-  fseek(p->outFile, 0, SEEK_END);
+  e->code[e->codeCount++] = byte;
+}
+static void emitBytes(Emitter* e, uint8_t byte1, uint8_t byte2) {
+  emitByte(e, byte1);
+  emitByte(e, byte2);
 }
-static void emitAddress(Parser* p, uint32_t address) {
-  fwrite(&address, sizeof(uint32_t), 1, p->outFile);
+void emitRaw(Emitter* e, const void* data, size_t size) {
+  for (size_t i = 0; i < size; i++) emitByte(e, ((const uint8_t*)data)[i]);
+}
+// Superinstructions are formed as code is emitted: instructions that can
+// start one record themselves here, and the next emitter checks whether it
+// directly follows such an instruction before folding itself into it.
+static void markFusable(Emitter* e, long start, uint8_t instruction) {
+  e->fusableStart = start;
+  e->fusableEnd = e->codeCount;
+  e->fusableOpcode = instruction;
 }
 
-static void emitLoop(Parser* p, long loopStart) {
-    emitByte(p, OP_LOOP);
+// The instruction that ends at the current offset, if it may be fused with
+// whatever comes next, or -1. Nothing is fused across a jump target.
+static int fusableOpcode(Emitter* e) {
+  long here = e->codeCount;
+  if (here != e->fusableEnd || here == e->lastJumpTarget) return -1;
+  return e->fusableOpcode;
+}
 
-    long offset = ftell(p->outFile) - loopStart + 2;
-     if (offset > UINT16_MAX) {
-        error(p, "Loop body too large.");
-    }
-    emitByte(p, (offset >> 8) & 0xff);
-    emitByte(p, offset & 0xff);
-}
-static void ripe_(Parser* p, bool canAssign) {
-    long endJump = emitJump(p, OP_JUMP_IF_FALSE);
-    emitByte(p, OP_POP);
-    parsePrecedence(p, PREC_RIPE);
-    patchJump(p, endJump);
-}
-
-static void yellow_(Parser* p, bool canAssign) {
-    long elseJump = emitJump(p, OP_JUMP_IF_FALSE);
-    long endJump = emitJump(p, OP_JUMP);
-    patchJump(p, elseJump);
-    emitByte(p, OP_POP);
-    parsePrecedence(p, PREC_YELLOW);
-    patchJump(p, endJump);
-}
-static void bananaStatement(Parser* p) {
-    long loopStart = ftell(p->outFile);
-    consume(p, TOKEN_LPAREN, "Expect '(' after 'banana'.");
-    expression(p);
-    consume(p, TOKEN_RPAREN, "Expect ')' after banana condition.");
-    consume(p, TOKEN_LBRACE, "Expect '{' after banana condition.");
-    long exitJump = emitJump(p, OP_JUMP_IF_FALSE);
-    emitByte(p, OP_POP);
-    block(p);
-    emitLoop(p, loopStart);
-    patchJump(p, exitJump);
-    emitByte(p, OP_POP);
-}
-
-static void emitReturn(Parser* p) {
-  emitByte(p, OP_NIL);
-  emitByte(p, OP_RETURN);
-}
-static void advance(Parser* p) {
-  p->previous = p->current;
-  p->current = scanToken(&p->lexer);
-  if (p->current.type == TOKEN_ERROR) {
-    errorAt(p, &p->current, p->current.start);
-  }
-}
-static void consume(Parser* p, TokenType type, const char* message) {
-  if (p->current.type == type) {
-    advance(p);
-    return;
+// Replaces the opcode of the fusable instruction, keeping its operands.
+static void refuse(Emitter* e, uint8_t instruction) {
+  e->code[e->fusableStart] = instruction;
+  e->fusableEnd = -1;
+}
+
+static void markJumpTarget(Emitter* e) { e->lastJumpTarget = e->codeCount; }
+
+static long emitJump(Emitter* e, uint8_t instruction) {
+  emitByte(e, instruction);
+  emitByte(e, 0xff);
+  emitByte(e, 0xff);
+  return e->codeCount - 2;
+}
+// Points the 16-bit offset at `offset`, counted from `end`, the end of its
+// instruction, at the current end of the code.
+static void patchOffset(Emitter* e, long offset, long end) {
+  long jump = e->codeCount - end;
+  if (jump > UINT16_MAX) {
+    error(e, "Too much code to jump over.");
   }
-  errorAt(p, &p->current, message);
-}
-static bool check(Parser* p, TokenType type) { return p->current.type == type; }
-static bool match(Parser* p, TokenType type) {
-  if (!check(p, type)) return false;
-  advance(p);
-  return true;
-}
-
-static void number(Parser* p, bool canAssign) {
-  double value = strtod(p->previous.start, NULL);
-  emitByte(p, OP_PUSH);
-  emitByte(p, VAL_NUMBER);
-  fwrite(&value, sizeof(double), 1, p->outFile);
-}
-static void string(Parser* p, bool canAssign) {
-  const char* str = p->previous.start + 1;
-  int length = p->previous.length - 2;
-  emitByte(p, OP_PUSH);
-  emitByte(p, VAL_OBJ);
-  emitByte(p, OBJ_STRING);
-  emitByte(p, (uint8_t)length);
-  fwrite(str, sizeof(char), length, p->outFile);
-}
-static void literal(Parser* p, bool canAssign) {
-  switch (p->previous.type) {
-    case TOKEN_FALSE: emitByte(p, OP_FALSE); break;
-    case TOKEN_TRUE:  emitByte(p, OP_TRUE); break;
-    case TOKEN_NIL:   emitByte(p, OP_NIL); break;
-    default: return;
+  e->code[offset] = (jump >> 8) & 0xff;
+  e->code[offset + 1] = jump & 0xff;
+  markJumpTarget(e);
+}
+void patchJump(Emitter* e, long offset) { patchOffset(e, offset, offset + 2); }
+
+// Jumps over the code that follows when the condition on top of the stack
+// is falsey, popping it either way. A comparison right before it becomes
+// part of the jump.
+static long emitConditionalJump(Emitter* e) {
+  uint8_t fused;
+  switch (fusableOpcode(e)) {
+    case OP_LESS:    fused = OP_JUMP_IF_NOT_LESS; break;
+    case OP_GREATER: fused = OP_JUMP_IF_NOT_GREATER; break;
+    case OP_EQUAL:   fused = OP_JUMP_IF_NOT_EQUAL; break;
+    default:         return emitJump(e, OP_POP_JUMP_IF_FALSE);
+  }
+  refuse(e, fused);
+  emitByte(e, 0xff);
+  emitByte(e, 0xff);
+  return e->codeCount - 2;
+}
+
+// Pops the value of a statement, folding the pop into an assignment that
+// produced it.
+static void emitPop(Emitter* e) {
+  switch (fusableOpcode(e)) {
+    case OP_SET_LOCAL:       refuse(e, OP_SET_LOCAL_POP); break;
+    case OP_SET_GLOBAL_SLOT: refuse(e, OP_SET_GLOBAL_SLOT_POP); break;
+    default:                 emitByte(e, OP_POP); break;
   }
 }
-static void unary(Parser* p, bool canAssign) {
-  TokenType operatorType = p->previous.type;
-  parsePrecedence(p, PREC_UNARY);
-  if (operatorType == TOKEN_BANG) emitByte(p, OP_NOT);
-}
-static void binary(Parser* p, bool canAssign) {
-  TokenType operatorType = p->previous.type;
-  ParseRule* rule = getRule(operatorType);
-  parsePrecedence(p, (Precedence)(rule->precedence + 1));
-  switch (operatorType) {
-    case TOKEN_PLUS:          emitByte(p, OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(p, OP_SUB); break;
-    case TOKEN_MUL:           emitByte(p, OP_MUL); break;
-    case TOKEN_DIV:           emitByte(p, OP_DIV); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(p, OP_EQUAL); break;
-    case TOKEN_BANG_EQUAL:    emitBytes(p, OP_EQUAL, OP_NOT); break;
-    case TOKEN_GREATER:       emitByte(p, OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(p, OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(p, OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(p, OP_GREATER, OP_NOT); break;
-    default: return;
+static uint32_t hashName(const char* chars, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)chars[i];
+    hash *= 16777619;
   }
+  return hash;
 }
-static void grouping(Parser* p, bool canAssign) {
-  expression(p);
-  consume(p, TOKEN_RPAREN, "Expect ')' after expression.");
-}
-static void ask(Parser* p, bool canAssign) {
-  consume(p, TOKEN_LPAREN, "Expect '(' after 'ask'.");
-  consume(p, TOKEN_RPAREN, "Expect ')' after ask arguments.");
-  emitByte(p, OP_ASK);
-}
-
-static void forage(Parser* p, bool canAssign) {
-    consume(p, TOKEN_LPAREN, "Expect '(' after 'forage'.");
-    expression(p); // The path
-    consume(p, TOKEN_RPAREN, "Expect ')' after forage arguments.");
-    emitByte(p, OP_FORAGE);
-}
-
-static void inscribe(Parser* p, bool canAssign) {
-    consume(p, TOKEN_LPAREN, "Expect '(' after 'inscribe'.");
-    expression(p); // The path
-    consume(p, TOKEN_COMMA, "Expect ',' between path and content.");
-    expression(p); // The content
-    consume(p, TOKEN_RPAREN, "Expect ')' after inscribe arguments.");
-    emitByte(p, OP_INSCRIBE);
-}
-
-static uint8_t argumentList(Parser* p) {
-  uint8_t argCount = 0;
-  if (!check(p, TOKEN_RPAREN)) {
-    do {
-      expression(p);
-      if (argCount == 255) error(p, "Can't have more than 255 arguments.");
-      argCount++;
-    } while (match(p, TOKEN_COMMA));
-  }
-  consume(p, TOKEN_RPAREN, "Expect ')' after arguments.");
-  return argCount;
-}
-static void call(Parser* p, bool canAssign) {
-  uint8_t argCount = argumentList(p);
-  emitBytes(p, OP_CALL, argCount);
-}
-static void bunchLiteral(Parser* p, bool canAssign) {
-    uint8_t itemCount = 0;
-    if (!check(p, TOKEN_RBRACKET)) {
-        do {
-            expression(p);
-            if (itemCount == 255) error(p, "Can't have more than 255 items in a bunch literal.");
-            itemCount++;
-        } while (match(p, TOKEN_COMMA));
-    }
-    consume(p, TOKEN_RBRACKET, "Expect ']' after bunch items.");
-    emitBytes(p, OP_BUILD_BUNCH, itemCount);
-}
-static void canopyLiteral(Parser* p, bool canAssign) {
-    uint8_t itemCount = 0;
-    if (!check(p, TOKEN_RBRACE)) {
-        do {
-            consume(p, TOKEN_STRING, "Expect string as canopy key.");
-            string(p, false);
-            consume(p, TOKEN_COLON, "Expect ':' after canopy key.");
-            expression(p);
-            if (itemCount == 255) error(p, "Can't have more than 255 items in a canopy literal.");
-            itemCount++;
-        } while (match(p, TOKEN_COMMA));
-    }
-    consume(p, TOKEN_RBRACE, "Expect '}' after canopy items.");
-    emitBytes(p, OP_BUILD_CANOPY, itemCount);
-}
-static void subscript(Parser* p, bool canAssign) {
-    expression(p);
-    consume(p, TOKEN_RBRACKET, "Expect ']' after subscript.");
-    if (canAssign && match(p, TOKEN_EQUAL)) {
-        expression(p);
-        emitByte(p, OP_SET_SUBSCRIPT);
-    } else {
-        emitByte(p, OP_GET_SUBSCRIPT);
+
+static void growNameBuckets(NameTable* table) {
+  int capacity = table->bucketCapacity < 16 ? 16 : table->bucketCapacity * 2;
+  int* buckets = (int*)calloc(capacity, sizeof(int));
+  for (int slot = 0; slot < table->count; slot++) {
+    Token* name = &table->names[slot];
+    uint32_t index = hashName(name->start, name->length) & (capacity - 1);
+    while (buckets[index] != 0) index = (index + 1) & (capacity - 1);
+    buckets[index] = slot + 1;
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->bucketCapacity = capacity;
+}
+
+uint16_t nameSlot(Emitter* e, NameTable* table, Token* name,
+                  const char* overflowMessage) {
+  if (table->bucketCapacity > 0) {
+    uint32_t index =
+        hashName(name->start, name->length) & (table->bucketCapacity - 1);
+    while (table->buckets[index] != 0) {
+      Token* existing = &table->names[table->buckets[index] - 1];
+      if (existing->length == name->length &&
+          memcmp(existing->start, name->start, name->length) == 0) {
+        return (uint16_t)(table->buckets[index] - 1);
+      }
+      index = (index + 1) & (table->bucketCapacity - 1);
     }
-}
+  }
 
-ParseRule rules[] = {
-    [TOKEN_LPAREN]      = {grouping, call, PREC_CALL},
-    [TOKEN_RPAREN]      = {NULL, NULL, PREC_NONE},
-    [TOKEN_LBRACE]      = {canopyLiteral, NULL, PREC_NONE},
-    [TOKEN_RBRACE]      = {NULL, NULL, PREC_NONE},
-    [TOKEN_LBRACKET]    = {bunchLiteral, subscript, PREC_CALL},
-    [TOKEN_RBRACKET]    = {NULL, NULL, PREC_NONE},
-    [TOKEN_COLON]       = {NULL, NULL, PREC_NONE},
-    [TOKEN_COMMA]       = {NULL, NULL, PREC_NONE},
-    [TOKEN_BANG]        = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL]  = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_EQUAL]       = {NULL, NULL, PREC_NONE},
-    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_GREATER]     = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS]        = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL]  = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_ID]          = {variable, NULL, PREC_NONE},
-    
-    [TOKEN_SLICE]       = {stringOperation, NULL, PREC_NONE},
-    [TOKEN_GRAFT]       = {stringOperation, NULL, PREC_NONE},
-    [TOKEN_SCAN]        = {stringOperation, NULL, PREC_NONE},
-    [TOKEN_SHED]        = {stringOperation, NULL, PREC_NONE},
-    [TOKEN_TALLY]       = {tally, NULL, PREC_NONE},
-
-    [TOKEN_STRING]      = {string, NULL, PREC_NONE},
-    [TOKEN_NUM]         = {number, NULL, PREC_NONE},
-    [TOKEN_ASK]         = {ask, NULL, PREC_NONE},
-    [TOKEN_FORAGE]      = {forage, NULL, PREC_NONE},
-    [TOKEN_INSCRIBE]    = {inscribe, NULL, PREC_NONE},
-    [TOKEN_FALSE]       = {literal, NULL, PREC_NONE},
-    [TOKEN_TRUE]        = {literal, NULL, PREC_NONE},
-    [TOKEN_NIL]         = {literal, NULL, PREC_NONE},
-    [TOKEN_PLUS]        = {NULL, binary, PREC_TERM},
-    [TOKEN_MINUS]       = {NULL, binary, PREC_TERM},
-    [TOKEN_MUL]         = {NULL, binary, PREC_FACTOR},
-    [TOKEN_DIV]         = {NULL, binary, PREC_FACTOR},
-    [TOKEN_SUMMON]      = {NULL, NULL, PREC_NONE},
-    [TOKEN_TUMBLE]      = {NULL, NULL, PREC_NONE},
-    [TOKEN_BANANA]      = {NULL, NULL, PREC_NONE},
-    [TOKEN_RIPE]        = {NULL, ripe_, PREC_RIPE},     
-    [TOKEN_YELLOW]      = {NULL, yellow_, PREC_YELLOW},
-    [TOKEN_CATCH]       = {NULL, NULL, PREC_NONE},
-    [TOKEN_ERROR]       = {NULL, NULL, PREC_NONE},
-    [TOKEN_EOF]         = {NULL, NULL, PREC_NONE}, 
-
-};
-
-static ParseRule* getRule(TokenType type) { return &rules[type]; }
-static void parsePrecedence(Parser* p, Precedence precedence) {
-  advance(p);
-  ParseFn prefixRule = getRule(p->previous.type)->prefix;
-  if (prefixRule == NULL) {
-    error(p, "Expect expression.");
-    return;
+  if (table->count == UINT16_MAX) {
+    error(e, overflowMessage);
+    return 0;
   }
-  bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(p, canAssign);
-  while (precedence <= getRule(p->current.type)->precedence) {
-    advance(p);
-    ParseFn infixRule = getRule(p->previous.type)->infix;
-    infixRule(p, canAssign);
+  if (table->count == table->capacity) {
+    table->capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+    table->names = (Token*)realloc(table->names, sizeof(Token) * table->capacity);
   }
-}
-static void expression(Parser* p) { parsePrecedence(p, PREC_ASSIGNMENT); }
-static void block(Parser* p) {
-  while (!check(p, TOKEN_RBRACE) && !check(p, TOKEN_EOF)) {
-    declaration(p);
+  table->names[table->count++] = *name;
+  if ((table->count + 1) * 4 > table->bucketCapacity * 3) {
+    growNameBuckets(table);
+  } else {
+    uint32_t index =
+        hashName(name->start, name->length) & (table->bucketCapacity - 1);
+    while (table->buckets[index] != 0) {
+      index = (index + 1) & (table->bucketCapacity - 1);
+    }
+    table->buckets[index] = table->count;
   }
-  consume(p, TOKEN_RBRACE, "Expect '}' after block.");
+  return (uint16_t)(table->count - 1);
 }
-static void printStatement(Parser* p) {
-  expression(p);
-  emitByte(p, OP_PRINT);
+
+static void emitGlobal(Emitter* e, uint8_t instruction, Token* name) {
+  uint16_t slot = nameSlot(e, &e->globals, name, "Too many global variables.");
+  long start = e->codeCount;
+  emitByte(e, instruction);
+  emitRaw(e, &slot, sizeof(uint16_t));
+  markFusable(e, start, instruction);
 }
-static void stringOperation(Parser* p, bool canAssign) {
-    TokenType opType = p->previous.type;
-    consume(p, TOKEN_LPAREN, "Expect '(' after a string operation.");
-    expression(p); // The primary string or first argument
 
-    if (opType == TOKEN_GRAFT || opType == TOKEN_SLICE || opType == TOKEN_SCAN) {
-        consume(p, TOKEN_COMMA, "Expect ',' separating arguments.");
-        expression(p); // The second argument
-    }
+// String literal tokens still have their quotes.
+uint16_t stringConstant(Emitter* e, Token* literal) {
+  Token value = {.start = literal->start + 1, .length = literal->length - 2};
+  return nameSlot(e, &e->constants, &value, "Too many constants in one file.");
+}
 
-    // slice has a third argument
-    if (opType == TOKEN_SLICE) {
-        consume(p, TOKEN_COMMA, "Expect ',' separating arguments.");
-        expression(p);
-    }
+static void emitStringConstant(Emitter* e, Token* literal) {
+  uint16_t index = stringConstant(e, literal);
+  emitByte(e, OP_CONSTANT);
+  emitRaw(e, &index, sizeof(uint16_t));
+}
 
-    consume(p, TOKEN_RPAREN, "Expect ')' after arguments.");
+uint16_t addFunction(Emitter* e, Token name, int arity, uint32_t address) {
+  if (e->functionCount == UINT16_MAX) {
+    error(e, "Too many tribes in one file.");
+    return 0;
+  }
+  if (e->functionCount == e->functionCapacity) {
+    e->functionCapacity = e->functionCapacity < 8 ? 8 : e->functionCapacity * 2;
+    e->functions = (FunctionProto*)realloc(
+        e->functions, sizeof(FunctionProto) * e->functionCapacity);
+  }
+  uint16_t index = (uint16_t)e->functionCount++;
+  e->functions[index] = (FunctionProto){name, (uint8_t)arity, address, 0};
+  return index;
+}
 
-    switch (opType) {
-        case TOKEN_SLICE: emitByte(p, OP_SLICE); break;
-        case TOKEN_GRAFT: emitByte(p, OP_GRAFT); break;
-        case TOKEN_SCAN:  emitByte(p, OP_SCAN); break;
-        case TOKEN_SHED:  emitByte(p, OP_SHED); break;
-        default:          error(p, "Invalid string operation.");
-    }
+void addHandler(Emitter* e, long start, long end, int depth, int slot) {
+  if (e->handlerCount == e->handlerCapacity) {
+    e->handlerCapacity = e->handlerCapacity < 8 ? 8 : e->handlerCapacity * 2;
+    e->handlers = (TumbleHandler*)realloc(
+        e->handlers, sizeof(TumbleHandler) * e->handlerCapacity);
+    if (e->handlers == NULL) exit(1);
+  }
+  e->handlers[e->handlerCount++] = (TumbleHandler){
+      e->compiler->address, (uint32_t)start, (uint32_t)end,
+      (uint32_t)e->codeCount, (uint8_t)depth, (uint8_t)slot};
 }
-static void tally(Parser* p, bool canAssign) {
-    consume(p, TOKEN_LPAREN, "Expect '(' after 'tally'.");
-    expression(p); // The string expression
-    consume(p, TOKEN_RPAREN, "Expect ')' after tally argument.");
-    emitByte(p, OP_STRLEN); // We can reuse the old opcode
+
+static void emitFunction(Emitter* e, Token name, int arity, uint32_t address) {
+  uint16_t index = addFunction(e, name, arity, address);
+  emitByte(e, OP_FUNCTION);
+  emitRaw(e, &index, sizeof(uint16_t));
 }
-static void expressionStatement(Parser* p) {
-  expression(p);
-  // In REPL mode, print the result of an expression statement.
-  // Otherwise, pop it off the stack.
-  emitByte(p, p->isRepl ? OP_PRINT : OP_POP);
-}
-
-static void ifStatement(Parser* p) {
-  consume(p, TOKEN_LPAREN, "Expect '(' after 'if'.");
-  expression(p);
-  consume(p, TOKEN_RPAREN, "Expect ')' after if condition.");
-  consume(p, TOKEN_LBRACE, "Expect '{' after condition.");
-  long thenJump = emitJump(p, OP_JUMP_IF_FALSE);
-  emitByte(p, OP_POP);
-  block(p);
-  long elseJump = emitJump(p, OP_JUMP);
-  patchJump(p, thenJump);
-  emitByte(p, OP_POP);
-  if (match(p, TOKEN_ELSE)) {
-    consume(p, TOKEN_LBRACE, "Expect '{' after 'else'.");
-    block(p);
-  }
-  patchJump(p, elseJump);
-}
-
-static void swingStatement(Parser* p) {
-  expression(p);
-  emitByte(p, OP_LOOP_START);
-  uint32_t loopStart = ftell(p->outFile);
-  consume(p, TOKEN_LBRACE, "Expect '{' before swing block.");
-  block(p);
-  emitByte(p, OP_JUMP_BACK);
-  emitAddress(p, loopStart);
-}
-static void giveStatement(Parser* p) {
-  if (check(p, TOKEN_RBRACE)) {
-    emitReturn(p);
-  } else {
-    expression(p);
-    emitByte(p, OP_RETURN);
-  }
-}
-
-static void tumbleStatement(Parser* p) {
-    consume(p, TOKEN_LBRACE, "Expect '{' after 'tumble'.");
-    long catchJump = emitJump(p, OP_TUMBLE_SETUP);
-    block(p);
-    emitByte(p, OP_TUMBLE_END);
-    long exitJump = emitJump(p, OP_JUMP);
-    patchJump(p, catchJump);
-    consume(p, TOKEN_CATCH, "Expect 'catch' after 'tumble' block.");
-    consume(p, TOKEN_LPAREN, "Expect '(' after 'catch'.");
-    beginScope(p);
-    consume(p, TOKEN_ID, "Expect error variable name.");
-    declareVariable(p);
-    consume(p, TOKEN_RPAREN, "Expect ')' after error variable.");
-    consume(p, TOKEN_LBRACE, "Expect '{' after catch clause.");
-    block(p);
-    endScope(p);
-    patchJump(p, exitJump);
-}
-
-static void summonStatement(Parser* p) {
-    consume(p, TOKEN_STRING, "Expect file path string after 'summon'.");
-    string(p, false);
-    emitByte(p, OP_SUMMON);
-}
-
-static void statement(Parser* p) {
-  if (match(p, TOKEN_TREE)) {
-    printStatement(p);
-  } else if (match(p, TOKEN_GIVE)) {
-    giveStatement(p);
-  } else if (match(p, TOKEN_IF)) {
-    ifStatement(p);
-  } else if (match(p, TOKEN_TUMBLE)) {
-    tumbleStatement(p);
-  } else if (match(p, TOKEN_SUMMON)) {
-    summonStatement(p);
-  } else if (match(p, TOKEN_SWING)) {
-    swingStatement(p);
-  }
-  else if (match(p, TOKEN_BANANA)) {
-    bananaStatement(p);
-  }
-   else if (match(p, TOKEN_LBRACE)) {
-    beginScope(p);
-    block(p);
-    endScope(p);
-  } else {
-    expressionStatement(p);
+
+// Writes the 16-bit offset of a backward jump to `loopStart`, measured from
+// the end of the instruction; `after` operand bytes still follow it.
+static void emitLoopOffset(Emitter* e, long loopStart, int after) {
+  long offset = e->codeCount - loopStart + 2 + after;
+  if (offset > UINT16_MAX) {
+    error(e, "Loop body too large.");
   }
+  emitByte(e, (offset >> 8) & 0xff);
+  emitByte(e, offset & 0xff);
 }
 
-static void initCompiler(Compiler* compiler, Compiler* enclosing) {
+static void emitLoop(Emitter* e, long loopStart) {
+  emitByte(e, OP_LOOP);
+  emitLoopOffset(e, loopStart, 0);
+}
+
+static void emitReturn(Emitter* e) {
+  emitByte(e, OP_NIL);
+  emitByte(e, OP_RETURN);
+}
+
+void initCompiler(Compiler* compiler, Compiler* enclosing) {
   compiler->enclosing = enclosing;
+  compiler->address = 0;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->tumbleDepth = 0;
+  compiler->freeRegister = 1;
+  compiler->registerCount = 1;
   Local* local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->name.start = "";
   local->name.length = 0;
 }
 
-static void beginScope(Parser* p) { p->compiler->scopeDepth++; }
+static void beginScope(Emitter* e) { e->compiler->scopeDepth++; }
 
-static void endScope(Parser* p) {
-  p->compiler->scopeDepth--;
-  while (p->compiler->localCount > 0 &&
-         p->compiler->locals[p->compiler->localCount - 1].depth > p->compiler->scopeDepth) {
-    emitByte(p, OP_POP);
-    p->compiler->localCount--;
+static void endScope(Emitter* e) {
+  e->compiler->scopeDepth--;
+  while (e->compiler->localCount > 0 &&
+         e->compiler->locals[e->compiler->localCount - 1].depth > e->compiler->scopeDepth) {
+    emitByte(e, OP_POP);
+    e->compiler->localCount--;
   }
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+int resolveLocal(Compiler* compiler, Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (name->length == local->name.length &&
@@ -537,146 +278,603 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static void addLocal(Parser* p, Token name) {
-  if (p->compiler->localCount == 256) {
-    error(p, "Too many local variables in function.");
+static void addLocal(Emitter* e, Token* name) {
+  if (e->compiler->localCount == 256) {
+    errorAt(e, name, "Too many local variables in function.");
     return;
   }
-  Local* local = &p->compiler->locals[p->compiler->localCount++];
-  local->name = name;
-  local->depth = p->compiler->scopeDepth;
+  Local* local = &e->compiler->locals[e->compiler->localCount++];
+  local->name = *name;
+  local->depth = e->compiler->scopeDepth;
 }
 
-static void declareVariable(Parser* p) {
-  if (p->compiler->scopeDepth == 0) return;
-  Token* name = &p->previous;
-  for (int i = p->compiler->localCount - 1; i >= 0; i--) {
-    Local* local = &p->compiler->locals[i];
-    if (local->depth != -1 && local->depth < p->compiler->scopeDepth) break;
-    if (name->length == local->name.length &&
-        memcmp(name->start, local->name.start, name->length) == 0) {
-      error(p, "Already a variable with this name in this scope.");
-    }
+int declareHidden(Emitter* e) {
+  if (e->compiler->localCount == 256) {
+    error(e, "Too many local variables in function.");
+    return 0;
   }
-  addLocal(p, *name);
+  int slot = e->compiler->localCount++;
+  Local* local = &e->compiler->locals[slot];
+  local->depth = e->compiler->scopeDepth;
+  local->name.start = "";
+  local->name.length = 0;
+  return slot;
 }
 
-static void varDeclaration(Parser* p) {
-  consume(p, TOKEN_ID, "Expect variable name.");
-  Token name = p->previous;
-  declareVariable(p);
-  if (match(p, TOKEN_EQUAL)) {
-    expression(p);
-  } else {
-    emitByte(p, OP_NIL);
+void declareVariable(Emitter* e, Token* name) {
+  if (e->compiler->scopeDepth == 0) return;
+  for (int i = e->compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &e->compiler->locals[i];
+    if (local->depth != -1 && local->depth < e->compiler->scopeDepth) break;
+    if (name->length == local->name.length &&
+        memcmp(name->start, local->name.start, name->length) == 0) {
+      errorAt(e, name, "Already a variable with this name in this scope.");
+    }
   }
-  if (p->compiler->scopeDepth == 0) {
-    emitByte(p, OP_SET_GLOBAL);
-    uint8_t len = (uint8_t)name.length;
-    emitByte(p, len);
-    fwrite(name.start, sizeof(char), len, p->outFile);
-    emitByte(p, OP_POP);
+  addLocal(e, name);
+}
+
+static void expressions(Emitter* e, NodeList list) {
+  for (int i = 0; i < list.count; i++) expression(e, list.items[i]);
+}
+
+static void binary(Emitter* e, Node* node) {
+  expression(e, node->as.binary.left);
+  expression(e, node->as.binary.right);
+  uint8_t instruction;
+  switch (node->token.type) {
+    case TOKEN_PLUS:          instruction = OP_ADD; break;
+    case TOKEN_MINUS:         instruction = OP_SUB; break;
+    case TOKEN_MUL:           instruction = OP_MUL; break;
+    case TOKEN_DIV:           instruction = OP_DIV; break;
+    case TOKEN_EQUAL_EQUAL:   instruction = OP_EQUAL; break;
+    case TOKEN_BANG_EQUAL:    instruction = OP_NOT_EQUAL; break;
+    case TOKEN_GREATER:       instruction = OP_GREATER; break;
+    case TOKEN_GREATER_EQUAL: instruction = OP_GREATER_EQUAL; break;
+    case TOKEN_LESS:          instruction = OP_LESS; break;
+    case TOKEN_LESS_EQUAL:    instruction = OP_LESS_EQUAL; break;
+    default: return;
   }
-}
-
-static void funDeclaration(Parser* p) {
-  consume(p, TOKEN_ID, "Expect function name.");
-  Token name = p->previous;
-  declareVariable(p);
-  long bodyJump = emitJump(p, OP_JUMP);
-  long bodyStart = ftell(p->outFile);
-  Compiler compiler;
-  initCompiler(&compiler, p->compiler);
-  p->compiler = &compiler;
-  beginScope(p);
-  int arity = 0;
-  consume(p, TOKEN_LPAREN, "Expect '(' after function name.");
-  if (!check(p, TOKEN_RPAREN)) {
-    do {
-      arity++;
-      if (arity > 255) error(p, "Can't have more than 255 parameters.");
-      consume(p, TOKEN_ID, "Expect parameter name.");
-      declareVariable(p);
-    } while (match(p, TOKEN_COMMA));
-  }
-  consume(p, TOKEN_RPAREN, "Expect ')' after parameters.");
-  consume(p, TOKEN_LBRACE, "Expect '{' before function body.");
-  block(p);
-  emitReturn(p);
-  p->compiler = p->compiler->enclosing;
-  patchJump(p, bodyJump);
-  emitByte(p, OP_PUSH);
-  emitByte(p, VAL_OBJ);
-  emitByte(p, OBJ_FUNCTION);
-  emitByte(p, (uint8_t)arity);
-  emitAddress(p, bodyStart);
-  uint8_t nameLen = (uint8_t)name.length;
-  emitByte(p, nameLen);
-  fwrite(name.start, sizeof(char), nameLen, p->outFile);
-  if (p->compiler->scopeDepth == 0) {
-    emitByte(p, OP_SET_GLOBAL);
-    uint8_t len = (uint8_t)name.length;
-    emitByte(p, len);
-    fwrite(name.start, sizeof(char), len, p->outFile);
-  }
-}
-
-static void variable(Parser* p, bool canAssign) {
-  Token name = p->previous;
-  int arg = resolveLocal(p->compiler, &name);
+  long start = e->codeCount;
+  emitByte(e, instruction);
+  markFusable(e, start, instruction);
+}
+
+static void ripe_(Emitter* e, Node* node) {
+  expression(e, node->as.binary.left);
+  long endJump = emitJump(e, OP_JUMP_IF_FALSE);
+  emitByte(e, OP_POP);
+  expression(e, node->as.binary.right);
+  patchJump(e, endJump);
+}
+
+static void yellow_(Emitter* e, Node* node) {
+  expression(e, node->as.binary.left);
+  long elseJump = emitJump(e, OP_JUMP_IF_FALSE);
+  long endJump = emitJump(e, OP_JUMP);
+  patchJump(e, elseJump);
+  emitByte(e, OP_POP);
+  expression(e, node->as.binary.right);
+  patchJump(e, endJump);
+}
+
+// `condition ? thenValue : elseValue`, as left behind by inlining a tribe.
+static void conditional(Emitter* e, Node* node) {
+  expression(e, node->as.conditional.condition);
+  long elseJump = emitConditionalJump(e);
+  expression(e, node->as.conditional.thenValue);
+  long endJump = emitJump(e, OP_JUMP);
+  patchJump(e, elseJump);
+  expression(e, node->as.conditional.elseValue);
+  patchJump(e, endJump);
+}
+
+static void variable(Emitter* e, Node* node) {
+  int arg = resolveLocal(e->compiler, &node->token);
   if (arg != -1) {
-    if (canAssign && match(p, TOKEN_EQUAL)) {
-      expression(p);
-      emitBytes(p, OP_SET_LOCAL, (uint8_t)arg);
+    if (node->type == NODE_ASSIGN) {
+      expression(e, node->as.value);
+      long start = e->codeCount;
+      emitBytes(e, OP_SET_LOCAL, (uint8_t)arg);
+      markFusable(e, start, OP_SET_LOCAL);
+    } else if (fusableOpcode(e) == OP_GET_LOCAL) {
+      // Two locals read back to back, as in `a ooh b`.
+      refuse(e, OP_GET_LOCAL_PAIR);
+      emitByte(e, (uint8_t)arg);
     } else {
-      emitBytes(p, OP_GET_LOCAL, (uint8_t)arg);
+      long start = e->codeCount;
+      emitBytes(e, OP_GET_LOCAL, (uint8_t)arg);
+      markFusable(e, start, OP_GET_LOCAL);
     }
   } else {
-    if (canAssign && match(p, TOKEN_EQUAL)) {
-      expression(p);
-      emitByte(p, OP_SET_GLOBAL);
+    if (node->type == NODE_ASSIGN) {
+      expression(e, node->as.value);
+      emitGlobal(e, OP_SET_GLOBAL_SLOT, &node->token);
     } else {
-      emitByte(p, OP_GET_GLOBAL);
+      emitGlobal(e, OP_GET_GLOBAL_SLOT, &node->token);
     }
-    uint8_t len = (uint8_t)name.length;
-    emitByte(p, len);
-    fwrite(name.start, sizeof(char), len, p->outFile);
   }
 }
 
-static void declaration(Parser* p) {
-  if (p->hadError) return;
-  if (match(p, TOKEN_TRIBE)) {
-    funDeclaration(p);
-  } else if (match(p, TOKEN_APE)) {
-    varDeclaration(p);
+static void stringOperation(Emitter* e, Node* node) {
+  expressions(e, node->as.items);
+  switch (node->token.type) {
+    case TOKEN_SLICE: emitByte(e, OP_SLICE); break;
+    case TOKEN_GRAFT: emitByte(e, OP_GRAFT); break;
+    case TOKEN_SCAN:  emitByte(e, OP_SCAN); break;
+    case TOKEN_SHED:  emitByte(e, OP_SHED); break;
+    default:          error(e, "Invalid string operation.");
+  }
+}
+
+static void expression(Emitter* e, Node* node) {
+  Node* enclosing = e->node;
+  e->node = node;
+  switch (node->type) {
+    case NODE_NUMBER:
+      emitByte(e, OP_PUSH);
+      emitByte(e, VAL_NUMBER);
+      emitRaw(e, &node->as.number, sizeof(double));
+      break;
+    case NODE_STRING: emitStringConstant(e, &node->token); break;
+    case NODE_TRUE:   emitByte(e, OP_TRUE); break;
+    case NODE_FALSE:  emitByte(e, OP_FALSE); break;
+    case NODE_NIL:    emitByte(e, OP_NIL); break;
+    case NODE_NOT:
+      expression(e, node->as.operand);
+      emitByte(e, OP_NOT);
+      break;
+    case NODE_BINARY: binary(e, node); break;
+    case NODE_RIPE:   ripe_(e, node); break;
+    case NODE_YELLOW: yellow_(e, node); break;
+    case NODE_CONDITIONAL: conditional(e, node); break;
+    case NODE_VARIABLE:
+    case NODE_ASSIGN:
+      variable(e, node);
+      break;
+    case NODE_CALL:
+      expression(e, node->as.call.callee);
+      expressions(e, node->as.call.arguments);
+      emitBytes(e, OP_CALL, (uint8_t)node->as.call.arguments.count);
+      break;
+    case NODE_BUNCH:
+      expressions(e, node->as.items);
+      emitBytes(e, OP_BUILD_BUNCH, (uint8_t)node->as.items.count);
+      break;
+    case NODE_CANOPY:
+      expressions(e, node->as.items);
+      emitBytes(e, OP_BUILD_CANOPY, (uint8_t)(node->as.items.count / 2));
+      break;
+    case NODE_SUBSCRIPT:
+      expression(e, node->as.subscript.object);
+      expression(e, node->as.subscript.index);
+      emitByte(e, OP_GET_SUBSCRIPT);
+      break;
+    case NODE_SET_SUBSCRIPT:
+      expression(e, node->as.subscript.object);
+      expression(e, node->as.subscript.index);
+      expression(e, node->as.subscript.value);
+      emitByte(e, OP_SET_SUBSCRIPT);
+      break;
+    case NODE_ASK: emitByte(e, OP_ASK); break;
+    case NODE_FORAGE:
+      expression(e, node->as.operand);
+      emitByte(e, OP_FORAGE);
+      break;
+    case NODE_INSCRIBE:
+      expression(e, node->as.binary.left);
+      expression(e, node->as.binary.right);
+      emitByte(e, OP_INSCRIBE);
+      break;
+    case NODE_STRING_OP: stringOperation(e, node); break;
+    case NODE_TALLY:
+      expression(e, node->as.operand);
+      emitByte(e, OP_STRLEN); // We can reuse the old opcode
+      break;
+    default:
+      error(e, "Expect expression.");
+      break;
+  }
+  e->node = enclosing;
+}
+
+static void expressionStatement(Emitter* e, Node* node) {
+  expression(e, node->as.operand);
+  // In REPL mode, print the result of an expression statement.
+  // Otherwise, pop it off the stack.
+  if (e->isRepl) {
+    emitByte(e, OP_PRINT);
   } else {
-    statement(p);
+    emitPop(e);
   }
 }
 
-int compile(const char* source, FILE* outFile, bool isRepl) {
-  Parser p;
-  p.hadError = false;
-  initLexer(&p.lexer, source);
-  p.outFile = outFile;
-  p.isRepl = isRepl; // Set the REPL flag in the parser
-  if (p.outFile == NULL) return 0;
+static void ifStatement(Emitter* e, Node* node) {
+  expression(e, node->as.ifStmt.condition);
+  long thenJump = emitConditionalJump(e);
+  declarations(e, node->as.ifStmt.thenBranch);
+  long elseJump = emitJump(e, OP_JUMP);
+  patchJump(e, thenJump);
+  declarations(e, node->as.ifStmt.elseBranch);
+  patchJump(e, elseJump);
+}
+
+// Inside a tribe or a block, each pass through a loop body pops the locals
+// it declared, so that the frame is the same size every time round. At the
+// top level the body declares globals.
+static void loopBody(Emitter* e, NodeList body) {
+  if (e->compiler->scopeDepth == 0) {
+    declarations(e, body);
+    return;
+  }
+  beginScope(e);
+  declarations(e, body);
+  endScope(e);
+}
+
+// A swing instruction: the 16-bit offset, then the frame slot it works on.
+static void emitSwing(Emitter* e, uint8_t instruction, long loopStart, int slot) {
+  emitByte(e, instruction);
+  emitLoopOffset(e, loopStart, 1);
+  emitByte(e, (uint8_t)slot);
+}
+
+// The count lives in a hidden local, which OP_SWING_COUNT decrements at the
+// end of each pass.
+static void swingStatement(Emitter* e, Node* node) {
+  expression(e, node->as.loop.condition);
+  int counter = declareHidden(e);
+  long loopStart = e->codeCount;
+  markJumpTarget(e);
+  loopBody(e, node->as.loop.body);
+  emitSwing(e, OP_SWING_COUNT, loopStart, counter);
+  emitByte(e, OP_POP);
+  e->compiler->localCount--;
+}
+
+// `swing i from a to b`: both bounds are evaluated once, into the loop
+// variable and a hidden local for the limit after it.
+static void swingRange(Emitter* e, Node* node) {
+  beginScope(e);
+  expression(e, node->as.range.from);
+  expression(e, node->as.range.to);
+  int slot = e->compiler->localCount;
+  declareVariable(e, &node->token);
+  declareHidden(e);
+  long exitJump = emitJump(e, OP_SWING_RANGE);
+  emitByte(e, (uint8_t)slot);
+  long exitEnd = e->codeCount;
+  long loopStart = e->codeCount;
+  markJumpTarget(e);
+  beginScope(e);
+  declarations(e, node->as.range.body);
+  endScope(e);
+  emitSwing(e, OP_SWING_STEP, loopStart, slot);
+  patchOffset(e, exitJump, exitEnd);
+  endScope(e);
+}
+
+static void bananaStatement(Emitter* e, Node* node) {
+  long loopStart = e->codeCount;
+  markJumpTarget(e);
+  expression(e, node->as.loop.condition);
+  long exitJump = emitConditionalJump(e);
+  loopBody(e, node->as.loop.body);
+  emitLoop(e, loopStart);
+  patchJump(e, exitJump);
+}
+
+// Whether the code for `node` ends with the OP_CALL of a call whose result is
+// the value of the whole expression. Short-circuit operators end with their
+// right operand, which they only skip to leave the left one as the result.
+static bool endsWithCall(Node* node) {
+  switch (node->type) {
+    case NODE_CALL:   return true;
+    case NODE_RIPE:
+    case NODE_YELLOW: return endsWithCall(node->as.binary.right);
+    default:          return false;
+  }
+}
+
+// A tribe that gives the result of a call reuses its own frame for the
+// callee. Not inside a tumble block, whose handler belongs to this frame, and
+// not at the top level of a script.
+static void emitTailCall(Emitter* e, Node* value) {
+  if (e->compiler->enclosing == NULL || e->compiler->tumbleDepth > 0) return;
+  if (!endsWithCall(value)) return;
+  e->code[e->codeCount - 2] = OP_TAIL_CALL;
+}
+
+static void giveStatement(Emitter* e, Node* node) {
+  if (node->as.operand == NULL) {
+    emitReturn(e);
+  } else {
+    expression(e, node->as.operand);
+    emitTailCall(e, node->as.operand);
+    emitByte(e, OP_RETURN);
+  }
+}
+
+// The body runs as plain code; only its entry in the handler table says where
+// a failure inside it continues. Locals the body declares stay in scope
+// after it, so the catch variable comes after them and they are nil when
+// the catch block runs.
+static void tumbleStatement(Emitter* e, Node* node) {
+  long start = e->codeCount;
+  int depth = e->compiler->localCount;
+  markJumpTarget(e);
+  e->compiler->tumbleDepth++;
+  declarations(e, node->as.tumble.body);
+  e->compiler->tumbleDepth--;
+  long end = e->codeCount;
+  long exitJump = emitJump(e, OP_JUMP);
+  markJumpTarget(e);
+  addHandler(e, start, end, depth, e->compiler->localCount);
+  beginScope(e);
+  declareVariable(e, &node->as.tumble.errorName);
+  declarations(e, node->as.tumble.handler);
+  endScope(e);
+  patchJump(e, exitJump);
+}
+
+static void summonStatement(Emitter* e, Node* node) {
+  expression(e, node->as.operand);
+  emitByte(e, OP_SUMMON);
+  emitByte(e, OP_POP); // the module's return value
+}
+
+static void varDeclaration(Emitter* e, Node* node) {
+  declareVariable(e, &node->token);
+  if (node->as.value != NULL) {
+    expression(e, node->as.value);
+  } else {
+    emitByte(e, OP_NIL);
+  }
+  if (e->compiler->scopeDepth == 0) {
+    emitGlobal(e, OP_SET_GLOBAL_SLOT, &node->token);
+    emitPop(e);
+  }
+}
 
+static void funDeclaration(Emitter* e, Node* node) {
+  declareVariable(e, &node->token);
+  long bodyJump = emitJump(e, OP_JUMP);
+  long bodyStart = e->codeCount;
   Compiler compiler;
-  initCompiler(&compiler, NULL);
-  p.compiler = &compiler;
+  initCompiler(&compiler, e->compiler);
+  compiler.address = (uint32_t)bodyStart;
+  e->compiler = &compiler;
+  beginScope(e);
+  for (int i = 0; i < node->as.tribe.arity; i++) {
+    declareVariable(e, &node->as.tribe.params[i]);
+  }
+  declarations(e, node->as.tribe.body);
+  emitReturn(e);
+  e->compiler = e->compiler->enclosing;
+  patchJump(e, bodyJump);
+  emitFunction(e, node->token, node->as.tribe.arity, bodyStart);
+  if (e->compiler->scopeDepth == 0) {
+    emitGlobal(e, OP_SET_GLOBAL_SLOT, &node->token);
+    emitPop(e);
+  }
+}
 
-  advance(&p);
-  while (!match(&p, TOKEN_EOF)) {
-    declaration(&p);
-    if (p.hadError) break;
+static void declaration(Emitter* e, Node* node) {
+  Node* enclosing = e->node;
+  e->node = node;
+  switch (node->type) {
+    case NODE_TRIBE: funDeclaration(e, node); break;
+    case NODE_VAR:   varDeclaration(e, node); break;
+    case NODE_PRINT:
+      expression(e, node->as.operand);
+      emitByte(e, OP_PRINT);
+      break;
+    case NODE_GIVE:   giveStatement(e, node); break;
+    case NODE_IF:     ifStatement(e, node); break;
+    case NODE_TUMBLE: tumbleStatement(e, node); break;
+    case NODE_SUMMON: summonStatement(e, node); break;
+    case NODE_SWING:  swingStatement(e, node); break;
+    case NODE_SWING_RANGE: swingRange(e, node); break;
+    case NODE_BANANA: bananaStatement(e, node); break;
+    case NODE_BLOCK:
+      beginScope(e);
+      declarations(e, node->as.statements);
+      endScope(e);
+      break;
+    default: expressionStatement(e, node); break;
   }
-  
+  e->node = enclosing;
+}
 
-      emitReturn(&p);
-  
+static void declarations(Emitter* e, NodeList list) {
+  for (int i = 0; i < list.count; i++) declaration(e, list.items[i]);
+}
 
-  return !p.hadError;
+static void writeGlobalsSection(FILE* outFile, NameTable* globals) {
+  uint8_t* section = NULL;
+  size_t sectionSize = 0;
+  FILE* stream = open_memstream((char**)&section, &sectionSize);
+  uint16_t count = (uint16_t)globals->count;
+  fwrite(&count, sizeof(uint16_t), 1, stream);
+  for (int i = 0; i < globals->count; i++) {
+    uint8_t length = (uint8_t)globals->names[i].length;
+    fwrite(&length, sizeof(uint8_t), 1, stream);
+    fwrite(globals->names[i].start, sizeof(char), length, stream);
+  }
+  fclose(stream);
+  writeApbSection(outFile, APB_SECTION_GLOBALS, section, (uint32_t)sectionSize);
+  free(section);
+}
+
+static void writeConstantsSection(FILE* outFile, NameTable* constants) {
+  uint8_t* section = NULL;
+  size_t sectionSize = 0;
+  FILE* stream = open_memstream((char**)&section, &sectionSize);
+  uint16_t count = (uint16_t)constants->count;
+  fwrite(&count, sizeof(uint16_t), 1, stream);
+  for (int i = 0; i < constants->count; i++) {
+    uint8_t kind = APB_CONSTANT_STRING;
+    uint32_t length = (uint32_t)constants->names[i].length;
+    fwrite(&kind, sizeof(uint8_t), 1, stream);
+    fwrite(&length, sizeof(uint32_t), 1, stream);
+    fwrite(constants->names[i].start, sizeof(char), length, stream);
+  }
+  fclose(stream);
+  writeApbSection(outFile, APB_SECTION_CONSTANTS, section, (uint32_t)sectionSize);
+  free(section);
+}
+
+static void writeFunctionsSection(FILE* outFile, Emitter* e) {
+  uint8_t* section = NULL;
+  size_t sectionSize = 0;
+  FILE* stream = open_memstream((char**)&section, &sectionSize);
+  uint16_t count = (uint16_t)e->functionCount;
+  fwrite(&e->stack, sizeof(uint32_t), 1, stream);
+  fwrite(&count, sizeof(uint16_t), 1, stream);
+  for (int i = 0; i < e->functionCount; i++) {
+    FunctionProto* function = &e->functions[i];
+    uint8_t nameLength = (uint8_t)function->name.length;
+    fwrite(&function->arity, sizeof(uint8_t), 1, stream);
+    fwrite(&function->address, sizeof(uint32_t), 1, stream);
+    fwrite(&function->stack, sizeof(uint32_t), 1, stream);
+    fwrite(&nameLength, sizeof(uint8_t), 1, stream);
+    fwrite(function->name.start, sizeof(char), nameLength, stream);
+  }
+  fclose(stream);
+  writeApbSection(outFile, APB_SECTION_FUNCTIONS, section, (uint32_t)sectionSize);
+  free(section);
+}
+
+static void writeHandlersSection(FILE* outFile, Emitter* e) {
+  uint8_t* section = NULL;
+  size_t sectionSize = 0;
+  FILE* stream = open_memstream((char**)&section, &sectionSize);
+  uint32_t count = (uint32_t)e->handlerCount;
+  fwrite(&count, sizeof(uint32_t), 1, stream);
+  for (int i = 0; i < e->handlerCount; i++) {
+    TumbleHandler* handler = &e->handlers[i];
+    fwrite(&handler->function, sizeof(uint32_t), 1, stream);
+    fwrite(&handler->start, sizeof(uint32_t), 1, stream);
+    fwrite(&handler->end, sizeof(uint32_t), 1, stream);
+    fwrite(&handler->target, sizeof(uint32_t), 1, stream);
+    fwrite(&handler->depth, sizeof(uint8_t), 1, stream);
+    fwrite(&handler->slot, sizeof(uint8_t), 1, stream);
+  }
+  fclose(stream);
+  writeApbSection(outFile, APB_SECTION_HANDLERS, section, (uint32_t)sectionSize);
+  free(section);
+}
+
+// Runs the peephole pass over the finished code, moving the tribe entry
+// points and the bounds of tumble blocks along with it.
+static void runPeephole(Emitter* e) {
+  int count = e->functionCount + 4 * e->handlerCount;
+  uint32_t* entries = (uint32_t*)malloc(sizeof(uint32_t) * (count + 1));
+  for (int i = 0; i < e->functionCount; i++) entries[i] = e->functions[i].address;
+  uint32_t* bounds = entries + e->functionCount;
+  for (int i = 0; i < e->handlerCount; i++) {
+    bounds[4 * i] = e->handlers[i].function;
+    bounds[4 * i + 1] = e->handlers[i].start;
+    bounds[4 * i + 2] = e->handlers[i].end;
+    bounds[4 * i + 3] = e->handlers[i].target;
+  }
+  e->codeCount = optimizeCode(e->code, e->codeCount, entries, count);
+  for (int i = 0; i < e->functionCount; i++) e->functions[i].address = entries[i];
+  for (int i = 0; i < e->handlerCount; i++) {
+    e->handlers[i].function = bounds[4 * i];
+    e->handlers[i].start = bounds[4 * i + 1];
+    e->handlers[i].end = bounds[4 * i + 2];
+    e->handlers[i].target = bounds[4 * i + 3];
+  }
+  free(entries);
+}
+
+// The stack the function at `address` needs, for the function table.
+// Register code gives its frame size in the R_ENTER it starts with.
+static uint32_t measureStack(Emitter* e, Token* name, uint32_t address,
+                             int arity, bool registers) {
+  if (registers) return e->code[address + 1];
+  int depth = stackDepth(e->code, (uint32_t)e->codeCount, address, arity,
+                         e->handlers, e->handlerCount);
+  if (depth < 0) {
+    if (name != NULL) errorAt(e, name, "Too much to hold on the stack at once.");
+    e->hadError = true;
+    return 0;
+  }
+  return (uint32_t)depth;
 }
 
+int compile(const char* source, FILE* outFile, bool isRepl, bool optimize,
+            bool registers) {
+  if (outFile == NULL) return 0;
+
+  Arena arena;
+  initArena(&arena);
+  NodeList program;
+  if (!parse(source, &arena, &program)) {
+    freeArena(&arena);
+    return 0;
+  }
+  foldConstants(&arena, &program);
+  inlineTribes(&arena, program);
+  // Inlined calls with literal arguments can often be folded further.
+  foldConstants(&arena, &program);
+
+  Emitter e;
+  e.hadError = false;
+  e.node = NULL;
+  e.isRepl = isRepl;
+  e.code = NULL;
+  e.codeCount = 0;
+  e.codeCapacity = 0;
+  e.lastJumpTarget = -1;
+  e.fusableEnd = -1;
+  e.globals = (NameTable){NULL, 0, 0, NULL, 0};
+  e.constants = (NameTable){NULL, 0, 0, NULL, 0};
+  e.functions = NULL;
+  e.functionCount = 0;
+  e.functionCapacity = 0;
+  e.stack = 0;
+  e.handlers = NULL;
+  e.handlerCount = 0;
+  e.handlerCapacity = 0;
+
+  Compiler compiler;
+  initCompiler(&compiler, NULL);
+  e.compiler = &compiler;
+  if (registers) {
+    generateRegisterCode(&e, program);
+  } else {
+    declarations(&e, program);
+    emitReturn(&e);
+    if (optimize && !e.hadError) runPeephole(&e);
+  }
+  if (!e.hadError) {
+    e.stack = measureStack(&e, e.node != NULL ? &e.node->token : NULL, 0, 0,
+                           registers);
+  }
+  for (int i = 0; i < e.functionCount && !e.hadError; i++) {
+    FunctionProto* function = &e.functions[i];
+    function->stack = measureStack(&e, &function->name, function->address,
+                                   function->arity, registers);
+  }
+
+  if (!e.hadError) {
+    writeApbHeader(outFile, registers ? APB_FLAG_REGISTERS : 0);
+    writeGlobalsSection(outFile, &e.globals);
+    writeConstantsSection(outFile, &e.constants);
+    writeFunctionsSection(outFile, &e);
+    if (e.handlerCount > 0) writeHandlersSection(outFile, &e);
+    writeApbSection(outFile, APB_SECTION_CODE, e.code, (uint32_t)e.codeCount);
+  }
+
+  free(e.code);
+  free(e.globals.names);
+  free(e.globals.buckets);
+  free(e.constants.names);
+  free(e.constants.buckets);
+  free(e.functions);
+  free(e.handlers);
+  freeArena(&arena);
+  return !e.hadError;
+}
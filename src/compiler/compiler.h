@@ -3,7 +3,12 @@
 
 #include "../common.h"
 
-int compile(const char* source, FILE* outFile, bool isRepl);
+// Compiles `source` into an .apb image written to `outFile`. With `optimize`
+// the code is run through the peephole pass in peephole.c first. With
+// `registers` the file holds register code (see registers.c) instead, which
+// the peephole pass does not apply to.
+int compile(const char* source, FILE* outFile, bool isRepl, bool optimize,
+            bool registers);
 
 #endif 
 
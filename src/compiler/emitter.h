@@ -0,0 +1,97 @@
+#ifndef APE_EMITTER_H
+#define APE_EMITTER_H
+
+#include "ast.h"
+
+// State shared by the two code generators: compiler.c, which writes stack
+// code, and registers.c, which writes register code. Both fill the same code
+// buffer and tables, and compile() writes them out the same way.
+
+typedef struct {
+  Token name;
+  int depth;
+} Local;
+
+typedef struct Compiler {
+  struct Compiler* enclosing;
+  uint32_t address;    // where the function's code starts; 0 for the top level
+  Local locals[256];
+  int localCount;
+  int scopeDepth;
+  int tumbleDepth;     // tumble blocks around the code being compiled
+  // Register code only. Local N lives in register N, and temporaries are
+  // taken from freeRegister upwards; registerCount is the frame size so far.
+  int freeRegister;
+  int registerCount;
+} Compiler;
+
+// A deduplicated list of names or strings, numbered in order of first
+// appearance. Each compilation unit keeps one for the globals it mentions and
+// one for its string constants; both are written into the .apb so the VM can
+// bind them when it loads the file.
+typedef struct {
+  Token* names;
+  int count;
+  int capacity;
+  int* buckets;        // open-addressed hash of slot + 1, 0 when empty
+  int bucketCapacity;
+} NameTable;
+
+// Every tribe declaration gets a prototype in the .apb function table. The VM
+// creates the function objects once, when it loads the file.
+typedef struct {
+  Token name;
+  uint8_t arity;
+  uint32_t address;
+  uint32_t stack;      // value slots the code needs, worked out at the end
+} FunctionProto;
+
+typedef struct {
+  bool hadError;
+  Node* node;          // the node being compiled, where errors are reported
+  uint8_t* code;       // the code section, assembled into the .apb at the end
+  long codeCount;
+  long codeCapacity;
+  long lastJumpTarget; // code offset the latest jump or loop lands on
+  long fusableStart;   // the latest instruction a superinstruction may absorb
+  long fusableEnd;
+  uint8_t fusableOpcode;
+  Compiler* compiler;
+  NameTable globals;
+  NameTable constants;
+  FunctionProto* functions;
+  int functionCount;
+  int functionCapacity;
+  uint32_t stack;      // what the top-level code needs, as in FunctionProto
+  TumbleHandler* handlers;
+  int handlerCount;
+  int handlerCapacity;
+  bool isRepl; // Flag to indicate if we are in REPL mode
+} Emitter;
+
+void errorAt(Emitter* e, Token* token, const char* message);
+void emitByte(Emitter* e, uint8_t byte);
+void emitRaw(Emitter* e, const void* data, size_t size);
+// Fills in the 16-bit forward jump whose operand is at `offset` so that it
+// lands on the current end of the code.
+void patchJump(Emitter* e, long offset);
+
+uint16_t nameSlot(Emitter* e, NameTable* table, Token* name,
+                  const char* overflowMessage);
+// The constant slot of a string literal token, which still has its quotes.
+uint16_t stringConstant(Emitter* e, Token* literal);
+// Adds a tribe prototype and returns its index in the function table.
+uint16_t addFunction(Emitter* e, Token name, int arity, uint32_t address);
+
+// Lists a tumble block of the function being compiled in the handler table.
+// Blocks are added as they end, so inner ones come first.
+void addHandler(Emitter* e, long start, long end, int depth, int slot);
+
+void initCompiler(Compiler* compiler, Compiler* enclosing);
+int resolveLocal(Compiler* compiler, Token* name);
+void declareVariable(Emitter* e, Token* name);
+// Adds a local with no name, which code can only reach by its slot, even at
+// the top level of a script. Returns the slot.
+int declareHidden(Emitter* e);
+
+#endif
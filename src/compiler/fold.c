@@ -0,0 +1,285 @@
+#include "fold.h"
+
+// Constant folding and dead code elimination on the tree built by parser.c.
+//
+// An expression is folded only when its operands are literals and the VM
+// would compute the same value without raising an error, so `1 ooh "a"` is
+// left for the VM to report. Folded nodes are rewritten in place into
+// literal nodes; they keep the operator's token for error messages.
+//
+// Statements are dropped when they can be shown never to run: the branch an
+// `if` with a literal condition doesn't take, a `banana` loop whose
+// condition is falsey, and whatever follows a `give` in the same block.
+// Since the branches of an `if` don't open a scope, the branch that is kept
+// is spliced into the enclosing block as it is.
+
+typedef struct {
+  Arena* arena;
+} Folder;
+
+static Node* foldExpression(Folder* f, Node* node);
+static NodeList foldStatements(Folder* f, NodeList list);
+
+static bool isLiteral(Node* node) {
+  switch (node->type) {
+    case NODE_NUMBER:
+    case NODE_STRING:
+    case NODE_TRUE:
+    case NODE_FALSE:
+    case NODE_NIL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Mirrors isFalsey() in the VM. Only called on literals.
+static bool isFalseyLiteral(Node* node) {
+  return node->type == NODE_NIL || node->type == NODE_FALSE;
+}
+
+// String literal tokens still have their quotes.
+static const char* stringChars(Node* node) { return node->token.start + 1; }
+static int stringLength(Node* node) { return node->token.length - 2; }
+
+// Mirrors valuesEqual() in the VM. Strings are interned there, so two
+// strings are the same value when their characters are.
+static bool literalsEqual(Node* a, Node* b) {
+  if (a->type != b->type) return false;
+  switch (a->type) {
+    case NODE_NUMBER: return a->as.number == b->as.number;
+    case NODE_STRING:
+      return stringLength(a) == stringLength(b) &&
+             memcmp(stringChars(a), stringChars(b), stringLength(a)) == 0;
+    default: return true;
+  }
+}
+
+static Node* makeBool(Node* node, bool value) {
+  node->type = value ? NODE_TRUE : NODE_FALSE;
+  return node;
+}
+
+static Node* makeNumber(Node* node, double value) {
+  node->type = NODE_NUMBER;
+  node->as.number = value;
+  return node;
+}
+
+// Builds the literal for `left` and `right` joined, quotes included, so the
+// code generator can treat it like any string token.
+static Node* concatenate(Folder* f, Node* node, Node* left, Node* right) {
+  int leftLength = stringLength(left);
+  int rightLength = stringLength(right);
+  char* chars = (char*)arenaAlloc(f->arena, leftLength + rightLength + 2);
+  chars[0] = '"';
+  memcpy(chars + 1, stringChars(left), leftLength);
+  memcpy(chars + 1 + leftLength, stringChars(right), rightLength);
+  chars[leftLength + rightLength + 1] = '"';
+
+  node->type = NODE_STRING;
+  node->token.type = TOKEN_STRING;
+  node->token.start = chars;
+  node->token.length = leftLength + rightLength + 2;
+  return node;
+}
+
+static Node* foldBinary(Folder* f, Node* node) {
+  Node* left = node->as.binary.left = foldExpression(f, node->as.binary.left);
+  Node* right = node->as.binary.right = foldExpression(f, node->as.binary.right);
+  if (!isLiteral(left) || !isLiteral(right)) return node;
+
+  switch (node->token.type) {
+    case TOKEN_EQUAL_EQUAL: return makeBool(node, literalsEqual(left, right));
+    case TOKEN_BANG_EQUAL:  return makeBool(node, !literalsEqual(left, right));
+    case TOKEN_PLUS:
+      if (left->type == NODE_STRING && right->type == NODE_STRING) {
+        return concatenate(f, node, left, right);
+      }
+      break;
+    default:
+      break;
+  }
+
+  // Everything else only works on two numbers.
+  if (left->type != NODE_NUMBER || right->type != NODE_NUMBER) return node;
+  double a = left->as.number;
+  double b = right->as.number;
+  switch (node->token.type) {
+    case TOKEN_PLUS:          return makeNumber(node, a + b);
+    case TOKEN_MINUS:         return makeNumber(node, a - b);
+    case TOKEN_MUL:           return makeNumber(node, a * b);
+    case TOKEN_DIV:           return makeNumber(node, a / b);
+    case TOKEN_GREATER:       return makeBool(node, a > b);
+    case TOKEN_LESS:          return makeBool(node, a < b);
+    // The VM computes these as the negation of the opposite comparison,
+    // which differs from `>=` and `<=` when an operand is NaN.
+    case TOKEN_GREATER_EQUAL: return makeBool(node, !(a < b));
+    case TOKEN_LESS_EQUAL:    return makeBool(node, !(a > b));
+    default:                  return node;
+  }
+}
+
+static void foldAll(Folder* f, NodeList list) {
+  for (int i = 0; i < list.count; i++) {
+    list.items[i] = foldExpression(f, list.items[i]);
+  }
+}
+
+static Node* foldExpression(Folder* f, Node* node) {
+  if (node == NULL) return NULL;
+  switch (node->type) {
+    case NODE_NOT:
+      node->as.operand = foldExpression(f, node->as.operand);
+      if (isLiteral(node->as.operand)) {
+        return makeBool(node, isFalseyLiteral(node->as.operand));
+      }
+      return node;
+    case NODE_BINARY: return foldBinary(f, node);
+    case NODE_RIPE:
+    case NODE_YELLOW: {
+      // Both give their left operand when it decides the result, and their
+      // right one otherwise.
+      Node* left = node->as.binary.left = foldExpression(f, node->as.binary.left);
+      node->as.binary.right = foldExpression(f, node->as.binary.right);
+      if (!isLiteral(left)) return node;
+      bool decided = isFalseyLiteral(left) == (node->type == NODE_RIPE);
+      return decided ? left : node->as.binary.right;
+    }
+    case NODE_CONDITIONAL: {
+      Node* condition = node->as.conditional.condition =
+          foldExpression(f, node->as.conditional.condition);
+      node->as.conditional.thenValue = foldExpression(f, node->as.conditional.thenValue);
+      node->as.conditional.elseValue = foldExpression(f, node->as.conditional.elseValue);
+      if (!isLiteral(condition)) return node;
+      return isFalseyLiteral(condition) ? node->as.conditional.elseValue
+                                        : node->as.conditional.thenValue;
+    }
+    case NODE_ASSIGN:
+      node->as.value = foldExpression(f, node->as.value);
+      return node;
+    case NODE_CALL:
+      node->as.call.callee = foldExpression(f, node->as.call.callee);
+      foldAll(f, node->as.call.arguments);
+      return node;
+    case NODE_BUNCH:
+    case NODE_CANOPY:
+    case NODE_STRING_OP:
+      foldAll(f, node->as.items);
+      return node;
+    case NODE_SUBSCRIPT:
+    case NODE_SET_SUBSCRIPT:
+      node->as.subscript.object = foldExpression(f, node->as.subscript.object);
+      node->as.subscript.index = foldExpression(f, node->as.subscript.index);
+      node->as.subscript.value = foldExpression(f, node->as.subscript.value);
+      return node;
+    case NODE_FORAGE:
+    case NODE_TALLY:
+      node->as.operand = foldExpression(f, node->as.operand);
+      return node;
+    case NODE_INSCRIBE:
+      node->as.binary.left = foldExpression(f, node->as.binary.left);
+      node->as.binary.right = foldExpression(f, node->as.binary.right);
+      return node;
+    default:
+      return node;
+  }
+}
+
+// The statements of a block as they are folded, which may be more or fewer
+// than it started with.
+typedef struct {
+  Node** items;
+  int count;
+  int capacity;
+} StatementBuffer;
+
+static void pushStatement(StatementBuffer* buffer, Node* node) {
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity < 8 ? 8 : buffer->capacity * 2;
+    buffer->items = (Node**)realloc(buffer->items, sizeof(Node*) * buffer->capacity);
+    if (buffer->items == NULL) exit(1);
+  }
+  buffer->items[buffer->count++] = node;
+}
+
+static void pushStatements(StatementBuffer* buffer, NodeList list) {
+  for (int i = 0; i < list.count; i++) pushStatement(buffer, list.items[i]);
+}
+
+// Folds one statement into `out`. Returns false if the statements after it
+// can't run.
+static bool foldStatement(Folder* f, Node* node, StatementBuffer* out) {
+  switch (node->type) {
+    case NODE_IF: {
+      Node* condition = node->as.ifStmt.condition =
+          foldExpression(f, node->as.ifStmt.condition);
+      NodeList thenBranch = foldStatements(f, node->as.ifStmt.thenBranch);
+      NodeList elseBranch = foldStatements(f, node->as.ifStmt.elseBranch);
+      if (!isLiteral(condition)) {
+        node->as.ifStmt.thenBranch = thenBranch;
+        node->as.ifStmt.elseBranch = elseBranch;
+        break;
+      }
+      NodeList taken = isFalseyLiteral(condition) ? elseBranch : thenBranch;
+      pushStatements(out, taken);
+      return taken.count == 0 || taken.items[taken.count - 1]->type != NODE_GIVE;
+    }
+    case NODE_BANANA:
+      node->as.loop.condition = foldExpression(f, node->as.loop.condition);
+      node->as.loop.body = foldStatements(f, node->as.loop.body);
+      if (isLiteral(node->as.loop.condition) &&
+          isFalseyLiteral(node->as.loop.condition)) {
+        return true;
+      }
+      break;
+    case NODE_SWING:
+      node->as.loop.condition = foldExpression(f, node->as.loop.condition);
+      node->as.loop.body = foldStatements(f, node->as.loop.body);
+      break;
+    case NODE_SWING_RANGE:
+      node->as.range.from = foldExpression(f, node->as.range.from);
+      node->as.range.to = foldExpression(f, node->as.range.to);
+      node->as.range.body = foldStatements(f, node->as.range.body);
+      break;
+    case NODE_BLOCK:
+      node->as.statements = foldStatements(f, node->as.statements);
+      break;
+    case NODE_TUMBLE:
+      node->as.tumble.body = foldStatements(f, node->as.tumble.body);
+      node->as.tumble.handler = foldStatements(f, node->as.tumble.handler);
+      break;
+    case NODE_TRIBE:
+      node->as.tribe.body = foldStatements(f, node->as.tribe.body);
+      break;
+    case NODE_VAR:
+      node->as.value = foldExpression(f, node->as.value);
+      break;
+    case NODE_GIVE:
+      node->as.operand = foldExpression(f, node->as.operand);
+      pushStatement(out, node);
+      return false;
+    case NODE_SUMMON:
+      break;
+    default:
+      node->as.operand = foldExpression(f, node->as.operand);
+      break;
+  }
+  pushStatement(out, node);
+  return true;
+}
+
+static NodeList foldStatements(Folder* f, NodeList list) {
+  StatementBuffer out = {NULL, 0, 0};
+  for (int i = 0; i < list.count; i++) {
+    if (!foldStatement(f, list.items[i], &out)) break;
+  }
+  NodeList result = newNodeList(f->arena, out.items, out.count);
+  free(out.items);
+  return result;
+}
+
+void foldConstants(Arena* arena, NodeList* program) {
+  Folder f = {arena};
+  *program = foldStatements(&f, *program);
+}
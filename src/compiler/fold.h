@@ -0,0 +1,10 @@
+#ifndef APE_FOLD_H
+#define APE_FOLD_H
+
+#include "ast.h"
+
+// Evaluates the parts of `program` whose values are known at compile time
+// and drops code that can never run. New nodes are allocated in `arena`.
+void foldConstants(Arena* arena, NodeList* program);
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+
+#include "inline.h"
+
+// Inlining of small tribes, run on the tree between the two folding passes.
+//
+// A call is inlined when its callee is a tribe declared at the top level of
+// the file being compiled whose name is never declared or assigned anywhere
+// else in it, so that the name can only mean that tribe. The call must come
+// after the declaration in the source, pass the right number of arguments,
+// and pass only literals and variables, which can be read where the tribe's
+// body reads its parameters without changing what they evaluate to.
+//
+// Only bodies that do nothing but choose a value are inlined: `give`, `if`
+// whose branches end in a `give`, and `ape` with a literal value, over
+// expressions that read parameters and such locals. The `if`s become
+// conditional expressions:
+//
+//   tribe max(a, b) { if (a > b) { give a } give b }
+//   tree max(x, 3)          =>     tree (x > 3) ? x : 3
+//
+// Another file can still reassign the tribe's global at run time; the calls
+// inlined here keep using the tribe as declared.
+
+// The most nodes an inlined call may turn into.
+#define INLINE_MAX_NODES 16
+// The most parameters and locals an inlined tribe may have.
+#define INLINE_MAX_BINDINGS 8
+
+// A name declared at the top level, and its tribe if that is what declared
+// it. Kept sorted by name.
+typedef struct {
+  Token name;
+  Node* tribe;
+  bool inlinable;
+} Candidate;
+
+typedef struct {
+  Arena* arena;
+  Candidate* candidates;
+  int candidateCount;
+  bool expanding;    // false while looking for disqualifying declarations
+} Inliner;
+
+// What the parameters and locals of the tribe being inlined stand for.
+typedef struct {
+  Token names[INLINE_MAX_BINDINGS];
+  Node* values[INLINE_MAX_BINDINGS];
+  int count;
+} Bindings;
+
+static int compareNames(const Token* a, const Token* b) {
+  if (a->length != b->length) return a->length - b->length;
+  return memcmp(a->start, b->start, a->length);
+}
+
+static int compareCandidates(const void* a, const void* b) {
+  return compareNames(&((const Candidate*)a)->name, &((const Candidate*)b)->name);
+}
+
+static Candidate* findCandidate(Inliner* in, Token* name) {
+  Candidate key = {*name, NULL, false};
+  return (Candidate*)bsearch(&key, in->candidates, in->candidateCount,
+                             sizeof(Candidate), compareCandidates);
+}
+
+static void disqualify(Inliner* in, Token* name) {
+  if (in->expanding) return;
+  Candidate* candidate = findCandidate(in, name);
+  if (candidate != NULL) candidate->inlinable = false;
+}
+
+static Node* clone(Inliner* in, Node* node) {
+  Node* copy = newNode(in->arena, node->type, node->token);
+  *copy = *node;
+  return copy;
+}
+
+static bool isLiteral(Node* node) {
+  switch (node->type) {
+    case NODE_NUMBER:
+    case NODE_STRING:
+    case NODE_TRUE:
+    case NODE_FALSE:
+    case NODE_NIL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// A copy of `node` with the tribe's parameters and locals replaced by what
+// they are bound to, or NULL if it reads anything else or is too big.
+static Node* substitute(Inliner* in, Bindings* bindings, Node* node, int* budget) {
+  if (node == NULL || --*budget < 0) return NULL;
+  if (isLiteral(node)) return clone(in, node);
+
+  Node* copy;
+  switch (node->type) {
+    case NODE_VARIABLE:
+      for (int i = bindings->count - 1; i >= 0; i--) {
+        if (compareNames(&bindings->names[i], &node->token) == 0) {
+          return clone(in, bindings->values[i]);
+        }
+      }
+      return NULL;
+    case NODE_NOT:
+      copy = clone(in, node);
+      copy->as.operand = substitute(in, bindings, node->as.operand, budget);
+      return copy->as.operand != NULL ? copy : NULL;
+    case NODE_BINARY:
+    case NODE_RIPE:
+    case NODE_YELLOW:
+      copy = clone(in, node);
+      copy->as.binary.left = substitute(in, bindings, node->as.binary.left, budget);
+      copy->as.binary.right = substitute(in, bindings, node->as.binary.right, budget);
+      if (copy->as.binary.left == NULL || copy->as.binary.right == NULL) return NULL;
+      return copy;
+    default:
+      return NULL;
+  }
+}
+
+static Node* nilNode(Inliner* in, Token token, int* budget) {
+  if (--*budget < 0) return NULL;
+  return newNode(in->arena, NODE_NIL, token);
+}
+
+static bool endsWithGive(NodeList list) {
+  return list.count > 0 && list.items[list.count - 1]->type == NODE_GIVE;
+}
+
+// The value a tribe gives when it runs `body` from statement `from` on, as
+// one expression, or NULL if the statements do more than choose a value.
+static Node* bodyValue(Inliner* in, Bindings* bindings, Node* tribe,
+                       NodeList body, int from, int* budget) {
+  if (from == body.count) return nilNode(in, tribe->token, budget);
+
+  Node* statement = body.items[from];
+  switch (statement->type) {
+    case NODE_GIVE:
+      if (statement->as.operand == NULL) return nilNode(in, statement->token, budget);
+      return substitute(in, bindings, statement->as.operand, budget);
+
+    case NODE_VAR: {
+      Node* value = statement->as.value;
+      if (value != NULL && !isLiteral(value)) return NULL;
+      if (bindings->count == INLINE_MAX_BINDINGS) return NULL;
+      for (int i = 0; i < bindings->count; i++) {
+        if (compareNames(&bindings->names[i], &statement->token) == 0) return NULL;
+      }
+      if (value == NULL) value = nilNode(in, statement->token, budget);
+      if (value == NULL) return NULL;
+      bindings->names[bindings->count] = statement->token;
+      bindings->values[bindings->count++] = value;
+      Node* result = bodyValue(in, bindings, tribe, body, from + 1, budget);
+      bindings->count--;
+      return result;
+    }
+
+    case NODE_IF: {
+      NodeList thenBranch = statement->as.ifStmt.thenBranch;
+      NodeList elseBranch = statement->as.ifStmt.elseBranch;
+      if (!endsWithGive(thenBranch)) return NULL;
+      if (elseBranch.count > 0 && !endsWithGive(elseBranch)) return NULL;
+
+      Node* node = newNode(in->arena, NODE_CONDITIONAL, statement->token);
+      int bound = bindings->count;
+      node->as.conditional.condition =
+          substitute(in, bindings, statement->as.ifStmt.condition, budget);
+      node->as.conditional.thenValue =
+          bodyValue(in, bindings, tribe, thenBranch, 0, budget);
+      bindings->count = bound;
+      // Without an else, the statements after the `if` are the other branch.
+      node->as.conditional.elseValue =
+          elseBranch.count > 0
+              ? bodyValue(in, bindings, tribe, elseBranch, 0, budget)
+              : bodyValue(in, bindings, tribe, body, from + 1, budget);
+      bindings->count = bound;
+      if (--*budget < 0 || node->as.conditional.condition == NULL ||
+          node->as.conditional.thenValue == NULL ||
+          node->as.conditional.elseValue == NULL) {
+        return NULL;
+      }
+      return node;
+    }
+
+    default:
+      return NULL;
+  }
+}
+
+static Node* inlineCall(Inliner* in, Node* call) {
+  Node* callee = call->as.call.callee;
+  if (callee->type != NODE_VARIABLE) return call;
+  Candidate* candidate = findCandidate(in, &callee->token);
+  if (candidate == NULL || !candidate->inlinable) return call;
+
+  Node* tribe = candidate->tribe;
+  NodeList arguments = call->as.call.arguments;
+  // Before its declaration has run, the tribe doesn't exist yet.
+  if (callee->token.start < tribe->token.start) return call;
+  if (arguments.count != tribe->as.tribe.arity) return call;
+  if (arguments.count > INLINE_MAX_BINDINGS) return call;
+
+  Bindings bindings;
+  bindings.count = 0;
+  for (int i = 0; i < arguments.count; i++) {
+    Node* argument = arguments.items[i];
+    if (!isLiteral(argument) && argument->type != NODE_VARIABLE) return call;
+    bindings.names[bindings.count] = tribe->as.tribe.params[i];
+    bindings.values[bindings.count++] = argument;
+  }
+
+  int budget = INLINE_MAX_NODES;
+  Node* value = bodyValue(in, &bindings, tribe, tribe->as.tribe.body, 0, &budget);
+  return value != NULL ? value : call;
+}
+
+static Node* walkExpression(Inliner* in, Node* node);
+static void walkStatements(Inliner* in, NodeList list);
+
+static void walkExpressions(Inliner* in, NodeList list) {
+  for (int i = 0; i < list.count; i++) {
+    list.items[i] = walkExpression(in, list.items[i]);
+  }
+}
+
+// Visits every expression under `node`. While expanding, returns what should
+// replace it.
+static Node* walkExpression(Inliner* in, Node* node) {
+  if (node == NULL) return NULL;
+  switch (node->type) {
+    case NODE_NOT:
+    case NODE_FORAGE:
+    case NODE_TALLY:
+      node->as.operand = walkExpression(in, node->as.operand);
+      break;
+    case NODE_BINARY:
+    case NODE_RIPE:
+    case NODE_YELLOW:
+    case NODE_INSCRIBE:
+      node->as.binary.left = walkExpression(in, node->as.binary.left);
+      node->as.binary.right = walkExpression(in, node->as.binary.right);
+      break;
+    case NODE_ASSIGN:
+      disqualify(in, &node->token);
+      node->as.value = walkExpression(in, node->as.value);
+      break;
+    case NODE_CALL:
+      node->as.call.callee = walkExpression(in, node->as.call.callee);
+      walkExpressions(in, node->as.call.arguments);
+      if (in->expanding) return inlineCall(in, node);
+      break;
+    case NODE_BUNCH:
+    case NODE_CANOPY:
+    case NODE_STRING_OP:
+      walkExpressions(in, node->as.items);
+      break;
+    case NODE_SUBSCRIPT:
+    case NODE_SET_SUBSCRIPT:
+      node->as.subscript.object = walkExpression(in, node->as.subscript.object);
+      node->as.subscript.index = walkExpression(in, node->as.subscript.index);
+      node->as.subscript.value = walkExpression(in, node->as.subscript.value);
+      break;
+    case NODE_CONDITIONAL:
+      node->as.conditional.condition = walkExpression(in, node->as.conditional.condition);
+      node->as.conditional.thenValue = walkExpression(in, node->as.conditional.thenValue);
+      node->as.conditional.elseValue = walkExpression(in, node->as.conditional.elseValue);
+      break;
+    default:
+      break;
+  }
+  return node;
+}
+
+static void walkStatement(Inliner* in, Node* node) {
+  switch (node->type) {
+    case NODE_IF:
+      node->as.ifStmt.condition = walkExpression(in, node->as.ifStmt.condition);
+      walkStatements(in, node->as.ifStmt.thenBranch);
+      walkStatements(in, node->as.ifStmt.elseBranch);
+      break;
+    case NODE_SWING:
+    case NODE_BANANA:
+      node->as.loop.condition = walkExpression(in, node->as.loop.condition);
+      walkStatements(in, node->as.loop.body);
+      break;
+    case NODE_SWING_RANGE:
+      node->as.range.from = walkExpression(in, node->as.range.from);
+      node->as.range.to = walkExpression(in, node->as.range.to);
+      disqualify(in, &node->token);
+      walkStatements(in, node->as.range.body);
+      break;
+    case NODE_BLOCK:
+      walkStatements(in, node->as.statements);
+      break;
+    case NODE_TUMBLE:
+      walkStatements(in, node->as.tumble.body);
+      disqualify(in, &node->as.tumble.errorName);
+      walkStatements(in, node->as.tumble.handler);
+      break;
+    case NODE_TRIBE: {
+      Candidate* candidate = in->expanding ? NULL : findCandidate(in, &node->token);
+      if (candidate != NULL && candidate->tribe != node) candidate->inlinable = false;
+      for (int i = 0; i < node->as.tribe.arity; i++) {
+        disqualify(in, &node->as.tribe.params[i]);
+      }
+      walkStatements(in, node->as.tribe.body);
+      break;
+    }
+    case NODE_VAR:
+      disqualify(in, &node->token);
+      node->as.value = walkExpression(in, node->as.value);
+      break;
+    case NODE_SUMMON:
+      break;
+    default:
+      node->as.operand = walkExpression(in, node->as.operand);
+      break;
+  }
+}
+
+static void walkStatements(Inliner* in, NodeList list) {
+  for (int i = 0; i < list.count; i++) walkStatement(in, list.items[i]);
+}
+
+void inlineTribes(Arena* arena, NodeList program) {
+  Inliner in;
+  in.arena = arena;
+  in.expanding = false;
+
+  // Every tribe declared at the top level is a candidate, unless its name is
+  // declared there more than once.
+  in.candidates = (Candidate*)malloc(sizeof(Candidate) * (program.count > 0 ? program.count : 1));
+  in.candidateCount = 0;
+  for (int i = 0; i < program.count; i++) {
+    Node* node = program.items[i];
+    if (node->type != NODE_TRIBE && node->type != NODE_VAR) continue;
+    Candidate* candidate = &in.candidates[in.candidateCount++];
+    candidate->name = node->token;
+    candidate->tribe = node->type == NODE_TRIBE ? node : NULL;
+    candidate->inlinable = candidate->tribe != NULL;
+  }
+  qsort(in.candidates, in.candidateCount, sizeof(Candidate), compareCandidates);
+  for (int i = 1; i < in.candidateCount; i++) {
+    if (compareCandidates(&in.candidates[i - 1], &in.candidates[i]) == 0) {
+      in.candidates[i - 1].inlinable = false;
+      in.candidates[i].inlinable = false;
+    }
+  }
+
+  walkStatements(&in, program);
+  in.expanding = true;
+  walkStatements(&in, program);
+  free(in.candidates);
+}
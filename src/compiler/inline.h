@@ -0,0 +1,10 @@
+#ifndef APE_INLINE_H
+#define APE_INLINE_H
+
+#include "ast.h"
+
+// Replaces calls to small tribes declared in `program` with the value their
+// body computes. New nodes are allocated in `arena`.
+void inlineTribes(Arena* arena, NodeList program);
+
+#endif
@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+
+typedef struct {
+  Lexer lexer;
+  Token current;
+  Token previous;
+  bool hadError;
+  Arena* arena;
+} Parser;
+
+// Nodes collected for a list whose length is not known yet. They are copied
+// into the arena once the list is complete.
+typedef struct {
+  Node** items;
+  int count;
+  int capacity;
+} NodeBuffer;
+
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT,
+  PREC_YELLOW,      // Logical OR
+  PREC_RIPE,        // Logical AND
+  PREC_EQUALITY,
+  PREC_COMPARISON,
+  PREC_TERM,
+  PREC_FACTOR,
+  PREC_UNARY,
+  PREC_CALL,
+  PREC_PRIMARY
+} Precedence;
+
+typedef Node* (*PrefixFn)(Parser*, bool);
+typedef Node* (*InfixFn)(Parser*, Node*, bool);
+
+typedef struct {
+  PrefixFn prefix;
+  InfixFn infix;
+  Precedence precedence;
+} ParseRule;
+
+static Node* expression(Parser* p);
+static Node* declaration(Parser* p);
+static ParseRule* getRule(TokenType type);
+static Node* parsePrecedence(Parser* p, Precedence precedence);
+static NodeList block(Parser* p);
+
+static void errorAt(Parser* p, Token* token, const char* message) {
+  if (p->hadError) return;
+  p->hadError = true;
+  reportError(token, message);
+}
+static void error(Parser* p, const char* message) { errorAt(p, &p->previous, message); }
+
+static void advance(Parser* p) {
+  p->previous = p->current;
+  p->current = scanToken(&p->lexer);
+  if (p->current.type == TOKEN_ERROR) {
+    errorAt(p, &p->current, p->current.start);
+  }
+}
+static void consume(Parser* p, TokenType type, const char* message) {
+  if (p->current.type == type) {
+    advance(p);
+    return;
+  }
+  errorAt(p, &p->current, message);
+}
+static bool check(Parser* p, TokenType type) { return p->current.type == type; }
+static bool match(Parser* p, TokenType type) {
+  if (!check(p, type)) return false;
+  advance(p);
+  return true;
+}
+
+static void pushNode(NodeBuffer* buffer, Node* node) {
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity < 8 ? 8 : buffer->capacity * 2;
+    buffer->items = (Node**)realloc(buffer->items, sizeof(Node*) * buffer->capacity);
+    if (buffer->items == NULL) exit(1);
+  }
+  buffer->items[buffer->count++] = node;
+}
+static NodeList finishNodes(Parser* p, NodeBuffer* buffer) {
+  NodeList list = newNodeList(p->arena, buffer->items, buffer->count);
+  free(buffer->items);
+  return list;
+}
+
+static Node* makeNode(Parser* p, NodeType type, Token token) {
+  return newNode(p->arena, type, token);
+}
+
+static Node* number(Parser* p, bool canAssign) {
+  (void)canAssign;
+  Node* node = makeNode(p, NODE_NUMBER, p->previous);
+  node->as.number = strtod(p->previous.start, NULL);
+  return node;
+}
+static Node* string(Parser* p, bool canAssign) {
+  (void)canAssign;
+  return makeNode(p, NODE_STRING, p->previous);
+}
+static Node* literal(Parser* p, bool canAssign) {
+  (void)canAssign;
+  switch (p->previous.type) {
+    case TOKEN_FALSE: return makeNode(p, NODE_FALSE, p->previous);
+    case TOKEN_TRUE:  return makeNode(p, NODE_TRUE, p->previous);
+    default:          return makeNode(p, NODE_NIL, p->previous);
+  }
+}
+static Node* unary(Parser* p, bool canAssign) {
+  (void)canAssign;
+  Token operator = p->previous;
+  Node* operand = parsePrecedence(p, PREC_UNARY);
+  if (operator.type != TOKEN_BANG) return operand;
+  Node* node = makeNode(p, NODE_NOT, operator);
+  node->as.operand = operand;
+  return node;
+}
+static Node* binary(Parser* p, Node* left, bool canAssign) {
+  (void)canAssign;
+  Token operator = p->previous;
+  ParseRule* rule = getRule(operator.type);
+  Node* node = makeNode(p, NODE_BINARY, operator);
+  node->as.binary.left = left;
+  node->as.binary.right = parsePrecedence(p, (Precedence)(rule->precedence + 1));
+  return node;
+}
+static Node* ripe_(Parser* p, Node* left, bool canAssign) {
+  (void)canAssign;
+  Node* node = makeNode(p, NODE_RIPE, p->previous);
+  node->as.binary.left = left;
+  node->as.binary.right = parsePrecedence(p, PREC_RIPE);
+  return node;
+}
+static Node* yellow_(Parser* p, Node* left, bool canAssign) {
+  (void)canAssign;
+  Node* node = makeNode(p, NODE_YELLOW, p->previous);
+  node->as.binary.left = left;
+  node->as.binary.right = parsePrecedence(p, PREC_YELLOW);
+  return node;
+}
+static Node* grouping(Parser* p, bool canAssign) {
+  (void)canAssign;
+  Node* node = expression(p);
+  consume(p, TOKEN_RPAREN, "Expect ')' after expression.");
+  return node;
+}
+static Node* ask(Parser* p, bool canAssign) {
+  (void)canAssign;
+  Node* node = makeNode(p, NODE_ASK, p->previous);
+  consume(p, TOKEN_LPAREN, "Expect '(' after 'ask'.");
+  consume(p, TOKEN_RPAREN, "Expect ')' after ask arguments.");
+  return node;
+}
+
+static Node* forage(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_FORAGE, p->previous);
+    consume(p, TOKEN_LPAREN, "Expect '(' after 'forage'.");
+    node->as.operand = expression(p); // The path
+    consume(p, TOKEN_RPAREN, "Expect ')' after forage arguments.");
+    return node;
+}
+
+static Node* inscribe(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_INSCRIBE, p->previous);
+    consume(p, TOKEN_LPAREN, "Expect '(' after 'inscribe'.");
+    node->as.binary.left = expression(p); // The path
+    consume(p, TOKEN_COMMA, "Expect ',' between path and content.");
+    node->as.binary.right = expression(p); // The content
+    consume(p, TOKEN_RPAREN, "Expect ')' after inscribe arguments.");
+    return node;
+}
+
+static NodeList argumentList(Parser* p) {
+  NodeBuffer arguments = {NULL, 0, 0};
+  if (!check(p, TOKEN_RPAREN)) {
+    do {
+      pushNode(&arguments, expression(p));
+      if (arguments.count == 256) error(p, "Can't have more than 255 arguments.");
+    } while (match(p, TOKEN_COMMA));
+  }
+  consume(p, TOKEN_RPAREN, "Expect ')' after arguments.");
+  return finishNodes(p, &arguments);
+}
+static Node* call(Parser* p, Node* callee, bool canAssign) {
+  (void)canAssign;
+  Node* node = makeNode(p, NODE_CALL, p->previous);
+  node->as.call.callee = callee;
+  node->as.call.arguments = argumentList(p);
+  return node;
+}
+static Node* bunchLiteral(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_BUNCH, p->previous);
+    NodeBuffer items = {NULL, 0, 0};
+    if (!check(p, TOKEN_RBRACKET)) {
+        do {
+            pushNode(&items, expression(p));
+            if (items.count == 256) error(p, "Can't have more than 255 items in a bunch literal.");
+        } while (match(p, TOKEN_COMMA));
+    }
+    consume(p, TOKEN_RBRACKET, "Expect ']' after bunch items.");
+    node->as.items = finishNodes(p, &items);
+    return node;
+}
+static Node* canopyLiteral(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_CANOPY, p->previous);
+    NodeBuffer items = {NULL, 0, 0};
+    if (!check(p, TOKEN_RBRACE)) {
+        do {
+            consume(p, TOKEN_STRING, "Expect string as canopy key.");
+            pushNode(&items, string(p, false));
+            consume(p, TOKEN_COLON, "Expect ':' after canopy key.");
+            pushNode(&items, expression(p));
+            if (items.count == 2 * 256) error(p, "Can't have more than 255 items in a canopy literal.");
+        } while (match(p, TOKEN_COMMA));
+    }
+    consume(p, TOKEN_RBRACE, "Expect '}' after canopy items.");
+    node->as.items = finishNodes(p, &items);
+    return node;
+}
+static Node* subscript(Parser* p, Node* object, bool canAssign) {
+    Token bracket = p->previous;
+    Node* index = expression(p);
+    consume(p, TOKEN_RBRACKET, "Expect ']' after subscript.");
+    Node* node;
+    if (canAssign && match(p, TOKEN_EQUAL)) {
+        node = makeNode(p, NODE_SET_SUBSCRIPT, bracket);
+        node->as.subscript.value = expression(p);
+    } else {
+        node = makeNode(p, NODE_SUBSCRIPT, bracket);
+    }
+    node->as.subscript.object = object;
+    node->as.subscript.index = index;
+    return node;
+}
+static Node* variable(Parser* p, bool canAssign) {
+  Token name = p->previous;
+  if (canAssign && match(p, TOKEN_EQUAL)) {
+    Node* node = makeNode(p, NODE_ASSIGN, name);
+    node->as.value = expression(p);
+    return node;
+  }
+  return makeNode(p, NODE_VARIABLE, name);
+}
+static Node* stringOperation(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_STRING_OP, p->previous);
+    TokenType opType = p->previous.type;
+    NodeBuffer arguments = {NULL, 0, 0};
+    consume(p, TOKEN_LPAREN, "Expect '(' after a string operation.");
+    pushNode(&arguments, expression(p)); // The primary string or first argument
+
+    if (opType == TOKEN_GRAFT || opType == TOKEN_SLICE || opType == TOKEN_SCAN) {
+        consume(p, TOKEN_COMMA, "Expect ',' separating arguments.");
+        pushNode(&arguments, expression(p)); // The second argument
+    }
+
+    // slice has a third argument
+    if (opType == TOKEN_SLICE) {
+        consume(p, TOKEN_COMMA, "Expect ',' separating arguments.");
+        pushNode(&arguments, expression(p));
+    }
+
+    consume(p, TOKEN_RPAREN, "Expect ')' after arguments.");
+    node->as.items = finishNodes(p, &arguments);
+    return node;
+}
+static Node* tally(Parser* p, bool canAssign) {
+    (void)canAssign;
+    Node* node = makeNode(p, NODE_TALLY, p->previous);
+    consume(p, TOKEN_LPAREN, "Expect '(' after 'tally'.");
+    node->as.operand = expression(p); // The string expression
+    consume(p, TOKEN_RPAREN, "Expect ')' after tally argument.");
+    return node;
+}
+
+ParseRule rules[] = {
+    [TOKEN_LPAREN]      = {grouping, call, PREC_CALL},
+    [TOKEN_RPAREN]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_LBRACE]      = {canopyLiteral, NULL, PREC_NONE},
+    [TOKEN_RBRACE]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_LBRACKET]    = {bunchLiteral, subscript, PREC_CALL},
+    [TOKEN_RBRACKET]    = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON]       = {NULL, NULL, PREC_NONE},
+    [TOKEN_COMMA]       = {NULL, NULL, PREC_NONE},
+    [TOKEN_BANG]        = {unary, NULL, PREC_NONE},
+    [TOKEN_BANG_EQUAL]  = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_EQUAL]       = {NULL, NULL, PREC_NONE},
+    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_GREATER]     = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS]        = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL]  = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_ID]          = {variable, NULL, PREC_NONE},
+
+    [TOKEN_SLICE]       = {stringOperation, NULL, PREC_NONE},
+    [TOKEN_GRAFT]       = {stringOperation, NULL, PREC_NONE},
+    [TOKEN_SCAN]        = {stringOperation, NULL, PREC_NONE},
+    [TOKEN_SHED]        = {stringOperation, NULL, PREC_NONE},
+    [TOKEN_TALLY]       = {tally, NULL, PREC_NONE},
+
+    [TOKEN_STRING]      = {string, NULL, PREC_NONE},
+    [TOKEN_NUM]         = {number, NULL, PREC_NONE},
+    [TOKEN_ASK]         = {ask, NULL, PREC_NONE},
+    [TOKEN_FORAGE]      = {forage, NULL, PREC_NONE},
+    [TOKEN_INSCRIBE]    = {inscribe, NULL, PREC_NONE},
+    [TOKEN_FALSE]       = {literal, NULL, PREC_NONE},
+    [TOKEN_TRUE]        = {literal, NULL, PREC_NONE},
+    [TOKEN_NIL]         = {literal, NULL, PREC_NONE},
+    [TOKEN_PLUS]        = {NULL, binary, PREC_TERM},
+    [TOKEN_MINUS]       = {NULL, binary, PREC_TERM},
+    [TOKEN_MUL]         = {NULL, binary, PREC_FACTOR},
+    [TOKEN_DIV]         = {NULL, binary, PREC_FACTOR},
+    [TOKEN_SUMMON]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_TUMBLE]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_BANANA]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_RIPE]        = {NULL, ripe_, PREC_RIPE},
+    [TOKEN_YELLOW]      = {NULL, yellow_, PREC_YELLOW},
+    [TOKEN_CATCH]       = {NULL, NULL, PREC_NONE},
+    [TOKEN_ERROR]       = {NULL, NULL, PREC_NONE},
+    [TOKEN_EOF]         = {NULL, NULL, PREC_NONE},
+
+};
+
+static ParseRule* getRule(TokenType type) { return &rules[type]; }
+static Node* parsePrecedence(Parser* p, Precedence precedence) {
+  advance(p);
+  PrefixFn prefixRule = getRule(p->previous.type)->prefix;
+  if (prefixRule == NULL) {
+    error(p, "Expect expression.");
+    return NULL;
+  }
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  Node* node = prefixRule(p, canAssign);
+  while (precedence <= getRule(p->current.type)->precedence) {
+    advance(p);
+    InfixFn infixRule = getRule(p->previous.type)->infix;
+    node = infixRule(p, node, canAssign);
+  }
+  return node;
+}
+static Node* expression(Parser* p) { return parsePrecedence(p, PREC_ASSIGNMENT); }
+static NodeList block(Parser* p) {
+  NodeBuffer statements = {NULL, 0, 0};
+  while (!check(p, TOKEN_RBRACE) && !check(p, TOKEN_EOF)) {
+    Node* statement = declaration(p);
+    if (statement != NULL) pushNode(&statements, statement);
+  }
+  consume(p, TOKEN_RBRACE, "Expect '}' after block.");
+  return finishNodes(p, &statements);
+}
+
+// A statement that wraps one expression, such as `tree x` or `summon "f"`.
+static Node* wrap(Parser* p, NodeType type, Token token, Node* operand) {
+  Node* node = makeNode(p, type, token);
+  node->as.operand = operand;
+  return node;
+}
+
+static Node* giveStatement(Parser* p) {
+  Token keyword = p->previous;
+  if (check(p, TOKEN_RBRACE)) return wrap(p, NODE_GIVE, keyword, NULL);
+  return wrap(p, NODE_GIVE, keyword, expression(p));
+}
+
+static Node* ifStatement(Parser* p) {
+  Node* node = makeNode(p, NODE_IF, p->previous);
+  consume(p, TOKEN_LPAREN, "Expect '(' after 'if'.");
+  node->as.ifStmt.condition = expression(p);
+  consume(p, TOKEN_RPAREN, "Expect ')' after if condition.");
+  consume(p, TOKEN_LBRACE, "Expect '{' after condition.");
+  node->as.ifStmt.thenBranch = block(p);
+  if (match(p, TOKEN_ELSE)) {
+    consume(p, TOKEN_LBRACE, "Expect '{' after 'else'.");
+    node->as.ifStmt.elseBranch = block(p);
+  }
+  return node;
+}
+
+// `from` and `to` are only words inside a swing header, so programs that use
+// them as names keep working.
+static bool matchWord(Parser* p, const char* word) {
+  size_t length = strlen(word);
+  if (!check(p, TOKEN_ID) || (size_t)p->current.length != length ||
+      memcmp(p->current.start, word, length) != 0) {
+    return false;
+  }
+  advance(p);
+  return true;
+}
+
+// `swing count { ... }` runs its body count times; `swing i from a to b`
+// runs it with a local i counting up from a while it is at most b.
+static Node* swingStatement(Parser* p) {
+  Token keyword = p->previous;
+  Node* count = expression(p);
+  if (count->type == NODE_VARIABLE && matchWord(p, "from")) {
+    Node* node = makeNode(p, NODE_SWING_RANGE, count->token);
+    node->as.range.from = expression(p);
+    if (!matchWord(p, "to")) errorAt(p, &p->current, "Expect 'to' after swing start.");
+    node->as.range.to = expression(p);
+    consume(p, TOKEN_LBRACE, "Expect '{' before swing block.");
+    node->as.range.body = block(p);
+    return node;
+  }
+  Node* node = makeNode(p, NODE_SWING, keyword);
+  node->as.loop.condition = count;
+  consume(p, TOKEN_LBRACE, "Expect '{' before swing block.");
+  node->as.loop.body = block(p);
+  return node;
+}
+
+static Node* bananaStatement(Parser* p) {
+    Node* node = makeNode(p, NODE_BANANA, p->previous);
+    consume(p, TOKEN_LPAREN, "Expect '(' after 'banana'.");
+    node->as.loop.condition = expression(p);
+    consume(p, TOKEN_RPAREN, "Expect ')' after banana condition.");
+    consume(p, TOKEN_LBRACE, "Expect '{' after banana condition.");
+    node->as.loop.body = block(p);
+    return node;
+}
+
+static Node* tumbleStatement(Parser* p) {
+    Node* node = makeNode(p, NODE_TUMBLE, p->previous);
+    consume(p, TOKEN_LBRACE, "Expect '{' after 'tumble'.");
+    node->as.tumble.body = block(p);
+    consume(p, TOKEN_CATCH, "Expect 'catch' after 'tumble' block.");
+    consume(p, TOKEN_LPAREN, "Expect '(' after 'catch'.");
+    consume(p, TOKEN_ID, "Expect error variable name.");
+    node->as.tumble.errorName = p->previous;
+    consume(p, TOKEN_RPAREN, "Expect ')' after error variable.");
+    consume(p, TOKEN_LBRACE, "Expect '{' after catch clause.");
+    node->as.tumble.handler = block(p);
+    return node;
+}
+
+static Node* summonStatement(Parser* p) {
+    Token keyword = p->previous;
+    consume(p, TOKEN_STRING, "Expect file path string after 'summon'.");
+    return wrap(p, NODE_SUMMON, keyword, string(p, false));
+}
+
+static Node* statement(Parser* p) {
+  Token keyword = p->current;
+  if (match(p, TOKEN_TREE)) {
+    return wrap(p, NODE_PRINT, keyword, expression(p));
+  } else if (match(p, TOKEN_GIVE)) {
+    return giveStatement(p);
+  } else if (match(p, TOKEN_IF)) {
+    return ifStatement(p);
+  } else if (match(p, TOKEN_TUMBLE)) {
+    return tumbleStatement(p);
+  } else if (match(p, TOKEN_SUMMON)) {
+    return summonStatement(p);
+  } else if (match(p, TOKEN_SWING)) {
+    return swingStatement(p);
+  } else if (match(p, TOKEN_BANANA)) {
+    return bananaStatement(p);
+  } else if (match(p, TOKEN_LBRACE)) {
+    Node* node = makeNode(p, NODE_BLOCK, keyword);
+    node->as.statements = block(p);
+    return node;
+  }
+  return wrap(p, NODE_EXPRESSION, keyword, expression(p));
+}
+
+static Node* varDeclaration(Parser* p) {
+  consume(p, TOKEN_ID, "Expect variable name.");
+  Node* node = makeNode(p, NODE_VAR, p->previous);
+  if (match(p, TOKEN_EQUAL)) {
+    node->as.value = expression(p);
+  }
+  return node;
+}
+
+static Node* funDeclaration(Parser* p) {
+  consume(p, TOKEN_ID, "Expect function name.");
+  Node* node = makeNode(p, NODE_TRIBE, p->previous);
+  Token params[256];
+  int arity = 0;
+  consume(p, TOKEN_LPAREN, "Expect '(' after function name.");
+  if (!check(p, TOKEN_RPAREN)) {
+    do {
+      if (arity == 255) error(p, "Can't have more than 255 parameters.");
+      consume(p, TOKEN_ID, "Expect parameter name.");
+      if (arity < 255) params[arity] = p->previous;
+      arity++;
+    } while (match(p, TOKEN_COMMA));
+  }
+  consume(p, TOKEN_RPAREN, "Expect ')' after parameters.");
+  consume(p, TOKEN_LBRACE, "Expect '{' before function body.");
+  int count = arity < 255 ? arity : 255;
+  node->as.tribe.arity = count;
+  node->as.tribe.params = (Token*)arenaAlloc(p->arena, sizeof(Token) * (count > 0 ? count : 1));
+  memcpy(node->as.tribe.params, params, sizeof(Token) * count);
+  node->as.tribe.body = block(p);
+  return node;
+}
+
+static Node* declaration(Parser* p) {
+  if (p->hadError) return NULL;
+  if (match(p, TOKEN_TRIBE)) {
+    return funDeclaration(p);
+  } else if (match(p, TOKEN_APE)) {
+    return varDeclaration(p);
+  }
+  return statement(p);
+}
+
+bool parse(const char* source, Arena* arena, NodeList* program) {
+  Parser p;
+  initLexer(&p.lexer, source);
+  p.hadError = false;
+  p.arena = arena;
+
+  NodeBuffer declarations = {NULL, 0, 0};
+  advance(&p);
+  while (!match(&p, TOKEN_EOF)) {
+    Node* node = declaration(&p);
+    if (p.hadError) break;
+    pushNode(&declarations, node);
+  }
+  *program = finishNodes(&p, &declarations);
+  return !p.hadError;
+}
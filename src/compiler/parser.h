@@ -0,0 +1,11 @@
+#ifndef APE_PARSER_H
+#define APE_PARSER_H
+
+#include "ast.h"
+
+// Parses a whole source file into its top-level declarations, allocating
+// the nodes in `arena`. Prints the first syntax error and returns false if
+// there is one.
+bool parse(const char* source, Arena* arena, NodeList* program);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+
+#include "peephole.h"
+#include "../bytecode/bytecode.h"
+
+// The code is decoded into a list of instructions whose jumps refer to other
+// instructions rather than to byte offsets. Rewrites only ever mark
+// instructions removed or change them in place, and the code is encoded
+// again at the end, recomputing every jump offset, tribe entry point and
+// tumble block bound.
+//
+// An instruction that a jump lands on, or that a tribe or a tumble block
+// starts at, is a target; so is the first one after a tumble block. A sequence is only merged when none of its instructions after the
+// first is a target, since code jumping into the middle of it would then
+// have nowhere to land.
+
+typedef struct {
+  uint8_t bytes[1 + 1 + sizeof(double)];  // as decoded; OP_PUSH is longest
+  int length;
+  int target;      // for jumps, the instruction they land on
+  bool isTarget;
+  bool removed;
+} Instruction;
+
+typedef struct {
+  Instruction* code;
+  int count;
+  int* entries;    // instruction each entry address is at
+  int entryCount;
+} Program;
+
+typedef enum {
+  JUMP_NONE,
+  JUMP_FORWARD,    // 16-bit offset past the end of the instruction
+  JUMP_BACKWARD,   // 16-bit offset back from the end of the instruction
+} JumpKind;
+
+static JumpKind jumpKind(uint8_t opcode) {
+  switch (opcode) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_SWING_RANGE:
+      return JUMP_FORWARD;
+    case OP_LOOP:
+    case OP_SWING_COUNT:
+    case OP_SWING_STEP:
+      return JUMP_BACKWARD;
+    default:
+      return JUMP_NONE;
+  }
+}
+
+// The first instruction at or after `index` that hasn't been removed. A jump
+// to a removed instruction lands there instead, which is the same thing:
+// instructions are only removed when they do nothing or never run.
+static int live(Program* program, int index) {
+  while (index < program->count && program->code[index].removed) index++;
+  return index;
+}
+
+static Instruction* at(Program* program, int index) {
+  return index < program->count ? &program->code[index] : NULL;
+}
+
+static void decode(Program* program, const uint8_t* code, long length,
+                   const uint32_t* entries) {
+  // Instruction index by offset, with one past the end for jumps that leave
+  // the code.
+  int* indexAt = (int*)malloc(sizeof(int) * (length + 1));
+  program->code = (Instruction*)malloc(sizeof(Instruction) * (length > 0 ? length : 1));
+  program->count = 0;
+  for (long offset = 0; offset < length;) {
+    Instruction* instruction = &program->code[program->count];
+    instruction->length = instructionLength(code, (int)offset);
+    memcpy(instruction->bytes, code + offset, instruction->length);
+    instruction->removed = false;
+    indexAt[offset] = program->count++;
+    offset += instruction->length;
+  }
+  indexAt[length] = program->count;
+
+  long offset = 0;
+  for (int i = 0; i < program->count; i++) {
+    Instruction* instruction = &program->code[i];
+    long end = offset + instruction->length;
+    uint16_t jump = (uint16_t)(instruction->bytes[1] << 8 | instruction->bytes[2]);
+    switch (jumpKind(instruction->bytes[0])) {
+      case JUMP_FORWARD:  instruction->target = indexAt[end + jump]; break;
+      case JUMP_BACKWARD: instruction->target = indexAt[end - jump]; break;
+      case JUMP_NONE: instruction->target = -1; break;
+    }
+    offset = end;
+  }
+  for (int i = 0; i < program->entryCount; i++) {
+    program->entries[i] = indexAt[entries[i]];
+  }
+  free(indexAt);
+}
+
+static void markTargets(Program* program) {
+  for (int i = 0; i < program->count; i++) program->code[i].isTarget = false;
+  for (int i = 0; i < program->count; i++) {
+    Instruction* instruction = &program->code[i];
+    if (instruction->removed || instruction->target < 0) continue;
+    instruction->target = live(program, instruction->target);
+    if (instruction->target < program->count) {
+      program->code[instruction->target].isTarget = true;
+    }
+  }
+  for (int i = 0; i < program->entryCount; i++) {
+    program->entries[i] = live(program, program->entries[i]);
+    if (program->entries[i] < program->count) {
+      program->code[program->entries[i]].isTarget = true;
+    }
+  }
+}
+
+static void setOpcode(Instruction* instruction, uint8_t opcode, int length) {
+  instruction->bytes[0] = opcode;
+  instruction->length = length;
+}
+
+static uint16_t slotOperand(Instruction* instruction) {
+  uint16_t slot;
+  memcpy(&slot, &instruction->bytes[1], sizeof(uint16_t));
+  return slot;
+}
+
+// A jump to an OP_JUMP can go straight to where that one lands.
+static bool threadJump(Program* program, Instruction* instruction) {
+  if (jumpKind(instruction->bytes[0]) != JUMP_FORWARD) return false;
+  bool changed = false;
+  for (int hops = 0; hops < program->count; hops++) {
+    Instruction* target = at(program, live(program, instruction->target));
+    if (target == NULL || target->bytes[0] != OP_JUMP) break;
+    int next = live(program, target->target);
+    if (next == instruction->target) break;
+    instruction->target = next;
+    changed = true;
+  }
+  return changed;
+}
+
+// The comparison that gives the opposite result, with the same errors.
+static int negatedComparison(uint8_t opcode) {
+  switch (opcode) {
+    case OP_EQUAL:         return OP_NOT_EQUAL;
+    case OP_NOT_EQUAL:     return OP_EQUAL;
+    case OP_GREATER:       return OP_LESS_EQUAL;
+    case OP_LESS_EQUAL:    return OP_GREATER;
+    case OP_LESS:          return OP_GREATER_EQUAL;
+    case OP_GREATER_EQUAL: return OP_LESS;
+    default:               return -1;
+  }
+}
+
+static int comparisonJump(uint8_t opcode) {
+  switch (opcode) {
+    case OP_LESS:    return OP_JUMP_IF_NOT_LESS;
+    case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case OP_EQUAL:   return OP_JUMP_IF_NOT_EQUAL;
+    default:         return -1;
+  }
+}
+
+// Applies the first rewrite that matches at instruction `index`.
+static bool rewrite(Program* program, int index) {
+  Instruction* instruction = &program->code[index];
+  int nextIndex = live(program, index + 1);
+  Instruction* next = at(program, nextIndex);
+  Instruction* third = next != NULL ? at(program, live(program, nextIndex + 1)) : NULL;
+  uint8_t opcode = instruction->bytes[0];
+
+  if (threadJump(program, instruction)) return true;
+
+  // A jump to the instruction right after it.
+  if (jumpKind(opcode) == JUMP_FORWARD &&
+      live(program, instruction->target) == nextIndex) {
+    switch (opcode) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+        instruction->removed = true;
+        return true;
+      case OP_POP_JUMP_IF_FALSE:
+        setOpcode(instruction, OP_POP, 1);
+        instruction->target = -1;
+        return true;
+      default:
+        break;
+    }
+  }
+
+  // Code after an unconditional jump or a return runs only if something
+  // jumps to it, such as the OP_NIL OP_RETURN after a tribe's last `give`.
+  if (opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN) {
+    bool changed = false;
+    for (int i = nextIndex; i < program->count && !program->code[i].isTarget; i++) {
+      changed |= !program->code[i].removed;
+      program->code[i].removed = true;
+    }
+    return changed;
+  }
+
+  if (next == NULL || next->isTarget) return false;
+
+  // An assignment statement followed by a read of the same variable keeps
+  // the value on the stack instead.
+  if (opcode == OP_SET_GLOBAL_SLOT_POP && next->bytes[0] == OP_GET_GLOBAL_SLOT &&
+      slotOperand(instruction) == slotOperand(next)) {
+    setOpcode(instruction, OP_SET_GLOBAL_SLOT, 1 + sizeof(uint16_t));
+    next->removed = true;
+    return true;
+  }
+  if (opcode == OP_SET_GLOBAL_SLOT && next->bytes[0] == OP_POP &&
+      third != NULL && !third->isTarget && third->bytes[0] == OP_GET_GLOBAL_SLOT &&
+      slotOperand(instruction) == slotOperand(third)) {
+    next->removed = true;
+    third->removed = true;
+    return true;
+  }
+  if (opcode == OP_SET_LOCAL_POP && instruction->bytes[1] == next->bytes[1]) {
+    if (next->bytes[0] == OP_GET_LOCAL) {
+      setOpcode(instruction, OP_SET_LOCAL, 2);
+      next->removed = true;
+      return true;
+    }
+    if (next->bytes[0] == OP_GET_LOCAL_PAIR) {
+      setOpcode(instruction, OP_SET_LOCAL, 2);
+      next->bytes[1] = next->bytes[2];
+      setOpcode(next, OP_GET_LOCAL, 2);
+      return true;
+    }
+  }
+
+  int negated = negatedComparison(opcode);
+  if (negated >= 0 && next->bytes[0] == OP_NOT) {
+    setOpcode(instruction, (uint8_t)negated, 1);
+    next->removed = true;
+    return true;
+  }
+
+  int fused = comparisonJump(opcode);
+  if (fused >= 0 && next->bytes[0] == OP_POP_JUMP_IF_FALSE) {
+    setOpcode(instruction, (uint8_t)fused, 3);
+    instruction->target = next->target;
+    next->removed = true;
+    return true;
+  }
+  return false;
+}
+
+static long encode(Program* program, uint8_t* code, uint32_t* entries) {
+  long* offsetOf = (long*)malloc(sizeof(long) * (program->count + 1));
+  long offset = 0;
+  for (int i = 0; i < program->count; i++) {
+    offsetOf[i] = offset;
+    if (!program->code[i].removed) offset += program->code[i].length;
+  }
+  offsetOf[program->count] = offset;
+
+  offset = 0;
+  for (int i = 0; i < program->count; i++) {
+    Instruction* instruction = &program->code[i];
+    if (instruction->removed) continue;
+    long end = offset + instruction->length;
+    long target = instruction->target >= 0
+                      ? offsetOf[live(program, instruction->target)]
+                      : 0;
+    if (jumpKind(instruction->bytes[0]) != JUMP_NONE) {
+      uint16_t jump = (uint16_t)(target >= end ? target - end : end - target);
+      instruction->bytes[1] = (jump >> 8) & 0xff;
+      instruction->bytes[2] = jump & 0xff;
+    }
+    memcpy(code + offset, instruction->bytes, instruction->length);
+    offset = end;
+  }
+  for (int i = 0; i < program->entryCount; i++) {
+    entries[i] = (uint32_t)offsetOf[live(program, program->entries[i])];
+  }
+  free(offsetOf);
+  return offset;
+}
+
+long optimizeCode(uint8_t* code, long length, uint32_t* entries, int entryCount) {
+  Program program;
+  program.entryCount = entryCount;
+  program.entries = (int*)malloc(sizeof(int) * (entryCount > 0 ? entryCount : 1));
+  decode(&program, code, length, entries);
+
+  // Each rewrite can expose another, so repeat until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    markTargets(&program);
+    for (int i = 0; i < program.count; i++) {
+      if (!program.code[i].removed && rewrite(&program, i)) changed = true;
+    }
+  }
+
+  length = encode(&program, code, entries);
+  free(program.code);
+  free(program.entries);
+  return length;
+}
@@ -0,0 +1,15 @@
+#ifndef APE_PEEPHOLE_H
+#define APE_PEEPHOLE_H
+
+#include "../common.h"
+
+// Rewrites the code section of a compiled file in place: threads chains of
+// jumps, removes unreachable code and replaces instruction sequences that
+// have a shorter equivalent. `entries` are the addresses other than jump
+// targets that must stay instruction boundaries: where each tribe body
+// starts, and where each tumble block starts, ends and continues after a
+// failure. They are moved along with the code. Returns the new length of the
+// code, which is never longer.
+long optimizeCode(uint8_t* code, long length, uint32_t* entries, int entryCount);
+
+#endif
@@ -0,0 +1,608 @@
+#include "registers.h"
+
+// Register code generation: walks the same tree as compiler.c but writes the
+// instruction set of REGISTER_OPCODE_LIST. Each frame is a fixed window of
+// registers: slot 0 holds the callee, locals take the next registers in
+// declaration order, and temporaries are taken above the locals while an
+// expression is evaluated and given back once it is done. Between
+// statements freeRegister is always equal to localCount.
+//
+// A local used as an operand is read straight from its register, so
+// `a ooh b` between locals is one R_ADD with no moves, and `x = x ooh 1`
+// writes x in place.
+
+// Registers are u8 operands, and R_ENTER stores the frame size in one too.
+#define MAX_REGISTERS 255
+
+static void toRegister(Emitter* e, Node* node, int target);
+static void declarations(Emitter* e, NodeList list);
+
+static void error(Emitter* e, const char* message) { errorAt(e, &e->node->token, message); }
+
+// Takes the lowest free register for a temporary.
+static int pushRegister(Emitter* e) {
+  Compiler* c = e->compiler;
+  if (c->freeRegister >= MAX_REGISTERS) {
+    error(e, "Too many registers in function.");
+    return 0;
+  }
+  int reg = c->freeRegister++;
+  if (c->freeRegister > c->registerCount) c->registerCount = c->freeRegister;
+  return reg;
+}
+
+static void emit1(Emitter* e, uint8_t instruction, int a) {
+  emitByte(e, instruction);
+  emitByte(e, (uint8_t)a);
+}
+static void emit2(Emitter* e, uint8_t instruction, int a, int b) {
+  emit1(e, instruction, a);
+  emitByte(e, (uint8_t)b);
+}
+static void emit3(Emitter* e, uint8_t instruction, int a, int b, int c) {
+  emit2(e, instruction, a, b);
+  emitByte(e, (uint8_t)c);
+}
+static void emitSlot(Emitter* e, uint8_t instruction, int a, uint16_t slot) {
+  emit1(e, instruction, a);
+  emitRaw(e, &slot, sizeof(uint16_t));
+}
+static void emitMove(Emitter* e, int target, int source) {
+  if (target != source) emit2(e, R_MOVE, target, source);
+}
+
+// Reserves the 16-bit offset that ends every jump; patchJump fills it in.
+static long jumpOperand(Emitter* e) {
+  emitByte(e, 0xff);
+  emitByte(e, 0xff);
+  return e->codeCount - 2;
+}
+
+// Writes the 16-bit offset that ends a backward jump to `loopStart`.
+static void loopOperand(Emitter* e, long loopStart) {
+  long offset = e->codeCount - loopStart + 2;
+  if (offset > UINT16_MAX) {
+    error(e, "Loop body too large.");
+  }
+  emitByte(e, (offset >> 8) & 0xff);
+  emitByte(e, offset & 0xff);
+}
+
+static void emitLoop(Emitter* e, long loopStart) {
+  emitByte(e, R_LOOP);
+  loopOperand(e, loopStart);
+}
+
+static void emitReturnNil(Emitter* e) {
+  int reg = pushRegister(e);
+  emit1(e, R_NIL, reg);
+  emit1(e, R_RETURN, reg);
+  e->compiler->freeRegister--;
+}
+
+// Every function starts with R_ENTER; its frame size is filled in once the
+// body has been generated.
+static long emitEnter(Emitter* e) {
+  emit1(e, R_ENTER, 0);
+  return e->codeCount - 1;
+}
+static void patchEnter(Emitter* e, long operand) {
+  e->code[operand] = (uint8_t)e->compiler->registerCount;
+}
+
+static void beginScope(Emitter* e) { e->compiler->scopeDepth++; }
+
+static void endScope(Emitter* e) {
+  Compiler* c = e->compiler;
+  c->scopeDepth--;
+  while (c->localCount > 0 && c->locals[c->localCount - 1].depth > c->scopeDepth) {
+    c->localCount--;
+  }
+  c->freeRegister = c->localCount;
+}
+
+// Makes `name` a local in the register just taken for its value.
+static void declareLocal(Emitter* e, Token* name) {
+  declareVariable(e, name);
+  if (e->compiler->localCount > MAX_REGISTERS) {
+    errorAt(e, name, "Too many registers in function.");
+  }
+}
+
+// Makes the register just taken a hidden local, such as a swing counter.
+static void declareHiddenLocal(Emitter* e) {
+  declareHidden(e);
+  if (e->compiler->localCount > MAX_REGISTERS) {
+    error(e, "Too many registers in function.");
+  }
+}
+
+static int localRegister(Emitter* e, Node* node) {
+  if (node->type != NODE_VARIABLE) return -1;
+  return resolveLocal(e->compiler, &node->token);
+}
+
+static bool anyAssignment(NodeList list);
+
+// Whether evaluating `node` may assign to a variable.
+static bool hasAssignment(Node* node) {
+  if (node == NULL) return false;
+  switch (node->type) {
+    case NODE_ASSIGN:
+      return true;
+    case NODE_NOT:
+    case NODE_FORAGE:
+    case NODE_TALLY:
+      return hasAssignment(node->as.operand);
+    case NODE_BINARY:
+    case NODE_RIPE:
+    case NODE_YELLOW:
+    case NODE_INSCRIBE:
+      return hasAssignment(node->as.binary.left) ||
+             hasAssignment(node->as.binary.right);
+    case NODE_CALL:
+      return hasAssignment(node->as.call.callee) ||
+             anyAssignment(node->as.call.arguments);
+    case NODE_BUNCH:
+    case NODE_CANOPY:
+    case NODE_STRING_OP:
+      return anyAssignment(node->as.items);
+    case NODE_SUBSCRIPT:
+    case NODE_SET_SUBSCRIPT:
+      return hasAssignment(node->as.subscript.object) ||
+             hasAssignment(node->as.subscript.index) ||
+             hasAssignment(node->as.subscript.value);
+    case NODE_CONDITIONAL:
+      return hasAssignment(node->as.conditional.condition) ||
+             hasAssignment(node->as.conditional.thenValue) ||
+             hasAssignment(node->as.conditional.elseValue);
+    default:
+      return false;
+  }
+}
+
+static bool anyAssignment(NodeList list) {
+  for (int i = 0; i < list.count; i++) {
+    if (hasAssignment(list.items[i])) return true;
+  }
+  return false;
+}
+
+// Evaluates `node` and returns the register holding its value: a local's own
+// register, or a new temporary. `copy` forces a temporary, for an operand
+// whose local a later operand may assign to before the instruction runs.
+static int operand(Emitter* e, Node* node, bool copy) {
+  int reg = copy ? -1 : localRegister(e, node);
+  if (reg != -1) return reg;
+  reg = pushRegister(e);
+  toRegister(e, node, reg);
+  return reg;
+}
+
+// Evaluates each of `items` into consecutive new registers and returns the
+// first.
+static int consecutive(Emitter* e, NodeList items) {
+  int first = e->compiler->freeRegister;
+  for (int i = 0; i < items.count; i++) toRegister(e, items.items[i], pushRegister(e));
+  return first;
+}
+
+// Puts the callee and the arguments of a call in consecutive registers and
+// returns the first, where the result of the call will land. That is
+// `target` itself when it is the newest temporary.
+static int callWindow(Emitter* e, Node* node, int target) {
+  Compiler* c = e->compiler;
+  int base = target;
+  if (target < c->localCount || target != c->freeRegister - 1) base = pushRegister(e);
+  toRegister(e, node->as.call.callee, base);
+  consecutive(e, node->as.call.arguments);
+  return base;
+}
+
+// A register version of a comparison whose result only decides a jump.
+static long jumpIfFalse(Emitter* e, Node* condition) {
+  Compiler* c = e->compiler;
+  int saved = c->freeRegister;
+  long offset;
+  uint8_t fused = 0;
+  if (condition->type == NODE_BINARY) {
+    switch (condition->token.type) {
+      case TOKEN_LESS:        fused = R_JUMP_IF_NOT_LESS; break;
+      case TOKEN_GREATER:     fused = R_JUMP_IF_NOT_GREATER; break;
+      case TOKEN_EQUAL_EQUAL: fused = R_JUMP_IF_NOT_EQUAL; break;
+      default: break;
+    }
+  }
+  if (fused != 0) {
+    Node* right = condition->as.binary.right;
+    int a = operand(e, condition->as.binary.left, hasAssignment(right));
+    int b = operand(e, right, false);
+    emit2(e, fused, a, b);
+  } else {
+    emit1(e, R_JUMP_IF_FALSE, operand(e, condition, false));
+  }
+  offset = jumpOperand(e);
+  c->freeRegister = saved;
+  return offset;
+}
+
+static void binary(Emitter* e, Node* node, int target) {
+  uint8_t instruction;
+  switch (node->token.type) {
+    case TOKEN_PLUS:          instruction = R_ADD; break;
+    case TOKEN_MINUS:         instruction = R_SUB; break;
+    case TOKEN_MUL:           instruction = R_MUL; break;
+    case TOKEN_DIV:           instruction = R_DIV; break;
+    case TOKEN_EQUAL_EQUAL:   instruction = R_EQUAL; break;
+    case TOKEN_BANG_EQUAL:    instruction = R_NOT_EQUAL; break;
+    case TOKEN_GREATER:       instruction = R_GREATER; break;
+    case TOKEN_GREATER_EQUAL: instruction = R_GREATER_EQUAL; break;
+    case TOKEN_LESS:          instruction = R_LESS; break;
+    case TOKEN_LESS_EQUAL:    instruction = R_LESS_EQUAL; break;
+    case TOKEN_INSCRIBE:      instruction = R_INSCRIBE; break;
+    default: return;
+  }
+  Node* right = node->as.binary.right;
+  int a = operand(e, node->as.binary.left, hasAssignment(right));
+  int b = operand(e, right, false);
+  emit3(e, instruction, target, a, b);
+}
+
+// ripe, yellow and the inliner's conditionals write their result before they
+// are done, so a local being assigned only gets it at the end.
+static int scratchFor(Emitter* e, int target) {
+  return target < e->compiler->localCount ? pushRegister(e) : target;
+}
+
+static void shortCircuit(Emitter* e, Node* node, int target) {
+  int reg = scratchFor(e, target);
+  toRegister(e, node->as.binary.left, reg);
+  emit1(e, node->type == NODE_RIPE ? R_JUMP_IF_FALSE : R_JUMP_IF_TRUE, reg);
+  long endJump = jumpOperand(e);
+  toRegister(e, node->as.binary.right, reg);
+  patchJump(e, endJump);
+  emitMove(e, target, reg);
+}
+
+static void conditional(Emitter* e, Node* node, int target) {
+  int reg = scratchFor(e, target);
+  long elseJump = jumpIfFalse(e, node->as.conditional.condition);
+  toRegister(e, node->as.conditional.thenValue, reg);
+  emitByte(e, R_JUMP);
+  long endJump = jumpOperand(e);
+  patchJump(e, elseJump);
+  toRegister(e, node->as.conditional.elseValue, reg);
+  patchJump(e, endJump);
+  emitMove(e, target, reg);
+}
+
+static void variable(Emitter* e, Node* node, int target) {
+  int local = resolveLocal(e->compiler, &node->token);
+  if (node->type == NODE_ASSIGN) {
+    if (local != -1) {
+      toRegister(e, node->as.value, local);
+      emitMove(e, target, local);
+    } else {
+      toRegister(e, node->as.value, target);
+      emitSlot(e, R_SET_GLOBAL, target,
+               nameSlot(e, &e->globals, &node->token, "Too many global variables."));
+    }
+  } else if (local != -1) {
+    emitMove(e, target, local);
+  } else {
+    emitSlot(e, R_GET_GLOBAL, target,
+             nameSlot(e, &e->globals, &node->token, "Too many global variables."));
+  }
+}
+
+static void setSubscript(Emitter* e, Node* node, int target) {
+  Node* index = node->as.subscript.index;
+  Node* value = node->as.subscript.value;
+  int object = operand(e, node->as.subscript.object,
+                       hasAssignment(index) || hasAssignment(value));
+  int key = operand(e, index, hasAssignment(value));
+  int reg = operand(e, value, false);
+  emit3(e, R_SET_SUBSCRIPT, object, key, reg);
+  emitMove(e, target, reg);
+}
+
+static void stringOperation(Emitter* e, Node* node, int target) {
+  switch (node->token.type) {
+    case TOKEN_SLICE: emit2(e, R_SLICE, target, consecutive(e, node->as.items)); break;
+    case TOKEN_GRAFT: emit2(e, R_GRAFT, target, consecutive(e, node->as.items)); break;
+    case TOKEN_SCAN:  emit2(e, R_SCAN, target, consecutive(e, node->as.items)); break;
+    case TOKEN_SHED:
+      emit2(e, R_SHED, target, operand(e, node->as.items.items[0], false));
+      break;
+    default: error(e, "Invalid string operation.");
+  }
+}
+
+// Generates code that leaves the value of `node` in register `target`.
+// Temporaries taken on the way are free again afterwards.
+static void toRegister(Emitter* e, Node* node, int target) {
+  Node* enclosing = e->node;
+  e->node = node;
+  int saved = e->compiler->freeRegister;
+  switch (node->type) {
+    case NODE_NUMBER:
+      emit1(e, R_NUMBER, target);
+      emitRaw(e, &node->as.number, sizeof(double));
+      break;
+    case NODE_STRING:
+      emitSlot(e, R_CONSTANT, target, stringConstant(e, &node->token));
+      break;
+    case NODE_TRUE:  emit1(e, R_TRUE, target); break;
+    case NODE_FALSE: emit1(e, R_FALSE, target); break;
+    case NODE_NIL:   emit1(e, R_NIL, target); break;
+    case NODE_NOT:
+      emit2(e, R_NOT, target, operand(e, node->as.operand, false));
+      break;
+    case NODE_BINARY:
+    case NODE_INSCRIBE:
+      binary(e, node, target);
+      break;
+    case NODE_RIPE:
+    case NODE_YELLOW:
+      shortCircuit(e, node, target);
+      break;
+    case NODE_CONDITIONAL: conditional(e, node, target); break;
+    case NODE_VARIABLE:
+    case NODE_ASSIGN:
+      variable(e, node, target);
+      break;
+    case NODE_CALL: {
+      int base = callWindow(e, node, target);
+      emit2(e, R_CALL, base, node->as.call.arguments.count);
+      emitMove(e, target, base);
+      break;
+    }
+    case NODE_BUNCH: {
+      int first = consecutive(e, node->as.items);
+      emit3(e, R_BUILD_BUNCH, target, first, node->as.items.count);
+      break;
+    }
+    case NODE_CANOPY: {
+      int first = consecutive(e, node->as.items);
+      emit3(e, R_BUILD_CANOPY, target, first, node->as.items.count / 2);
+      break;
+    }
+    case NODE_SUBSCRIPT: {
+      Node* index = node->as.subscript.index;
+      int object = operand(e, node->as.subscript.object, hasAssignment(index));
+      emit3(e, R_GET_SUBSCRIPT, target, object, operand(e, index, false));
+      break;
+    }
+    case NODE_SET_SUBSCRIPT: setSubscript(e, node, target); break;
+    case NODE_ASK: emit1(e, R_ASK, target); break;
+    case NODE_FORAGE:
+      emit2(e, R_FORAGE, target, operand(e, node->as.operand, false));
+      break;
+    case NODE_STRING_OP: stringOperation(e, node, target); break;
+    case NODE_TALLY:
+      emit2(e, R_STRLEN, target, operand(e, node->as.operand, false));
+      break;
+    default:
+      error(e, "Expect expression.");
+      break;
+  }
+  e->compiler->freeRegister = saved;
+  e->node = enclosing;
+}
+
+// An expression whose value is not used. Assignments store straight into
+// their variable.
+static void expressionStatement(Emitter* e, Node* node) {
+  Compiler* c = e->compiler;
+  int local = node->type == NODE_ASSIGN ? resolveLocal(c, &node->token) : -1;
+  if (local != -1) {
+    toRegister(e, node->as.value, local);
+  } else {
+    toRegister(e, node, pushRegister(e));
+    c->freeRegister--;
+  }
+}
+
+static void giveStatement(Emitter* e, Node* node) {
+  Compiler* c = e->compiler;
+  Node* value = node->as.operand;
+  if (value == NULL) {
+    emitReturnNil(e);
+  } else if (value->type == NODE_CALL && c->enclosing != NULL &&
+             c->tumbleDepth == 0) {
+    // The callee takes over this frame, as OP_TAIL_CALL does.
+    int base = callWindow(e, value, pushRegister(e));
+    emit2(e, R_TAIL_CALL, base, value->as.call.arguments.count);
+    c->freeRegister = c->localCount;
+  } else {
+    emit1(e, R_RETURN, operand(e, value, false));
+    c->freeRegister = c->localCount;
+  }
+}
+
+static void ifStatement(Emitter* e, Node* node) {
+  long thenJump = jumpIfFalse(e, node->as.ifStmt.condition);
+  declarations(e, node->as.ifStmt.thenBranch);
+  if (node->as.ifStmt.elseBranch.count == 0) {
+    patchJump(e, thenJump);
+    return;
+  }
+  emitByte(e, R_JUMP);
+  long elseJump = jumpOperand(e);
+  patchJump(e, thenJump);
+  declarations(e, node->as.ifStmt.elseBranch);
+  patchJump(e, elseJump);
+}
+
+// As in the stack code, locals a loop body declares in a tribe or a block
+// go out of scope at the end of each pass.
+static void loopBody(Emitter* e, NodeList body) {
+  if (e->compiler->scopeDepth == 0) {
+    declarations(e, body);
+    return;
+  }
+  beginScope(e);
+  declarations(e, body);
+  endScope(e);
+}
+
+// The count is copied into a hidden local, which R_SWING_COUNT decrements at
+// the end of each pass.
+static void swingStatement(Emitter* e, Node* node) {
+  int counter = pushRegister(e);
+  toRegister(e, node->as.loop.condition, counter);
+  declareHiddenLocal(e);
+  long loopStart = e->codeCount;
+  loopBody(e, node->as.loop.body);
+  emit1(e, R_SWING_COUNT, counter);
+  loopOperand(e, loopStart);
+  e->compiler->localCount--;
+  e->compiler->freeRegister = e->compiler->localCount;
+}
+
+// `swing i from a to b`: the loop variable's register, then the limit's.
+static void swingRange(Emitter* e, Node* node) {
+  Compiler* c = e->compiler;
+  beginScope(e);
+  int slot = pushRegister(e);
+  toRegister(e, node->as.range.from, slot);
+  toRegister(e, node->as.range.to, pushRegister(e));
+  c->freeRegister = slot;
+  declareLocal(e, &node->token);
+  declareHiddenLocal(e);
+  c->freeRegister = c->localCount;
+  emit1(e, R_SWING_RANGE, slot);
+  long exitJump = jumpOperand(e);
+  long loopStart = e->codeCount;
+  beginScope(e);
+  declarations(e, node->as.range.body);
+  endScope(e);
+  emit1(e, R_SWING_STEP, slot);
+  loopOperand(e, loopStart);
+  patchJump(e, exitJump);
+  endScope(e);
+}
+
+static void bananaStatement(Emitter* e, Node* node) {
+  long loopStart = e->codeCount;
+  long exitJump = jumpIfFalse(e, node->as.loop.condition);
+  loopBody(e, node->as.loop.body);
+  emitLoop(e, loopStart);
+  patchJump(e, exitJump);
+}
+
+// As in the stack code, the block is only an entry in the handler table.
+// The error lands in the register of the handler's variable, which comes
+// after whatever locals the body declares.
+static void tumbleStatement(Emitter* e, Node* node) {
+  Compiler* c = e->compiler;
+  long start = e->codeCount;
+  int depth = c->localCount;
+  c->tumbleDepth++;
+  declarations(e, node->as.tumble.body);
+  c->tumbleDepth--;
+  long end = e->codeCount;
+  emitByte(e, R_JUMP);
+  long exitJump = jumpOperand(e);
+  beginScope(e);
+  addHandler(e, start, end, depth, pushRegister(e));
+  declareLocal(e, &node->as.tumble.errorName);
+  declarations(e, node->as.tumble.handler);
+  endScope(e);
+  patchJump(e, exitJump);
+}
+
+static void summonStatement(Emitter* e, Node* node) {
+  int reg = pushRegister(e);
+  toRegister(e, node->as.operand, reg);
+  emit1(e, R_SUMMON, reg);
+  e->compiler->freeRegister--;
+}
+
+static void varDeclaration(Emitter* e, Node* node) {
+  Compiler* c = e->compiler;
+  int reg = pushRegister(e);
+  if (node->as.value != NULL) {
+    toRegister(e, node->as.value, reg);
+  } else {
+    emit1(e, R_NIL, reg);
+  }
+  if (c->scopeDepth == 0) {
+    emitSlot(e, R_SET_GLOBAL, reg,
+             nameSlot(e, &e->globals, &node->token, "Too many global variables."));
+    c->freeRegister--;
+  } else {
+    declareLocal(e, &node->token);
+  }
+}
+
+static void funDeclaration(Emitter* e, Node* node) {
+  emitByte(e, R_JUMP);
+  long bodyJump = jumpOperand(e);
+  uint32_t bodyStart = (uint32_t)e->codeCount;
+  Compiler compiler;
+  initCompiler(&compiler, e->compiler);
+  compiler.address = bodyStart;
+  e->compiler = &compiler;
+  beginScope(e);
+  for (int i = 0; i < node->as.tribe.arity; i++) {
+    declareLocal(e, &node->as.tribe.params[i]);
+  }
+  compiler.freeRegister = compiler.localCount;
+  compiler.registerCount = compiler.localCount;
+  long enter = emitEnter(e);
+  declarations(e, node->as.tribe.body);
+  emitReturnNil(e);
+  patchEnter(e, enter);
+  e->compiler = e->compiler->enclosing;
+  patchJump(e, bodyJump);
+
+  uint16_t index = addFunction(e, node->token, node->as.tribe.arity, bodyStart);
+  int reg = pushRegister(e);
+  emitSlot(e, R_FUNCTION, reg, index);
+  if (e->compiler->scopeDepth == 0) {
+    emitSlot(e, R_SET_GLOBAL, reg,
+             nameSlot(e, &e->globals, &node->token, "Too many global variables."));
+    e->compiler->freeRegister--;
+  } else {
+    declareLocal(e, &node->token);
+  }
+}
+
+static void declaration(Emitter* e, Node* node) {
+  Node* enclosing = e->node;
+  e->node = node;
+  switch (node->type) {
+    case NODE_TRIBE: funDeclaration(e, node); break;
+    case NODE_VAR:   varDeclaration(e, node); break;
+    case NODE_PRINT:
+      emit1(e, R_PRINT, operand(e, node->as.operand, false));
+      e->compiler->freeRegister = e->compiler->localCount;
+      break;
+    case NODE_GIVE:   giveStatement(e, node); break;
+    case NODE_IF:     ifStatement(e, node); break;
+    case NODE_TUMBLE: tumbleStatement(e, node); break;
+    case NODE_SUMMON: summonStatement(e, node); break;
+    case NODE_SWING:  swingStatement(e, node); break;
+    case NODE_SWING_RANGE: swingRange(e, node); break;
+    case NODE_BANANA: bananaStatement(e, node); break;
+    case NODE_BLOCK:
+      beginScope(e);
+      declarations(e, node->as.statements);
+      endScope(e);
+      break;
+    default: expressionStatement(e, node->as.operand); break;
+  }
+  e->node = enclosing;
+}
+
+static void declarations(Emitter* e, NodeList list) {
+  for (int i = 0; i < list.count; i++) declaration(e, list.items[i]);
+}
+
+void generateRegisterCode(Emitter* e, NodeList program) {
+  long enter = emitEnter(e);
+  declarations(e, program);
+  emitReturnNil(e);
+  patchEnter(e, enter);
+}
@@ -0,0 +1,10 @@
+#ifndef APE_REGISTERS_H
+#define APE_REGISTERS_H
+
+#include "emitter.h"
+
+// Generates register code (REGISTER_OPCODE_LIST) for `program` into the
+// emitter's code buffer and tables, ending with the top-level return.
+void generateRegisterCode(Emitter* e, NodeList program);
+
+#endif
@@ -2,6 +2,29 @@
 #include <string.h>
 
 #include "debug.h"
+#include "../bytecode/bytecode.h"
+
+static const char* opcodeNames[] = {
+#define OPCODE_NAME(name) #name,
+    OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+const char* opcodeName(uint8_t opcode) {
+    if (opcode >= OP_COUNT) return "OP_UNKNOWN";
+    return opcodeNames[opcode];
+}
+
+static const char* registerOpcodeNames[] = {
+#define OPCODE_NAME(name) #name,
+    REGISTER_OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+const char* registerOpcodeName(uint8_t opcode) {
+    if (opcode >= R_COUNT) return "R_UNKNOWN";
+    return registerOpcodeNames[opcode];
+}
 
 // Helper to print a simple instruction with commentary
 static int simpleInstruction(const char* name, int offset) {
@@ -23,19 +46,61 @@ static int jumpInstruction(const char* name, int sign, uint8_t* bytecode, int of
     return offset + 3;
 }
 
-// Helper for instructions dealing with global variables, which are stored by name
+// Helper for the swing instructions: a 2-byte offset, then a local slot
+static int swingInstruction(const char* name, int sign, uint8_t* bytecode, int offset) {
+    uint16_t jump = (uint16_t)(bytecode[offset + 1] << 8 | bytecode[offset + 2]);
+    printf("%-16s %4d -> %d slot %d\n", name, offset, offset + 4 + sign * jump, bytecode[offset + 3]);
+    return offset + 4;
+}
+
+// Helper for OP_GET_LOCAL_PAIR, which reads two local slots
+static int localPairInstruction(const char* name, uint8_t* bytecode, int offset) {
+    printf("%-16s %4d %4d\n", name, bytecode[offset + 1], bytecode[offset + 2]);
+    return offset + 3;
+}
+
+// The globals table of the file being disassembled, used to name global slots
+static const ApbModule* currentModule = NULL;
+
+// Helper for instructions dealing with global variables, which refer to a slot in the globals table
 static int globalInstruction(const char* name, uint8_t* bytecode, int offset) {
-    uint8_t len = bytecode[offset + 1];
-    printf("%-16s '", name);
-    // Print the variable name character by character
-    for(int i = 0; i < len; i++) {
-        printf("%c", bytecode[offset + 2 + i]);
+    uint16_t slot;
+    memcpy(&slot, &bytecode[offset + 1], sizeof(uint16_t));
+    printf("%-16s %4d", name, slot);
+    if (currentModule != NULL && slot < currentModule->globalCount) {
+        printf(" '%.*s'", currentModule->globals[slot].length, currentModule->globals[slot].chars);
     }
-    printf("'\n");
-    return offset + 2 + len;
+    printf("\n");
+    return offset + 1 + sizeof(uint16_t);
 }
 
-// Helper for the complex OP_PUSH instruction, which handles all literals
+// Helper for OP_CONSTANT, which pushes an entry of the file's constants table
+static int constantIndexInstruction(const char* name, uint8_t* bytecode, int offset) {
+    uint16_t index;
+    memcpy(&index, &bytecode[offset + 1], sizeof(uint16_t));
+    printf("%-16s %4d", name, index);
+    if (currentModule != NULL && index < currentModule->constantCount) {
+        const ApbConstant* constant = &currentModule->constants[index];
+        printf(" \"%.*s\"", (int)constant->length, constant->chars);
+    }
+    printf("\n");
+    return offset + 1 + sizeof(uint16_t);
+}
+
+// Helper for OP_FUNCTION, which pushes a tribe from the file's function table
+static int functionInstruction(const char* name, uint8_t* bytecode, int offset) {
+    uint16_t index;
+    memcpy(&index, &bytecode[offset + 1], sizeof(uint16_t));
+    printf("%-16s %4d", name, index);
+    if (currentModule != NULL && index < currentModule->functionCount) {
+        const ApbFunction* function = &currentModule->functions[index];
+        printf(" <tribe %.*s>", function->name.length, function->name.chars);
+    }
+    printf("\n");
+    return offset + 1 + sizeof(uint16_t);
+}
+
+// Helper for the OP_PUSH instruction, which pushes number literals, which handles all literals
 static int constantInstruction(const char* name, uint8_t* bytecode, int offset) {
     printf("%-16s ", name);
     // The byte after OP_PUSH tells us the type of literal
@@ -50,36 +115,6 @@ static int constantInstruction(const char* name, uint8_t* bytecode, int offset)
             current_offset += sizeof(double);
             break;
         }
-        case VAL_OBJ: {
-            // If it's an object, we need to know what kind of object
-            ObjType objType = (ObjType)bytecode[current_offset];
-            current_offset++;
-            switch(objType) {
-                case OBJ_STRING: {
-                    uint8_t len = bytecode[current_offset];
-                    current_offset++;
-                    printf("STRING \"%.*s\"\n", len, &bytecode[current_offset]);
-                    current_offset += len;
-                    break;
-                }
-                case OBJ_FUNCTION: {
-                    uint8_t arity = bytecode[current_offset];
-                    current_offset++;
-                    uint32_t codeAddr;
-                    memcpy(&codeAddr, &bytecode[current_offset], sizeof(uint32_t));
-                    current_offset += sizeof(uint32_t);
-                    uint8_t nameLen = bytecode[current_offset];
-                    current_offset++;
-                    printf("FUNCTION <tribe %.*s> (arity: %d, addr: %u)\n", nameLen, &bytecode[current_offset], arity, codeAddr);
-                    current_offset += nameLen;
-                    break;
-                }
-                default:
-                    printf("UNKNOWN_OBJ_TYPE %d\n", objType);
-                    break;
-            }
-            break;
-        }
         default:
             printf("UNKNOWN_VAL_TYPE %d\n", type);
             break;
@@ -94,6 +129,8 @@ int disassembleInstruction(uint8_t* bytecode, int offset) {
     uint8_t instruction = bytecode[offset];
     switch (instruction) {
         case OP_PUSH:           return constantInstruction("OP_PUSH", bytecode, offset);
+        case OP_CONSTANT:       return constantIndexInstruction("OP_CONSTANT      ; pick a banana from the pantry", bytecode, offset);
+        case OP_FUNCTION:       return functionInstruction("OP_FUNCTION      ; call on a tribe from the scroll", bytecode, offset);
         case OP_NIL:            return simpleInstruction("OP_NIL           ; nil, the absence of bananas", offset);
         case OP_TRUE:           return simpleInstruction("OP_TRUE          ; true, the banana is ripe", offset);
         case OP_FALSE:          return simpleInstruction("OP_FALSE         ; false, the banana is not ripe", offset);
@@ -108,38 +145,153 @@ int disassembleInstruction(uint8_t* bytecode, int offset) {
         case OP_LESS:           return simpleInstruction("OP_LESS          ; fewer bananas than the other ape", offset);
         case OP_JUMP_IF_FALSE:  return jumpInstruction("OP_JUMP_IF_FALSE ; jump if the banana is falsey", 1, bytecode, offset);
         case OP_JUMP:           return jumpInstruction("OP_JUMP          ; swing to another branch", 1, bytecode, offset);
-        case OP_JUMP_BACK: {
-            uint32_t target_offset;
-            memcpy(&target_offset, &bytecode[offset + 1], sizeof(uint32_t));
-            printf("%-16s -> %u ; swing way back\n", "OP_JUMP_BACK", target_offset);
-            return offset + 1 + sizeof(uint32_t);
-        }
-        case OP_LOOP_START:     return simpleInstruction("OP_LOOP_START    ; begin the banana-counting dance", offset);
+        case OP_SWING_COUNT:    return swingInstruction("OP_SWING_COUNT   ; count down the swings, then back on the vine", -1, bytecode, offset);
+        case OP_SWING_RANGE:    return swingInstruction("OP_SWING_RANGE   ; skip the dance unless the count starts in range", 1, bytecode, offset);
+        case OP_SWING_STEP:     return swingInstruction("OP_SWING_STEP    ; one more banana, then back while in range", -1, bytecode, offset);
         case OP_PRINT:          return simpleInstruction("OP_PRINT         ; ape screeches about bananas", offset);
         case OP_ASK:            return simpleInstruction("OP_ASK           ; ask the jungle for wisdom (and input)", offset);
-        case OP_GET_GLOBAL:     return globalInstruction("OP_GET_GLOBAL    ; find a banana in the jungle", bytecode, offset);
-        case OP_SET_GLOBAL:     return globalInstruction("OP_SET_GLOBAL    ; place a banana in the jungle", bytecode, offset);
+        case OP_GET_GLOBAL_SLOT: return globalInstruction("OP_GET_GLOBAL_SLOT ; find a banana in the jungle", bytecode, offset);
+        case OP_SET_GLOBAL_SLOT: return globalInstruction("OP_SET_GLOBAL_SLOT ; place a banana in the jungle", bytecode, offset);
         case OP_GET_LOCAL:      return byteInstruction("OP_GET_LOCAL     ; grab a nearby banana", bytecode, offset);
         case OP_SET_LOCAL:      return byteInstruction("OP_SET_LOCAL     ; place a banana nearby", bytecode, offset);
         case OP_CALL:           return byteInstruction("OP_CALL          ; summon the tribe", bytecode, offset);
+        case OP_TAIL_CALL:      return byteInstruction("OP_TAIL_CALL     ; hand the vine over to the tribe", bytecode, offset);
         case OP_RETURN:         return simpleInstruction("OP_RETURN        ; ape returns to the tribe's canopy", offset);
         case OP_BUILD_BUNCH:    return byteInstruction("OP_BUILD_BUNCH   ; gather a bunch of bananas (array)", bytecode, offset);
         case OP_BUILD_CANOPY:   return byteInstruction("OP_BUILD_CANOPY  ; build a sturdy canopy (map)", bytecode, offset);
         case OP_GET_SUBSCRIPT:  return simpleInstruction("OP_GET_SUBSCRIPT ; grab a specific banana from the bunch", offset);
         case OP_SET_SUBSCRIPT:  return simpleInstruction("OP_SET_SUBSCRIPT ; put a banana back in the bunch", offset);
-        case OP_TUMBLE_SETUP:   return jumpInstruction("OP_TUMBLE_SETUP  ; prepare for a clumsy tumble (try)", 1, bytecode, offset);
-        case OP_TUMBLE_END:     return simpleInstruction("OP_TUMBLE_END    ; the tumble is over, safe now", offset);
         case OP_SUMMON:         return simpleInstruction("OP_SUMMON        ; summon another ape spirit (module)", offset);
         case OP_LOOP:           return jumpInstruction("OP_LOOP          ; swing back on the vine", -1, bytecode, offset);
+        case OP_GET_LOCAL_PAIR: return localPairInstruction("OP_GET_LOCAL_PAIR ; grab two nearby bananas", bytecode, offset);
+        case OP_SET_LOCAL_POP:  return byteInstruction("OP_SET_LOCAL_POP ; put the banana down nearby", bytecode, offset);
+        case OP_SET_GLOBAL_SLOT_POP: return globalInstruction("OP_SET_GLOBAL_SLOT_POP ; leave a banana in the jungle", bytecode, offset);
+        case OP_NOT_EQUAL:      return simpleInstruction("OP_NOT_EQUAL     ; are the banana bunches different?", offset);
+        case OP_GREATER_EQUAL:  return simpleInstruction("OP_GREATER_EQUAL ; at least as many bananas", offset);
+        case OP_LESS_EQUAL:     return simpleInstruction("OP_LESS_EQUAL    ; at most as many bananas", offset);
+        case OP_POP_JUMP_IF_FALSE: return jumpInstruction("OP_POP_JUMP_IF_FALSE ; drop the banana, jump if it was falsey", 1, bytecode, offset);
+        case OP_JUMP_IF_NOT_LESS: return jumpInstruction("OP_JUMP_IF_NOT_LESS ; jump unless fewer bananas", 1, bytecode, offset);
+        case OP_JUMP_IF_NOT_GREATER: return jumpInstruction("OP_JUMP_IF_NOT_GREATER ; jump unless more bananas", 1, bytecode, offset);
+        case OP_JUMP_IF_NOT_EQUAL: return jumpInstruction("OP_JUMP_IF_NOT_EQUAL ; jump unless the bunches match", 1, bytecode, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
 
+// Register code: the register operands come first, then the slot, number or
+// jump offset, so one printer handles every instruction.
+static int disassembleRegisterInstruction(uint8_t* bytecode, int offset) {
+    printf("%04d ", offset);
+
+    uint8_t instruction = bytecode[offset];
+    int length = registerInstructionLength(bytecode, offset);
+    printf("%-22s", registerOpcodeName(instruction));
+    switch (instruction) {
+        case R_NUMBER: {
+            double num;
+            memcpy(&num, &bytecode[offset + 2], sizeof(double));
+            printf(" r%d %g\n", bytecode[offset + 1], num);
+            break;
+        }
+        case R_CONSTANT:
+        case R_FUNCTION:
+        case R_GET_GLOBAL:
+        case R_SET_GLOBAL: {
+            uint16_t index;
+            memcpy(&index, &bytecode[offset + 2], sizeof(uint16_t));
+            printf(" r%d %4d", bytecode[offset + 1], index);
+            if (currentModule == NULL) {
+                printf("\n");
+                break;
+            }
+            if (instruction == R_CONSTANT && index < currentModule->constantCount) {
+                const ApbConstant* constant = &currentModule->constants[index];
+                printf(" \"%.*s\"", (int)constant->length, constant->chars);
+            } else if (instruction == R_FUNCTION && index < currentModule->functionCount) {
+                const ApbFunction* function = &currentModule->functions[index];
+                printf(" <tribe %.*s>", function->name.length, function->name.chars);
+            } else if ((instruction == R_GET_GLOBAL || instruction == R_SET_GLOBAL) &&
+                       index < currentModule->globalCount) {
+                printf(" '%.*s'", currentModule->globals[index].length, currentModule->globals[index].chars);
+            }
+            printf("\n");
+            break;
+        }
+        case R_ENTER:
+            printf(" %d registers\n", bytecode[offset + 1]);
+            break;
+        case R_CALL:
+        case R_TAIL_CALL:
+            printf(" r%d %d args\n", bytecode[offset + 1], bytecode[offset + 2]);
+            break;
+        case R_BUILD_BUNCH:
+        case R_BUILD_CANOPY:
+            printf(" r%d r%d %d\n", bytecode[offset + 1], bytecode[offset + 2], bytecode[offset + 3]);
+            break;
+        case R_JUMP:
+        case R_LOOP:
+        case R_JUMP_IF_FALSE:
+        case R_JUMP_IF_TRUE:
+        case R_JUMP_IF_NOT_LESS:
+        case R_JUMP_IF_NOT_GREATER:
+        case R_JUMP_IF_NOT_EQUAL:
+        case R_SWING_COUNT:
+        case R_SWING_RANGE:
+        case R_SWING_STEP: {
+            for (int i = offset + 1; i < offset + length - 2; i++) printf(" r%d", bytecode[i]);
+            uint16_t jump = (uint16_t)(bytecode[offset + length - 2] << 8 | bytecode[offset + length - 1]);
+            int sign = instruction == R_LOOP || instruction == R_SWING_COUNT ||
+                       instruction == R_SWING_STEP ? -1 : 1;
+            printf(" -> %d\n", offset + length + sign * jump);
+            break;
+        }
+        default:
+            for (int i = offset + 1; i < offset + length; i++) printf(" r%d", bytecode[i]);
+            printf("\n");
+            break;
+    }
+    return offset + length;
+}
+
 void disassembleBytecode(const char* name, uint8_t* bytecode, long size) {
+    ApbModule module;
+    if (!readApb(bytecode, (size_t)size, &module)) {
+        printf("== %s: not an ApesLang bytecode file ==\n", name);
+        return;
+    }
+
     printf("== %s: The Ape Scrolls ==\n", name);
-    for (int offset = 0; offset < size; ) {
-        offset = disassembleInstruction(bytecode, offset);
+    printf("-- jungle globals (%d) --\n", module.globalCount);
+    for (int i = 0; i < module.globalCount; i++) {
+        printf("%4d '%.*s'\n", i, module.globals[i].length, module.globals[i].chars);
+    }
+    printf("-- banana pantry (%d constants) --\n", module.constantCount);
+    for (int i = 0; i < module.constantCount; i++) {
+        printf("%4d \"%.*s\"\n", i, (int)module.constants[i].length, module.constants[i].chars);
+    }
+    printf("-- tribes (%d) --\n", module.functionCount);
+    for (int i = 0; i < module.functionCount; i++) {
+        printf("%4d <tribe %.*s> (arity: %d, addr: %u)\n", i, module.functions[i].name.length,
+               module.functions[i].name.chars, module.functions[i].arity, module.functions[i].address);
+    }
+    if (module.handlerCount > 0) {
+        printf("-- clumsy tumbles (%d) --\n", module.handlerCount);
+        for (int i = 0; i < module.handlerCount; i++) {
+            TumbleHandler* handler = &module.handlers[i];
+            printf("%4d in %u: %u..%u -> %u (slots %d..%d)\n", i, handler->function,
+                   handler->start, handler->end, handler->target, handler->depth, handler->slot);
+        }
+    }
+    bool registers = (module.flags & APB_FLAG_REGISTERS) != 0;
+    printf("-- %s code (%u bytes) --\n", registers ? "register" : "stack", module.codeSize);
+
+    currentModule = &module;
+    uint8_t* code = (uint8_t*)module.code;
+    for (int offset = 0; offset < (int)module.codeSize; ) {
+        offset = registers ? disassembleRegisterInstruction(code, offset)
+                           : disassembleInstruction(code, offset);
     }
+    currentModule = NULL;
+    freeApb(&module);
 }
@@ -6,5 +6,7 @@
 
 void disassembleBytecode(const char* name, uint8_t* bytecode, long size);
 int disassembleInstruction(uint8_t* bytecode, int offset);
+const char* opcodeName(uint8_t opcode);
+const char* registerOpcodeName(uint8_t opcode);
 
 #endif
\ No newline at end of file
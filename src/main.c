@@ -1,5 +1,9 @@
+#include <sys/resource.h>
+#include <time.h>
+
 #include "common.h"
 #include "./compiler/compiler.h"
+#include "./compiler/aot.h"
 #include "./vm/vm.h"
 #include "./debug/debug.h"
 #include "./lexer/lexer.h" 
@@ -8,8 +12,9 @@ static char* processedFiles[1024];
 static int processedCount = 0;
 static char* readFile(const char* path);
 char** findDependencies(const char* source, int* count);
-void compileWithDependencies(const char* ape_path);
+void compileWithDependencies(const char* ape_path, bool optimize, bool registers);
 static void printVmStats(VM* vm);
+static void printRunStats(VM* vm, double seconds);
 
 bool hasBeenProcessed(const char* path) {
     for (int i = 0; i < processedCount; i++) {
@@ -25,7 +30,7 @@ void markAsProcessed(const char* path) {
 }
 
 // The main recursive compilation driver.
-void compileWithDependencies(const char* ape_path) {
+void compileWithDependencies(const char* ape_path, bool optimize, bool registers) {
     // 1. Avoid re-compiling or circular dependencies.
     if (hasBeenProcessed(ape_path)) {
         return;
@@ -45,7 +50,7 @@ void compileWithDependencies(const char* ape_path) {
     free(source); // Free the source after scanning
     
     for (int i = 0; i < dep_count; i++) {
-        compileWithDependencies(deps[i]);
+        compileWithDependencies(deps[i], optimize, registers);
         free(deps[i]); // Free the path string
     }
     free(deps);
@@ -69,7 +74,7 @@ void compileWithDependencies(const char* ape_path) {
         exit(71);
     }
 
-    if (compile(source, outFile, false)) { // This is your existing compile function
+    if (compile(source, outFile, false, optimize, registers)) { // This is your existing compile function
         printf("   Success: %s -> %s\n", ape_path, path_apb);
     } else {
         fprintf(stderr, "   Failure: Could not compile %s.\n", ape_path);
@@ -150,12 +155,139 @@ static char* readFile(const char* path) {
 static void printVmStats(VM* vm) {
     printf("\n-- Apelang Stats --\n");
     printf("Memory: %zu bytes\n", vm->bytesAllocated);
+    printf("Peak Memory: %zu bytes\n", vm->peakBytesAllocated);
     printf("Stack Depth: %d\n", vm->maxFrameCount);
+    printf("Frames Pushed: %ld\n", vm->framesPushed);
     printf("Allocated Objects: %ld\n", vm->objectsAllocated);
-    printf("GC Cycles: %d\n", vm->gcCycles);
+    printf("Minor GCs: %d (%.3f ms, longest %.3f ms, %zu bytes promoted)\n",
+           vm->minorCycles, vm->minorPauseTotal * 1000.0,
+           vm->minorPauseMax * 1000.0, vm->promotedBytes);
+    printf("Major GCs: %d (%ld slices, %.3f ms, longest slice %.3f ms)\n",
+           vm->gcCycles, vm->gcSlices, vm->majorPauseTotal * 1000.0,
+           vm->majorPauseMax * 1000.0);
+    if (vm->gcThreads > 1) {
+        printf("GC Threads: %d (%ld slices shared)\n", vm->gcThreads,
+               vm->gcSharedSlices);
+    }
+    static const char* pauseBuckets[GC_PAUSE_BUCKETS] = {
+        "<=10us", "<=100us", "<=1ms", "<=10ms", ">10ms"};
+    printf("GC Pauses:");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        printf(" %s %ld", pauseBuckets[i], vm->pauseHistogram[i]);
+    }
+    printf("\n");
+    printf("Intern Hits: %ld\n", vm->internHits);
+    printf("Intern Misses: %ld\n", vm->internMisses);
     printf("-------------------\n");
 }
 
+static double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One line per quickened opcode that was used: how many sites were rewritten
+// into it, how often its guard failed and (with PROFILE=1) how often it ran
+// without failing.
+static void printQuickeningStats(VM* vm) {
+    static const uint8_t quickened[] = {
+        OP_ADD_NUM, OP_ADD_STR, OP_SUB_NUM, OP_MUL_NUM,
+        OP_DIV_NUM, OP_EQUAL_NUM, OP_GREATER_NUM, OP_LESS_NUM,
+    };
+    printf("Quickening:\n");
+    for (size_t i = 0; i < sizeof(quickened); i++) {
+        uint8_t op = quickened[i];
+        if (vm->quickenings[op] == 0) continue;
+        printf("  %-18s %8ld rewrites %8ld misses", opcodeName(op),
+               vm->quickenings[op], vm->quickenMisses[op]);
+#ifdef APE_PROFILE
+        printf(" %12llu hits",
+               (unsigned long long)(vm->opcodeCounts[op] - vm->quickenMisses[op]));
+#endif
+        printf("\n");
+    }
+}
+
+// Extra numbers for `apeslang run --stats`: wall time and, in builds made
+// with PROFILE=1, how many instructions ran and which opcodes dominated.
+static void printRunStats(VM* vm, double seconds) {
+    printf("\n-- Apelang Run Stats --\n");
+#ifdef APE_COMPUTED_GOTO
+    printf("Dispatch: computed goto\n");
+#else
+    printf("Dispatch: switch\n");
+#endif
+    printf("Execution: %s\n", vm->registerMode ? "registers" : "stack");
+    if (vm->jitEnabled && !vm->registerMode) {
+        printf("JIT: %d tribes compiled (%zu bytes), %d left to the interpreter\n",
+               vm->jitCompiled, vm->jitCodeBytes, vm->jitRejected);
+    } else {
+        printf("JIT: off\n");
+    }
+    printf("Run Time: %.3f ms\n", seconds * 1000.0);
+    if (seconds > 0) {
+        printf("Allocation Rate: %.2f M allocations/s\n",
+               vm->objectsAllocated / seconds / 1e6);
+    }
+    printf("Pool Pages: %zu bytes\n", vm->pool.pageBytes);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("Max RSS: %ld KB\n", usage.ru_maxrss);
+    }
+#ifdef APE_PROFILE
+    const char* (*nameOf)(uint8_t) = vm->registerMode ? registerOpcodeName : opcodeName;
+    printf("Instructions: %llu\n", (unsigned long long)vm->instructionCount);
+    if (seconds > 0) {
+        printf("Instructions/sec: %.0f\n", vm->instructionCount / seconds);
+    }
+    printf("Top Opcodes:\n");
+    bool shown[256] = {false};
+    for (int rank = 0; rank < 10; rank++) {
+        int best = -1;
+        for (int op = 0; op < 256; op++) {
+            if (shown[op] || vm->opcodeCounts[op] == 0) continue;
+            if (best == -1 || vm->opcodeCounts[op] > vm->opcodeCounts[best]) best = op;
+        }
+        if (best == -1) break;
+        shown[best] = true;
+        printf("  %-18s %12llu\n", nameOf((uint8_t)best),
+               (unsigned long long)vm->opcodeCounts[best]);
+    }
+    // The candidates for superinstructions: opcodes that most often run
+    // straight after one another.
+    printf("Top Pairs:\n");
+    static bool shownPair[256][256];
+    memset(shownPair, 0, sizeof(shownPair));
+    for (int rank = 0; rank < 10; rank++) {
+        int bestFirst = -1, bestSecond = -1;
+        uint64_t bestCount = 0;
+        for (int first = 0; first < 256; first++) {
+            for (int second = 0; second < 256; second++) {
+                uint64_t count = vm->pairCounts[first][second];
+                if (count > bestCount && !shownPair[first][second]) {
+                    bestFirst = first;
+                    bestSecond = second;
+                    bestCount = count;
+                }
+            }
+        }
+        if (bestFirst == -1) break;
+        shownPair[bestFirst][bestSecond] = true;
+        printf("  %-18s %-18s %12llu\n", nameOf((uint8_t)bestFirst),
+               nameOf((uint8_t)bestSecond), (unsigned long long)bestCount);
+    }
+#else
+    printf("Instructions: (build with PROFILE=1 to count)\n");
+#endif
+    long calls = vm->callCacheHits + vm->callCacheMisses;
+    printf("Call Caches: %ld hits, %ld misses (%.1f%% hit rate)\n",
+           vm->callCacheHits, vm->callCacheMisses,
+           calls > 0 ? 100.0 * vm->callCacheHits / calls : 0.0);
+    if (!vm->registerMode) printQuickeningStats(vm);
+    printf("-----------------------\n");
+}
+
 static void runRepl() {
     VM vm;
     initVM(&vm); // Initialize the VM once for the whole session
@@ -198,7 +330,7 @@ static void compileCommand(const char* sourcePath) {
   }
 
   // Pass false for isRepl when compiling a file
-  int success = compile(source, outFile, false);
+  int success = compile(source, outFile, false, false, false);
   free(source);
   fclose(outFile);
 
@@ -210,7 +342,7 @@ static void compileCommand(const char* sourcePath) {
   }
 }
 
-static void runCommand(const char* bytecodePath) {
+static void runCommand(const char* bytecodePath, bool showStats, bool jit) {
   if (strrchr(bytecodePath, '.') == NULL || strcmp(strrchr(bytecodePath, '.'), ".apb") != 0) {
     fprintf(stderr, "Error: File for execution must have a .apb extension.\n");
     exit(64);
@@ -218,10 +350,14 @@ static void runCommand(const char* bytecodePath) {
 
   VM vm;
   initVM(&vm);
+  vm.jitEnabled = vm.jitEnabled && jit;
 
+  double start = monotonicSeconds();
   VMResult result = runBytecode(&vm, bytecodePath);
+  double elapsed = monotonicSeconds() - start;
 
   printVmStats(&vm);
+  if (showStats) printRunStats(&vm, elapsed);
   freeVM(&vm);
 
   if (result != VM_RESULT_OK) {
@@ -259,30 +395,81 @@ static void disassembleCommand(const char* path) {
     free(bytecode);
 }
 
+// Writes the C translation of a compiled program; see compiler/aot.h.
+static void aotCommand(const char* bytecodePath, const char* outputPath) {
+  if (strrchr(bytecodePath, '.') == NULL || strcmp(strrchr(bytecodePath, '.'), ".apb") != 0) {
+    fprintf(stderr, "Error: File for translation must have a .apb extension.\n");
+    exit(64);
+  }
+  if (!aotTranslate(bytecodePath, outputPath)) exit(65);
+  printf("Translated %s to %s.\n", bytecodePath, outputPath);
+}
+
+// Reads the options between `compile` and the file name.
+static bool compileFlags(int argc, const char* argv[], bool* optimize, bool* registers) {
+  for (int i = 2; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-O") == 0) {
+      *optimize = true;
+    } else if (strcmp(argv[i], "--registers") == 0) {
+      *registers = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the options between `run` and the file name.
+static bool runFlags(int argc, const char* argv[], bool* showStats, bool* jit) {
+  for (int i = 2; i < argc - 1; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      *showStats = true;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      *jit = false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
 int main(int argc, const char* argv[]) {
   if (argc < 2) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  apeslang compile <file.ape>\n");
-    fprintf(stderr, "  apeslang run <file.apb>\n");
+    fprintf(stderr, "  apeslang compile [-O] [--registers] <file.ape>\n");
+    fprintf(stderr, "  apeslang run [--stats] [--no-jit] <file.apb>\n");
     fprintf(stderr, "  apeslang repl\n");
     fprintf(stderr, "  apeslang disassemble <file.apb>\n");
+    fprintf(stderr, "  apeslang aot <file.apb> -o <file.c>\n");
     return 64;
   }
 
   const char* command = argv[1];
-
-   if (argc == 3 && strcmp(argv[1], "compile") == 0) {
-        compileWithDependencies(argv[2]);
+  bool optimize = false;
+  bool registers = false;
+  bool showStats = false;
+  bool jit = true;
+
+   if (strcmp(command, "compile") == 0 && argc >= 3 &&
+       compileFlags(argc, argv, &optimize, &registers)) {
+        // -O runs the peephole optimizer over each compiled file;
+        // --registers compiles it for the register VM instead.
+        compileWithDependencies(argv[argc - 1], optimize, registers);
         // Clean up memory from the processed files list
         for (int i = 0; i < processedCount; i++) {
             free(processedFiles[i]);
         }
-    } else if (strcmp(command, "run") == 0 && argc == 3) {
-    runCommand(argv[2]);
+    } else if (strcmp(command, "run") == 0 && argc >= 3 &&
+               runFlags(argc, argv, &showStats, &jit)) {
+    // --no-jit interprets every tribe, however hot.
+    runCommand(argv[argc - 1], showStats, jit);
   } else if (strcmp(command, "repl") == 0 && argc == 2) {
     runRepl();
   } else if (strcmp(command, "disassemble") == 0 && argc == 3) {
     disassembleCommand(argv[2]);
+  } else if (strcmp(command, "aot") == 0 && argc == 5 &&
+             strcmp(argv[3], "-o") == 0) {
+    aotCommand(argv[2], argv[4]);
   } else {
     fprintf(stderr, "Unknown command or incorrect number of arguments.\n");
     return 64;
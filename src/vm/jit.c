@@ -0,0 +1,897 @@
+// MAP_ANONYMOUS is not part of POSIX.
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef APE_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../bytecode/bytecode.h"
+
+// The machine code of one tribe. Offset 0 is the entry stub shared by every
+// entry point: it saves the callee-saved registers, loads the frame and jumps
+// to the address it was given.
+struct JitCode {
+  uint8_t* code;     // mapped read and execute
+  size_t size;       // bytes mapped
+  uint32_t start;    // bytecode offset of the tribe's first instruction
+  uint32_t span;     // bytecode bytes covered from start
+  int32_t* native;   // machine code offset per bytecode offset, -1 if none
+};
+
+// Tribes span at most this many bytes of bytecode.
+#define JIT_MAX_SPAN (1 << 20)
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1 };
+
+// Condition codes of jcc and setcc.
+enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+       CC_P = 0xA, CC_NP = 0xB, CC_L = 0xC };
+
+// What the templates keep in callee-saved registers while a tribe runs.
+#define VMREG RBX  // the VM
+#define SLOTS R12  // frame->slots
+#define SP R13     // the stack top; vm->stackTop is stale until stored back
+#define FRAME R14  // byte offset of the frame in vm->frames
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#define TOP (-VALUE_SIZE)
+#define SECOND (-2 * VALUE_SIZE)
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define TYPE ((int32_t)offsetof(Value, type))
+#define PAYLOAD ((int32_t)offsetof(Value, as))
+#endif
+
+#define VM_FIELD(field) ((int32_t)offsetof(VM, field))
+
+typedef struct {
+  size_t at;         // where the 32-bit displacement goes
+  int label;
+} Fixup;
+
+// An out-of-line slow path: a call to jitOperation() for the instruction at
+// `ip`, then a jump back to `resume`. With a `branch`, the operation pushes a
+// condition and the stub jumps to `branch` when it is falsey.
+typedef struct {
+  int entry;
+  int resume;
+  int branch;
+  const uint8_t* ip;
+} Stub;
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+  int* labels;       // machine code offset per label, -1 until bound
+  int labelCount;
+  int labelCapacity;
+  Fixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+  Stub* stubs;
+  int stubCount;
+  int stubCapacity;
+  int errorExit;     // returns JIT_ERROR
+  int okExit;        // returns JIT_RETURNED
+  int tailExit;      // returns JIT_TAIL_CALL
+} Assembler;
+
+#define GROW(array, count, capacity)                                     \
+  do {                                                                   \
+    if ((count) == (capacity)) {                                         \
+      (capacity) = (capacity) < 16 ? 16 : (capacity) * 2;                \
+      (array) = realloc((array), sizeof(*(array)) * (size_t)(capacity)); \
+      if ((array) == NULL) exit(1);                                      \
+    }                                                                    \
+  } while (false)
+
+static void emit(Assembler* a, uint8_t byte) {
+  if (a->count == a->capacity) {
+    a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+    a->bytes = realloc(a->bytes, a->capacity);
+    if (a->bytes == NULL) exit(1);
+  }
+  a->bytes[a->count++] = byte;
+}
+
+static void emit32(Assembler* a, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(a, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* a, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(a, (uint8_t)(value >> (8 * i)));
+}
+
+static int newLabel(Assembler* a) {
+  GROW(a->labels, a->labelCount, a->labelCapacity);
+  a->labels[a->labelCount] = -1;
+  return a->labelCount++;
+}
+
+static void bind(Assembler* a, int label) { a->labels[label] = (int)a->count; }
+
+static void fixup(Assembler* a, int label) {
+  GROW(a->fixups, a->fixupCount, a->fixupCapacity);
+  a->fixups[a->fixupCount++] = (Fixup){a->count, label};
+  emit32(a, 0);
+}
+
+// --- x86-64 encoding ---------------------------------------------------------
+// Memory operands are always [base + disp32].
+
+static void rex(Assembler* a, bool wide, int reg, int rm) {
+  uint8_t prefix = (uint8_t)(0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) |
+                             ((rm & 8) ? 0x01 : 0));
+  if (prefix != 0x40) emit(a, prefix);
+}
+
+static void memOperand(Assembler* a, int reg, int base, int32_t disp) {
+  emit(a, (uint8_t)(0x80 | (reg & 7) << 3 | (base & 7)));
+  if ((base & 7) == RSP) emit(a, 0x24);  // rsp and r12 need a SIB byte
+  emit32(a, (uint32_t)disp);
+}
+
+static void regOperand(Assembler* a, int reg, int rm) {
+  emit(a, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+// mov reg, [base + disp]
+static void load(Assembler* a, int reg, int base, int32_t disp) {
+  rex(a, true, reg, base);
+  emit(a, 0x8B);
+  memOperand(a, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void store(Assembler* a, int base, int32_t disp, int reg) {
+  rex(a, true, reg, base);
+  emit(a, 0x89);
+  memOperand(a, reg, base, disp);
+}
+
+// lea reg, [base + disp]
+static void lea(Assembler* a, int reg, int base, int32_t disp) {
+  rex(a, true, reg, base);
+  emit(a, 0x8D);
+  memOperand(a, reg, base, disp);
+}
+
+// mov reg, imm64
+static void loadImm(Assembler* a, int reg, uint64_t value) {
+  rex(a, true, 0, reg);
+  emit(a, (uint8_t)(0xB8 + (reg & 7)));
+  emit64(a, value);
+}
+
+// add reg, imm32 (/0) or cmp reg, imm32 (/7)
+static void aluImm(Assembler* a, int extension, int reg, int32_t value) {
+  rex(a, true, 0, reg);
+  emit(a, 0x81);
+  regOperand(a, extension, reg);
+  emit32(a, (uint32_t)value);
+}
+
+static void addImm(Assembler* a, int reg, int32_t value) { aluImm(a, 0, reg, value); }
+
+// A two-register instruction `op dst, src`: 0x01 add, 0x21 and, 0x29 sub,
+// 0x39 cmp, 0x89 mov.
+static void aluReg(Assembler* a, uint8_t opcode, int dst, int src) {
+  rex(a, true, src, dst);
+  emit(a, opcode);
+  regOperand(a, src, dst);
+}
+
+// cmp dword or byte [base + disp], imm8
+static void cmpMem(Assembler* a, bool byteSized, int base, int32_t disp, uint8_t value) {
+  rex(a, false, 0, base);
+  emit(a, byteSized ? 0x80 : 0x83);
+  memOperand(a, 7, base, disp);
+  emit(a, value);
+}
+
+#ifndef NAN_BOXING
+// mov dword [base + disp], imm32
+static void storeImm32(Assembler* a, int base, int32_t disp, uint32_t value) {
+  rex(a, false, 0, base);
+  emit(a, 0xC7);
+  memOperand(a, 0, base, disp);
+  emit32(a, value);
+}
+#endif
+
+// mov byte [base + disp], imm8
+static void storeByte(Assembler* a, int base, int32_t disp, uint8_t value) {
+  rex(a, false, 0, base);
+  emit(a, 0xC6);
+  memOperand(a, 0, base, disp);
+  emit(a, value);
+}
+
+// An SSE instruction with a memory operand: `prefix 0F opcode`.
+static void sse(Assembler* a, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp) {
+  if (prefix != 0) emit(a, prefix);
+  rex(a, false, xmm, base);
+  emit(a, 0x0F);
+  emit(a, opcode);
+  memOperand(a, xmm, base, disp);
+}
+
+#define MOVSD_LOAD 0xF2, 0x10
+#define MOVSD_STORE 0xF2, 0x11
+#define UCOMISD 0x66, 0x2E
+#define ADDSD 0xF2, 0x58
+#define SUBSD 0xF2, 0x5C
+
+// The same between two xmm registers.
+static void sseReg(Assembler* a, uint8_t prefix, uint8_t opcode, int dst, int src) {
+  emit(a, prefix);
+  emit(a, 0x0F);
+  emit(a, opcode);
+  regOperand(a, dst, src);
+}
+
+// movq xmm1, 1.0
+static void loadOne(Assembler* a) {
+  loadImm(a, RCX, 0x3FF0000000000000);
+  emit(a, 0x66);
+  rex(a, true, XMM1, RCX);
+  emit(a, 0x0F);
+  emit(a, 0x6E);
+  regOperand(a, XMM1, RCX);
+}
+
+// setcc reg8 (al or cl)
+static void setcc(Assembler* a, int cc, int reg) {
+  emit(a, 0x0F);
+  emit(a, (uint8_t)(0x90 | cc));
+  emit(a, (uint8_t)(0xC0 | reg));
+}
+
+static void movzxAl(Assembler* a) {  // movzx eax, al
+  emit(a, 0x0F);
+  emit(a, 0xB6);
+  emit(a, 0xC0);
+}
+
+static void jump(Assembler* a, int label) {
+  emit(a, 0xE9);
+  fixup(a, label);
+}
+
+static void jumpIf(Assembler* a, int cc, int label) {
+  emit(a, 0x0F);
+  emit(a, (uint8_t)(0x80 | cc));
+  fixup(a, label);
+}
+
+static void push(Assembler* a, int reg) {
+  rex(a, false, 0, reg);
+  emit(a, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void pop(Assembler* a, int reg) {
+  rex(a, false, 0, reg);
+  emit(a, (uint8_t)(0x58 + (reg & 7)));
+}
+
+// --- value templates ---------------------------------------------------------
+
+// Copies through rcx and rdx, so either side may be addressed from rax.
+static void copyValue(Assembler* a, int dst, int32_t dstDisp, int src, int32_t srcDisp) {
+#ifdef NAN_BOXING
+  load(a, RCX, src, srcDisp);
+  store(a, dst, dstDisp, RCX);
+#else
+  // Two 8-byte moves: a 16-byte store would not forward to the 8-byte
+  // payload loads that usually follow it.
+  load(a, RCX, src, srcDisp);
+  load(a, RDX, src, srcDisp + 8);
+  store(a, dst, dstDisp, RCX);
+  store(a, dst, dstDisp + 8, RDX);
+#endif
+}
+
+static void storeConstant(Assembler* a, int base, int32_t disp, Value value) {
+#ifdef NAN_BOXING
+  loadImm(a, RAX, value);
+  store(a, base, disp, RAX);
+#else
+  uint64_t payload = 0;
+  if (IS_NUMBER(value)) {
+    memcpy(&payload, &value.as.number, sizeof(double));
+  } else if (IS_BOOL(value)) {
+    payload = AS_BOOL(value);
+  }
+  storeImm32(a, base, disp + TYPE, (uint32_t)value.type);
+  loadImm(a, RAX, payload);
+  store(a, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+static void jumpUnlessNumber(Assembler* a, int base, int32_t disp, int label) {
+#ifdef NAN_BOXING
+  load(a, RAX, base, disp);
+  loadImm(a, RCX, QNAN);
+  aluReg(a, 0x21, RAX, RCX);
+  aluReg(a, 0x39, RAX, RCX);
+  jumpIf(a, CC_E, label);
+#else
+  cmpMem(a, false, base, disp + TYPE, VAL_NUMBER);
+  jumpIf(a, CC_NE, label);
+#endif
+}
+
+// Stores the boolean in al as a value.
+static void storeBool(Assembler* a, int base, int32_t disp) {
+  movzxAl(a);
+#ifdef NAN_BOXING
+  loadImm(a, RCX, FALSE_VAL);
+  aluReg(a, 0x01, RAX, RCX);
+  store(a, base, disp, RAX);
+#else
+  storeImm32(a, base, disp + TYPE, VAL_BOOL);
+  store(a, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+// Jumps to `label` when the value is falsey (nil or false), or, with
+// `whenFalsey` unset, when it is truthy.
+static void branchFalsey(Assembler* a, int base, int32_t disp, int label, bool whenFalsey) {
+  int skip = newLabel(a);
+#ifdef NAN_BOXING
+  load(a, RAX, base, disp);
+  loadImm(a, RCX, NIL_VAL);
+  aluReg(a, 0x39, RAX, RCX);
+  jumpIf(a, CC_E, whenFalsey ? label : skip);
+  loadImm(a, RCX, FALSE_VAL);
+  aluReg(a, 0x39, RAX, RCX);
+  jumpIf(a, whenFalsey ? CC_E : CC_NE, label);
+#else
+  cmpMem(a, false, base, disp + TYPE, VAL_NIL);
+  jumpIf(a, CC_E, whenFalsey ? label : skip);
+  cmpMem(a, false, base, disp + TYPE, VAL_BOOL);
+  jumpIf(a, CC_NE, whenFalsey ? skip : label);
+  cmpMem(a, true, base, disp + PAYLOAD, 0);
+  jumpIf(a, whenFalsey ? CC_E : CC_NE, label);
+#endif
+  bind(a, skip);
+}
+
+// Reloads the registers that calls into C can invalidate: the stack may have
+// grown and moved, and vm->frames with it.
+static void reloadFrame(Assembler* a) {
+  load(a, SP, VMREG, VM_FIELD(stackTop));
+  load(a, RAX, VMREG, VM_FIELD(frames));
+  aluReg(a, 0x01, RAX, FRAME);
+  load(a, SLOTS, RAX, (int32_t)offsetof(CallFrame, slots));
+}
+
+// Hands the instruction at `ip` to jitOperation().
+static void callOperation(Assembler* a, const uint8_t* ip) {
+  store(a, VMREG, VM_FIELD(stackTop), SP);
+  aluReg(a, 0x89, RDI, VMREG);
+  loadImm(a, RSI, (uint64_t)(uintptr_t)ip);
+  loadImm(a, RAX, (uint64_t)(uintptr_t)&jitOperation);
+  emit(a, 0xFF);  // call rax
+  emit(a, 0xD0);
+  emit(a, 0x84);  // test al, al
+  emit(a, 0xC0);
+  jumpIf(a, CC_E, a->errorExit);
+  reloadFrame(a);
+}
+
+static int addStub(Assembler* a, const uint8_t* ip, int resume, int branch) {
+  GROW(a->stubs, a->stubCount, a->stubCapacity);
+  int entry = newLabel(a);
+  a->stubs[a->stubCount++] = (Stub){entry, resume, branch, ip};
+  return entry;
+}
+
+// --- translation -------------------------------------------------------------
+
+typedef struct {
+  const uint8_t* code;  // the owner's code
+  uint32_t start;
+  uint32_t span;
+  int* labels;          // label per bytecode offset from start, -1 if none
+  uint32_t* work;
+  int workCount;
+  int workCapacity;
+} Walk;
+
+static bool supported(uint8_t instruction) {
+  switch (instruction) {
+    case OP_SUMMON:
+      return false;
+    default:
+      return instruction < OP_COUNT;
+  }
+}
+
+static uint16_t readOffset(const uint8_t* ip) { return (uint16_t)(ip[1] << 8 | ip[2]); }
+
+static uint16_t readU16(const uint8_t* ip) {
+  uint16_t value;
+  memcpy(&value, ip + 1, sizeof(uint16_t));
+  return value;
+}
+
+static bool reach(Assembler* a, Walk* walk, uint32_t offset) {
+  if (offset < walk->start || offset - walk->start >= JIT_MAX_SPAN) return false;
+  uint32_t index = offset - walk->start;
+  if (index >= walk->span) {
+    uint32_t span = walk->span == 0 ? 256 : walk->span;
+    while (span <= index) span *= 2;
+    walk->labels = realloc(walk->labels, sizeof(int) * span);
+    if (walk->labels == NULL) exit(1);
+    for (uint32_t i = walk->span; i < span; i++) walk->labels[i] = -1;
+    walk->span = span;
+  }
+  if (walk->labels[index] != -1) return true;
+  walk->labels[index] = newLabel(a);
+  GROW(walk->work, walk->workCount, walk->workCapacity);
+  walk->work[walk->workCount++] = offset;
+  return true;
+}
+
+// The bytecode offset a jump at `offset` lands on.
+static uint32_t jumpTarget(const uint8_t* code, uint32_t offset) {
+  const uint8_t* ip = code + offset;
+  uint32_t end = offset + (uint32_t)instructionLength(code, (int)offset);
+  switch (*ip) {
+    case OP_LOOP:
+    case OP_SWING_COUNT:
+    case OP_SWING_STEP:
+      return end - readOffset(ip);
+    default:
+      return end + readOffset(ip);
+  }
+}
+
+// Finds every instruction reachable from the tribe's entry. Returns false if
+// one of them has no template.
+static bool walkTribe(Assembler* a, Walk* walk) {
+  if (!reach(a, walk, walk->start)) return false;
+  while (walk->workCount > 0) {
+    uint32_t offset = walk->work[--walk->workCount];
+    uint8_t instruction = walk->code[offset];
+    if (!supported(instruction)) return false;
+    uint32_t next = offset + (uint32_t)instructionLength(walk->code, (int)offset);
+    switch (instruction) {
+      case OP_RETURN:
+      case OP_TAIL_CALL:
+        break;
+      case OP_JUMP:
+      case OP_LOOP:
+        if (!reach(a, walk, jumpTarget(walk->code, offset))) return false;
+        break;
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_EQUAL:
+      case OP_SWING_COUNT:
+      case OP_SWING_RANGE:
+      case OP_SWING_STEP:
+        if (!reach(a, walk, jumpTarget(walk->code, offset))) return false;
+        if (!reach(a, walk, next)) return false;
+        break;
+      default:
+        if (!reach(a, walk, next)) return false;
+        break;
+    }
+  }
+  return true;
+}
+
+static int labelAt(Walk* walk, uint32_t offset) { return walk->labels[offset - walk->start]; }
+
+// Checks that both operands are numbers, or takes the slow path.
+static void numberOperands(Assembler* a, const uint8_t* ip, int next, int branch) {
+  int slow = addStub(a, ip, next, branch);
+  jumpUnlessNumber(a, SP, TOP, slow);
+  jumpUnlessNumber(a, SP, SECOND, slow);
+}
+
+static void translate(Assembler* a, Walk* walk, uint32_t offset, int next) {
+  const uint8_t* ip = walk->code + offset;
+  switch (*ip) {
+    case OP_PUSH: {
+      double number;
+      memcpy(&number, ip + 2, sizeof(double));
+      storeConstant(a, SP, 0, NUMBER_VAL(number));
+      addImm(a, SP, VALUE_SIZE);
+      break;
+    }
+    case OP_CONSTANT:
+    case OP_FUNCTION:
+      load(a, RAX, VMREG, VM_FIELD(constants));
+      copyValue(a, SP, 0, RAX, readU16(ip) * VALUE_SIZE);
+      addImm(a, SP, VALUE_SIZE);
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      storeConstant(a, SP, 0, *ip == OP_NIL ? NIL_VAL : BOOL_VAL(*ip == OP_TRUE));
+      addImm(a, SP, VALUE_SIZE);
+      break;
+    case OP_POP:
+      addImm(a, SP, -VALUE_SIZE);
+      break;
+    case OP_GET_LOCAL:
+      copyValue(a, SP, 0, SLOTS, ip[1] * VALUE_SIZE);
+      addImm(a, SP, VALUE_SIZE);
+      break;
+    case OP_SET_LOCAL:
+      copyValue(a, SLOTS, ip[1] * VALUE_SIZE, SP, TOP);
+      break;
+    case OP_SET_LOCAL_POP:
+      addImm(a, SP, -VALUE_SIZE);
+      copyValue(a, SLOTS, ip[1] * VALUE_SIZE, SP, 0);
+      break;
+    case OP_GET_LOCAL_PAIR:
+      copyValue(a, SP, 0, SLOTS, ip[1] * VALUE_SIZE);
+      copyValue(a, SP, VALUE_SIZE, SLOTS, ip[2] * VALUE_SIZE);
+      addImm(a, SP, 2 * VALUE_SIZE);
+      break;
+    case OP_GET_GLOBAL_SLOT: {
+      int32_t global = readU16(ip) * (int32_t)sizeof(Global);
+      load(a, RAX, VMREG, VM_FIELD(globals));
+      cmpMem(a, true, RAX, global + (int32_t)offsetof(Global, defined), 0);
+      jumpIf(a, CC_E, addStub(a, ip, next, -1));
+      copyValue(a, SP, 0, RAX, global + (int32_t)offsetof(Global, value));
+      addImm(a, SP, VALUE_SIZE);
+      break;
+    }
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_POP: {
+      int32_t global = readU16(ip) * (int32_t)sizeof(Global);
+      if (*ip == OP_SET_GLOBAL_SLOT_POP) addImm(a, SP, -VALUE_SIZE);
+      load(a, RAX, VMREG, VM_FIELD(globals));
+      copyValue(a, RAX, global + (int32_t)offsetof(Global, value), SP,
+                *ip == OP_SET_GLOBAL_SLOT_POP ? 0 : TOP);
+      storeByte(a, RAX, global + (int32_t)offsetof(Global, defined), 1);
+      break;
+    }
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUB:
+    case OP_SUB_NUM:
+    case OP_MUL:
+    case OP_MUL_NUM:
+    case OP_DIV:
+    case OP_DIV_NUM: {
+      uint8_t operation;
+      switch (*ip) {
+        case OP_SUB: case OP_SUB_NUM: operation = 0x5C; break;
+        case OP_MUL: case OP_MUL_NUM: operation = 0x59; break;
+        case OP_DIV: case OP_DIV_NUM: operation = 0x5E; break;
+        default:                      operation = 0x58; break;
+      }
+      numberOperands(a, ip, next, -1);
+      sse(a, MOVSD_LOAD, XMM0, SP, SECOND + PAYLOAD);
+      sse(a, 0xF2, operation, XMM0, SP, TOP + PAYLOAD);
+      sse(a, MOVSD_STORE, XMM0, SP, SECOND + PAYLOAD);
+      addImm(a, SP, -VALUE_SIZE);
+      break;
+    }
+    // ucomisd sets "above" only for an ordered greater-than, so each
+    // comparison puts its greater side first and NaN compares false, as
+    // in C. `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`.
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL:
+      numberOperands(a, ip, next, -1);
+      sse(a, MOVSD_LOAD, XMM0, SP, TOP + PAYLOAD);
+      sse(a, UCOMISD, XMM0, SP, SECOND + PAYLOAD);
+      setcc(a, *ip == OP_GREATER_EQUAL ? CC_BE : CC_A, RAX);
+      storeBool(a, SP, SECOND);
+      addImm(a, SP, -VALUE_SIZE);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_LESS_EQUAL:
+      numberOperands(a, ip, next, -1);
+      sse(a, MOVSD_LOAD, XMM0, SP, SECOND + PAYLOAD);
+      sse(a, UCOMISD, XMM0, SP, TOP + PAYLOAD);
+      setcc(a, *ip == OP_LESS_EQUAL ? CC_BE : CC_A, RAX);
+      storeBool(a, SP, SECOND);
+      addImm(a, SP, -VALUE_SIZE);
+      break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL:
+      numberOperands(a, ip, next, -1);
+      sse(a, MOVSD_LOAD, XMM0, SP, SECOND + PAYLOAD);
+      sse(a, UCOMISD, XMM0, SP, TOP + PAYLOAD);
+      setcc(a, CC_E, RAX);
+      setcc(a, CC_NP, RCX);
+      emit(a, 0x20);  // and al, cl
+      emit(a, 0xC8);
+      if (*ip == OP_NOT_EQUAL) {
+        emit(a, 0x34);  // xor al, 1
+        emit(a, 0x01);
+      }
+      storeBool(a, SP, SECOND);
+      addImm(a, SP, -VALUE_SIZE);
+      break;
+    case OP_NOT: {
+      int falsey = newLabel(a);
+      int done = newLabel(a);
+      branchFalsey(a, SP, TOP, falsey, true);
+      emit(a, 0x31);  // xor eax, eax
+      emit(a, 0xC0);
+      jump(a, done);
+      bind(a, falsey);
+      emit(a, 0xB8);  // mov eax, 1
+      emit32(a, 1);
+      bind(a, done);
+      storeBool(a, SP, TOP);
+      break;
+    }
+    case OP_JUMP_IF_FALSE:
+      branchFalsey(a, SP, TOP, labelAt(walk, jumpTarget(walk->code, offset)), true);
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      addImm(a, SP, -VALUE_SIZE);
+      branchFalsey(a, SP, 0, labelAt(walk, jumpTarget(walk->code, offset)), true);
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      int target = labelAt(walk, jumpTarget(walk->code, offset));
+      numberOperands(a, ip, next, target);
+      addImm(a, SP, -2 * VALUE_SIZE);
+      if (*ip == OP_JUMP_IF_NOT_LESS) {
+        sse(a, MOVSD_LOAD, XMM0, SP, VALUE_SIZE + PAYLOAD);
+        sse(a, UCOMISD, XMM0, SP, PAYLOAD);
+        jumpIf(a, CC_BE, target);
+      } else if (*ip == OP_JUMP_IF_NOT_GREATER) {
+        sse(a, MOVSD_LOAD, XMM0, SP, PAYLOAD);
+        sse(a, UCOMISD, XMM0, SP, VALUE_SIZE + PAYLOAD);
+        jumpIf(a, CC_BE, target);
+      } else {
+        sse(a, MOVSD_LOAD, XMM0, SP, PAYLOAD);
+        sse(a, UCOMISD, XMM0, SP, VALUE_SIZE + PAYLOAD);
+        jumpIf(a, CC_NE, target);
+        jumpIf(a, CC_P, target);
+      }
+      break;
+    }
+    case OP_JUMP:
+      jump(a, labelAt(walk, jumpTarget(walk->code, offset)));
+      break;
+    case OP_LOOP:
+      jump(a, labelAt(walk, jumpTarget(walk->code, offset)));
+      break;
+    // Swing state is in the frame's slots: the count, or the loop variable
+    // and then its limit.
+    case OP_SWING_COUNT: {
+      int32_t counter = ip[3] * VALUE_SIZE;
+      jumpUnlessNumber(a, SLOTS, counter, next);
+      sse(a, MOVSD_LOAD, XMM0, SLOTS, counter + PAYLOAD);
+      loadOne(a);
+      sseReg(a, UCOMISD, XMM0, XMM1);
+      jumpIf(a, CC_BE, next);
+      sseReg(a, SUBSD, XMM0, XMM1);
+      sse(a, MOVSD_STORE, XMM0, SLOTS, counter + PAYLOAD);
+      jump(a, labelAt(walk, jumpTarget(walk->code, offset)));
+      break;
+    }
+    case OP_SWING_RANGE: {
+      int32_t variable = ip[3] * VALUE_SIZE;
+      int slow = addStub(a, ip, next, -1);
+      jumpUnlessNumber(a, SLOTS, variable, slow);
+      jumpUnlessNumber(a, SLOTS, variable + VALUE_SIZE, slow);
+      sse(a, MOVSD_LOAD, XMM0, SLOTS, variable + VALUE_SIZE + PAYLOAD);
+      sse(a, UCOMISD, XMM0, SLOTS, variable + PAYLOAD);
+      jumpIf(a, CC_B, labelAt(walk, jumpTarget(walk->code, offset)));
+      break;
+    }
+    case OP_SWING_STEP: {
+      int32_t variable = ip[3] * VALUE_SIZE;
+      jumpUnlessNumber(a, SLOTS, variable, addStub(a, ip, next, -1));
+      sse(a, MOVSD_LOAD, XMM0, SLOTS, variable + PAYLOAD);
+      loadOne(a);
+      sseReg(a, ADDSD, XMM0, XMM1);
+      sse(a, MOVSD_STORE, XMM0, SLOTS, variable + PAYLOAD);
+      sse(a, MOVSD_LOAD, XMM1, SLOTS, variable + VALUE_SIZE + PAYLOAD);
+      sseReg(a, UCOMISD, XMM1, XMM0);
+      jumpIf(a, CC_B, next);
+      jump(a, labelAt(walk, jumpTarget(walk->code, offset)));
+      break;
+    }
+    case OP_RETURN:
+      addImm(a, SP, -VALUE_SIZE);
+      copyValue(a, SLOTS, 0, SP, 0);
+      lea(a, SP, SLOTS, VALUE_SIZE);
+      store(a, VMREG, VM_FIELD(stackTop), SP);
+      rex(a, false, 0, VMREG);  // dec dword [vm->frameCount]
+      emit(a, 0xFF);
+      memOperand(a, 1, VMREG, VM_FIELD(frameCount));
+      jump(a, a->okExit);
+      break;
+    case OP_TAIL_CALL:
+      callOperation(a, ip);
+      jump(a, a->tailExit);
+      break;
+    default:
+      // Calls, printing, input, collections and strings.
+      callOperation(a, ip);
+      break;
+  }
+}
+
+// The entry stub and the three exits.
+static void prologue(Assembler* a) {
+  push(a, RBX);
+  push(a, R12);
+  push(a, R13);
+  push(a, R14);
+  push(a, R15);  // keeps rsp 16-byte aligned for calls
+  aluReg(a, 0x89, VMREG, RDI);
+  rex(a, true, RAX, VMREG);  // movsxd rax, dword [vm->frameCount]
+  emit(a, 0x63);
+  memOperand(a, RAX, VMREG, VM_FIELD(frameCount));
+  addImm(a, RAX, -1);
+  rex(a, true, FRAME, RAX);  // imul r14, rax, sizeof(CallFrame)
+  emit(a, 0x69);
+  regOperand(a, FRAME, RAX);
+  emit32(a, (uint32_t)sizeof(CallFrame));
+  reloadFrame(a);
+  emit(a, 0xFF);  // jmp rsi
+  emit(a, 0xE6);
+
+  int done = newLabel(a);
+  bind(a, a->okExit);
+  emit(a, 0xB8);
+  emit32(a, JIT_RETURNED);
+  jump(a, done);
+  bind(a, a->errorExit);
+  emit(a, 0xB8);
+  emit32(a, JIT_ERROR);
+  jump(a, done);
+  bind(a, a->tailExit);
+  emit(a, 0xB8);
+  emit32(a, JIT_TAIL_CALL);
+  bind(a, done);
+  pop(a, R15);
+  pop(a, R14);
+  pop(a, R13);
+  pop(a, R12);
+  pop(a, RBX);
+  emit(a, 0xC3);  // ret
+}
+
+static void freeAssembler(Assembler* a, Walk* walk) {
+  free(a->bytes);
+  free(a->labels);
+  free(a->fixups);
+  free(a->stubs);
+  free(walk->labels);
+  free(walk->work);
+}
+
+bool jitCompile(VM* vm, ObjFunction* function) {
+  if (!vm->jitEnabled || function->isModule || function->registers > 0 ||
+      function->jit != NULL) {
+    return false;
+  }
+  // Compiled code doesn't keep the frame's ip, which the handler table is
+  // searched with.
+  if (function->handlerCount > 0) {
+    vm->jitRejected++;
+    return false;
+  }
+  ObjFunction* owner = function->owner ? function->owner : function;
+  Assembler a = {0};
+  Walk walk = {0};
+  walk.code = owner->code;
+  walk.start = function->code_offset;
+  a.errorExit = newLabel(&a);
+  a.okExit = newLabel(&a);
+  a.tailExit = newLabel(&a);
+
+  if (!walkTribe(&a, &walk)) {
+    freeAssembler(&a, &walk);
+    vm->jitRejected++;
+    return false;
+  }
+
+  prologue(&a);
+  for (uint32_t i = 0; i < walk.span; i++) {
+    if (walk.labels[i] == -1) continue;
+    uint32_t offset = walk.start + i;
+    // The next instruction in reach, where a non-jump falls through to.
+    uint32_t length = (uint32_t)instructionLength(walk.code, (int)offset);
+    int next = i + length < walk.span ? walk.labels[i + length] : -1;
+    bind(&a, walk.labels[i]);
+    translate(&a, &walk, offset, next);
+  }
+  for (int i = 0; i < a.stubCount; i++) {
+    Stub* stub = &a.stubs[i];
+    bind(&a, stub->entry);
+    callOperation(&a, stub->ip);
+    if (stub->branch != -1) {
+      addImm(&a, SP, -VALUE_SIZE);
+      branchFalsey(&a, SP, 0, stub->branch, true);
+    }
+    jump(&a, stub->resume);
+  }
+  for (int i = 0; i < a.fixupCount; i++) {
+    Fixup* f = &a.fixups[i];
+    int32_t displacement = a.labels[f->label] - (int32_t)(f->at + 4);
+    memcpy(&a.bytes[f->at], &displacement, sizeof(int32_t));
+  }
+
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (a.count + page - 1) / page * page;
+  uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    freeAssembler(&a, &walk);
+    vm->jitRejected++;
+    return false;
+  }
+  memcpy(code, a.bytes, a.count);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    freeAssembler(&a, &walk);
+    vm->jitRejected++;
+    return false;
+  }
+
+  JitCode* jit = malloc(sizeof(JitCode));
+  if (jit == NULL) exit(1);
+  jit->code = code;
+  jit->size = size;
+  jit->start = walk.start;
+  jit->span = walk.span;
+  jit->native = malloc(sizeof(int32_t) * (walk.span > 0 ? walk.span : 1));
+  if (jit->native == NULL) exit(1);
+  for (uint32_t i = 0; i < walk.span; i++) {
+    jit->native[i] = walk.labels[i] == -1 ? -1 : a.labels[walk.labels[i]];
+  }
+  function->jit = jit;
+  vm->jitCompiled++;
+  vm->jitCodeBytes += a.count;
+  freeAssembler(&a, &walk);
+  return true;
+}
+
+void* jitEntry(ObjFunction* function, const uint8_t* ip) {
+  JitCode* jit = function->jit;
+  ObjFunction* owner = function->owner ? function->owner : function;
+  const uint8_t* start = owner->code + jit->start;
+  if (ip < start || ip >= start + jit->span) return NULL;
+  int32_t native = jit->native[ip - start];
+  return native == -1 ? NULL : jit->code + native;
+}
+
+JitStatus jitExecute(VM* vm, void* entry) {
+  JitCode* jit = vm->frames[vm->frameCount - 1].function->jit;
+  JitStatus (*native)(VM*, void*) = (JitStatus (*)(VM*, void*))(void*)jit->code;
+  return native(vm, entry);
+}
+
+void jitFree(ObjFunction* function) {
+  JitCode* jit = function->jit;
+  munmap(jit->code, jit->size);
+  free(jit->native);
+  free(jit);
+  function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef APE_JIT_H
+#define APE_JIT_H
+
+#include "vm.h"
+
+// A baseline JIT for stack code. Once a tribe has been called, or has gone
+// round its loops, JIT_THRESHOLD times it is translated into x86-64 machine
+// code, one fixed template per instruction, in memory mapped executable for
+// it. The templates work on the same value stack and call frames as the
+// interpreter: they handle locals, globals, number arithmetic, comparisons
+// and jumps themselves and call back into jitOperation() for everything
+// else. Tribes that summon, which has no template, or that have tumble
+// blocks stay interpreted.
+//
+// Compiled code keeps the stack top in a machine register and stores it back
+// into vm->stackTop before it calls into C, so the collector and the
+// interpreter always see the whole stack. Calls made by compiled code run the
+// callee to completion on the C stack, natively or in a nested interpreter
+// loop; a runtime error returns through each of those activations until one
+// running a frame that is inside a tumble block catches it.
+#if defined(__x86_64__) && defined(__linux__) && !defined(APE_NO_JIT)
+#define APE_JIT
+#endif
+
+#define JIT_THRESHOLD 1000 // calls and loop iterations before a tribe is compiled
+#define JIT_MAX_DEPTH 1000 // activations nested on the C stack; deeper calls are interpreted
+
+typedef enum {
+  JIT_RETURNED,  // the frame returned and its result replaced the callee slot
+  JIT_ERROR,     // a runtime error was reported and not caught
+  JIT_TAIL_CALL, // the frame now belongs to the tribe it tail-called
+} JitStatus;
+
+#ifdef APE_JIT
+
+// Compiles `function`, returning false and leaving it to the interpreter when
+// it can't.
+bool jitCompile(VM* vm, ObjFunction* function);
+// The machine code address for bytecode address `ip` of a compiled function,
+// or NULL when no instruction starts there.
+void* jitEntry(ObjFunction* function, const uint8_t* ip);
+// Runs the top call frame natively from `entry`.
+JitStatus jitExecute(VM* vm, void* entry);
+void jitFree(ObjFunction* function);
+
+// Defined in vm.c: runs the instruction at `ip` for compiled code.
+bool jitOperation(VM* vm, const uint8_t* ip);
+
+#endif
+
+#endif
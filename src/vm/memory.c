@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+void initPool(Pool* pool) {
+  for (int i = 0; i < POOL_CLASSES; i++) pool->free[i] = NULL;
+  pool->top = NULL;
+  pool->end = NULL;
+  pool->pages = NULL;
+  pool->pageBytes = 0;
+}
+
+void freePool(Pool* pool) {
+  while (pool->pages != NULL) {
+    PoolPage* page = pool->pages;
+    pool->pages = page->next;
+    free(page);
+  }
+  initPool(pool);
+}
+
+void poolAdopt(Pool* pool, Pool* from) {
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    PoolBlock* first = from->free[i];
+    if (first == NULL) continue;
+    PoolBlock* last = first;
+    while (last->next != NULL) last = last->next;
+    last->next = pool->free[i];
+    pool->free[i] = first;
+    from->free[i] = NULL;
+  }
+}
+
+// Cuts a block for `size`'s class from the newest page.
+static void* carve(Pool* pool, size_t size) {
+  size_t rounded = (size_t)(poolClass(size) + 1) * POOL_GRANULE;
+  if (pool->top == NULL || (size_t)(pool->end - pool->top) < rounded) {
+    // What is left of the old page is too small for this class; it stays
+    // unused.
+    void* memory;
+    if (posix_memalign(&memory, POOL_PAGE_SIZE, POOL_PAGE_SIZE) != 0) exit(1);
+    PoolPage* page = (PoolPage*)memory;
+    memset(page, 0, sizeof(PoolPage));
+    page->next = pool->pages;
+    pool->pages = page;
+    pool->pageBytes += POOL_PAGE_SIZE;
+    pool->top = (char*)(page + 1);
+    pool->end = (char*)page + POOL_PAGE_SIZE;
+  }
+  void* block = pool->top;
+  pool->top += rounded;
+  return block;
+}
+
+void* poolAllocateSlow(Pool* pool, size_t size) {
+  if (size <= POOL_MAX_SIZE) return carve(pool, size);
+  void* block = malloc(size);
+  if (block == NULL) exit(1);
+  return block;
+}
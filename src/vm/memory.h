@@ -0,0 +1,136 @@
+#ifndef APE_MEMORY_H
+#define APE_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// The VM's allocator for old objects and the arrays behind bunches and
+// canopies. Blocks of up to POOL_MAX_SIZE bytes come in size classes
+// POOL_GRANULE bytes apart, cut from POOL_PAGE_SIZE pages; a freed block goes
+// on its class's free list, where the next allocation of that class takes it
+// from. Bigger arrays go to malloc. Blocks are freed with the size they were
+// allocated with, which the collector always knows, so they carry no header.
+// Pages are kept until the pool is freed.
+//
+// Pages are aligned to their size, so the page a block is on is found from
+// its address alone. Each page starts with two bitmaps, one bit per granule:
+// which granules start an object, and which of those objects the major
+// collector has marked. Marking sets bits there instead of writing to each
+// object, and a page's marks fit in a few memory pages, so checking them
+// costs little more than the object reads marking does anyway. Sweeping
+// finds a page's garbage from its bitmaps, a word at a time, without reading
+// what lives. Objects must fit a class, so only arrays go to malloc.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_PAGE_SIZE (1024 * 1024)
+#define POOL_BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct PoolPage {
+  struct PoolPage* next;
+  bool unswept;           // marked before the sweep under way reached it
+  uint64_t objects[POOL_BITMAP_WORDS];
+  uint64_t marks[POOL_BITMAP_WORDS];
+} PoolPage;
+
+typedef struct {
+  PoolBlock* free[POOL_CLASSES];
+  char* top;              // the unused part of the newest page
+  char* end;
+  PoolPage* pages;
+  size_t pageBytes;       // held in pages, in use or not
+} Pool;
+
+void initPool(Pool* pool);
+void freePool(Pool* pool);
+// Moves the blocks on `from`'s free lists to `pool`'s. `from` has no pages:
+// it is where a thread other than the pool's owner frees blocks.
+void poolAdopt(Pool* pool, Pool* from);
+// Allocates when the class's free list is empty or `size` is too big for a
+// class.
+void* poolAllocateSlow(Pool* pool, size_t size);
+
+static inline int poolClass(size_t size) {
+  return (int)((size - 1) / POOL_GRANULE);
+}
+
+static inline PoolPage* poolPageOf(const void* block) {
+  return (PoolPage*)((uintptr_t)block & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+
+// The bitmap bit of the granule `block` starts at.
+static inline size_t poolBit(const void* block) {
+  return ((uintptr_t)block & (POOL_PAGE_SIZE - 1)) / POOL_GRANULE;
+}
+
+static inline uint64_t* poolMarkWord(const void* object) {
+  return &poolPageOf(object)->marks[poolBit(object) / 64];
+}
+
+static inline bool poolIsMarked(const void* object) {
+  return (*poolMarkWord(object) >> (poolBit(object) % 64)) & 1;
+}
+
+static inline void poolSetMark(const void* object) {
+  *poolMarkWord(object) |= (uint64_t)1 << (poolBit(object) % 64);
+}
+
+// Marks `object` where other threads may be marking objects that share its
+// bitmap word. Returns whether this call marked it.
+static inline bool poolMarkShared(const void* object) {
+  uint64_t* word = poolMarkWord(object);
+  uint64_t bit = (uint64_t)1 << (poolBit(object) % 64);
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return false;
+  return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+// `size` must not be 0.
+static inline void* poolAllocate(Pool* pool, size_t size) {
+  if (size <= POOL_MAX_SIZE) {
+    PoolBlock** list = &pool->free[poolClass(size)];
+    PoolBlock* block = *list;
+    if (block != NULL) {
+      *list = block->next;
+      return block;
+    }
+  }
+  return poolAllocateSlow(pool, size);
+}
+
+static inline void poolFree(Pool* pool, void* pointer, size_t size) {
+  if (pointer == NULL) return;
+  if (size > POOL_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+  PoolBlock* block = (PoolBlock*)pointer;
+  PoolBlock** list = &pool->free[poolClass(size)];
+  block->next = *list;
+  *list = block;
+}
+
+// Allocates a block that the bitmaps know as an unmarked object. `size` must
+// fit a class.
+static inline void* poolAllocateObject(Pool* pool, size_t size) {
+  void* object = poolAllocate(pool, size);
+  size_t bit = poolBit(object);
+  poolPageOf(object)->objects[bit / 64] |= (uint64_t)1 << (bit % 64);
+  return object;
+}
+
+static inline void poolFreeObject(Pool* pool, void* object, size_t size) {
+  PoolPage* page = poolPageOf(object);
+  size_t bit = poolBit(object);
+  uint64_t keep = ~((uint64_t)1 << (bit % 64));
+  page->objects[bit / 64] &= keep;
+  page->marks[bit / 64] &= keep;
+  poolFree(pool, object, size);
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "native.h"
+
+// C stack reserved per allowed call frame, and kept free below the floor for
+// the runtime functions compiled code calls.
+#define NATIVE_STACK_PER_FRAME 1024
+#define NATIVE_STACK_MARGIN (256 * 1024)
+
+char* nativeStackFloor = NULL;
+
+static const NativeProgram* program;
+static int firstModule; // vm->constants index of the first module function
+
+bool tailCallNative(VM* vm, int argCount) {
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+  Value callee = vm->stackTop[-1 - argCount];
+  if (!IS_OBJ(callee) || !IS_FUNCTION(callee)) {
+    runtimeError(vm, "Can only call functions and tribes.");
+    return false;
+  }
+  ObjFunction* function = AS_FUNCTION(callee);
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d for function %s.",
+                 function->arity, argCount,
+                 function->name ? function->name->chars : "<script>");
+    return false;
+  }
+  memmove(frame->slots, vm->stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm->stackTop = frame->slots + argCount + 1;
+  frame->function = function;
+  return function->native(vm);
+}
+
+// Modules are compiled in, so a summon finds them by path instead of reading
+// the .apb. Like the loader, each summon runs the module's code again.
+bool summonNative(VM* vm) {
+  Value pathValue = vm->stackTop[-1];
+  if (!IS_STRING(pathValue)) {
+    runtimeError(vm, "summon path must be a string.");
+    return false;
+  }
+  const char* path = AS_CSTRING(pathValue);
+  int length = AS_STRING(pathValue)->length;
+  if (length <= 4 || strcmp(path + length - 4, ".ape") != 0) {
+    runtimeError(vm, "Summon path must end in .ape");
+    return false;
+  }
+  for (int i = 1; i < program->moduleCount; i++) {
+    if (strcmp(program->modules[i].path, path) != 0) continue;
+    ObjFunction* module = AS_FUNCTION(vm->constants[firstModule + i]);
+    vm->stackTop[-1] = OBJ_VAL(module);
+    return pushFrame(vm, module, 0) && module->native(vm);
+  }
+  runtimeError(vm, "Cannot open or read module file '%.*s.apb'. Compile it first.",
+               length - 4, path);
+  return false;
+}
+
+// Binds the program's names and builds its functions, in the order the
+// loader would for the script and then each module it summons.
+static void loadProgram(VM* vm) {
+  for (int i = 0; i < program->globalCount; i++) {
+    const char* name = program->globals[i];
+    if (resolveGlobal(vm, name, (int)strlen(name)) != i) {
+      fprintf(stderr, "Too many global variables.\n");
+      exit(70);
+    }
+  }
+  for (int i = 0; i < program->moduleCount; i++) {
+    const NativeModule* module = &program->modules[i];
+    for (int j = 0; j < module->constantCount; j++) {
+      const NativeString* constant = &module->constants[j];
+      addConstant(vm, OBJ_VAL(copyString(vm, constant->chars, constant->length)));
+    }
+    for (int j = 0; j < module->tribeCount; j++) {
+      const NativeTribe* proto = &module->tribes[j];
+      ObjFunction* tribe = newFunction(vm, proto->arity, NULL);
+      tribe->native = proto->code;
+      addConstant(vm, OBJ_VAL(tribe));
+      tribe->name = copyString(vm, proto->name, (int)strlen(proto->name));
+    }
+  }
+  firstModule = vm->constantCount;
+  for (int i = 0; i < program->moduleCount; i++) {
+    const NativeModule* module = &program->modules[i];
+    ObjFunction* function = newFunction(vm, 0, NULL);
+    function->native = module->body;
+    addConstant(vm, OBJ_VAL(function));
+    const char* name = module->path != NULL ? module->path : "script";
+    function->name = copyString(vm, name, (int)strlen(name));
+  }
+}
+
+static void* runScript(void* argument) {
+  VM* vm = (VM*)argument;
+  char here;
+  nativeStackFloor = &here - (size_t)vm->frameLimit * NATIVE_STACK_PER_FRAME;
+  ObjFunction* script = AS_FUNCTION(vm->constants[firstModule]);
+  *vm->stackTop++ = OBJ_VAL(script);
+  pushFrame(vm, script, 0);
+
+  printf("🌴 🦍  OOH-OOH-AAH-AAH!  WELCOME TO THE BANANA JUNGLE  🦍 🌴\n");
+  printf("ApesLang VM Output\n");
+  return script->native(vm) ? argument : NULL;
+}
+
+int runNativeProgram(const NativeProgram* nativeProgram) {
+  VM vm;
+  initVM(&vm);
+  vm.jitEnabled = false;
+  disableNursery(&vm);
+  program = nativeProgram;
+  loadProgram(&vm);
+
+  pthread_attr_t attributes;
+  pthread_t thread;
+  void* result = NULL;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes,
+                            (size_t)vm.frameLimit * NATIVE_STACK_PER_FRAME +
+                                NATIVE_STACK_MARGIN);
+  if (pthread_create(&thread, &attributes, runScript, &vm) != 0) {
+    fprintf(stderr, "Could not start the program's thread.\n");
+    exit(70);
+  }
+  pthread_join(thread, &result);
+  pthread_attr_destroy(&attributes);
+  freeVM(&vm);
+
+  if (result == NULL) {
+    fprintf(stderr, "\nExecution failed.\n");
+    return 70;
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef APE_NATIVE_H
+#define APE_NATIVE_H
+
+#include "runtime.h"
+
+// Support for programs compiled ahead of time by `apeslang aot`. The C file
+// it writes includes this header, describes the program in a NativeProgram
+// and hands it to runNativeProgram(); it is linked against libaperuntime.a,
+// which holds runtime.c, memory.c and native.c and no interpreter.
+//
+// Every tribe, and the top-level code of every module, is a C function that
+// runs the top call frame to its end. Frames, the value stack, globals and
+// constants are the interpreter's, so objects, the collector and runtime
+// errors behave exactly as they do under `apeslang run`. A function returns
+// true once it has put its result in its callee slot and popped its frame,
+// and false when a runtime error leaves it uncaught; a tumble block is a
+// jump from where something fails inside it to its catch block, decided when
+// the program is translated.
+
+typedef bool (*NativeCode)(VM* vm);
+
+typedef struct {
+  const char* chars;
+  int length;
+} NativeString;
+
+typedef struct {
+  const char* name;
+  int arity;
+  NativeCode code;
+} NativeTribe;
+
+// One .apb file. Its string constants and then its tribes are appended to
+// vm->constants in that order, as the loader would.
+typedef struct {
+  const char* path;  // as summoned, e.g. "lib.ape"; NULL for the script
+  const NativeString* constants;
+  int constantCount;
+  const NativeTribe* tribes;
+  int tribeCount;
+  NativeCode body;
+} NativeModule;
+
+typedef struct {
+  const char* const* globals;  // global i of the program is vm->globals[i]
+  int globalCount;
+  const NativeModule* modules; // the script first, then what it summons
+  int moduleCount;
+} NativeProgram;
+
+// Loads `program` into a fresh VM and runs its script. Returns the process
+// exit status: 0, or 70 after an uncaught runtime error.
+int runNativeProgram(const NativeProgram* program);
+
+// Compiled code runs on a thread whose stack has room for the deepest
+// recursion the frame limit allows; calls below this address are refused as
+// a stack overflow instead of crashing.
+extern char* nativeStackFloor;
+
+// OP_CALL: calls the callee below the top `argCount` values to completion.
+static inline bool callNative(VM* vm, int argCount) {
+  char here;
+  Value callee = vm->stackTop[-1 - argCount];
+  if (!IS_OBJ(callee) || !IS_FUNCTION(callee)) {
+    runtimeError(vm, "Can only call functions and tribes.");
+    return false;
+  }
+  if (&here < nativeStackFloor) {
+    runtimeError(vm, "Stack overflow!");
+    return false;
+  }
+  ObjFunction* function = AS_FUNCTION(callee);
+  return pushFrame(vm, function, argCount) && function->native(vm);
+}
+
+// OP_TAIL_CALL: the callee takes over the top frame, as in the interpreter.
+// Compiled with optimisation this is a jump, so tail recursion runs in
+// constant C stack.
+bool tailCallNative(VM* vm, int argCount);
+// OP_SUMMON: runs the module whose path is on top of the stack and leaves its
+// result in place of the path.
+bool summonNative(VM* vm);
+
+// The number with these bits, for the constants a C literal can't spell.
+static inline double nativeNumber(uint64_t bits) {
+  double number;
+  memcpy(&number, &bits, sizeof(double));
+  return number;
+}
+
+#endif
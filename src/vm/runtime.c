@@ -0,0 +1,1568 @@
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jit.h"
+#include "runtime.h"
+
+#define GC_HEAP_GROW_FACTOR 2
+
+#define GC_SLICE_DEFAULT 4096 // APE_GC_SLICE overrides it
+
+#define GC_THREADS_MAX 64 // for APE_GC_THREADS
+// A slice with at least this much work to do shares it among the gc threads;
+// a smaller one would spend more waking them than they save. Above the
+// default slice, so only big slices are shared unless APE_GC_SHARE_MIN
+// lowers it. It can't go below a batch of marking per thread (see
+// GC_BUDGET_BATCH).
+#define GC_SHARE_MIN_DEFAULT 65536
+
+#define NURSERY_KB_DEFAULT 256 // APE_NURSERY_KB overrides it
+// Objects bigger than this share of the nursery start old: copying them out
+// would cost more than it saves.
+#define NURSERY_LARGE_OBJECT(nurseryBytes) ((nurseryBytes) / 8)
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+#define TABLE_MAX_LOAD 0.75
+
+static void majorSlice(VM* vm);
+static Obj* allocateOldObject(VM* vm, size_t size, ObjType type);
+static bool markShared(VM* vm, long budget);
+
+// Marks a deleted intern table entry so that probe sequences stay intact.
+static ObjString internTombstone;
+#define TOMBSTONE (&internTombstone)
+
+static ObjString** findInterned(ObjString** entries, int capacity,
+                               const char* chars, int length, uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
+  ObjString** tombstone = NULL;
+  for (;;) {
+    ObjString** entry = &entries[index];
+    if (*entry == NULL) {
+      return tombstone != NULL ? tombstone : entry;
+    } else if (*entry == TOMBSTONE) {
+      if (tombstone == NULL) tombstone = entry;
+    } else if ((*entry)->hash == hash && (*entry)->length == length &&
+               memcmp((*entry)->chars, chars, length) == 0) {
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growStringTable(StringTable* table) {
+  int capacity = table->capacity < 64 ? 64 : table->capacity * 2;
+  ObjString** entries = (ObjString**)calloc(capacity, sizeof(ObjString*));
+  if (entries == NULL) exit(1);
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString* string = table->entries[i];
+    if (string == NULL || string == TOMBSTONE) continue;
+    *findInterned(entries, capacity, string->chars, string->length,
+                  string->hash) = string;
+    table->count++;
+  }
+  free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+// Drops the strings the collector is about to free. Young strings are never
+// marked; minor collections drop theirs.
+static void removeUnmarkedStrings(VM* vm) {
+  StringTable* table = &vm->strings;
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString* string = table->entries[i];
+    if (string != NULL && string != TOMBSTONE && !isYoung(vm, (Obj*)string) &&
+        !poolIsMarked(string)) {
+      table->entries[i] = TOMBSTONE;
+    }
+  }
+}
+
+// Allocates a string, bunch or canopy of `size` bytes: in the nursery when
+// it fits, otherwise in the old generation. A nursery that is too full for
+// an object that belongs in it, or more young bytes than it holds, asks for
+// a minor collection at the next safe point; until then new objects that do
+// not fit start old. The header and a string's `chars` are set up; the
+// caller fills in the rest before it allocates again.
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  size_t rounded = NURSERY_ALIGN(size);
+  Obj* object;
+  if (vm->allocateOld == 0 && rounded <= vm->nurserySize - (size_t)(vm->nurseryTop - vm->nursery)) {
+    object = (Obj*)vm->nurseryTop;
+    vm->nurseryTop += rounded;
+    vm->bytesAllocated += size;
+    if (vm->bytesAllocated > vm->peakBytesAllocated) {
+      vm->peakBytesAllocated = vm->bytesAllocated;
+    }
+    vm->objectsAllocated++;
+    vm->youngBytes += size;
+    if (vm->youngBytes > vm->nurserySize) {
+      vm->nurseryFull = true;
+    }
+    if (type == OBJ_STRING) {
+      ((ObjString*)object)->chars = (char*)((ObjString*)object + 1);
+    }
+  } else {
+    if (vm->allocateOld == 0 && size <= NURSERY_LARGE_OBJECT(vm->nurserySize)) {
+      vm->nurseryFull = true;
+    }
+    object = allocateOldObject(vm, size, type);
+  }
+  object->type = type;
+  object->forwarded = false;
+  object->remembered = false;
+  if (vm->gcPhase == GC_MARKING) markObject(vm, object);
+  return object;
+}
+
+// Every string in the VM is created here. Returns the existing string with
+// these contents if there is one, otherwise allocates and interns a copy.
+ObjString* copyString(VM* vm, const char* chars, int length) {
+    uint32_t hash = hashString(chars, length);
+    StringTable* table = &vm->strings;
+    if (table->capacity > 0) {
+        ObjString** entry = findInterned(table->entries, table->capacity,
+                                         chars, length, hash);
+        if (*entry != NULL && *entry != TOMBSTONE) {
+            vm->internHits++;
+            return *entry;
+        }
+    }
+    vm->internMisses++;
+
+    size_t size = sizeof(ObjString) + length + 1;
+    ObjString* stringObj = (ObjString*)allocateObject(vm, size, OBJ_STRING);
+    stringObj->length = length;
+    memcpy(stringObj->chars, chars, length);
+    stringObj->chars[length] = '\0';
+    stringObj->hash = hash;
+
+    // The allocation may have collected, so look the slot up again.
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        growStringTable(table);
+    }
+    ObjString** entry = findInterned(table->entries, table->capacity,
+                                     chars, length, hash);
+    if (*entry == NULL) table->count++;
+    *entry = stringObj;
+    return stringObj;
+}
+
+// Roughly the size of the old generation: what was allocated before the last
+// minor collection and survived it, and what was promoted since. A major
+// collection is due when this outgrows nextGC, so young garbage, which the
+// next minor collection frees, does not start one.
+static inline size_t oldBytes(VM* vm) {
+  return vm->bytesAllocated > vm->youngBytes ? vm->bytesAllocated - vm->youngBytes
+                                             : 0;
+}
+
+// Counts a block going from `oldSize` to `newSize` bytes, and runs a slice of
+// major collection if one is due.
+static void countAllocation(VM* vm, size_t oldSize, size_t newSize) {
+  vm->bytesAllocated += newSize - oldSize;
+  if (vm->bytesAllocated > vm->peakBytesAllocated) {
+      vm->peakBytesAllocated = vm->bytesAllocated;
+  }
+  
+  if (oldSize == 0 && newSize > 0) {
+      vm->objectsAllocated++;
+  }
+
+  if (newSize > oldSize) {
+    if (vm->nursery != NULL) vm->youngBytes += newSize - oldSize;
+    if (vm->gcPhase != GC_IDLE || oldBytes(vm) > vm->nextGC) majorSlice(vm);
+  }
+}
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+  countAllocation(vm, oldSize, newSize);
+  if (newSize == 0) {
+    poolFree(&vm->pool, pointer, oldSize);
+    return NULL;
+  }
+  void* result = poolAllocate(&vm->pool, newSize);
+  if (pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    poolFree(&vm->pool, pointer, oldSize);
+  }
+  return result;
+}
+
+// Whether the sweep under way has yet to reach `object`'s bitmap word.
+static bool aheadOfSweep(VM* vm, Obj* object) {
+  PoolPage* page = poolPageOf(object);
+  return page->unswept &&
+         (page != vm->sweepPage || poolBit(object) / 64 >= (size_t)vm->sweepWord);
+}
+
+// An old object of `size` bytes with its type and, for a string, `chars` set,
+// white unless the major collection under way must keep it: one made where
+// the sweep has yet to reach starts marked. A string too big for a pool class
+// keeps its characters in a block of their own, since every old object needs
+// a mark bit in a page.
+static Obj* newOldObject(VM* vm, size_t size, ObjType type) {
+  Obj* object;
+  if (size > POOL_MAX_SIZE) {
+    ObjString* string =
+        (ObjString*)poolAllocateObject(&vm->pool, sizeof(ObjString));
+    string->chars = (char*)malloc(size - sizeof(ObjString));
+    if (string->chars == NULL) exit(1);
+    object = (Obj*)string;
+  } else {
+    object = (Obj*)poolAllocateObject(&vm->pool, size);
+    if (type == OBJ_STRING) {
+      ((ObjString*)object)->chars = (char*)((ObjString*)object + 1);
+    }
+  }
+  object->type = type;
+  if (vm->gcPhase == GC_SWEEPING && aheadOfSweep(vm, object)) poolSetMark(object);
+  return object;
+}
+
+static Obj* allocateOldObject(VM* vm, size_t size, ObjType type) {
+  countAllocation(vm, 0, size);
+  return newOldObject(vm, size, type);
+}
+
+static void freeOldObject(VM* vm, Obj* object, size_t size) {
+  countAllocation(vm, size, 0);
+  poolFreeObject(&vm->pool, object, size);
+}
+
+char* readTextFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    buffer[bytesRead] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+bool writeTextFile(const char* path, const char* content) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    size_t contentLength = strlen(content);
+    size_t bytesWritten = fwrite(content, sizeof(char), contentLength, file);
+    fclose(file);
+    return bytesWritten == contentLength;
+}
+
+uint32_t hashString(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static uint32_t hashValue(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+  return 0;
+}
+
+static CanopyEntry* findCanopyEntry(CanopyEntry* entries, int capacity,
+                                    Value key) {
+  uint32_t index = hashValue(key) % capacity;
+  for (;;) {
+    CanopyEntry* entry = &entries[index];
+    if (IS_NIL(entry->key) || valuesEqual(entry->key, key)) {
+      return entry;
+    }
+    index = (index + 1) % capacity;
+  }
+}
+
+bool canopySet(ObjCanopy* canopy, Value key, Value value) {
+  CanopyEntry* entry = findCanopyEntry(canopy->entries, canopy->capacity, key);
+  bool isNewKey = IS_NIL(entry->key);
+  if (isNewKey) {
+    if (IS_NIL(entry->value)) canopy->count++;
+    entry->key = key;
+  }
+  entry->value = value;
+  return isNewKey;
+}
+
+bool canopyGet(ObjCanopy* canopy, Value key, Value* value) {
+  if (canopy->count == 0) return false;
+  CanopyEntry* entry = findCanopyEntry(canopy->entries, canopy->capacity, key);
+  if (IS_NIL(entry->key)) return false;
+  *value = entry->value;
+  return true;
+}
+
+// Joins two strings. Both must stay reachable while this runs, since
+// interning the result may trigger a collection.
+ObjString* joinStrings(VM* vm, ObjString* a, ObjString* b) {
+  int length = a->length + b->length;
+  char* chars = (char*)malloc(length + 1);
+  if (chars == NULL) exit(1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  ObjString* result = copyString(vm, chars, length);
+  free(chars);
+  return result;
+}
+
+static void growGlobalIndex(VM* vm) {
+  int capacity = vm->globalIndexCapacity < 16 ? 16 : vm->globalIndexCapacity * 2;
+  int* index = (int*)calloc(capacity, sizeof(int));
+  if (index == NULL) exit(1);
+  for (int i = 0; i < vm->globalCount; i++) {
+    uint32_t bucket =
+        hashString(vm->globals[i].name, vm->globals[i].nameLen) & (capacity - 1);
+    while (index[bucket] != 0) bucket = (bucket + 1) & (capacity - 1);
+    index[bucket] = i + 1;
+  }
+  free(vm->globalIndex);
+  vm->globalIndex = index;
+  vm->globalIndexCapacity = capacity;
+}
+
+// Returns the VM-wide index of the global called `name`, adding an undefined
+// entry the first time a name is seen. -1 when the table is full.
+int resolveGlobal(VM* vm, const char* name, int len) {
+  if (vm->globalIndexCapacity > 0) {
+    uint32_t bucket = hashString(name, len) & (vm->globalIndexCapacity - 1);
+    while (vm->globalIndex[bucket] != 0) {
+      Global* global = &vm->globals[vm->globalIndex[bucket] - 1];
+      if (global->nameLen == len && memcmp(global->name, name, len) == 0) {
+        return vm->globalIndex[bucket] - 1;
+      }
+      bucket = (bucket + 1) & (vm->globalIndexCapacity - 1);
+    }
+  }
+
+  if (vm->globalCount == GLOBALS_MAX) return -1;
+  if (vm->globalCount == vm->globalCapacity) {
+    vm->globalCapacity = vm->globalCapacity < 8 ? 8 : vm->globalCapacity * 2;
+    vm->globals =
+        (Global*)realloc(vm->globals, sizeof(Global) * vm->globalCapacity);
+    if (vm->globals == NULL) exit(1);
+  }
+  int index = vm->globalCount++;
+  Global* global = &vm->globals[index];
+  global->name = (char*)malloc(len + 1);
+  memcpy(global->name, name, len);
+  global->name[len] = '\0';
+  global->nameLen = len;
+  global->value = NIL_VAL;
+  global->defined = false;
+
+  if ((vm->globalCount + 1) * 4 > vm->globalIndexCapacity * 3) {
+    growGlobalIndex(vm);
+  } else {
+    uint32_t bucket = hashString(name, len) & (vm->globalIndexCapacity - 1);
+    while (vm->globalIndex[bucket] != 0) {
+      bucket = (bucket + 1) & (vm->globalIndexCapacity - 1);
+    }
+    vm->globalIndex[bucket] = index + 1;
+  }
+  return index;
+}
+
+// A function with no code of its own; callers fill in code or owner.
+// Functions always start old: call caches and compiled code refer to them by
+// address.
+ObjFunction* newFunction(VM* vm, int arity, ObjString* name) {
+  ObjFunction* function =
+      (ObjFunction*)allocateOldObject(vm, sizeof(ObjFunction), OBJ_FUNCTION);
+  function->arity = arity;
+  function->name = name;
+  function->code = NULL;
+  function->owner = NULL;
+  function->code_offset = 0;
+  function->isModule = false;
+  function->registers = 0;
+  function->stack = 0;
+  function->hotness = 0;
+  function->jit = NULL;
+  function->native = NULL;
+  function->handlers = NULL;
+  function->handlerCount = 0;
+  function->calls = NULL;
+  function->obj.forwarded = false;
+  function->obj.remembered = false;
+  if (vm->gcPhase == GC_MARKING) markObject(vm, (Obj*)function);
+  if (name != NULL) writeBarrier(vm, (Obj*)function, OBJ_VAL(name));
+  return function;
+}
+
+void addConstant(VM* vm, Value value) {
+  if (vm->constantCount == vm->constantCapacity) {
+    vm->constantCapacity = vm->constantCapacity < 8 ? 8 : vm->constantCapacity * 2;
+    vm->constants =
+        (Value*)realloc(vm->constants, sizeof(Value) * vm->constantCapacity);
+    if (vm->constants == NULL) exit(1);
+  }
+  vm->constants[vm->constantCount++] = value;
+}
+
+// Moves the value stack to a bigger block so that at least `needed` slots are
+// free past stackTop, and rebases every pointer into it. Returns false when
+// that would go past the stack ceiling.
+bool growStack(VM* vm, int needed) {
+  size_t used = (size_t)(vm->stackTop - vm->stack);
+  size_t capacity = (size_t)(vm->stackEnd - vm->stack);
+  size_t required = used + (size_t)needed;
+  if (required > (size_t)vm->stackLimit) return false;
+  while (capacity < required) capacity *= 2;
+  if (capacity > (size_t)vm->stackLimit) capacity = (size_t)vm->stackLimit;
+
+  Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) exit(1);
+  memcpy(stack, vm->stack, sizeof(Value) * used);
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackTop = stack + used;
+  vm->stackEnd = stack + capacity;
+  return true;
+}
+
+bool growFrames(VM* vm) {
+  if (vm->frameCapacity >= vm->frameLimit) return false;
+  int capacity = vm->frameCapacity * 2;
+  if (capacity > vm->frameLimit) capacity = vm->frameLimit;
+  CallFrame* frames =
+      (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) exit(1);
+  vm->frames = frames;
+  vm->frameCapacity = capacity;
+  return true;
+}
+
+static void reserveGray(GrayStack* stack, int needed) {
+  if (needed <= stack->capacity) return;
+  while (stack->capacity < needed) {
+    stack->capacity = stack->capacity < 64 ? 64 : stack->capacity * 2;
+  }
+  stack->items = (Obj**)realloc(stack->items, sizeof(Obj*) * stack->capacity);
+  if (stack->items == NULL) exit(1);
+}
+
+static inline void pushGray(GrayStack* stack, Obj* object) {
+  if (stack->count == stack->capacity) reserveGray(stack, stack->count + 1);
+  stack->items[stack->count++] = object;
+}
+
+// Marks `object` and pushes it on `stack` if it is old and white. Threads
+// that mark together must set the bits with atomic operations, which is
+// `shared`.
+static inline void grayObject(VM* vm, GrayStack* stack, Obj* object,
+                              bool shared) {
+  if (object == NULL || isYoung(vm, object)) return;
+  if (shared) {
+    if (!poolMarkShared(object)) return;
+  } else {
+    if (poolIsMarked(object)) return;
+    poolSetMark(object);
+  }
+  // Nothing has read the object yet; start the read that blackening it will
+  // need while marking goes on.
+  __builtin_prefetch(object);
+  pushGray(stack, object);
+}
+
+static inline void grayValue(VM* vm, GrayStack* stack, Value value,
+                             bool shared) {
+  if (IS_OBJ(value)) grayObject(vm, stack, AS_OBJ(value), shared);
+}
+
+void markObject(VM* vm, Obj* object) {
+  grayObject(vm, &vm->gray, object, false);
+}
+
+static inline void markValue(VM* vm, Value value) {
+  grayValue(vm, &vm->gray, value, false);
+}
+
+// Grays what `object` refers to onto `stack` and returns the work that took.
+static inline long blackenInto(VM* vm, GrayStack* stack, Obj* object,
+                               bool shared) {
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      grayObject(vm, stack, (Obj*)function->name, shared);
+      grayObject(vm, stack, (Obj*)function->owner, shared);
+      return 3;
+    }
+    case OBJ_BUNCH: {
+      ObjBunch* bunch = (ObjBunch*)object;
+      for (int i = 0; i < bunch->count; i++) {
+        grayValue(vm, stack, bunch->values[i], shared);
+      }
+      return 1 + bunch->count;
+    }
+    case OBJ_CANOPY: {
+      ObjCanopy* canopy = (ObjCanopy*)object;
+      for (int i = 0; i < canopy->capacity; i++) {
+        grayValue(vm, stack, canopy->entries[i].key, shared);
+        grayValue(vm, stack, canopy->entries[i].value, shared);
+      }
+      return 1 + 2 * (long)canopy->capacity;
+    }
+    case OBJ_STRING:
+      break;
+  }
+  return 1;
+}
+
+static long blackenObject(VM* vm, Obj* object) {
+  return blackenInto(vm, &vm->gray, object, false);
+}
+
+// Blackens gray objects until `budget` is spent. Returns whether none are
+// left.
+static bool markGray(VM* vm, long budget) {
+  if (vm->gcThreads > 1 && budget >= vm->gcShareMin && vm->gray.count > 0) {
+    return markShared(vm, budget);
+  }
+  while (vm->gray.count > 0) {
+    if (budget <= 0) return false;
+    budget -= blackenObject(vm, vm->gray.items[--vm->gray.count]);
+  }
+  return true;
+}
+
+static void markRoots(VM* vm) {
+  // Compiled code stores its stack top back before it calls into C, so the
+  // collector never runs with live values above vm->stackTop.
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) markValue(vm, *slot);
+  for (int i = 0; i < vm->globalCount; i++) markValue(vm, vm->globals[i].value);
+  for (int i = 0; i < vm->constantCount; i++) markValue(vm, vm->constants[i]);
+  for (int i = 0; i < vm->frameCount; i++)
+    markObject(vm, (Obj*)vm->frames[i].function);
+  markValue(vm, vm->lastError);
+}
+
+// Frees `object`, which must not be a function, and what it owns into
+// `pool` and returns the bytes that frees. It touches nothing of the VM's, so
+// the threads that sweep together can each free into a pool of their own.
+static size_t releaseObject(Pool* pool, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      size_t size = sizeof(ObjString) + string->length + 1;
+      if (size > POOL_MAX_SIZE) {
+        free(string->chars);
+        poolFreeObject(pool, object, sizeof(ObjString));
+      } else {
+        poolFreeObject(pool, object, size);
+      }
+      return size;
+    }
+    case OBJ_BUNCH: {
+      ObjBunch* bunch = (ObjBunch*)object;
+      size_t values = sizeof(Value) * bunch->capacity;
+      poolFree(pool, bunch->values, values);
+      poolFreeObject(pool, object, sizeof(ObjBunch));
+      return values + sizeof(ObjBunch);
+    }
+    case OBJ_CANOPY: {
+      ObjCanopy* canopy = (ObjCanopy*)object;
+      size_t entries = sizeof(CanopyEntry) * canopy->capacity;
+      poolFree(pool, canopy->entries, entries);
+      poolFreeObject(pool, object, sizeof(ObjCanopy));
+      return entries + sizeof(ObjCanopy);
+    }
+    case OBJ_FUNCTION:
+      break;
+  }
+  return 0;
+}
+
+static void freeObject(VM* vm, Obj* object) {
+  if (object->type != OBJ_FUNCTION) {
+    countAllocation(vm, releaseObject(&vm->pool, object), 0);
+    return;
+  }
+  ObjFunction* function = (ObjFunction*)object;
+  if (function->isModule) {
+    free(function->code);
+    free(function->handlers);
+    free(function->calls);
+  }
+  // A new function could be allocated at this address, so no cache entry
+  // that names this one may be trusted any more.
+  vm->cacheEpoch++;
+#ifdef APE_JIT
+  if (function->jit != NULL) jitFree(function);
+#endif
+  freeOldObject(vm, object, sizeof(ObjFunction));
+}
+
+// Frees the unmarked objects of one bitmap word of a page and unmarks the
+// others. Returns the work that took: a unit for the word and one per object
+// freed.
+static long sweepWord(VM* vm, PoolPage* page, int word) {
+  uint64_t dead = page->objects[word] & ~page->marks[word];
+  page->marks[word] = 0;
+  long work = 1;
+  for (; dead != 0; dead &= dead - 1) {
+    size_t bit = (size_t)word * 64 + __builtin_ctzll(dead);
+    freeObject(vm, (Obj*)((char*)page + bit * POOL_GRANULE));
+    work++;
+  }
+  return work;
+}
+
+// A marking thread draws its work from the slice's budget this many units at
+// a time.
+#define GC_BUDGET_BATCH 256
+// A marking thread with more gray objects than this hands half of them to
+// threads that have run out.
+#define GC_SHARE_ABOVE 64
+
+typedef enum { GC_TASK_MARK, GC_TASK_SWEEP } GCTask;
+
+typedef struct {
+  GCWorkers* workers;
+  pthread_t thread;
+  bool started;
+  // Marking: the gray objects this thread blackens, and those it has put
+  // where the others may take them, which `lock` guards.
+  GrayStack gray;
+  GrayStack shared;
+  pthread_mutex_t lock;
+  // Sweeping: the pages from `first` up to `last`, and what sweeping them
+  // freed. Functions are left for the VM's thread to free, since that
+  // touches the call caches and the JIT.
+  PoolPage* first;
+  PoolPage* last;
+  Pool freed;
+  size_t freedBytes;
+  long work;
+  GrayStack functions;
+} GCWorker;
+
+// The threads that share a slice. The VM's own thread is the first worker;
+// the others wait for `generation` to change, do `task` and count
+// themselves out of `running`.
+struct GCWorkers {
+  VM* vm;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finish;
+  unsigned long generation;
+  int running;
+  bool quit;
+  GCTask task;
+  // Marking, read and written with atomic operations.
+  long budget;
+  bool stop;
+  int idle;
+  GCWorker workers[];
+};
+
+// Moves half of `from`'s shared gray objects onto `to`'s own. Returns whether
+// there were any.
+static bool stealGray(GCWorker* to, GCWorker* from) {
+  if (__atomic_load_n(&from->shared.count, __ATOMIC_RELAXED) == 0) return false;
+  pthread_mutex_lock(&from->lock);
+  int count = from->shared.count;
+  int take = (count + 1) / 2;
+  for (int i = count - take; i < count; i++) {
+    pushGray(&to->gray, from->shared.items[i]);
+  }
+  __atomic_store_n(&from->shared.count, count - take, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&from->lock);
+  return take > 0;
+}
+
+static bool stealAny(GCWorkers* workers, GCWorker* self) {
+  int first = (int)(self - workers->workers);
+  for (int i = 0; i < workers->count; i++) {
+    if (stealGray(self, &workers->workers[(first + i) % workers->count])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool anyShared(GCWorkers* workers) {
+  for (int i = 0; i < workers->count; i++) {
+    if (__atomic_load_n(&workers->workers[i].shared.count, __ATOMIC_RELAXED) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Puts the top half of this thread's gray objects where the others may take
+// them, if what it put there before has all been taken.
+static void shareGray(GCWorker* self) {
+  if (__atomic_load_n(&self->shared.count, __ATOMIC_RELAXED) > 0) return;
+  pthread_mutex_lock(&self->lock);
+  // Only this thread adds to its shared stack, so it is still empty.
+  int half = self->gray.count / 2;
+  reserveGray(&self->shared, half);
+  self->gray.count -= half;
+  memcpy(self->shared.items, self->gray.items + self->gray.count,
+         sizeof(Obj*) * half);
+  __atomic_store_n(&self->shared.count, half, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&self->lock);
+}
+
+// Blackens this thread's gray objects and any it can take from the others
+// until there are none anywhere or the budget is spent. A thread is idle
+// only while it has none of its own and has found none to take, and only
+// busy threads share, so once all of them are idle marking is done.
+static void markTask(GCWorkers* workers, GCWorker* self) {
+  VM* vm = workers->vm;
+  long drawn = 0;
+  for (;;) {
+    while (self->gray.count > 0) {
+      if (drawn <= 0) {
+        if (__atomic_load_n(&workers->stop, __ATOMIC_RELAXED)) return;
+        // The last draw takes whatever is left, so that a budget that is not
+        // a whole number of batches still gets spent.
+        long left = __atomic_fetch_sub(&workers->budget, GC_BUDGET_BATCH,
+                                       __ATOMIC_RELAXED);
+        if (left <= 0) {
+          __atomic_store_n(&workers->stop, true, __ATOMIC_RELAXED);
+          return;
+        }
+        drawn = left < GC_BUDGET_BATCH ? left : GC_BUDGET_BATCH;
+      }
+      drawn -= blackenInto(vm, &self->gray,
+                           self->gray.items[--self->gray.count], true);
+      if (self->gray.count > GC_SHARE_ABOVE &&
+          __atomic_load_n(&workers->idle, __ATOMIC_RELAXED) > 0) {
+        shareGray(self);
+      }
+    }
+    if (stealAny(workers, self)) continue;
+    __atomic_add_fetch(&workers->idle, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&workers->stop, __ATOMIC_RELAXED)) return;
+      if (__atomic_load_n(&workers->idle, __ATOMIC_ACQUIRE) == workers->count) {
+        return;
+      }
+      if (anyShared(workers)) {
+        __atomic_sub_fetch(&workers->idle, 1, __ATOMIC_ACQ_REL);
+        if (stealAny(workers, self)) break;
+        __atomic_add_fetch(&workers->idle, 1, __ATOMIC_ACQ_REL);
+      }
+      sched_yield();
+    }
+  }
+}
+
+// Sweeps this thread's pages as sweepWord() does, freeing into its own pool.
+static void sweepTask(GCWorker* self) {
+  for (PoolPage* page = self->first; page != self->last; page = page->next) {
+    for (int word = 0; word < POOL_BITMAP_WORDS; word++) {
+      uint64_t dead = page->objects[word] & ~page->marks[word];
+      page->marks[word] = 0;
+      self->work++;
+      for (; dead != 0; dead &= dead - 1) {
+        size_t bit = (size_t)word * 64 + __builtin_ctzll(dead);
+        Obj* object = (Obj*)((char*)page + bit * POOL_GRANULE);
+        if (object->type == OBJ_FUNCTION) {
+          pushGray(&self->functions, object);
+        } else {
+          self->freedBytes += releaseObject(&self->freed, object);
+        }
+        self->work++;
+      }
+    }
+    page->unswept = false;
+  }
+}
+
+static void runTask(GCWorkers* workers, GCWorker* self) {
+  if (workers->task == GC_TASK_MARK) {
+    markTask(workers, self);
+  } else {
+    sweepTask(self);
+  }
+}
+
+static void* gcThread(void* argument) {
+  GCWorker* self = (GCWorker*)argument;
+  GCWorkers* workers = self->workers;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&workers->lock);
+  for (;;) {
+    while (!workers->quit && workers->generation == seen) {
+      pthread_cond_wait(&workers->start, &workers->lock);
+    }
+    if (workers->quit) break;
+    seen = workers->generation;
+    pthread_mutex_unlock(&workers->lock);
+    runTask(workers, self);
+    pthread_mutex_lock(&workers->lock);
+    if (--workers->running == 0) pthread_cond_signal(&workers->finish);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+// Starts the gc threads the first time a slice shares its work. If some
+// cannot be started, the slice is shared among fewer.
+static GCWorkers* startWorkers(VM* vm) {
+  if (vm->gcWorkers != NULL) return vm->gcWorkers;
+  GCWorkers* workers = (GCWorkers*)calloc(
+      1, sizeof(GCWorkers) + sizeof(GCWorker) * vm->gcThreads);
+  if (workers == NULL) exit(1);
+  workers->vm = vm;
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->start, NULL);
+  pthread_cond_init(&workers->finish, NULL);
+  for (int i = 0; i < vm->gcThreads; i++) {
+    GCWorker* worker = &workers->workers[i];
+    worker->workers = workers;
+    pthread_mutex_init(&worker->lock, NULL);
+    initPool(&worker->freed);
+  }
+  workers->count = 1;
+  while (workers->count < vm->gcThreads) {
+    GCWorker* worker = &workers->workers[workers->count];
+    if (pthread_create(&worker->thread, NULL, gcThread, worker) != 0) break;
+    worker->started = true;
+    workers->count++;
+  }
+  vm->gcWorkers = workers;
+  return workers;
+}
+
+static void stopWorkers(GCWorkers* workers) {
+  pthread_mutex_lock(&workers->lock);
+  workers->quit = true;
+  pthread_cond_broadcast(&workers->start);
+  pthread_mutex_unlock(&workers->lock);
+  for (int i = 0; i < workers->vm->gcThreads; i++) {
+    GCWorker* worker = &workers->workers[i];
+    if (worker->started) pthread_join(worker->thread, NULL);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->gray.items);
+    free(worker->shared.items);
+    free(worker->functions.items);
+  }
+  pthread_mutex_destroy(&workers->lock);
+  pthread_cond_destroy(&workers->start);
+  pthread_cond_destroy(&workers->finish);
+  free(workers);
+}
+
+// Runs `task` on every gc thread, this one included, and waits for all of
+// them to finish it.
+static void shareTask(VM* vm, GCWorkers* workers, GCTask task) {
+  pthread_mutex_lock(&workers->lock);
+  workers->task = task;
+  workers->running = workers->count - 1;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->start);
+  pthread_mutex_unlock(&workers->lock);
+  runTask(workers, &workers->workers[0]);
+  pthread_mutex_lock(&workers->lock);
+  while (workers->running > 0) {
+    pthread_cond_wait(&workers->finish, &workers->lock);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  vm->gcSharedSlices++;
+}
+
+// markGray() for a slice big enough to share: the gray objects are dealt out
+// among the gc threads, which mark with atomic bit operations and take work
+// from each other as they run out. Whatever is still gray when the budget is
+// spent goes back on the VM's list.
+static bool markShared(VM* vm, long budget) {
+  GCWorkers* workers = startWorkers(vm);
+  for (int i = 0; i < vm->gray.count; i++) {
+    pushGray(&workers->workers[i % workers->count].gray, vm->gray.items[i]);
+  }
+  vm->gray.count = 0;
+  workers->budget = budget;
+  workers->stop = false;
+  workers->idle = 0;
+  shareTask(vm, workers, GC_TASK_MARK);
+  for (int i = 0; i < workers->count; i++) {
+    GCWorker* worker = &workers->workers[i];
+    for (int j = 0; j < worker->gray.count; j++) {
+      pushGray(&vm->gray, worker->gray.items[j]);
+    }
+    for (int j = 0; j < worker->shared.count; j++) {
+      pushGray(&vm->gray, worker->shared.items[j]);
+    }
+    worker->gray.count = 0;
+    worker->shared.count = 0;
+  }
+  return vm->gray.count == 0;
+}
+
+// Sweeps whole pages from vm->sweepPage on, as many as `budget` pays for, by
+// cutting them into a run of neighbouring pages per gc thread. `budget` pays
+// for at least a page per thread. Returns the work that took.
+static long sweepShared(VM* vm, long budget) {
+  GCWorkers* workers = startWorkers(vm);
+  long limit = budget / POOL_BITMAP_WORDS;
+  long pages = 0;
+  for (PoolPage* page = vm->sweepPage; page != NULL && pages < limit;
+       page = page->next) {
+    pages++;
+  }
+  PoolPage* page = vm->sweepPage;
+  for (int i = 0; i < workers->count; i++) {
+    GCWorker* worker = &workers->workers[i];
+    long share = pages / workers->count + (i < pages % workers->count);
+    worker->first = page;
+    for (long j = 0; j < share; j++) page = page->next;
+    worker->last = page;
+    worker->freedBytes = 0;
+    worker->work = 0;
+  }
+  shareTask(vm, workers, GC_TASK_SWEEP);
+  vm->sweepPage = page;
+  long work = 0;
+  for (int i = 0; i < workers->count; i++) {
+    GCWorker* worker = &workers->workers[i];
+    poolAdopt(&vm->pool, &worker->freed);
+    countAllocation(vm, worker->freedBytes, 0);
+    for (int j = 0; j < worker->functions.count; j++) {
+      freeObject(vm, worker->functions.items[j]);
+    }
+    worker->functions.count = 0;
+    work += worker->work;
+  }
+  return work;
+}
+
+// Sweeps the bitmap words the sweep has yet to reach until `budget` is
+// spent. Returns whether the sweep is done.
+static bool sweepSome(VM* vm, long budget) {
+  while (vm->sweepPage != NULL) {
+    if (vm->gcThreads > 1 && budget >= vm->gcShareMin &&
+        budget / POOL_BITMAP_WORDS >= vm->gcThreads && vm->sweepWord == 0) {
+      budget -= sweepShared(vm, budget);
+      continue;
+    }
+    PoolPage* page = vm->sweepPage;
+    for (; vm->sweepWord < POOL_BITMAP_WORDS; vm->sweepWord++) {
+      if (budget <= 0) return false;
+      budget -= sweepWord(vm, page, vm->sweepWord);
+    }
+    page->unswept = false;
+    vm->sweepPage = page->next;
+    vm->sweepWord = 0;
+  }
+  return true;
+}
+
+static double gcClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:   return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_BUNCH:    return sizeof(ObjBunch);
+    case OBJ_CANOPY:   return sizeof(ObjCanopy);
+  }
+  return 0;
+}
+
+// Loops `object` over the objects in the nursery, oldest first.
+#define FOR_EACH_NURSERY_OBJECT(vm, object)                               \
+  for (Obj* object = (Obj*)(vm)->nursery; (char*)object < (vm)->nurseryTop; \
+       object = (Obj*)((char*)object + NURSERY_ALIGN(objectSize(object))))
+
+static void recordPause(VM* vm, double seconds, double* total, double* max) {
+  *total += seconds;
+  if (seconds > *max) *max = seconds;
+  int bucket = 0;
+  for (double bound = 10e-6; seconds > bound && bucket < GC_PAUSE_BUCKETS - 1;
+       bound *= 10) {
+    bucket++;
+  }
+  vm->pauseHistogram[bucket]++;
+}
+
+static void startMajor(VM* vm) {
+  vm->gcCycles++;
+  vm->gcPhase = GC_MARKING;
+  vm->gcLimit = oldBytes(vm) * GC_HEAP_GROW_FACTOR;
+  markRoots(vm);
+}
+
+// Runs once the gray list is empty. The roots may have been given white
+// objects since they were marked, and young objects are never marked, so
+// both are scanned again and whatever that grays is marked in the same
+// pause. That takes time in proportion to the roots and the nursery, not
+// the heap. Everything old left white is garbage.
+static void finishMarking(VM* vm) {
+  markRoots(vm);
+  FOR_EACH_NURSERY_OBJECT(vm, object) blackenObject(vm, object);
+  markGray(vm, LONG_MAX);
+  removeUnmarkedStrings(vm);
+  // Remembered objects that are about to be freed leave the set.
+  int kept = 0;
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    if (poolIsMarked(vm->remembered[i])) vm->remembered[kept++] = vm->remembered[i];
+  }
+  vm->rememberedCount = kept;
+  // The sweep covers the pages there are now; ones made from here on hold
+  // nothing to sweep.
+  for (PoolPage* page = vm->pool.pages; page != NULL; page = page->next) {
+    page->unswept = true;
+  }
+  vm->sweepPage = vm->pool.pages;
+  vm->sweepWord = 0;
+  vm->gcPhase = GC_SWEEPING;
+}
+
+// Does up to `budget` units of the major collection under way. Returns
+// whether it is over.
+static bool majorWork(VM* vm, long budget) {
+  if (vm->gcPhase == GC_MARKING) {
+    if (markGray(vm, budget)) finishMarking(vm);
+    return false;
+  }
+  if (!sweepSome(vm, budget)) return false;
+  vm->gcPhase = GC_IDLE;
+  vm->nextGC = oldBytes(vm) * GC_HEAP_GROW_FACTOR;
+  return true;
+}
+
+// One pause of major collection work, starting a collection when the old
+// generation has outgrown nextGC. A program that allocates faster than the
+// slices keep up with gets the rest of the collection in one pause once the
+// old generation doubles, rather than a heap that grows without bound.
+static void majorSlice(VM* vm) {
+  double start = gcClock();
+  if (vm->gcPhase == GC_IDLE) startMajor(vm);
+  majorWork(vm, oldBytes(vm) > vm->gcLimit ? LONG_MAX : vm->gcSliceBudget);
+  vm->gcSlices++;
+  recordPause(vm, gcClock() - start, &vm->majorPauseTotal, &vm->majorPauseMax);
+}
+
+void collectGarbage(VM* vm) {
+  double start = gcClock();
+  if (vm->gcPhase == GC_IDLE) startMajor(vm);
+  while (!majorWork(vm, LONG_MAX)) {}
+  vm->gcSlices++;
+  recordPause(vm, gcClock() - start, &vm->majorPauseTotal, &vm->majorPauseMax);
+}
+
+void rememberObject(VM* vm, Obj* object) {
+  if (vm->rememberedCount == vm->rememberedCapacity) {
+    vm->rememberedCapacity =
+        vm->rememberedCapacity < 64 ? 64 : vm->rememberedCapacity * 2;
+    vm->remembered = (Obj**)realloc(vm->remembered,
+                                    sizeof(Obj*) * vm->rememberedCapacity);
+    if (vm->remembered == NULL) exit(1);
+  }
+  object->remembered = true;
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+// Copies a reachable nursery object to the old generation, once; the
+// nursery copy is flagged as forwarded and points to the new one. The copy
+// goes on the promoted list, where collectNursery() scans it in turn. Its
+// bytes were counted when it was allocated, so the total does not change.
+static Obj* promote(VM* vm, Obj* object) {
+  if (object->forwarded) return object->next;
+  size_t size = objectSize(object);
+  Obj* copy = newOldObject(vm, size, object->type);
+  if (object->type == OBJ_STRING) {
+    ObjString* string = (ObjString*)copy;
+    char* chars = string->chars;
+    memcpy(string, object, sizeof(ObjString));
+    string->chars = chars;
+    memcpy(chars, ((ObjString*)object)->chars, string->length + 1);
+  } else {
+    memcpy(copy, object, size);
+  }
+  copy->next = vm->promoted;
+  vm->promoted = copy;
+  if (vm->gcPhase == GC_MARKING) markObject(vm, copy);
+  object->forwarded = true;
+  object->next = copy;
+  vm->promotedBytes += size;
+  return copy;
+}
+
+static inline void forwardValue(VM* vm, Value* slot) {
+  if (IS_OBJ(*slot) && isYoung(vm, AS_OBJ(*slot))) {
+    *slot = OBJ_VAL(promote(vm, AS_OBJ(*slot)));
+  }
+}
+
+// Points every reference that `object` holds into the nursery at the copy.
+static void forwardFields(VM* vm, Obj* object) {
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      if (function->name != NULL && isYoung(vm, (Obj*)function->name)) {
+        function->name = (ObjString*)promote(vm, (Obj*)function->name);
+      }
+      break;
+    }
+    case OBJ_BUNCH: {
+      ObjBunch* bunch = (ObjBunch*)object;
+      for (int i = 0; i < bunch->count; i++) forwardValue(vm, &bunch->values[i]);
+      break;
+    }
+    case OBJ_CANOPY: {
+      ObjCanopy* canopy = (ObjCanopy*)object;
+      for (int i = 0; i < canopy->capacity; i++) {
+        forwardValue(vm, &canopy->entries[i].key);
+        forwardValue(vm, &canopy->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_STRING:
+      break;
+  }
+}
+
+void collectNursery(VM* vm) {
+  double start = gcClock();
+  vm->minorCycles++;
+
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) forwardValue(vm, slot);
+  for (int i = 0; i < vm->globalCount; i++) forwardValue(vm, &vm->globals[i].value);
+  for (int i = 0; i < vm->constantCount; i++) forwardValue(vm, &vm->constants[i]);
+  forwardValue(vm, &vm->lastError);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    forwardFields(vm, vm->remembered[i]);
+    vm->remembered[i]->remembered = false;
+  }
+  vm->rememberedCount = 0;
+
+  // Scan the copies, newest first, until scanning makes no more.
+  while (vm->promoted != NULL) {
+    Obj* copy = vm->promoted;
+    vm->promoted = copy->next;
+    forwardFields(vm, copy);
+  }
+
+  StringTable* table = &vm->strings;
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString* string = table->entries[i];
+    if (string == NULL || string == TOMBSTONE || !isYoung(vm, (Obj*)string)) continue;
+    table->entries[i] =
+        string->obj.forwarded ? (ObjString*)string->obj.next : TOMBSTONE;
+  }
+
+  // What was not copied is garbage.
+  FOR_EACH_NURSERY_OBJECT(vm, object) {
+    if (object->forwarded) continue;
+    vm->bytesAllocated -= objectSize(object);
+    if (object->type == OBJ_BUNCH) {
+      ObjBunch* bunch = (ObjBunch*)object;
+      reallocate(vm, bunch->values, sizeof(Value) * bunch->capacity, 0);
+    } else if (object->type == OBJ_CANOPY) {
+      ObjCanopy* canopy = (ObjCanopy*)object;
+      reallocate(vm, canopy->entries, sizeof(CanopyEntry) * canopy->capacity, 0);
+    }
+  }
+  vm->nurseryTop = vm->nursery;
+  vm->nurseryFull = false;
+  vm->youngBytes = 0;
+  recordPause(vm, gcClock() - start, &vm->minorPauseTotal, &vm->minorPauseMax);
+
+  // The copies grew the old generation, maybe past its threshold.
+  if (vm->gcPhase != GC_IDLE || oldBytes(vm) > vm->nextGC) majorSlice(vm);
+}
+
+void disableNursery(VM* vm) {
+  free(vm->nursery);
+  vm->nursery = vm->nurseryTop = NULL;
+  vm->nurserySize = 0;
+}
+
+// The operations below are shared by both interpreter loops, compiled code
+// and ahead-of-time compiled programs, which pass in their operands where
+// they keep them: on the stack, in registers or in C locals spilled to the
+// frame's slots. The operands stay there until the operation is done, so they
+// are still rooted if it allocates. On failure they report a runtime error
+// and return false.
+
+// The backing arrays of bunches and canopies are allocated before the object
+// itself, so that no collection sees the object half made.
+Value newBunch(VM* vm, Value* items, int count) {
+  Value* values = (Value*)reallocate(vm, NULL, 0, sizeof(Value) * count);
+  ObjBunch* bunch = (ObjBunch*)allocateObject(vm, sizeof(ObjBunch), OBJ_BUNCH);
+  bunch->values = values;
+  bunch->count = count;
+  bunch->capacity = count;
+  memcpy(bunch->values, items, sizeof(Value) * count);
+  if (count > 0 && !isYoung(vm, (Obj*)bunch)) rememberObject(vm, (Obj*)bunch);
+  return OBJ_VAL(bunch);
+}
+
+// `items` alternate keys and values. They are inserted last pair first.
+Value newCanopy(VM* vm, Value* items, int pairs) {
+  int capacity = pairs > 0 ? pairs * 2 : 8;
+  CanopyEntry* entries = (CanopyEntry*)reallocate(
+      vm, NULL, 0, sizeof(CanopyEntry) * capacity);
+  ObjCanopy* canopy =
+      (ObjCanopy*)allocateObject(vm, sizeof(ObjCanopy), OBJ_CANOPY);
+  canopy->count = 0;
+  canopy->capacity = capacity;
+  canopy->entries = entries;
+  for (int i = 0; i < canopy->capacity; i++) {
+    canopy->entries[i].key = NIL_VAL;
+    canopy->entries[i].value = NIL_VAL;
+  }
+  for (int i = pairs - 1; i >= 0; i--) {
+    canopySet(canopy, items[2 * i], items[2 * i + 1]);
+  }
+  if (pairs > 0 && !isYoung(vm, (Obj*)canopy)) rememberObject(vm, (Obj*)canopy);
+  return OBJ_VAL(canopy);
+}
+
+// Reads a line from stdin: a number if it parses as one, otherwise a string,
+// and nil at the end of input or for an empty line.
+Value askLine(VM* vm) {
+  char line[1024];
+  if (!fgets(line, sizeof(line), stdin)) return NIL_VAL;
+  line[strcspn(line, "\r\n")] = 0;
+  if (line[0] == '\0') return NIL_VAL;
+
+  char* end;
+  double value = strtod(line, &end);
+  if (*end == '\0') return NUMBER_VAL(value);
+  return OBJ_VAL(copyString(vm, line, strlen(line)));
+}
+
+bool stringLength(VM* vm, Value value, Value* result) {
+  if (!IS_STRING(value)) {
+    runtimeError(vm, "Operand must be a string.");
+    return false;
+  }
+  *result = NUMBER_VAL((double)AS_STRING(value)->length);
+  return true;
+}
+
+// args: the two strings.
+bool graftStrings(VM* vm, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError(vm, "Operands for 'graft' must be strings.");
+    return false;
+  }
+  *result = OBJ_VAL(joinStrings(vm, AS_STRING(args[0]), AS_STRING(args[1])));
+  return true;
+}
+
+// args: the string, the start index and the end index.
+bool sliceString(VM* vm, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+    runtimeError(vm, "'slice' requires a string and two number indices.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  int start = (int)AS_NUMBER(args[1]);
+  int end = (int)AS_NUMBER(args[2]);
+  if (start < 0 || end > string->length || start > end) {
+    runtimeError(vm, "Slice indices out of bounds.");
+    return false;
+  }
+  *result = OBJ_VAL(copyString(vm, string->chars + start, end - start));
+  return true;
+}
+
+// args: the haystack and the needle.
+bool scanString(VM* vm, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError(vm, "'scan' requires two strings.");
+    return false;
+  }
+  char* haystack = AS_CSTRING(args[0]);
+  char* found = strstr(haystack, AS_CSTRING(args[1]));
+  *result = NUMBER_VAL(found ? found - haystack : -1);
+  return true;
+}
+
+bool shedString(VM* vm, Value value, Value* result) {
+  if (!IS_STRING(value)) {
+    runtimeError(vm, "'shed' requires a string.");
+    return false;
+  }
+  ObjString* string = AS_STRING(value);
+  char* start = string->chars;
+  while (isspace((unsigned char)*start)) start++;
+
+  char* end = string->chars + string->length - 1;
+  while (end > start && isspace((unsigned char)*end)) end--;
+
+  *result = OBJ_VAL(copyString(vm, start, (int)(end - start) + 1));
+  return true;
+}
+
+// The contents of the file at `path`, or nil if it can't be read.
+bool forage(VM* vm, Value path, Value* result) {
+  if (!IS_STRING(path)) {
+    runtimeError(vm, "'forage' path must be a string.");
+    return false;
+  }
+  char* content = readTextFile(AS_CSTRING(path));
+  if (content == NULL) {
+    *result = NIL_VAL;
+  } else {
+    *result = OBJ_VAL(copyString(vm, content, strlen(content)));
+    free(content);
+  }
+  return true;
+}
+
+bool inscribe(VM* vm, Value path, Value content, Value* result) {
+  if (!IS_STRING(path) || !IS_STRING(content)) {
+    runtimeError(vm, "'inscribe' arguments must be strings.");
+    return false;
+  }
+  *result = BOOL_VAL(writeTextFile(AS_CSTRING(path), AS_CSTRING(content)));
+  return true;
+}
+
+void runtimeError(VM* vm, const char* format, ...) {
+  char buffer[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  fprintf(stderr, "Runtime Error: %s", buffer);
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    // Deep recursion would bury the error; keep the innermost and outermost
+    // frames of the trace.
+    if (i == vm->frameCount - 1 - 10 && i >= 10) {
+      fprintf(stderr, "\n... %d more frames ...", i - 9);
+      i = 10;
+    }
+    CallFrame* frame = &vm->frames[i];
+    ObjFunction* function = frame->function;
+    fprintf(stderr, "\n[line ?] in %s()",
+            function->name ? function->name->chars : "<script>");
+  }
+  vm->lastError = OBJ_VAL(copyString(vm, buffer, strlen(buffer)));
+}
+
+static void printObject(Value value) {
+  switch (OBJ_TYPE(value)) {
+    case OBJ_STRING:
+      printf("%s", AS_CSTRING(value));
+      break;
+    case OBJ_FUNCTION:
+      if (AS_FUNCTION(value)->name == NULL)
+        printf("<script>");
+      else
+        printf("<tribe %s>", AS_FUNCTION(value)->name->chars);
+      break;
+    case OBJ_BUNCH: {
+      ObjBunch* bunch = AS_BUNCH(value);
+      printf("[");
+      for (int i = 0; i < bunch->count; i++) {
+        printValue(bunch->values[i]);
+        if (i < bunch->count - 1) printf(", ");
+      }
+      printf("]");
+      break;
+    }
+    case OBJ_CANOPY: {
+      ObjCanopy* canopy = AS_CANOPY(value);
+      printf("{");
+      int printed = 0;
+      for (int i = 0; i < canopy->capacity; i++) {
+        if (!IS_NIL(canopy->entries[i].key)) {
+          printValue(canopy->entries[i].key);
+          printf(": ");
+          printValue(canopy->entries[i].value);
+          if (printed < canopy->count - 1) printf(", ");
+          printed++;
+        }
+      }
+      printf("}");
+      break;
+    }
+  }
+}
+
+void printValue(Value value) {
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+}
+
+// Reads a positive integer from the environment, or returns `fallback`.
+static int limitFromEnv(const char* name, int fallback) {
+  const char* text = getenv(name);
+  if (text == NULL) return fallback;
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (*end != '\0' || value <= 0 || value > INT32_MAX) {
+    fprintf(stderr, "Ignoring %s=%s: expected a positive number.\n", name, text);
+    return fallback;
+  }
+  return (int)value;
+}
+
+void initVM(VM* vm) {
+  vm->stackLimit = limitFromEnv("APE_MAX_STACK", STACK_LIMIT_DEFAULT);
+  if (vm->stackLimit < STACK_INITIAL) vm->stackLimit = STACK_INITIAL;
+  vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+  if (vm->stack == NULL) exit(1);
+  vm->stackTop = vm->stack;
+  vm->stackEnd = vm->stack + STACK_INITIAL;
+
+  vm->frameLimit = limitFromEnv("APE_MAX_FRAMES", FRAMES_LIMIT_DEFAULT);
+  vm->frameCapacity =
+      vm->frameLimit < FRAMES_INITIAL ? vm->frameLimit : FRAMES_INITIAL;
+  vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * vm->frameCapacity);
+  if (vm->frames == NULL) exit(1);
+  vm->frameCount = 0;
+
+  vm->lastError = NIL_VAL;
+  vm->constants = NULL;
+  vm->constantCount = 0;
+  vm->constantCapacity = 0;
+  vm->globals = NULL;
+  vm->globalCount = 0;
+  vm->globalCapacity = 0;
+  vm->globalIndex = NULL;
+  vm->globalIndexCapacity = 0;
+  vm->cacheEpoch = 0;
+  size_t nurseryBytes =
+      (size_t)limitFromEnv("APE_NURSERY_KB", NURSERY_KB_DEFAULT) * 1024;
+  vm->nursery = (char*)malloc(nurseryBytes);
+  if (vm->nursery == NULL) exit(1);
+  vm->nurseryTop = vm->nursery;
+  vm->nurserySize = nurseryBytes;
+  vm->nurseryFull = false;
+  vm->youngBytes = 0;
+  vm->allocateOld = 0;
+  initPool(&vm->pool);
+  vm->gcPhase = GC_IDLE;
+  vm->gray.items = NULL;
+  vm->gray.count = 0;
+  vm->gray.capacity = 0;
+  vm->sweepPage = NULL;
+  vm->sweepWord = 0;
+  vm->gcSliceBudget = limitFromEnv("APE_GC_SLICE", GC_SLICE_DEFAULT);
+  vm->gcLimit = 0;
+  vm->gcThreads = limitFromEnv("APE_GC_THREADS", 1);
+  if (vm->gcThreads > GC_THREADS_MAX) vm->gcThreads = GC_THREADS_MAX;
+  vm->gcShareMin = limitFromEnv("APE_GC_SHARE_MIN", GC_SHARE_MIN_DEFAULT);
+  if (vm->gcShareMin < (long)GC_BUDGET_BATCH * vm->gcThreads) {
+    vm->gcShareMin = (long)GC_BUDGET_BATCH * vm->gcThreads;
+  }
+  vm->gcWorkers = NULL;
+  vm->remembered = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->promoted = NULL;
+  vm->bytesAllocated = 0;
+  vm->peakBytesAllocated = 0;
+  vm->nextGC = 1024 * 1024;
+
+  vm->maxFrameCount = 0;
+  vm->framesPushed = 0;
+  vm->registerMode = false;
+#ifdef APE_JIT
+  vm->jitEnabled = true;
+#else
+  vm->jitEnabled = false;
+#endif
+  vm->jitDepth = 0;
+  vm->jitCompiled = 0;
+  vm->jitRejected = 0;
+  vm->jitCodeBytes = 0;
+  vm->objectsAllocated = 0;
+  vm->gcCycles = 0;
+  vm->gcSlices = 0;
+  vm->gcSharedSlices = 0;
+  vm->minorCycles = 0;
+  vm->promotedBytes = 0;
+  vm->majorPauseTotal = 0;
+  vm->majorPauseMax = 0;
+  vm->minorPauseTotal = 0;
+  vm->minorPauseMax = 0;
+  memset(vm->pauseHistogram, 0, sizeof(vm->pauseHistogram));
+  vm->internHits = 0;
+  vm->internMisses = 0;
+  vm->callCacheHits = 0;
+  vm->callCacheMisses = 0;
+  memset(vm->quickenings, 0, sizeof(vm->quickenings));
+  memset(vm->quickenMisses, 0, sizeof(vm->quickenMisses));
+  vm->strings.entries = NULL;
+  vm->strings.count = 0;
+  vm->strings.capacity = 0;
+
+#ifdef APE_PROFILE
+  vm->instructionCount = 0;
+  memset(vm->opcodeCounts, 0, sizeof(vm->opcodeCounts));
+  vm->pairCounts = calloc(256, sizeof(*vm->pairCounts));
+  if (vm->pairCounts == NULL) exit(1);
+  vm->previousOpcode = 255;
+#endif
+}
+
+void freeVM(VM* vm) {
+  FOR_EACH_NURSERY_OBJECT(vm, object) {
+    if (object->type == OBJ_BUNCH) {
+      ObjBunch* bunch = (ObjBunch*)object;
+      poolFree(&vm->pool, bunch->values, sizeof(Value) * bunch->capacity);
+    } else if (object->type == OBJ_CANOPY) {
+      ObjCanopy* canopy = (ObjCanopy*)object;
+      poolFree(&vm->pool, canopy->entries, sizeof(CanopyEntry) * canopy->capacity);
+    }
+  }
+  free(vm->nursery);
+  free(vm->remembered);
+  free(vm->gray.items);
+  if (vm->gcWorkers != NULL) stopWorkers(vm->gcWorkers);
+  // Sweeping a page with no marks frees everything in it.
+  for (PoolPage* page = vm->pool.pages; page != NULL; page = page->next) {
+    memset(page->marks, 0, sizeof(page->marks));
+    for (int i = 0; i < POOL_BITMAP_WORDS; i++) sweepWord(vm, page, i);
+  }
+  freePool(&vm->pool);
+  for (int i = 0; i < vm->globalCount; i++) free(vm->globals[i].name);
+  free(vm->globals);
+  free(vm->globalIndex);
+  free(vm->constants);
+  free(vm->strings.entries);
+  free(vm->stack);
+  free(vm->frames);
+#ifdef APE_PROFILE
+  free(vm->pairCounts);
+#endif
+}
@@ -0,0 +1,215 @@
+#ifndef APE_RUNTIME_H
+#define APE_RUNTIME_H
+
+#include "vm.h"
+
+// The parts of the VM that don't depend on how code is executed: objects and
+// the collector, interned strings, canopies, globals, the stack and frame
+// arrays, and the operations behind the instructions that are more than a
+// few machine instructions. The interpreter loops and the JIT use them, and
+// they are also built on their own into libaperuntime.a, which the C files
+// written by `apeslang aot` link against (see compiler/aot.h).
+
+// Every allocation goes through here, so this is where a collection starts.
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+// Major collections mark from the roots and free the unreached old objects,
+// a slice at a time (see GCPhase). Nothing moves, so a slice can run inside
+// any allocation. collectGarbage() runs the rest of the current collection,
+// or a whole new one, in one pause.
+void collectGarbage(VM* vm);
+// Grays an old white object. Young objects are never marked.
+void markObject(VM* vm, Obj* object);
+
+// A minor collection: copies the reachable nursery objects to the old
+// generation and empties the nursery. Objects move, so it only runs at safe
+// points (see safePoint()).
+void collectNursery(VM* vm);
+void rememberObject(VM* vm, Obj* object);
+// Programs compiled with `apeslang aot` keep values in C locals that a minor
+// collection would not update, so they allocate everything old.
+void disableNursery(VM* vm);
+
+static inline bool isYoung(VM* vm, Obj* object) {
+  return (size_t)((char*)object - vm->nursery) < vm->nurserySize;
+}
+
+// Called when `object` comes to hold `value`. An old object given a young
+// one is remembered for the next minor collection; a marked object given an
+// unmarked one while marking grays it. Globals, the stack and the constants
+// are roots of every collection and need no barrier.
+static inline void writeBarrier(VM* vm, Obj* object, Value value) {
+  if (!IS_OBJ(value)) return;
+  Obj* target = AS_OBJ(value);
+  if (isYoung(vm, target)) {
+    if (!object->remembered && !isYoung(vm, object)) rememberObject(vm, object);
+  } else if (vm->gcPhase == GC_MARKING && !isYoung(vm, object) &&
+             poolIsMarked(object) && !poolIsMarked(target)) {
+    markObject(vm, target);
+  }
+}
+
+// Runs a minor collection if the nursery has filled up. Called between
+// instructions, where every live object is reachable from the roots and no C
+// code holds a pointer to one.
+static inline void safePoint(VM* vm) {
+  if (vm->nurseryFull) collectNursery(vm);
+}
+
+uint32_t hashString(const char* key, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* joinStrings(VM* vm, ObjString* a, ObjString* b);
+
+ObjFunction* newFunction(VM* vm, int arity, ObjString* name);
+void addConstant(VM* vm, Value value);
+int resolveGlobal(VM* vm, const char* name, int len);
+
+bool canopySet(ObjCanopy* canopy, Value key, Value value);
+bool canopyGet(ObjCanopy* canopy, Value key, Value* value);
+
+bool growStack(VM* vm, int needed);
+bool growFrames(VM* vm);
+
+// Prints the message and a trace of the call frames to stderr and keeps the
+// message in vm->lastError for a tumble handler to catch.
+void runtimeError(VM* vm, const char* format, ...);
+void printValue(Value value);
+
+char* readTextFile(const char* path);
+bool writeTextFile(const char* path, const char* content);
+
+Value newBunch(VM* vm, Value* items, int count);
+Value newCanopy(VM* vm, Value* items, int pairs);
+Value askLine(VM* vm);
+bool stringLength(VM* vm, Value value, Value* result);
+bool graftStrings(VM* vm, Value* args, Value* result);
+bool sliceString(VM* vm, Value* args, Value* result);
+bool scanString(VM* vm, Value* args, Value* result);
+bool shedString(VM* vm, Value value, Value* result);
+bool forage(VM* vm, Value path, Value* result);
+bool inscribe(VM* vm, Value path, Value content, Value* result);
+
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Strings are interned, so every object, strings included, is equal only to
+// itself.
+static inline bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_BOOL:
+      return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NIL:
+      return true;
+    case VAL_NUMBER:
+      return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_OBJ:
+      return AS_OBJ(a) == AS_OBJ(b);
+  }
+  return false;
+#endif
+}
+
+// Subscripts are hot in both interpreter loops; as out-of-line calls they
+// cost canopy_keys about 10%, so they are inlined into their callers.
+static inline bool getSubscript(VM* vm, Value collection, Value index, Value* result) {
+  if (IS_BUNCH(collection)) {
+    ObjBunch* bunch = AS_BUNCH(collection);
+    if (!IS_NUMBER(index)) {
+      runtimeError(vm, "Bunch index must be a number.");
+      return false;
+    }
+    int i = (int)AS_NUMBER(index);
+    *result = i < 0 || i >= bunch->count ? NIL_VAL : bunch->values[i];
+  } else if (IS_CANOPY(collection)) {
+    if (!IS_STRING(index)) {
+      runtimeError(vm, "Canopy keys must be strings.");
+      return false;
+    }
+    if (!canopyGet(AS_CANOPY(collection), index, result)) *result = NIL_VAL;
+  } else {
+    runtimeError(vm, "Subscript operator can only be used on bunches and canopies.");
+    return false;
+  }
+  return true;
+}
+
+static inline bool setSubscript(VM* vm, Value collection, Value index, Value value) {
+  if (IS_BUNCH(collection)) {
+    ObjBunch* bunch = AS_BUNCH(collection);
+    if (!IS_NUMBER(index)) {
+      runtimeError(vm, "Bunch index must be a number.");
+      return false;
+    }
+    int i = (int)AS_NUMBER(index);
+    if (i < 0 || i >= bunch->count) {
+      runtimeError(vm, "Bunch index out of bounds.");
+      return false;
+    }
+    writeBarrier(vm, (Obj*)bunch, value);
+    bunch->values[i] = value;
+  } else if (IS_CANOPY(collection)) {
+    if (!IS_STRING(index)) {
+      runtimeError(vm, "Canopy keys must be strings.");
+      return false;
+    }
+    // An existing entry keeps its key, so only a new one needs the barrier.
+    if (canopySet(AS_CANOPY(collection), index, value)) {
+      writeBarrier(vm, AS_OBJ(collection), index);
+    }
+    writeBarrier(vm, AS_OBJ(collection), value);
+  } else {
+    runtimeError(vm, "Subscript operator can only be used on bunches and canopies.");
+    return false;
+  }
+  return true;
+}
+
+// Grows the stack, if it has to, so that a frame of `function` starting at
+// `slots` fits. Growing moves the stack, `slots` with it.
+static inline bool fitFrame(VM* vm, ObjFunction* function, Value* slots) {
+  long needed = function->stack - (vm->stackTop - slots);
+  if (vm->stackEnd - vm->stackTop < needed && !growStack(vm, (int)needed)) {
+    runtimeError(vm, "Stack overflow!");
+    return false;
+  }
+  return true;
+}
+
+// Pushes a call frame for `function`, whose callee slot and `argCount`
+// arguments are the top of the stack, once the arity has been checked. The
+// caller sets the frame's ip.
+static inline bool enterFrame(VM* vm, ObjFunction* function, int argCount) {
+  if (vm->frameCount == vm->frameCapacity && !growFrames(vm)) {
+    runtimeError(vm, "Stack overflow!");
+    return false;
+  }
+  if (!fitFrame(vm, function, vm->stackTop - argCount - 1)) return false;
+
+  if (vm->frameCount + 1 > vm->maxFrameCount) {
+      vm->maxFrameCount = vm->frameCount + 1;
+  }
+
+  vm->framesPushed++;
+  CallFrame* frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->slots = vm->stackTop - argCount - 1;
+  return true;
+}
+
+// enterFrame() for a call that has not had its arity checked.
+static inline bool pushFrame(VM* vm, ObjFunction* function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d for function %s.",
+                 function->arity, argCount,
+                 function->name ? function->name->chars : "<script>");
+    return false;
+  }
+  return enterFrame(vm, function, argCount);
+}
+
+#endif
@@ -4,352 +4,529 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../bytecode/bytecode.h"
 #include "../compiler/compiler.h"
 #include "../debug/debug.h"
-#include "vm.h"
-
-#define GC_HEAP_GROW_FACTOR 2
+#include "jit.h"
+#include "runtime.h"
+
+#ifdef APE_PROFILE
+#define COUNT_INSTRUCTION(op)                    \
+  do {                                           \
+    vm->instructionCount++;                      \
+    vm->opcodeCounts[(op)]++;                    \
+    vm->pairCounts[vm->previousOpcode][(op)]++;  \
+    vm->previousOpcode = (op);                   \
+  } while (false)
+#else
+#define COUNT_INSTRUCTION(op) do { } while (false)
+#endif
 
-static void runtimeError(VM* vm, const char* format, ...);
-VMResult run(VM* vm);
+VMResult run(VM* vm, int baseFrame);
+static VMResult runRegisters(VM* vm);
 static bool call(VM* vm, ObjFunction* function, int argCount);
-static bool callValue(VM* vm, Value callee, int argCount);
-static bool valuesEqual(Value a, Value b);
-static void printValue(Value value);
-static uint32_t hashString(const char* key, int length);
-static bool canopySet(ObjCanopy* canopy, Value key, Value value);
-static int findVariable(VM* vm, const char* name, int len);
-static bool isFalsey(Value value);
-
-static void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
-static void markObject(Obj* object);
-static void markValue(Value value);
-static void collectGarbage(VM* vm);
-static void freeObject(VM* vm, Obj* object);
-
-
-
-static void pushNewString(VM* vm, const char* chars, int length) {
-    size_t size = sizeof(ObjString) + length + 1;
-    ObjString* stringObj = (ObjString*)reallocate(vm, NULL, 0, size);
-    stringObj->obj.type = OBJ_STRING;
-    stringObj->length = length;
-    stringObj->chars = (char*)(stringObj + 1);
-    memcpy(stringObj->chars, chars, length);
-    stringObj->chars[length] = '\0';
-    stringObj->hash = hashString(stringObj->chars, length);
-    stringObj->obj.isMarked = false;
-    stringObj->obj.next = vm->objects;
-    vm->objects = (Obj*)stringObj;
-    *vm->stackTop++ = OBJ_VAL(stringObj);
-}
 
-static void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
-  vm->bytesAllocated += newSize - oldSize;
-  
-  if (oldSize == 0 && newSize > 0) {
-      vm->objectsAllocated++;
-  }
+// Replaces the two strings on top of the stack with their concatenation.
+static void concatenate(VM* vm) {
+  // Peek at the stack, don't pop. This keeps them safe from the GC.
+  ObjString* b = AS_STRING(vm->stackTop[-1]);
+  ObjString* a = AS_STRING(vm->stackTop[-2]);
+  ObjString* result = joinStrings(vm, a, b);
 
-  if (newSize > oldSize) {
-    if (vm->bytesAllocated > vm->nextGC) {
-      collectGarbage(vm);
-    }
-  }
-  if (newSize == 0) {
-    free(pointer);
-    return NULL;
-  }
-  void* result = realloc(pointer, newSize);
-  if (result == NULL) exit(1);
-  return result;
+  // Now that the new string is created, pop the operands and push the result.
+  vm->stackTop -= 2;
+  *vm->stackTop++ = OBJ_VAL(result);
 }
 
-static char* readTextFile(const char* path) {
+static uint8_t* readBytecodeFile(const char* path, size_t* out_fileSize) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) return NULL;
 
     fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
+    *out_fileSize = ftell(file);
     rewind(file);
 
-    char* buffer = (char*)malloc(fileSize + 1);
+    uint8_t* buffer = (uint8_t*)malloc(*out_fileSize);
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        fclose(file);
-        return NULL;
+        fprintf(stderr, "Not enough memory to read bytecode file \"%s\".\n", path);
+        exit(74);
+    }
+
+    size_t bytesRead = fread(buffer, sizeof(uint8_t), *out_fileSize, file);
+    if (bytesRead < *out_fileSize) {
+        fprintf(stderr, "Could not read entire file \"%s\".\n", path);
+        exit(74);
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    buffer[bytesRead] = '\0';
     fclose(file);
     return buffer;
 }
 
-static bool writeTextFile(const char* path, const char* content) {
-    FILE* file = fopen(path, "w");
-    if (file == NULL) {
-        return false;
+// What the 16-bit operand of an instruction refers to, if it has one the
+// loader has to rebind.
+typedef enum {
+  OPERAND_NONE,
+  OPERAND_GLOBAL,
+  OPERAND_CONSTANT,
+  OPERAND_FUNCTION,
+} OperandKind;
+
+static OperandKind operandKind(uint8_t instruction, bool registers) {
+  if (registers) {
+    switch (instruction) {
+      case R_GET_GLOBAL:
+      case R_SET_GLOBAL: return OPERAND_GLOBAL;
+      case R_CONSTANT:   return OPERAND_CONSTANT;
+      case R_FUNCTION:   return OPERAND_FUNCTION;
+      default:           return OPERAND_NONE;
     }
-    size_t contentLength = strlen(content);
-    size_t bytesWritten = fwrite(content, sizeof(char), contentLength, file);
-    fclose(file);
-    return bytesWritten == contentLength;
-}
-
-
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
   }
-  return hash;
+  switch (instruction) {
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_POP: return OPERAND_GLOBAL;
+    case OP_CONSTANT:            return OPERAND_CONSTANT;
+    case OP_FUNCTION:            return OPERAND_FUNCTION;
+    default:                     return OPERAND_NONE;
+  }
 }
 
-static uint32_t hashValue(Value value) {
-  if (IS_STRING(value)) return AS_STRING(value)->hash;
-  return 0;
+// The frame size given by the R_ENTER that register code must start each
+// function with, or 0 if there is none that fits `arity`.
+static int enterRegisters(const uint8_t* code, uint32_t codeSize,
+                          uint32_t address, int arity) {
+  if (address + 1 >= codeSize || code[address] != R_ENTER) return 0;
+  int registers = code[address + 1];
+  return registers > arity ? registers : 0;
 }
 
-static CanopyEntry* findCanopyEntry(CanopyEntry* entries, int capacity,
-                                    Value key) {
-  uint32_t index = hashValue(key) % capacity;
-  for (;;) {
-    CanopyEntry* entry = &entries[index];
-    if (IS_NIL(entry->key) || valuesEqual(entry->key, key)) {
-      return entry;
+// Reorders the handler table of `module` so that each function's entries are
+// together, the top-level code's first and then each tribe's in the order of
+// the function table, keeping their innermost-first order. Returns NULL when
+// an entry belongs to no function or would put the error outside a register
+// frame.
+static TumbleHandler* groupHandlers(ApbModule* module) {
+  TumbleHandler* grouped = (TumbleHandler*)malloc(
+      sizeof(TumbleHandler) * (module->handlerCount > 0 ? module->handlerCount : 1));
+  if (grouped == NULL) exit(1);
+  bool registers = (module->flags & APB_FLAG_REGISTERS) != 0;
+  int count = 0;
+  for (int f = -1; f < module->functionCount; f++) {
+    uint32_t address = f < 0 ? 0 : module->functions[f].address;
+    int arity = f < 0 ? 0 : module->functions[f].arity;
+    int frameSize = enterRegisters(module->code, module->codeSize, address, arity);
+    for (int i = 0; i < module->handlerCount; i++) {
+      TumbleHandler* handler = &module->handlers[i];
+      if (handler->function != address) continue;
+      if (count == module->handlerCount ||
+          (registers && handler->slot >= frameSize)) {
+        free(grouped);
+        return NULL;
+      }
+      grouped[count++] = *handler;
     }
-    index = (index + 1) % capacity;
   }
+  if (count != module->handlerCount) {
+    free(grouped);
+    return NULL;
+  }
+  return grouped;
 }
 
-static bool canopySet(ObjCanopy* canopy, Value key, Value value) {
-  CanopyEntry* entry = findCanopyEntry(canopy->entries, canopy->capacity, key);
-  bool isNewKey = IS_NIL(entry->key);
-  if (isNewKey && IS_NIL(entry->value)) canopy->count++;
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
-}
-
-static bool canopyGet(ObjCanopy* canopy, Value key, Value* value) {
-  if (canopy->count == 0) return false;
-  CanopyEntry* entry = findCanopyEntry(canopy->entries, canopy->capacity, key);
-  if (IS_NIL(entry->key)) return false;
-  *value = entry->value;
-  return true;
+// How many of the `available` grouped handlers from `handlers` on belong to
+// the function at `address`.
+static int countHandlers(const TumbleHandler* handlers, int available,
+                         uint32_t address) {
+  int count = 0;
+  while (count < available && handlers[count].function == address) count++;
+  return count;
 }
 
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
+// Turns an .apb image into a module function that owns a private copy of the
+// code. Everything the code refers to by number is bound here, once: global
+// slots are mapped onto the VM's globals by name, and the module's constants
+// are materialised into vm->constants. The operands are rewritten in place to
+// the VM-wide indices. Returns NULL and reports the problem when the image is
+// malformed.
+static ObjFunction* loadModule(VM* vm, const uint8_t* image, size_t size,
+                               ObjString* name, const char* path) {
+  ApbModule module;
+  if (!readApb(image, size, &module)) {
+    fprintf(stderr, "\"%s\" is not a valid ApesLang bytecode file.\n", path);
+    return NULL;
+  }
+  if (vm->constantCount + module.constantCount + module.functionCount > CONSTANTS_MAX) {
+    fprintf(stderr, "Too many constants while loading \"%s\".\n", path);
+    freeApb(&module);
+    return NULL;
+  }
 
-static int findVariable(VM* vm, const char* name, int len) {
-  for (int i = 0; i < vm->variableCount; i++) {
-    if (vm->variables[i].nameLen == len &&
-        memcmp(vm->variables[i].name, name, len) == 0) {
-      return i;
+  uint16_t* slots = (uint16_t*)malloc(sizeof(uint16_t) *
+                                      (module.globalCount > 0 ? module.globalCount : 1));
+  if (slots == NULL) exit(1);
+  for (int i = 0; i < module.globalCount; i++) {
+    int index = resolveGlobal(vm, module.globals[i].chars, module.globals[i].length);
+    if (index == -1) {
+      fprintf(stderr, "Too many global variables while loading \"%s\".\n", path);
+      free(slots);
+      freeApb(&module);
+      return NULL;
     }
+    slots[i] = (uint16_t)index;
   }
-  return -1;
-}
 
-static bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
-  switch (a.type) {
-    case VAL_BOOL:
-      return AS_BOOL(a) == AS_BOOL(b);
-    case VAL_NIL:
-      return true;
-    case VAL_NUMBER:
-      return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ: {
-      if (IS_STRING(a) && IS_STRING(b)) {
-        ObjString* aString = AS_STRING(a);
-        ObjString* bString = AS_STRING(b);
-        return aString->length == bString->length &&
-               memcmp(aString->chars, bString->chars, aString->length) == 0;
-      }
-      return AS_OBJ(a) == AS_OBJ(b);
+  // One trailing 255 stops run() if execution ever falls off the end.
+  uint8_t* code = (uint8_t*)malloc(module.codeSize + 1);
+  if (code == NULL) exit(1);
+  memcpy(code, module.code, module.codeSize);
+  code[module.codeSize] = 255;
+
+  // The module's constants and then its tribe prototypes are appended to
+  // vm->constants, in that order.
+  int firstConstant = vm->constantCount;
+  int firstFunction = firstConstant + module.constantCount;
+  bool registers = (module.flags & APB_FLAG_REGISTERS) != 0;
+  // Frames are given the stack the table asks for, so it must at least hold
+  // the callee, the arguments and, in register code, the registers.
+  int frame = registers ? enterRegisters(code, module.codeSize, 0, 0) : 0;
+  bool valid = module.stack > 0 && module.stack <= STACK_DEPTH_MAX &&
+               (!registers || (frame > 0 && (int)module.stack >= frame));
+  for (int i = 0; i < module.functionCount; i++) {
+    ApbFunction* proto = &module.functions[i];
+    frame = registers ? enterRegisters(code, module.codeSize, proto->address,
+                                       proto->arity)
+                      : 0;
+    if (proto->address >= module.codeSize ||
+        proto->stack <= (uint32_t)proto->arity || proto->stack > STACK_DEPTH_MAX ||
+        (registers && (frame == 0 || (int)proto->stack < frame))) {
+      valid = false;
     }
   }
-  return false;
-}
-static uint8_t* readBytecodeFile(const char* path, size_t* out_fileSize) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) return NULL;
-
-    fseek(file, 0L, SEEK_END);
-    *out_fileSize = ftell(file);
-    rewind(file);
-
-    uint8_t* buffer = (uint8_t*)malloc(*out_fileSize);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read bytecode file \"%s\".\n", path);
-        exit(74);
+  // Register instructions have their target register before the operand.
+  int operandOffset = registers ? 2 : 1;
+  for (uint32_t offset = 0; valid && offset < module.codeSize;
+       offset += registers ? registerInstructionLength(code, offset)
+                           : instructionLength(code, offset)) {
+    uint8_t* at = &code[offset + operandOffset];
+    uint16_t operand;
+    switch (operandKind(code[offset], registers)) {
+      case OPERAND_GLOBAL:
+        memcpy(&operand, at, sizeof(uint16_t));
+        valid = operand < module.globalCount;
+        if (valid) memcpy(at, &slots[operand], sizeof(uint16_t));
+        break;
+      case OPERAND_CONSTANT:
+        memcpy(&operand, at, sizeof(uint16_t));
+        valid = operand < module.constantCount;
+        operand = (uint16_t)(firstConstant + operand);
+        memcpy(at, &operand, sizeof(uint16_t));
+        break;
+      case OPERAND_FUNCTION:
+        memcpy(&operand, at, sizeof(uint16_t));
+        valid = operand < module.functionCount;
+        operand = (uint16_t)(firstFunction + operand);
+        memcpy(at, &operand, sizeof(uint16_t));
+        break;
+      case OPERAND_NONE:
+        break;
     }
+  }
+  free(slots);
+  TumbleHandler* handlers = valid ? groupHandlers(&module) : NULL;
+  if (handlers == NULL) {
+    fprintf(stderr, "\"%s\" is not a valid ApesLang bytecode file.\n", path);
+    free(code);
+    freeApb(&module);
+    return NULL;
+  }
 
-    size_t bytesRead = fread(buffer, sizeof(uint8_t), *out_fileSize, file);
-    if (bytesRead < *out_fileSize) {
-        fprintf(stderr, "Could not read entire file \"%s\".\n", path);
-        exit(74);
+  // Each constant is rooted in vm->constants as soon as it exists, before the
+  // next allocation can trigger a collection. What the loader makes lives as
+  // long as the program, so it starts in the old generation.
+  vm->allocateOld++;
+  for (int i = 0; i < module.constantCount; i++) {
+    ApbConstant* constant = &module.constants[i];
+    addConstant(vm, OBJ_VAL(copyString(vm, constant->chars, (int)constant->length)));
+  }
+
+  ObjFunction* function = newFunction(vm, 0, name);
+  function->code = code;
+  function->isModule = true; // This tells the GC to free the code buffer later.
+  if (registers) function->registers = enterRegisters(code, module.codeSize, 0, 0);
+  function->stack = (int)module.stack;
+  function->handlers = handlers;
+  function->handlerCount = countHandlers(handlers, module.handlerCount, 0);
+  int nextHandler = function->handlerCount;
+  function->calls = (CallCache*)calloc(module.codeSize / 2 + 1, sizeof(CallCache));
+  if (function->calls == NULL) exit(1);
+
+  // Tribes are instantiated once, here; OP_FUNCTION just pushes them. The
+  // module sits on the stack meanwhile so a collection cannot take it.
+  *vm->stackTop++ = OBJ_VAL(function);
+  for (int i = 0; i < module.functionCount; i++) {
+    ApbFunction* proto = &module.functions[i];
+    ObjFunction* tribe = newFunction(vm, proto->arity, NULL);
+    tribe->owner = function;
+    tribe->code_offset = proto->address;
+    tribe->stack = (int)proto->stack;
+    if (registers) {
+      tribe->registers = enterRegisters(code, module.codeSize, proto->address,
+                                        proto->arity);
     }
+    tribe->handlerCount = countHandlers(handlers + nextHandler,
+                                       module.handlerCount - nextHandler,
+                                       proto->address);
+    if (tribe->handlerCount > 0) tribe->handlers = handlers + nextHandler;
+    nextHandler += tribe->handlerCount;
+    addConstant(vm, OBJ_VAL(tribe));
+    tribe->name = copyString(vm, proto->name.chars, proto->name.length);
+  }
+  vm->stackTop--;
+  vm->allocateOld--;
+  vm->cacheEpoch++;
 
-    fclose(file);
-    return buffer;
+  freeApb(&module);
+  return function;
 }
 
 static bool call(VM* vm, ObjFunction* function, int argCount) {
+  if (!pushFrame(vm, function, argCount)) return false;
+  ObjFunction* owner = function->owner ? function->owner : function;
+  vm->frames[vm->frameCount - 1].ip = owner->code + function->code_offset;
+  return true;
+}
+
+// Resolves `callee`, called with `argCount` arguments by the call
+// instruction at `ip` in `frame`'s code, to the function to run, and sets
+// `entry` to where its code starts. The site's cache answers when it holds
+// this callee from the current epoch: the call that filled it has already
+// checked that it is a function of that arity, and the arity of a site never
+// changes. Otherwise the callee is checked and the cache refilled. A
+// module's code has one cache entry per two bytes; every call instruction is
+// at least two bytes long, so no two share an entry. Returns NULL after
+// reporting a runtime error.
+static inline ObjFunction* resolveCall(VM* vm, CallFrame* frame, const uint8_t* ip,
+                                       Value callee, int argCount, uint8_t** entry) {
+  ObjFunction* owner = frame->function->owner ? frame->function->owner
+                                              : frame->function;
+  CallCache* cache = &owner->calls[(ip - owner->code) >> 1];
+  if (IS_OBJ(callee) && AS_OBJ(callee) == cache->callee &&
+      cache->epoch == vm->cacheEpoch) {
+    vm->callCacheHits++;
+    *entry = cache->entry;
+    return (ObjFunction*)cache->callee;
+  }
+  vm->callCacheMisses++;
+  if (!IS_OBJ(callee) || !IS_FUNCTION(callee)) {
+    runtimeError(vm, "Can only call functions and tribes.");
+    return NULL;
+  }
+  ObjFunction* function = AS_FUNCTION(callee);
   if (argCount != function->arity) {
     runtimeError(vm, "Expected %d arguments but got %d for function %s.",
                  function->arity, argCount,
                  function->name ? function->name->chars : "<script>");
-    return false;
-  }
-  if (vm->frameCount == FRAMES_MAX) {
-    runtimeError(vm, "Stack overflow!");
-    return false;
+    return NULL;
   }
+  ObjFunction* calleeOwner = function->owner ? function->owner : function;
+  cache->callee = AS_OBJ(callee);
+  cache->entry = calleeOwner->code + function->code_offset;
+  cache->epoch = vm->cacheEpoch;
+  *entry = cache->entry;
+  return function;
+}
 
-  if (vm->frameCount + 1 > vm->maxFrameCount) {
-      vm->maxFrameCount = vm->frameCount + 1;
-  }
+// Calls the callee below the top `argCount` values for the call instruction
+// at `ip` in `frame`'s code.
+static inline bool callSite(VM* vm, CallFrame* frame, const uint8_t* ip,
+                            int argCount) {
+  uint8_t* entry;
+  ObjFunction* function =
+      resolveCall(vm, frame, ip, vm->stackTop[-1 - argCount], argCount, &entry);
+  if (function == NULL || !enterFrame(vm, function, argCount)) return false;
+  vm->frames[vm->frameCount - 1].ip = entry;
+  return true;
+}
 
-  CallFrame* frame = &vm->frames[vm->frameCount++];
+// Replaces `frame`'s tribe with the callee below the top `argCount` values,
+// for the tail call at `ip`: the callee and its arguments take over the
+// frame's slots, which may need more stack for the callee than they did.
+static bool tailCall(VM* vm, CallFrame* frame, const uint8_t* ip, int argCount) {
+  uint8_t* entry;
+  ObjFunction* function =
+      resolveCall(vm, frame, ip, vm->stackTop[-1 - argCount], argCount, &entry);
+  if (function == NULL || !fitFrame(vm, function, frame->slots)) return false;
+  memmove(frame->slots, vm->stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm->stackTop = frame->slots + argCount + 1;
   frame->function = function;
-
-  ObjFunction* owner = function->owner ? function->owner : function;
-  frame->ip = owner->code + function->code_offset;
-
-  frame->slots = vm->stackTop - argCount - 1;
+  frame->ip = entry;
   return true;
 }
 
-static bool callValue(VM* vm, Value callee, int argCount) {
-  if (IS_OBJ(callee) && IS_FUNCTION(callee)) {
-    return call(vm, AS_FUNCTION(callee), argCount);
+// Loads the module a `summon` names: "lib.ape" runs the compiled "lib.apb".
+// `registers` is whether the summoning code is register code; a module
+// compiled for the other loop is refused, since neither loop can run the
+// other's instructions.
+static ObjFunction* summonModule(VM* vm, Value pathValue, bool registers) {
+  if (!IS_STRING(pathValue)) {
+    runtimeError(vm, "summon path must be a string.");
+    return NULL;
   }
-  runtimeError(vm, "Can only call functions and tribes.");
-  return false;
-}
 
-void markValue(Value value) {
-  if (IS_OBJ(value)) markObject(AS_OBJ(value));
-}
+  char* ape_path = AS_CSTRING(pathValue);
+  int path_len = strlen(ape_path);
+  if (path_len <= 4 || strcmp(ape_path + path_len - 4, ".ape") != 0) {
+    runtimeError(vm, "Summon path must end in .ape");
+    return NULL;
+  }
+  char apb_path[1024];
+  if ((size_t)(path_len - 4) + sizeof(".apb") > sizeof(apb_path)) {
+    runtimeError(vm, "Summon path is too long.");
+    return NULL;
+  }
+  snprintf(apb_path, sizeof(apb_path), "%.*s.apb", path_len - 4, ape_path);
 
-void markObject(Obj* object) {
-  if (object == NULL || object->isMarked) return;
-  object->isMarked = true;
-  switch (object->type) {
-    case OBJ_FUNCTION: {
-      ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);
-      markObject((Obj*)function->owner);
-      break;
-    }
-    case OBJ_BUNCH: {
-      ObjBunch* bunch = (ObjBunch*)object;
-      for (int i = 0; i < bunch->count; i++) markValue(bunch->values[i]);
-      break;
-    }
-    case OBJ_CANOPY: {
-      ObjCanopy* canopy = (ObjCanopy*)object;
-      for (int i = 0; i < canopy->capacity; i++) {
-        markValue(canopy->entries[i].key);
-        markValue(canopy->entries[i].value);
-      }
-      break;
-    }
-    case OBJ_STRING:
-      break;
+  // The loader keeps the module on the stack while it builds the tribes,
+  // which can be one slot past the deepest point of the summoning frame.
+  if (vm->stackTop == vm->stackEnd && !growStack(vm, 1)) {
+    runtimeError(vm, "Stack overflow!");
+    return NULL;
   }
-}
 
-static void markRoots(VM* vm) {
-  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) markValue(*slot);
-  for (int i = 0; i < vm->variableCount; i++) markValue(vm->variables[i].value);
-  for (int i = 0; i < vm->frameCount; i++)
-    markObject((Obj*)vm->frames[i].function);
-  markValue(vm->stack[STACK_MAX - 1]);
+  // Read the bytecode from the .apb file.
+  size_t bytecode_size = 0;
+  uint8_t* bytecode_buffer = readBytecodeFile(apb_path, &bytecode_size);
+  if (bytecode_buffer == NULL) {
+    runtimeError(vm, "Cannot open or read module file '%s'. Compile it first.", apb_path);
+    return NULL;
+  }
+
+  ObjFunction* module = loadModule(vm, bytecode_buffer, bytecode_size,
+                                   AS_STRING(pathValue), apb_path);
+  free(bytecode_buffer);
+  if (module == NULL) {
+    runtimeError(vm, "Cannot load module file '%s'.", apb_path);
+    return NULL;
+  }
+  if ((module->registers > 0) != registers) {
+    runtimeError(vm, "Module file '%s' was compiled %s --registers; recompile it %s.",
+                 apb_path, registers ? "without" : "with",
+                 registers ? "with --registers" : "without it");
+    return NULL;
+  }
+  return module;
 }
 
-static void freeObject(VM* vm, Obj* object) {
-  switch (object->type) {
-    case OBJ_STRING: {
-      ObjString* string = (ObjString*)object;
-      reallocate(vm, object, sizeof(ObjString) + string->length + 1, 0);
-      break;
-    }
-    case OBJ_FUNCTION: {
-      ObjFunction* function = (ObjFunction*)object;
-      if (function->isModule) {
-        free(function->code);
-      }
-      reallocate(vm, object, sizeof(ObjFunction), 0);
-      break;
-    }
-    case OBJ_BUNCH: {
-      ObjBunch* bunch = (ObjBunch*)object;
-      reallocate(vm, bunch->values, sizeof(Value) * bunch->capacity, 0);
-      reallocate(vm, object, sizeof(ObjBunch), 0);
-      break;
-    }
-    case OBJ_CANOPY: {
-      ObjCanopy* canopy = (ObjCanopy*)object;
-      reallocate(vm, canopy->entries, sizeof(CanopyEntry) * canopy->capacity,
-                 0);
-      reallocate(vm, object, sizeof(ObjCanopy), 0);
-      break;
-    }
+#ifdef APE_JIT
+// Counts a call or loop iteration of `function` and tells whether the frame
+// running it should continue in machine code, compiling the tribe once it has
+// become hot.
+static inline bool jitHot(VM* vm, ObjFunction* function) {
+  if (function->jit == NULL &&
+      (++function->hotness != JIT_THRESHOLD || !jitCompile(vm, function))) {
+    return false;
   }
+  return vm->jitDepth < JIT_MAX_DEPTH;
 }
 
-static void sweep(VM* vm) {
-  Obj* previous = NULL;
-  Obj* object = vm->objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+// Runs the top frame, whose tribe has been compiled, from frame->ip until it
+// returns. Tail calls stay in this loop, natively or in the interpreter
+// depending on the tribe they go to. Returns false on an uncaught error.
+static bool finishFrame(VM* vm) {
+  JitStatus status;
+  bool hot = true;
+  vm->jitDepth++;
+  for (;;) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    void* entry = hot ? jitEntry(frame->function, frame->ip) : NULL;
+    if (entry != NULL) {
+      status = jitExecute(vm, entry);
     } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL)
-        previous->next = object;
-      else
-        vm->objects = object;
-      freeObject(vm, unreached);
+      status = run(vm, vm->frameCount) == VM_RESULT_OK ? JIT_RETURNED : JIT_ERROR;
     }
+    if (status != JIT_TAIL_CALL) break;
+    hot = jitHot(vm, vm->frames[vm->frameCount - 1].function);
   }
+  vm->jitDepth--;
+  return status == JIT_RETURNED;
 }
-
-void collectGarbage(VM* vm) {
-  vm->gcCycles++;
-  markRoots(vm);
-  sweep(vm);
-  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+#endif
+
+// Finds the tumble block that catches the runtime error just reported,
+// searching the frames from the top down to frame `baseFrame` - 1 in their
+// functions' handler tables. Nothing is recorded on the way into a block:
+// each frame's ip is past the opcode of the instruction that failed, or of
+// the call it waits on, and no further than that instruction's end, which is
+// enough to tell which blocks it is in. The frames above the one that
+// catches the error are dropped, and that one continues at the catch block
+// with the error in the catch variable. Returns false when no frame in range
+// catches it.
+static bool catchError(VM* vm, int baseFrame) {
+  for (int i = vm->frameCount - 1; i >= baseFrame - 1; i--) {
+    CallFrame* frame = &vm->frames[i];
+    ObjFunction* function = frame->function;
+    if (function->handlerCount == 0) continue;
+    ObjFunction* owner = function->owner ? function->owner : function;
+    const TumbleHandler* handler =
+        findHandler(function->handlers, function->handlerCount,
+                    (uint32_t)(frame->ip - owner->code - 1));
+    if (handler == NULL) continue;
+
+    vm->frameCount = i + 1;
+    for (int slot = handler->depth; slot < handler->slot; slot++) {
+      frame->slots[slot] = NIL_VAL;
+    }
+    frame->slots[handler->slot] = vm->lastError;
+    // Register code keeps the stack top at the end of the frame's registers.
+    vm->stackTop = frame->slots + (function->registers > 0 ? function->registers
+                                                           : handler->slot + 1);
+    frame->ip = owner->code + handler->target;
+    return true;
+  }
+  return false;
 }
 
-VMResult run(VM* vm) {
+// Runs the frames from `baseFrame` (a frame count) up until the frame at
+// baseFrame - 1 returns. Only the outermost loop starts at 1; machine code
+// starts nested loops for the tribes it calls that have not been compiled.
+VMResult run(VM* vm, int baseFrame) {
   CallFrame* frame = &vm->frames[vm->frameCount - 1];
+
+// With GCC and Clang every handler jumps straight to the next one through a
+// table of label addresses, so each opcode gets its own indirect branch
+// instead of sharing the switch's. Other compilers use the portable switch.
+#ifdef APE_COMPUTED_GOTO
+#define DISPATCH()                                                   \
+  do {                                                               \
+    COUNT_INSTRUCTION(*frame->ip);                                   \
+    instruction = *frame->ip++;                                      \
+    goto *dispatchTable[instruction];                                \
+  } while (false)
+#define CASE(name) op_##name
+#define CASE_HALT op_halt
+#define CASE_UNKNOWN op_unknown
+#else
+#define DISPATCH() goto dispatch
+#define CASE(name) case name
+#define CASE_HALT case 255
+#define CASE_UNKNOWN default
+#endif
+// Continues at the catch block of the tumble that catches a runtime error
+// that has been reported. When that is in an activation further down the C
+// stack, or there is none, this loop returns the error to its caller.
+#define THROW()                                                      \
+  do {                                                               \
+    if (!catchError(vm, baseFrame)) return VM_RESULT_RUNTIME_ERROR;  \
+    frame = &vm->frames[vm->frameCount - 1];                         \
+    DISPATCH();                                                      \
+  } while (false)
 #define RUNTIME_ERROR(...)                                           \
   do {                                                               \
     runtimeError(vm, __VA_ARGS__);                                   \
-    if (vm->tryHandlerCount > 0) {                                   \
-      TryHandler* handler = &vm->tryHandlers[--vm->tryHandlerCount]; \
-      vm->frameCount = handler->frameCount;                          \
-      vm->stackTop = handler->stackTop;                              \
-      *vm->stackTop++ = vm->stack[STACK_MAX - 1];                    \
-      frame = &vm->frames[vm->frameCount - 1];                       \
-      frame->ip = handler->catchIp;                                  \
-      continue;                                                      \
-    } else {                                                         \
-      return VM_RESULT_RUNTIME_ERROR;                                \
-    }                                                                \
+    THROW();                                                         \
   } while (false)
-#define BINARY_OP(valueType, op)                                        \
+#define BINARY_OP(valueType, op, quickened)                              \
   do {                                                                  \
     if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) { \
       RUNTIME_ERROR("Operands must be numbers.");                       \
@@ -357,442 +534,420 @@ VMResult run(VM* vm) {
     double b = AS_NUMBER(*--vm->stackTop);                              \
     double a = AS_NUMBER(*--vm->stackTop);                              \
     *vm->stackTop++ = valueType(a op b);                                \
+    QUICKEN(quickened);                                                 \
   } while (false)
 
+// A comparison fused with the conditional jump after it: pops both operands
+// and skips ahead unless `a op b` holds.
+#define COMPARE_JUMP(op)                                               \
+  do {                                                                 \
+    if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {\
+      RUNTIME_ERROR("Operands must be numbers.");                      \
+    }                                                                  \
+    uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);    \
+    frame->ip += 2;                                                    \
+    double b = AS_NUMBER(*--vm->stackTop);                             \
+    double a = AS_NUMBER(*--vm->stackTop);                             \
+    if (!(a op b)) frame->ip += offset;                                \
+  } while (false)
+
+// Quickening. A generic instruction that has just run rewrites its own
+// opcode byte into the form specialised for the operands it saw. The
+// quickened form re-checks only its guard; when the guard fails it puts the
+// generic opcode back and re-dispatches to it, which may quicken the site
+// again for the new operand types. Module code is a private copy made by the
+// loader, so patching it in place is safe.
+#define QUICKEN(quickened)                                             \
+  do {                                                                 \
+    frame->ip[-1] = (quickened);                                       \
+    vm->quickenings[(quickened)]++;                                    \
+  } while (false)
+#define DEQUICKEN(quickened, generic)                                  \
+  do {                                                                 \
+    vm->quickenMisses[(quickened)]++;                                  \
+    *--frame->ip = (generic);                                          \
+    DISPATCH();                                                        \
+  } while (false)
+#define QUICK_BINARY_OP(valueType, op, quickened, generic)             \
+  do {                                                                 \
+    if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {\
+      DEQUICKEN(quickened, generic);                                   \
+    }                                                                  \
+    double b = AS_NUMBER(*--vm->stackTop);                             \
+    double a = AS_NUMBER(*--vm->stackTop);                             \
+    *vm->stackTop++ = valueType(a op b);                               \
+  } while (false)
+
+// Once the tribe on top has machine code, runs the frame there to its end.
+// Calls, tail calls and loop back-edges count towards compiling it; a loop
+// continues natively at the instruction it was about to run.
+#ifdef APE_JIT
+#define JIT_FINISH_FRAME()                                             \
+  do {                                                                 \
+    if (jitHot(vm, frame->function)) {                                 \
+      if (!finishFrame(vm)) THROW();                                   \
+      if (vm->frameCount < baseFrame) return VM_RESULT_OK;             \
+      frame = &vm->frames[vm->frameCount - 1];                         \
+    }                                                                  \
+  } while (false)
+#else
+#define JIT_FINISH_FRAME() do { } while (false)
+#endif
+
+  uint8_t instruction;
+#ifdef APE_COMPUTED_GOTO
+  static void* dispatchTable[256];
+  if (dispatchTable[0] == NULL) {
+    for (int i = 0; i < 256; i++) dispatchTable[i] = &&op_unknown;
+#define DISPATCH_ENTRY(name) dispatchTable[name] = &&op_##name;
+    OPCODE_LIST(DISPATCH_ENTRY)
+#undef DISPATCH_ENTRY
+    dispatchTable[255] = &&op_halt;
+  }
+  DISPATCH();
+  {
+    {
+#else
   for (;;) {
-    uint8_t instruction = *frame->ip++;
+  dispatch:
+    COUNT_INSTRUCTION(*frame->ip);
+    instruction = *frame->ip++;
     switch (instruction) {
-      case OP_STRLEN: {
-        Value value = *--vm->stackTop;
-        if (!IS_STRING(value)) {
-          RUNTIME_ERROR("Operand must be a string.");
-        }
-        ObjString* string = AS_STRING(value);
-        *vm->stackTop++ = NUMBER_VAL((double)string->length);
-        break;
+#endif
+      CASE(OP_STRLEN):
+        if (!stringLength(vm, vm->stackTop[-1], &vm->stackTop[-1])) THROW();
+        DISPATCH();
+      CASE(OP_GRAFT): {
+        Value result;
+        if (!graftStrings(vm, vm->stackTop - 2, &result)) THROW();
+        vm->stackTop -= 2;
+        *vm->stackTop++ = result;
+        safePoint(vm);
+        DISPATCH();
       }
-      case OP_GRAFT: {
-        Value b_val = *--vm->stackTop;
-        Value a_val = *--vm->stackTop;
-        if (!IS_STRING(a_val) || !IS_STRING(b_val)) {
-          RUNTIME_ERROR("Operands for 'graft' must be strings.");
-        }
-        ObjString* a = AS_STRING(a_val);
-        ObjString* b = AS_STRING(b_val);
-        int new_length = a->length + b->length;
-        char* new_chars = (char*)malloc(new_length + 1);
-        memcpy(new_chars, a->chars, a->length);
-        memcpy(new_chars + a->length, b->chars, b->length);
-        new_chars[new_length] = '\0';
-        pushNewString(vm, new_chars, new_length);
-        free(new_chars);
-        break;
+      CASE(OP_SLICE): {
+        Value result;
+        if (!sliceString(vm, vm->stackTop - 3, &result)) THROW();
+        vm->stackTop -= 3;
+        *vm->stackTop++ = result;
+        safePoint(vm);
+        DISPATCH();
       }
-
-      case OP_SLICE: {
-        Value end_val = *--vm->stackTop;
-        Value start_val = *--vm->stackTop;
-        Value str_val = *--vm->stackTop;
-        if (!IS_STRING(str_val) || !IS_NUMBER(start_val) || !IS_NUMBER(end_val)) {
-            RUNTIME_ERROR("'slice' requires a string and two number indices.");
-        }
-        ObjString* string = AS_STRING(str_val);
-        int start = (int)AS_NUMBER(start_val);
-        int end = (int)AS_NUMBER(end_val);
-
-        if (start < 0 || end > string->length || start > end) {
-            RUNTIME_ERROR("Slice indices out of bounds.");
-        }
-        int slice_len = end - start;
-        pushNewString(vm, string->chars + start, slice_len);
-        break;
+      CASE(OP_SCAN): {
+        Value result;
+        if (!scanString(vm, vm->stackTop - 2, &result)) THROW();
+        vm->stackTop -= 2;
+        *vm->stackTop++ = result;
+        DISPATCH();
       }
-
-      case OP_SCAN: {
-        Value needle_val = *--vm->stackTop;
-        Value haystack_val = *--vm->stackTop;
-        if (!IS_STRING(haystack_val) || !IS_STRING(needle_val)) {
-            RUNTIME_ERROR("'scan' requires two strings.");
-        }
-        char* haystack = AS_CSTRING(haystack_val);
-        char* needle = AS_CSTRING(needle_val);
-        char* found = strstr(haystack, needle);
-        if (found) {
-            *vm->stackTop++ = NUMBER_VAL(found - haystack);
-        } else {
-            *vm->stackTop++ = NUMBER_VAL(-1);
-        }
-        break;
+      CASE(OP_SHED):
+        if (!shedString(vm, vm->stackTop[-1], &vm->stackTop[-1])) THROW();
+        safePoint(vm);
+        DISPATCH();
+
+      CASE(OP_PUSH): {
+        // Only numbers are still pushed inline, after a VAL_NUMBER type byte.
+        double num;
+        memcpy(&num, frame->ip + 1, sizeof(double));
+        *vm->stackTop++ = NUMBER_VAL(num);
+        frame->ip += 1 + sizeof(double);
+        DISPATCH();
       }
-
-      case OP_SHED: {
-        Value str_val = *--vm->stackTop;
-        if (!IS_STRING(str_val)) {
-            RUNTIME_ERROR("'shed' requires a string.");
-        }
-        ObjString* string = AS_STRING(str_val);
-        char* start = string->chars;
-        while (isspace((unsigned char)*start)) start++;
-        
-        char* end = string->chars + string->length - 1;
-        while (end > start && isspace((unsigned char)*end)) end--;
-        
-        int shed_len = (end - start) + 1;
-        pushNewString(vm, start, shed_len);
-        break;
+      CASE(OP_CONSTANT): {
+        uint16_t index;
+        memcpy(&index, frame->ip, sizeof(uint16_t));
+        frame->ip += sizeof(uint16_t);
+        *vm->stackTop++ = vm->constants[index];
+        DISPATCH();
       }
-
-      case OP_PUSH: {
-        ValueType type = (ValueType)*frame->ip++;
-        if (type == VAL_NUMBER) {
-          double num;
-          memcpy(&num, frame->ip, sizeof(double));
-          *vm->stackTop++ = NUMBER_VAL(num);
-          frame->ip += sizeof(double);
-        } else if (type == VAL_OBJ) {
-          ObjType objType = (ObjType)*frame->ip++;
-          if (objType == OBJ_STRING) {
-            uint8_t len = *frame->ip++;
-            size_t size = sizeof(ObjString) + len + 1;
-            ObjString* stringObj = (ObjString*)reallocate(vm, NULL, 0, size);
-            stringObj->obj.type = OBJ_STRING;
-            stringObj->length = len;
-            stringObj->chars = (char*)(stringObj + 1);
-            memcpy(stringObj->chars, frame->ip, len);
-            stringObj->chars[len] = '\0';
-            frame->ip += len;
-            stringObj->hash = hashString(stringObj->chars, len);
-            stringObj->obj.isMarked = false;
-            stringObj->obj.next = vm->objects;
-            vm->objects = (Obj*)stringObj;
-            *vm->stackTop++ = OBJ_VAL(stringObj);
-          } else if (objType == OBJ_FUNCTION) {
-            ObjFunction* function =
-                (ObjFunction*)reallocate(vm, NULL, 0, sizeof(ObjFunction));
-            function->obj.type = OBJ_FUNCTION;
-            function->arity = *frame->ip++;
-            uint32_t codeAddr;
-            memcpy(&codeAddr, frame->ip, sizeof(uint32_t));
-            frame->ip += sizeof(uint32_t);
-
-            function->owner = frame->function;
-            function->code_offset = codeAddr;
-            function->code = NULL; // This function doesn't own a code chunk.
-
-            uint8_t nameLen = *frame->ip++;
-            size_t nameSize = sizeof(ObjString) + nameLen + 1;
-            ObjString* nameString =
-                (ObjString*)reallocate(vm, NULL, 0, nameSize);
-            nameString->obj.type = OBJ_STRING;
-            nameString->length = nameLen;
-            nameString->chars = (char*)(nameString + 1);
-            memcpy(nameString->chars, frame->ip, nameLen);
-            nameString->chars[nameLen] = '\0';
-            frame->ip += nameLen;
-
-            function->name = nameString;
-            function->isModule = false;
-            function->obj.isMarked = false;
-            function->obj.next = vm->objects;
-            vm->objects = (Obj*)function;
-            nameString->obj.isMarked = false;
-            nameString->obj.next = vm->objects;
-            vm->objects = (Obj*)nameString;
-            *vm->stackTop++ = OBJ_VAL(function);
-          }
-        }
-        break;
+      CASE(OP_FUNCTION): {
+        uint16_t index;
+        memcpy(&index, frame->ip, sizeof(uint16_t));
+        frame->ip += sizeof(uint16_t);
+        *vm->stackTop++ = vm->constants[index];
+        DISPATCH();
       }
-      case OP_POP:
+      CASE(OP_POP):
         --vm->stackTop;
-        break;
-      case OP_NIL:
+        DISPATCH();
+      CASE(OP_NIL):
         *vm->stackTop++ = NIL_VAL;
-        break;
-      case OP_TRUE:
+        DISPATCH();
+      CASE(OP_TRUE):
         *vm->stackTop++ = BOOL_VAL(true);
-        break;
-      case OP_FALSE:
+        DISPATCH();
+      CASE(OP_FALSE):
         *vm->stackTop++ = BOOL_VAL(false);
-        break;
-      case OP_NOT: {
+        DISPATCH();
+      CASE(OP_NOT): {
         Value v = *(--vm->stackTop);
         *vm->stackTop++ = BOOL_VAL(isFalsey(v));
-        break;
+        DISPATCH();
       }
-      case OP_EQUAL: {
+      CASE(OP_EQUAL): {
         Value b = *--vm->stackTop;
         Value a = *--vm->stackTop;
         *vm->stackTop++ = BOOL_VAL(valuesEqual(a, b));
-        break;
+        if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(OP_EQUAL_NUM);
+        DISPATCH();
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD: {
+      CASE(OP_NOT_EQUAL): {
+        Value b = *--vm->stackTop;
+        Value a = *--vm->stackTop;
+        *vm->stackTop++ = BOOL_VAL(!valuesEqual(a, b));
+        DISPATCH();
+      }
+      // `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, as they were when
+      // they compiled to a comparison and OP_NOT.
+      CASE(OP_GREATER_EQUAL): {
+        if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        double b = AS_NUMBER(*--vm->stackTop);
+        double a = AS_NUMBER(*--vm->stackTop);
+        *vm->stackTop++ = BOOL_VAL(!(a < b));
+        DISPATCH();
+      }
+      CASE(OP_LESS_EQUAL): {
+        if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        double b = AS_NUMBER(*--vm->stackTop);
+        double a = AS_NUMBER(*--vm->stackTop);
+        *vm->stackTop++ = BOOL_VAL(!(a > b));
+        DISPATCH();
+      }
+      CASE(OP_EQUAL_NUM):
+        QUICK_BINARY_OP(BOOL_VAL, ==, OP_EQUAL_NUM, OP_EQUAL);
+        DISPATCH();
+      CASE(OP_GREATER):
+        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+        DISPATCH();
+      CASE(OP_GREATER_NUM):
+        QUICK_BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM, OP_GREATER);
+        DISPATCH();
+      CASE(OP_LESS):
+        BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+        DISPATCH();
+      CASE(OP_LESS_NUM):
+        QUICK_BINARY_OP(BOOL_VAL, <, OP_LESS_NUM, OP_LESS);
+        DISPATCH();
+      CASE(OP_ADD): {
         if (IS_NUMBER(vm->stackTop[-1]) && IS_NUMBER(vm->stackTop[-2])) {
             double b = AS_NUMBER(*--vm->stackTop);
             double a = AS_NUMBER(*--vm->stackTop);
             *vm->stackTop++ = NUMBER_VAL(a + b);
+            QUICKEN(OP_ADD_NUM);
         } else if (IS_STRING(vm->stackTop[-1]) && IS_STRING(vm->stackTop[-2])) {
-            // Peek at the stack, don't pop. This keeps them safe from the GC.
-            ObjString* b = AS_STRING(vm->stackTop[-1]);
-            ObjString* a = AS_STRING(vm->stackTop[-2]);
-
-            int length = a->length + b->length;
-            size_t size = sizeof(ObjString) + length + 1;
-            
-            // Allocation might trigger GC. 'a' and 'b' are safe on the stack.
-            ObjString* result = (ObjString*)reallocate(vm, NULL, 0, size);
-            result->obj.type = OBJ_STRING;
-            result->length = length;
-            result->chars = (char*)(result + 1);
-            memcpy(result->chars, a->chars, a->length);
-            memcpy(result->chars + a->length, b->chars, b->length);
-            result->chars[length] = '\0';
-            
-            result->hash = hashString(result->chars, length);
-            result->obj.isMarked = false;
-            result->obj.next = vm->objects;
-            vm->objects = (Obj*)result;
-
-            // Now that the new string is created, pop the operands and push the result.
-            vm->stackTop -= 2;
-            *vm->stackTop++ = OBJ_VAL(result);
+            concatenate(vm);
+            QUICKEN(OP_ADD_STR);
+            safePoint(vm);
         } else {
             RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUB:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MUL:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIV:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_ADD_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, +, OP_ADD_NUM, OP_ADD);
+        DISPATCH();
+      CASE(OP_ADD_STR): {
+        if (!IS_STRING(vm->stackTop[-1]) || !IS_STRING(vm->stackTop[-2])) {
+          DEQUICKEN(OP_ADD_STR, OP_ADD);
+        }
+        concatenate(vm);
+        safePoint(vm);
+        DISPATCH();
+      }
+      CASE(OP_SUB):
+        BINARY_OP(NUMBER_VAL, -, OP_SUB_NUM);
+        DISPATCH();
+      CASE(OP_SUB_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, -, OP_SUB_NUM, OP_SUB);
+        DISPATCH();
+      CASE(OP_MUL):
+        BINARY_OP(NUMBER_VAL, *, OP_MUL_NUM);
+        DISPATCH();
+      CASE(OP_MUL_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, *, OP_MUL_NUM, OP_MUL);
+        DISPATCH();
+      CASE(OP_DIV):
+        BINARY_OP(NUMBER_VAL, /, OP_DIV_NUM);
+        DISPATCH();
+      CASE(OP_DIV_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, /, OP_DIV_NUM, OP_DIV);
+        DISPATCH();
+      CASE(OP_JUMP_IF_FALSE): {
         uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
         frame->ip += 2;
         if (isFalsey(vm->stackTop[-1])) frame->ip += offset;
-        break;
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_POP_JUMP_IF_FALSE): {
         uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
-        frame->ip += 2 + offset;
-        break;
+        frame->ip += 2;
+        if (isFalsey(*--vm->stackTop)) frame->ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_JUMP_IF_NOT_LESS):
+        COMPARE_JUMP(<);
+        DISPATCH();
+      CASE(OP_JUMP_IF_NOT_GREATER):
+        COMPARE_JUMP(>);
+        DISPATCH();
+      CASE(OP_JUMP_IF_NOT_EQUAL): {
         uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
         frame->ip += 2;
-        frame->ip -= offset;
-        break;
+        vm->stackTop -= 2;
+        if (!valuesEqual(vm->stackTop[0], vm->stackTop[1])) frame->ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP_START:
-        vm->loop_counters[vm->loop_counter_top++] = AS_NUMBER(*--vm->stackTop);
-        break;
-      case OP_JUMP_BACK: {
-        uint32_t target_offset;
-        memcpy(&target_offset, frame->ip, sizeof(uint32_t));
-        vm->loop_counters[vm->loop_counter_top - 1]--;
-        if (vm->loop_counters[vm->loop_counter_top - 1] > 0) {
-          ObjFunction* owner = frame->function->owner ? frame->function->owner : frame->function;
-          frame->ip = owner->code + target_offset;
-        } else {
-          vm->loop_counter_top--;
-          frame->ip += sizeof(uint32_t);
-        }
-        break;
+      CASE(OP_JUMP): {
+        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
+        frame->ip += 2 + offset;
+        DISPATCH();
       }
-      case OP_PRINT: {
-        printValue(*--vm->stackTop);
-        printf("\n");
-        break;
+      CASE(OP_LOOP): {
+        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
+        frame->ip += 2 - offset;
+        JIT_FINISH_FRAME();
+        DISPATCH();
       }
-      case OP_ASK: {
-        char line[1024];
-        if (!fgets(line, sizeof(line), stdin)) {
-          *vm->stackTop++ = NIL_VAL;
-          break;
+      // A swing count is a hidden local of the frame. It goes round again
+      // while more than one pass is left; a count that isn't a number runs
+      // the body once.
+      CASE(OP_SWING_COUNT): {
+        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
+        Value* counter = &frame->slots[frame->ip[2]];
+        frame->ip += 3;
+        if (IS_NUMBER(*counter) && AS_NUMBER(*counter) > 1) {
+          *counter = NUMBER_VAL(AS_NUMBER(*counter) - 1);
+          frame->ip -= offset;
+          JIT_FINISH_FRAME();
         }
-
-        line[strcspn(line, "\r\n")] = 0;
-
-        if (line[0] == '\0') {
-          *vm->stackTop++ = NIL_VAL;
-          break;
+        DISPATCH();
+      }
+      // `swing i from a to b` keeps i in the slot operand and b in the one
+      // after it.
+      CASE(OP_SWING_RANGE): {
+        Value* bounds = &frame->slots[frame->ip[2]];
+        if (!IS_NUMBER(bounds[0]) || !IS_NUMBER(bounds[1])) {
+          RUNTIME_ERROR("Swing bounds must be numbers.");
         }
-
-        char* end;
-        double value = strtod(line, &end);
-
-        if (*end == '\0') {
-          *vm->stackTop++ = NUMBER_VAL(value);
-        } else {
-          int len = strlen(line);
-          size_t size = sizeof(ObjString) + len + 1;
-          ObjString* obj = (ObjString*)reallocate(vm, NULL, 0, size);
-          obj->obj.type = OBJ_STRING;
-          obj->length = len;
-          obj->chars = (char*)(obj + 1);
-          memcpy(obj->chars, line, len + 1);
-          obj->hash = hashString(obj->chars, len);
-          obj->obj.isMarked = false;
-          obj->obj.next = vm->objects;
-          vm->objects = (Obj*)obj;
-          *vm->stackTop++ = OBJ_VAL(obj);
+        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
+        frame->ip += 3;
+        if (!(AS_NUMBER(bounds[0]) <= AS_NUMBER(bounds[1]))) frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_SWING_STEP): {
+        Value* bounds = &frame->slots[frame->ip[2]];
+        if (!IS_NUMBER(bounds[0])) RUNTIME_ERROR("Swing variable must be a number.");
+        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
+        double next = AS_NUMBER(bounds[0]) + 1;
+        bounds[0] = NUMBER_VAL(next);
+        frame->ip += 3;
+        if (next <= AS_NUMBER(bounds[1])) {
+          frame->ip -= offset;
+          JIT_FINISH_FRAME();
         }
-        break;
+        DISPATCH();
+      }
+      CASE(OP_PRINT): {
+        printValue(*--vm->stackTop);
+        printf("\n");
+        DISPATCH();
+      }
+      CASE(OP_ASK): {
+        Value line = askLine(vm);
+        *vm->stackTop++ = line;
+        safePoint(vm);
+        DISPATCH();
       }
-      case OP_GET_LOCAL:
+      CASE(OP_GET_LOCAL):
         *vm->stackTop++ = frame->slots[*frame->ip++];
-        break;
-      case OP_SET_LOCAL:
+        DISPATCH();
+      CASE(OP_SET_LOCAL):
         frame->slots[*frame->ip++] = vm->stackTop[-1];
-        break;
-      case OP_GET_GLOBAL: {
-        uint8_t len = *frame->ip++;
-        char name[256];
-        memcpy(name, frame->ip, len);
-        frame->ip += len;
-        int index = findVariable(vm, name, len);
-        if (index == -1) {
-          RUNTIME_ERROR("Undefined variable '%.*s'.", len, name);
-        } else {
-          *vm->stackTop++ = vm->variables[index].value;
+        DISPATCH();
+      CASE(OP_GET_LOCAL_PAIR):
+        vm->stackTop[0] = frame->slots[frame->ip[0]];
+        vm->stackTop[1] = frame->slots[frame->ip[1]];
+        vm->stackTop += 2;
+        frame->ip += 2;
+        DISPATCH();
+      CASE(OP_SET_LOCAL_POP):
+        frame->slots[*frame->ip++] = *--vm->stackTop;
+        DISPATCH();
+      CASE(OP_GET_GLOBAL_SLOT): {
+        uint16_t slot;
+        memcpy(&slot, frame->ip, sizeof(uint16_t));
+        frame->ip += sizeof(uint16_t);
+        Global* global = &vm->globals[slot];
+        if (!global->defined) {
+          RUNTIME_ERROR("Undefined variable '%.*s'.", global->nameLen, global->name);
         }
-        break;
+        *vm->stackTop++ = global->value;
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
-        uint8_t len = *frame->ip++;
-        char name[256];
-        memcpy(name, frame->ip, len);
-        name[len] = '\0';
-        frame->ip += len;
-        int index = findVariable(vm, name, len);
-        if (index == -1) {
-          index = vm->variableCount++;
-          vm->variables[index].name = (char*)malloc(len + 1);
-          strcpy(vm->variables[index].name, name);
-          vm->variables[index].nameLen = len;
-        }
-        vm->variables[index].value = vm->stackTop[-1];
-        break;
+      CASE(OP_SET_GLOBAL_SLOT): {
+        uint16_t slot;
+        memcpy(&slot, frame->ip, sizeof(uint16_t));
+        frame->ip += sizeof(uint16_t);
+        vm->globals[slot].value = vm->stackTop[-1];
+        vm->globals[slot].defined = true;
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL_SLOT_POP): {
+        uint16_t slot;
+        memcpy(&slot, frame->ip, sizeof(uint16_t));
+        frame->ip += sizeof(uint16_t);
+        vm->globals[slot].value = *--vm->stackTop;
+        vm->globals[slot].defined = true;
+        DISPATCH();
       }
-      case OP_BUILD_BUNCH: {
+      CASE(OP_BUILD_BUNCH): {
         uint8_t itemCount = *frame->ip++;
-        ObjBunch* bunch = (ObjBunch*)reallocate(vm, NULL, 0, sizeof(ObjBunch));
-        bunch->obj.type = OBJ_BUNCH;
-        bunch->values =
-            (Value*)reallocate(vm, NULL, 0, sizeof(Value) * itemCount);
-        bunch->count = itemCount;
-        bunch->capacity = itemCount;
-        memcpy(bunch->values, vm->stackTop - itemCount,
-               sizeof(Value) * itemCount);
+        Value bunch = newBunch(vm, vm->stackTop - itemCount, itemCount);
         vm->stackTop -= itemCount;
-        bunch->obj.isMarked = false;
-        bunch->obj.next = vm->objects;
-        vm->objects = (Obj*)bunch;
-        *vm->stackTop++ = OBJ_VAL(bunch);
-        break;
+        *vm->stackTop++ = bunch;
+        safePoint(vm);
+        DISPATCH();
       }
-      case OP_BUILD_CANOPY: {
+      CASE(OP_BUILD_CANOPY): {
         uint8_t itemCount = *frame->ip++;
-        ObjCanopy* canopy =
-            (ObjCanopy*)reallocate(vm, NULL, 0, sizeof(ObjCanopy));
-        canopy->obj.type = OBJ_CANOPY;
-        canopy->count = 0;
-        canopy->capacity = itemCount > 0 ? itemCount * 2 : 8;
-        canopy->entries = (CanopyEntry*)reallocate(
-            vm, NULL, 0, sizeof(CanopyEntry) * canopy->capacity);
-        for (int i = 0; i < canopy->capacity; i++) {
-          canopy->entries[i].key = NIL_VAL;
-          canopy->entries[i].value = NIL_VAL;
-        }
-        for (int i = 0; i < itemCount; i++) {
-          Value value = vm->stackTop[-1];
-          Value key = vm->stackTop[-2];
-          vm->stackTop -= 2;
-          canopySet(canopy, key, value);
-        }
-        canopy->obj.isMarked = false;
-        canopy->obj.next = vm->objects;
-        vm->objects = (Obj*)canopy;
-        *vm->stackTop++ = OBJ_VAL(canopy);
-        break;
+        Value canopy = newCanopy(vm, vm->stackTop - 2 * itemCount, itemCount);
+        vm->stackTop -= 2 * itemCount;
+        *vm->stackTop++ = canopy;
+        safePoint(vm);
+        DISPATCH();
       }
-      case OP_GET_SUBSCRIPT: {
-        Value index = *--vm->stackTop;
-        Value collection = *--vm->stackTop;
-        if (IS_BUNCH(collection)) {
-          ObjBunch* bunch = AS_BUNCH(collection);
-          if (!IS_NUMBER(index)) RUNTIME_ERROR("Bunch index must be a number.");
-          int i = (int)AS_NUMBER(index);
-          if (i < 0 || i >= bunch->count)
-            *vm->stackTop++ = NIL_VAL;
-          else
-            *vm->stackTop++ = bunch->values[i];
-        } else if (IS_CANOPY(collection)) {
-          ObjCanopy* canopy = AS_CANOPY(collection);
-          if (!IS_STRING(index)) RUNTIME_ERROR("Canopy keys must be strings.");
-          Value value;
-          if (canopyGet(canopy, index, &value))
-            *vm->stackTop++ = value;
-          else
-            *vm->stackTop++ = NIL_VAL;
-        } else {
-          RUNTIME_ERROR(
-              "Subscript operator can only be used on bunches and canopies.");
-        }
-        break;
+      CASE(OP_GET_SUBSCRIPT): {
+        Value result;
+        if (!getSubscript(vm, vm->stackTop[-2], vm->stackTop[-1], &result)) THROW();
+        vm->stackTop -= 2;
+        *vm->stackTop++ = result;
+        DISPATCH();
       }
-      case OP_SET_SUBSCRIPT: {
-        Value value = *--vm->stackTop;
-        Value index = *--vm->stackTop;
-        Value collection = *--vm->stackTop;
-        if (IS_BUNCH(collection)) {
-          ObjBunch* bunch = AS_BUNCH(collection);
-          if (!IS_NUMBER(index)) RUNTIME_ERROR("Bunch index must be a number.");
-          int i = (int)AS_NUMBER(index);
-          if (i < 0 || i >= bunch->count)
-            RUNTIME_ERROR("Bunch index out of bounds.");
-          bunch->values[i] = value;
-          *vm->stackTop++ = value;
-        } else if (IS_CANOPY(collection)) {
-          ObjCanopy* canopy = AS_CANOPY(collection);
-          if (!IS_STRING(index)) RUNTIME_ERROR("Canopy keys must be strings.");
-          canopySet(canopy, index, value);
-          *vm->stackTop++ = value;
-        } else {
-          RUNTIME_ERROR(
-              "Subscript operator can only be used on bunches and canopies.");
-        }
-        break;
+      CASE(OP_SET_SUBSCRIPT): {
+        Value value = vm->stackTop[-1];
+        if (!setSubscript(vm, vm->stackTop[-3], vm->stackTop[-2], value)) THROW();
+        vm->stackTop -= 3;
+        *vm->stackTop++ = value;
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         uint8_t argCount = *frame->ip++;
-        if (!callValue(vm, vm->stackTop[-1 - argCount], argCount)) {
-          if (vm->tryHandlerCount > 0) {
-            TryHandler* handler = &vm->tryHandlers[--vm->tryHandlerCount];
-            vm->frameCount = handler->frameCount;
-            vm->stackTop = handler->stackTop;
-            *vm->stackTop++ = vm->stack[STACK_MAX - 1];
-            frame = &vm->frames[vm->frameCount - 1];
-            frame->ip = handler->catchIp;
-            continue;
-          } else {
-            return VM_RESULT_RUNTIME_ERROR;
-          }
-        }
+        if (!callSite(vm, frame, frame->ip - 2, argCount)) THROW();
         frame = &vm->frames[vm->frameCount - 1];
-        break;
+        JIT_FINISH_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_TAIL_CALL): {
+        uint8_t argCount = *frame->ip++;
+        if (!tailCall(vm, frame, frame->ip - 2, argCount)) THROW();
+        JIT_FINISH_FRAME();
+        DISPATCH();
       }
-      case OP_RETURN: {
+      CASE(OP_RETURN): {
         Value result = *--vm->stackTop;
         vm->frameCount--;
         if (vm->frameCount == 0) {
@@ -801,220 +956,613 @@ VMResult run(VM* vm) {
         }
         vm->stackTop = frame->slots;
         *vm->stackTop++ = result;
+        if (vm->frameCount < baseFrame) return VM_RESULT_OK;
         frame = &vm->frames[vm->frameCount - 1];
-        break;
-      }
-      case OP_TUMBLE_SETUP: {
-        if (vm->tryHandlerCount == HANDLER_MAX)
-          RUNTIME_ERROR("Exceeded maximum nested tumble blocks.");
-        uint16_t offset = (uint16_t)(frame->ip[0] << 8 | frame->ip[1]);
-        frame->ip += 2;
-        TryHandler* handler = &vm->tryHandlers[vm->tryHandlerCount++];
-        handler->catchIp = frame->ip + offset;
-        handler->frameCount = vm->frameCount;
-        handler->stackTop = vm->stackTop;
-        break;
+        DISPATCH();
       }
-      case OP_TUMBLE_END:
-        vm->tryHandlerCount--;
-        break;
-      case OP_FORAGE: {
-        Value pathValue = *--vm->stackTop;
-        if (!IS_STRING(pathValue)) {
-            RUNTIME_ERROR("'forage' path must be a string.");
-        }
-        char* path = AS_CSTRING(pathValue);
-        char* content = readTextFile(path);
-
-        if (content == NULL) {
-            *vm->stackTop++ = NIL_VAL; // Push nil on failure
-        } else {
-            int len = strlen(content);
-            size_t size = sizeof(ObjString) + len + 1;
-            ObjString* obj = (ObjString*)reallocate(vm, NULL, 0, size);
-            obj->obj.type = OBJ_STRING;
-            obj->length = len;
-            obj->chars = (char*)(obj + 1);
-            memcpy(obj->chars, content, len + 1);
-            obj->hash = hashString(obj->chars, len);
-            obj->obj.isMarked = false;
-            obj->obj.next = vm->objects;
-            vm->objects = (Obj*)obj;
-            *vm->stackTop++ = OBJ_VAL(obj);
-            free(content);
-        }
-        break;
-      }
-      case OP_INSCRIBE: {
-        Value contentValue = *--vm->stackTop;
-        Value pathValue = *--vm->stackTop;
-        if (!IS_STRING(pathValue) || !IS_STRING(contentValue)) {
-            RUNTIME_ERROR("'inscribe' arguments must be strings.");
-        }
-        char* path = AS_CSTRING(pathValue);
-        char* content = AS_CSTRING(contentValue);
-
-        bool success = writeTextFile(path, content);
-        *vm->stackTop++ = BOOL_VAL(success);
-        break;
+      CASE(OP_FORAGE):
+        if (!forage(vm, vm->stackTop[-1], &vm->stackTop[-1])) THROW();
+        safePoint(vm);
+        DISPATCH();
+      CASE(OP_INSCRIBE): {
+        Value result;
+        if (!inscribe(vm, vm->stackTop[-2], vm->stackTop[-1], &result)) THROW();
+        vm->stackTop -= 2;
+        *vm->stackTop++ = result;
+        DISPATCH();
       }
-       case OP_SUMMON: {
-        Value pathValue = *--vm->stackTop;
-        if (!IS_STRING(pathValue)) {
-          RUNTIME_ERROR("summon path must be a string.");
-        }
-        
-        char* ape_path = AS_CSTRING(pathValue);
-        int path_len = strlen(ape_path);
-        if (path_len <= 4 || strcmp(ape_path + path_len - 4, ".ape") != 0) {
-            RUNTIME_ERROR("Summon path must end in .ape");
-        }
-        char apb_path[1024];
-        strncpy(apb_path, ape_path, path_len - 4);
-        apb_path[path_len - 4] = '\0';
-        strcat(apb_path, ".apb");
+      CASE(OP_SUMMON): {
+        // The path stays on the stack while the module loads so the GC can
+        // see it; the module function then takes its slot.
+        ObjFunction* moduleFunc = summonModule(vm, vm->stackTop[-1], false);
+        if (moduleFunc == NULL) THROW();
+        vm->stackTop[-1] = OBJ_VAL(moduleFunc);
 
-        // Read the bytecode from the .apb file.
-        size_t bytecode_size = 0;
-        uint8_t* bytecode_buffer = readBytecodeFile(apb_path, &bytecode_size);
-        if (bytecode_buffer == NULL) {
-            RUNTIME_ERROR("Cannot open or read module file '%s'. Compile it first.", apb_path);
-        }
-        
-        // Create the module function that will own this bytecode.
-        ObjFunction* moduleFunc =
-            (ObjFunction*)reallocate(vm, NULL, 0, sizeof(ObjFunction));
-        moduleFunc->obj.type = OBJ_FUNCTION;
-        moduleFunc->arity = 0;
-        moduleFunc->name = AS_STRING(pathValue);
-
-        // This function owns the new bytecode chunk.
-        moduleFunc->code = bytecode_buffer;
-        moduleFunc->isModule = true; // This tells the GC to free the code buffer later.
-        
-        moduleFunc->obj.isMarked = false;
-        moduleFunc->obj.next = vm->objects;
-        vm->objects = (Obj*)moduleFunc;
-        
         if (!call(vm, moduleFunc, 0)) {
             return VM_RESULT_RUNTIME_ERROR;
         }
         frame = &vm->frames[vm->frameCount - 1];
-        break;
+        DISPATCH();
       }
 
-      case 255:
+      CASE_HALT:
         return VM_RESULT_OK;
-      default:
+      CASE_UNKNOWN:
         RUNTIME_ERROR("Unknown opcode %d\n", instruction);
     }
   }
+#undef THROW
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef QUICK_BINARY_OP
+#undef COMPARE_JUMP
+#undef JIT_FINISH_FRAME
+#undef DISPATCH
+#undef CASE
+#undef CASE_HALT
+#undef CASE_UNKNOWN
 }
 
-static void runtimeError(VM* vm, const char* format, ...) {
-  char buffer[1024];
-  va_list args;
-  va_start(args, format);
-  vsnprintf(buffer, sizeof(buffer), format, args);
-  va_end(args);
-  fprintf(stderr, "Runtime Error: %s", buffer);
-  for (int i = vm->frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm->frames[i];
-    ObjFunction* function = frame->function;
-    fprintf(stderr, "\n[line ?] in %s()",
-            function->name ? function->name->chars : "<script>");
-  }
-  int len = strlen(buffer);
-  size_t size = sizeof(ObjString) + len + 1;
-  ObjString* errObj = (ObjString*)reallocate(vm, NULL, 0, size);
-  errObj->obj.type = OBJ_STRING;
-  errObj->length = len;
-  errObj->chars = (char*)(errObj + 1);
-  memcpy(errObj->chars, buffer, len + 1);
-  errObj->hash = hashString(errObj->chars, len);
-  errObj->obj.isMarked = false;
-  errObj->obj.next = vm->objects;
-  vm->objects = (Obj*)errObj;
-  vm->stack[STACK_MAX - 1] = OBJ_VAL(errObj);
-}
-
-void printValue(Value value) {
-  switch (value.type) {
-    case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
-      break;
-    case VAL_NIL:
-      printf("nil");
-      break;
-    case VAL_NUMBER:
-      printf("%g", AS_NUMBER(value));
-      break;
-    case VAL_OBJ:
-      switch (OBJ_TYPE(value)) {
-        case OBJ_STRING:
-          printf("%s", AS_CSTRING(value));
-          break;
-        case OBJ_FUNCTION:
-          if (AS_FUNCTION(value)->name == NULL)
-            printf("<script>");
-          else
-            printf("<tribe %s>", AS_FUNCTION(value)->name->chars);
-          break;
-        case OBJ_BUNCH: {
-          ObjBunch* bunch = AS_BUNCH(value);
-          printf("[");
-          for (int i = 0; i < bunch->count; i++) {
-            printValue(bunch->values[i]);
-            if (i < bunch->count - 1) printf(", ");
-          }
-          printf("]");
-          break;
-        }
-        case OBJ_CANOPY: {
-          ObjCanopy* canopy = AS_CANOPY(value);
-          printf("{");
-          int printed = 0;
-          for (int i = 0; i < canopy->capacity; i++) {
-            if (!IS_NIL(canopy->entries[i].key)) {
-              printValue(canopy->entries[i].key);
-              printf(": ");
-              printValue(canopy->entries[i].value);
-              if (printed < canopy->count - 1) printf(", ");
-              printed++;
-            }
-          }
-          printf("}");
-          break;
-        }
+#ifdef APE_JIT
+// The slow paths of compiled code, and the instructions it has no template
+// for. Runs the instruction at `ip` of the top frame on vm->stackTop, the way
+// run() does, and returns false once it has reported a runtime error. Jumps
+// are left to the caller: conditional ones get their condition pushed.
+static bool operation(VM* vm, const uint8_t* ip) {
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+  Value* top = vm->stackTop;
+  switch (*ip) {
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      if (IS_NUMBER(top[-1]) && IS_NUMBER(top[-2])) {
+        top[-2] = NUMBER_VAL(AS_NUMBER(top[-2]) + AS_NUMBER(top[-1]));
+        vm->stackTop--;
+      } else if (IS_STRING(top[-1]) && IS_STRING(top[-2])) {
+        concatenate(vm);
+      } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return false;
+      }
+      return true;
+    case OP_SUB:
+    case OP_SUB_NUM:
+    case OP_MUL:
+    case OP_MUL_NUM:
+    case OP_DIV:
+    case OP_DIV_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+      // Compiled code only gets here when an operand is not a number.
+      runtimeError(vm, "Operands must be numbers.");
+      return false;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      bool equal = valuesEqual(top[-2], top[-1]);
+      top[-2] = BOOL_VAL(*ip == OP_NOT_EQUAL ? !equal : equal);
+      vm->stackTop--;
+      return true;
+    }
+    case OP_GET_GLOBAL_SLOT: {
+      uint16_t slot;
+      memcpy(&slot, ip + 1, sizeof(uint16_t));
+      Global* global = &vm->globals[slot];
+      if (!global->defined) {
+        runtimeError(vm, "Undefined variable '%.*s'.", global->nameLen, global->name);
+        return false;
       }
-      break;
+      *vm->stackTop++ = global->value;
+      return true;
+    }
+    case OP_SWING_RANGE:
+      // As with arithmetic, only when a bound is not a number.
+      runtimeError(vm, "Swing bounds must be numbers.");
+      return false;
+    case OP_SWING_STEP:
+      runtimeError(vm, "Swing variable must be a number.");
+      return false;
+    case OP_PRINT:
+      printValue(*--vm->stackTop);
+      printf("\n");
+      return true;
+    case OP_ASK: {
+      Value line = askLine(vm);
+      *vm->stackTop++ = line;
+      return true;
+    }
+    case OP_BUILD_BUNCH: {
+      Value bunch = newBunch(vm, top - ip[1], ip[1]);
+      vm->stackTop -= ip[1];
+      *vm->stackTop++ = bunch;
+      return true;
+    }
+    case OP_BUILD_CANOPY: {
+      Value canopy = newCanopy(vm, top - 2 * ip[1], ip[1]);
+      vm->stackTop -= 2 * ip[1];
+      *vm->stackTop++ = canopy;
+      return true;
+    }
+    case OP_GET_SUBSCRIPT: {
+      Value result;
+      if (!getSubscript(vm, top[-2], top[-1], &result)) return false;
+      vm->stackTop -= 2;
+      *vm->stackTop++ = result;
+      return true;
+    }
+    case OP_SET_SUBSCRIPT: {
+      Value value = top[-1];
+      if (!setSubscript(vm, top[-3], top[-2], value)) return false;
+      vm->stackTop -= 3;
+      *vm->stackTop++ = value;
+      return true;
+    }
+    case OP_STRLEN:
+      return stringLength(vm, top[-1], &top[-1]);
+    case OP_SHED:
+      return shedString(vm, top[-1], &top[-1]);
+    case OP_FORAGE:
+      return forage(vm, top[-1], &top[-1]);
+    case OP_GRAFT:
+    case OP_SCAN:
+    case OP_INSCRIBE: {
+      Value result;
+      bool ok = *ip == OP_GRAFT ? graftStrings(vm, top - 2, &result)
+              : *ip == OP_SCAN  ? scanString(vm, top - 2, &result)
+                                : inscribe(vm, top[-2], top[-1], &result);
+      if (!ok) return false;
+      vm->stackTop -= 2;
+      *vm->stackTop++ = result;
+      return true;
+    }
+    case OP_SLICE: {
+      Value result;
+      if (!sliceString(vm, top - 3, &result)) return false;
+      vm->stackTop -= 3;
+      *vm->stackTop++ = result;
+      return true;
+    }
+    case OP_CALL: {
+      // The callee runs to completion before compiled code goes on.
+      if (!callSite(vm, frame, ip, ip[1])) return false;
+      if (jitHot(vm, vm->frames[vm->frameCount - 1].function)) return finishFrame(vm);
+      vm->jitDepth++;
+      VMResult result = run(vm, vm->frameCount);
+      vm->jitDepth--;
+      return result == VM_RESULT_OK;
+    }
+    case OP_TAIL_CALL:
+      return tailCall(vm, frame, ip, ip[1]);
+    default:
+      runtimeError(vm, "Unknown opcode %d\n", *ip);
+      return false;
   }
 }
 
-void initVM(VM* vm) {
-  vm->stackTop = vm->stack;
-  vm->frameCount = 0;
-  vm->variableCount = 0;
-  vm->tryHandlerCount = 0;
-  vm->loop_counter_top = 0;
-  vm->objects = NULL;
-  vm->bytesAllocated = 0;
-  vm->nextGC = 1024 * 1024;
-  vm->bytecode = NULL;
-
-  vm->maxFrameCount = 0;
-  vm->objectsAllocated = 0;
-  vm->gcCycles = 0;
+// Compiled code keeps its values on the stack and reloads its frame after
+// every call into C, so each return to it is a safe point.
+bool jitOperation(VM* vm, const uint8_t* ip) {
+  if (!operation(vm, ip)) return false;
+  safePoint(vm);
+  return true;
 }
+#endif
+
+// The interpreter loop for register code. Frames, globals, constants, tumble
+// handlers and swing counters work as in run(). A frame's registers are the
+// stack slots from frame->slots on; R_ENTER sizes the window, and stackTop
+// stays at its end so that the collector sees every register. A call's
+// window starts at the callee's register in the caller's window, so the
+// arguments are already in place.
+static VMResult runRegisters(VM* vm) {
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+  Value* regs = frame->slots;
 
-void freeVM(VM* vm) {
-  while (vm->objects) {
-    Obj* obj = vm->objects;
-    vm->objects = obj->next;
-    freeObject(vm, obj);
+#ifdef APE_COMPUTED_GOTO
+#define DISPATCH()                                                   \
+  do {                                                               \
+    COUNT_INSTRUCTION(*frame->ip);                                   \
+    instruction = *frame->ip++;                                      \
+    goto *dispatchTable[instruction];                                \
+  } while (false)
+#define CASE(name) op_##name
+#define CASE_HALT op_halt
+#define CASE_UNKNOWN op_unknown
+#else
+#define DISPATCH() goto dispatch
+#define CASE(name) case name
+#define CASE_HALT case 255
+#define CASE_UNKNOWN default
+#endif
+#define LOAD_FRAME()                                                 \
+  do {                                                               \
+    frame = &vm->frames[vm->frameCount - 1];                         \
+    regs = frame->slots;                                             \
+  } while (false)
+#define THROW()                                                      \
+  do {                                                               \
+    if (!catchError(vm, 1)) return VM_RESULT_RUNTIME_ERROR;          \
+    LOAD_FRAME();                                                    \
+    DISPATCH();                                                      \
+  } while (false)
+#define RUNTIME_ERROR(...)                                           \
+  do {                                                               \
+    runtimeError(vm, __VA_ARGS__);                                   \
+    THROW();                                                         \
+  } while (false)
+#define REG(n) regs[frame->ip[n]]
+#define READ_OFFSET(n) (uint16_t)(frame->ip[n] << 8 | frame->ip[(n) + 1])
+#define READ_U16(n, into) memcpy(&(into), frame->ip + (n), sizeof(uint16_t))
+// `a = b op c` on numbers.
+#define REGISTER_BINARY(valueType, expression)                         \
+  do {                                                                 \
+    Value b = REG(1);                                                  \
+    Value c = REG(2);                                                  \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                              \
+      RUNTIME_ERROR("Operands must be numbers.");                      \
+    }                                                                  \
+    double x = AS_NUMBER(b);                                           \
+    double y = AS_NUMBER(c);                                           \
+    REG(0) = valueType(expression);                                    \
+    frame->ip += 3;                                                    \
+  } while (false)
+// Skips ahead unless `a op b` holds.
+#define REGISTER_COMPARE_JUMP(op)                                      \
+  do {                                                                 \
+    Value a = REG(0);                                                  \
+    Value b = REG(1);                                                  \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                              \
+      RUNTIME_ERROR("Operands must be numbers.");                      \
+    }                                                                  \
+    uint16_t offset = READ_OFFSET(2);                                  \
+    frame->ip += 4;                                                    \
+    if (!(AS_NUMBER(a) op AS_NUMBER(b))) frame->ip += offset;          \
+  } while (false)
+// `a = operation(args...)` through one of the shared helpers above.
+#define REGISTER_HELPER(length, call)                                  \
+  do {                                                                 \
+    Value result;                                                      \
+    if (!(call)) THROW();                                              \
+    REG(0) = result;                                                   \
+    frame->ip += (length);                                             \
+    safePoint(vm);                                                     \
+  } while (false)
+
+  uint8_t instruction;
+#ifdef APE_COMPUTED_GOTO
+  static void* dispatchTable[256];
+  if (dispatchTable[0] == NULL) {
+    for (int i = 0; i < 256; i++) dispatchTable[i] = &&op_unknown;
+#define DISPATCH_ENTRY(name) dispatchTable[name] = &&op_##name;
+    REGISTER_OPCODE_LIST(DISPATCH_ENTRY)
+#undef DISPATCH_ENTRY
+    dispatchTable[255] = &&op_halt;
+  }
+  DISPATCH();
+  {
+    {
+#else
+  for (;;) {
+  dispatch:
+    COUNT_INSTRUCTION(*frame->ip);
+    instruction = *frame->ip++;
+    switch (instruction) {
+#endif
+      CASE(R_ENTER): {
+        // The caller left stackTop just past the arguments. The registers
+        // after them start out nil rather than whatever an earlier frame
+        // left there, which the collector could no longer trust.
+        Value* top = regs + frame->ip[0];
+        for (Value* slot = vm->stackTop; slot < top; slot++) *slot = NIL_VAL;
+        vm->stackTop = top;
+        frame->ip++;
+        DISPATCH();
+      }
+      CASE(R_MOVE):
+        REG(0) = REG(1);
+        frame->ip += 2;
+        DISPATCH();
+      CASE(R_NUMBER): {
+        double num;
+        memcpy(&num, frame->ip + 1, sizeof(double));
+        REG(0) = NUMBER_VAL(num);
+        frame->ip += 1 + sizeof(double);
+        DISPATCH();
+      }
+      CASE(R_CONSTANT):
+      CASE(R_FUNCTION): {
+        uint16_t index;
+        READ_U16(1, index);
+        REG(0) = vm->constants[index];
+        frame->ip += 1 + sizeof(uint16_t);
+        DISPATCH();
+      }
+      CASE(R_NIL):
+        REG(0) = NIL_VAL;
+        frame->ip++;
+        DISPATCH();
+      CASE(R_TRUE):
+        REG(0) = BOOL_VAL(true);
+        frame->ip++;
+        DISPATCH();
+      CASE(R_FALSE):
+        REG(0) = BOOL_VAL(false);
+        frame->ip++;
+        DISPATCH();
+      CASE(R_GET_GLOBAL): {
+        uint16_t slot;
+        READ_U16(1, slot);
+        Global* global = &vm->globals[slot];
+        if (!global->defined) {
+          RUNTIME_ERROR("Undefined variable '%.*s'.", global->nameLen, global->name);
+        }
+        REG(0) = global->value;
+        frame->ip += 1 + sizeof(uint16_t);
+        DISPATCH();
+      }
+      CASE(R_SET_GLOBAL): {
+        uint16_t slot;
+        READ_U16(1, slot);
+        vm->globals[slot].value = REG(0);
+        vm->globals[slot].defined = true;
+        frame->ip += 1 + sizeof(uint16_t);
+        DISPATCH();
+      }
+      CASE(R_NOT):
+        REG(0) = BOOL_VAL(isFalsey(REG(1)));
+        frame->ip += 2;
+        DISPATCH();
+      CASE(R_ADD): {
+        Value b = REG(1);
+        Value c = REG(2);
+        if (IS_NUMBER(b) && IS_NUMBER(c)) {
+          REG(0) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+        } else if (IS_STRING(b) && IS_STRING(c)) {
+          REG(0) = OBJ_VAL(joinStrings(vm, AS_STRING(b), AS_STRING(c)));
+          safePoint(vm);
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        frame->ip += 3;
+        DISPATCH();
+      }
+      CASE(R_SUB):
+        REGISTER_BINARY(NUMBER_VAL, x - y);
+        DISPATCH();
+      CASE(R_MUL):
+        REGISTER_BINARY(NUMBER_VAL, x * y);
+        DISPATCH();
+      CASE(R_DIV):
+        REGISTER_BINARY(NUMBER_VAL, x / y);
+        DISPATCH();
+      CASE(R_EQUAL):
+        REG(0) = BOOL_VAL(valuesEqual(REG(1), REG(2)));
+        frame->ip += 3;
+        DISPATCH();
+      CASE(R_NOT_EQUAL):
+        REG(0) = BOOL_VAL(!valuesEqual(REG(1), REG(2)));
+        frame->ip += 3;
+        DISPATCH();
+      CASE(R_GREATER):
+        REGISTER_BINARY(BOOL_VAL, x > y);
+        DISPATCH();
+      CASE(R_GREATER_EQUAL):
+        REGISTER_BINARY(BOOL_VAL, !(x < y));
+        DISPATCH();
+      CASE(R_LESS):
+        REGISTER_BINARY(BOOL_VAL, x < y);
+        DISPATCH();
+      CASE(R_LESS_EQUAL):
+        REGISTER_BINARY(BOOL_VAL, !(x > y));
+        DISPATCH();
+      CASE(R_JUMP): {
+        uint16_t offset = READ_OFFSET(0);
+        frame->ip += 2 + offset;
+        DISPATCH();
+      }
+      CASE(R_LOOP): {
+        uint16_t offset = READ_OFFSET(0);
+        frame->ip += 2;
+        frame->ip -= offset;
+        DISPATCH();
+      }
+      CASE(R_JUMP_IF_FALSE): {
+        bool skip = isFalsey(REG(0));
+        uint16_t offset = READ_OFFSET(1);
+        frame->ip += 3;
+        if (skip) frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(R_JUMP_IF_TRUE): {
+        bool skip = !isFalsey(REG(0));
+        uint16_t offset = READ_OFFSET(1);
+        frame->ip += 3;
+        if (skip) frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(R_JUMP_IF_NOT_LESS):
+        REGISTER_COMPARE_JUMP(<);
+        DISPATCH();
+      CASE(R_JUMP_IF_NOT_GREATER):
+        REGISTER_COMPARE_JUMP(>);
+        DISPATCH();
+      CASE(R_JUMP_IF_NOT_EQUAL): {
+        bool skip = !valuesEqual(REG(0), REG(1));
+        uint16_t offset = READ_OFFSET(2);
+        frame->ip += 4;
+        if (skip) frame->ip += offset;
+        DISPATCH();
+      }
+      // Swing state lives in registers, as in the stack code's slots.
+      CASE(R_SWING_COUNT): {
+        Value* counter = &REG(0);
+        uint16_t offset = READ_OFFSET(1);
+        frame->ip += 3;
+        if (IS_NUMBER(*counter) && AS_NUMBER(*counter) > 1) {
+          *counter = NUMBER_VAL(AS_NUMBER(*counter) - 1);
+          frame->ip -= offset;
+        }
+        DISPATCH();
+      }
+      CASE(R_SWING_RANGE): {
+        Value* bounds = &REG(0);
+        if (!IS_NUMBER(bounds[0]) || !IS_NUMBER(bounds[1])) {
+          RUNTIME_ERROR("Swing bounds must be numbers.");
+        }
+        uint16_t offset = READ_OFFSET(1);
+        frame->ip += 3;
+        if (!(AS_NUMBER(bounds[0]) <= AS_NUMBER(bounds[1]))) frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(R_SWING_STEP): {
+        Value* bounds = &REG(0);
+        if (!IS_NUMBER(bounds[0])) RUNTIME_ERROR("Swing variable must be a number.");
+        uint16_t offset = READ_OFFSET(1);
+        double next = AS_NUMBER(bounds[0]) + 1;
+        bounds[0] = NUMBER_VAL(next);
+        frame->ip += 3;
+        if (next <= AS_NUMBER(bounds[1])) frame->ip -= offset;
+        DISPATCH();
+      }
+      CASE(R_PRINT):
+        printValue(REG(0));
+        printf("\n");
+        frame->ip++;
+        DISPATCH();
+      CASE(R_ASK): {
+        Value line = askLine(vm);
+        REG(0) = line;
+        frame->ip++;
+        safePoint(vm);
+        DISPATCH();
+      }
+      CASE(R_CALL): {
+        Value* window = regs + frame->ip[0];
+        uint8_t argCount = frame->ip[1];
+        frame->ip += 2;
+        vm->stackTop = window + argCount + 1;
+        if (!callSite(vm, frame, frame->ip - 3, argCount)) THROW();
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(R_TAIL_CALL): {
+        Value* window = regs + frame->ip[0];
+        uint8_t argCount = frame->ip[1];
+        uint8_t* entry;
+        ObjFunction* function =
+            resolveCall(vm, frame, frame->ip - 1, *window, argCount, &entry);
+        if (function == NULL || !fitFrame(vm, function, regs)) THROW();
+        // Growing the stack moves the registers. The callee and its
+        // arguments then take over this frame's.
+        LOAD_FRAME();
+        window = regs + frame->ip[0];
+        memmove(regs, window, sizeof(Value) * (argCount + 1));
+        vm->stackTop = regs + argCount + 1;
+        frame->function = function;
+        frame->ip = entry;
+        DISPATCH();
+      }
+      CASE(R_RETURN): {
+        Value result = REG(0);
+        vm->frameCount--;
+        if (vm->frameCount == 0) {
+          vm->stackTop = regs;
+          return VM_RESULT_OK;
+        }
+        // The callee's register in the caller's window takes the result.
+        regs[0] = result;
+        LOAD_FRAME();
+        vm->stackTop = regs + frame->function->registers;
+        DISPATCH();
+      }
+      CASE(R_BUILD_BUNCH): {
+        Value bunch = newBunch(vm, &REG(1), frame->ip[2]);
+        REG(0) = bunch;
+        frame->ip += 3;
+        safePoint(vm);
+        DISPATCH();
+      }
+      CASE(R_BUILD_CANOPY): {
+        Value canopy = newCanopy(vm, &REG(1), frame->ip[2]);
+        REG(0) = canopy;
+        frame->ip += 3;
+        safePoint(vm);
+        DISPATCH();
+      }
+      CASE(R_GET_SUBSCRIPT):
+        REGISTER_HELPER(3, getSubscript(vm, REG(1), REG(2), &result));
+        DISPATCH();
+      CASE(R_SET_SUBSCRIPT):
+        if (!setSubscript(vm, REG(0), REG(1), REG(2))) THROW();
+        frame->ip += 3;
+        DISPATCH();
+      CASE(R_SUMMON): {
+        // The path stays in its register while the module loads; the module
+        // function then takes its place as the callee of a call with no
+        // arguments. Loading can grow the stack, which moves the registers.
+        ObjFunction* module = summonModule(vm, REG(0), true);
+        if (module == NULL) THROW();
+        LOAD_FRAME();
+        Value* window = &REG(0);
+        *window = OBJ_VAL(module);
+        frame->ip++;
+        vm->stackTop = window + 1;
+        if (!call(vm, module, 0)) {
+          return VM_RESULT_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(R_FORAGE):
+        REGISTER_HELPER(2, forage(vm, REG(1), &result));
+        DISPATCH();
+      CASE(R_INSCRIBE):
+        REGISTER_HELPER(3, inscribe(vm, REG(1), REG(2), &result));
+        DISPATCH();
+      CASE(R_SLICE):
+        REGISTER_HELPER(2, sliceString(vm, &REG(1), &result));
+        DISPATCH();
+      CASE(R_GRAFT):
+        REGISTER_HELPER(2, graftStrings(vm, &REG(1), &result));
+        DISPATCH();
+      CASE(R_SCAN):
+        REGISTER_HELPER(2, scanString(vm, &REG(1), &result));
+        DISPATCH();
+      CASE(R_SHED):
+        REGISTER_HELPER(2, shedString(vm, REG(1), &result));
+        DISPATCH();
+      CASE(R_STRLEN):
+        REGISTER_HELPER(2, stringLength(vm, REG(1), &result));
+        DISPATCH();
+
+      CASE_HALT:
+        return VM_RESULT_OK;
+      CASE_UNKNOWN:
+        RUNTIME_ERROR("Unknown opcode %d\n", instruction);
+    }
   }
-  for (int i = 0; i < vm->variableCount; i++) free(vm->variables[i].name);
-  free(vm->bytecode);
+#undef LOAD_FRAME
+#undef THROW
+#undef RUNTIME_ERROR
+#undef REG
+#undef READ_OFFSET
+#undef READ_U16
+#undef REGISTER_BINARY
+#undef REGISTER_COMPARE_JUMP
+#undef REGISTER_HELPER
+#undef DISPATCH
+#undef CASE
+#undef CASE_HALT
+#undef CASE_UNKNOWN
 }
 
 VMResult interpret(VM* vm, const char* source) {
@@ -1026,93 +1574,52 @@ VMResult interpret(VM* vm, const char* source) {
     return VM_RESULT_RUNTIME_ERROR;
   }
 
-  if (!compile(source, mem_file, true)) {
+  if (!compile(source, mem_file, true, false, false)) {
     fclose(mem_file);
     free(bytecode_buffer);
     return VM_RESULT_COMPILE_ERROR;
   }
 
-  fflush(mem_file);
+  fclose(mem_file);
 
   ObjFunction* function =
-      (ObjFunction*)reallocate(vm, NULL, 0, sizeof(ObjFunction));
-  function->obj.type = OBJ_FUNCTION;
-  function->arity = 0;
-  function->name = NULL;
-
-  function->code = bytecode_buffer;
-  function->owner = NULL;
-  function->code_offset = 0;
-  function->isModule = true; 
+      loadModule(vm, bytecode_buffer, bytecode_size, NULL, "<repl>");
+  free(bytecode_buffer);
+  if (function == NULL) return VM_RESULT_COMPILE_ERROR;
 
   *vm->stackTop++ = OBJ_VAL(function);
-  call(vm, function, 0);
-  
-  if (vm->frameCount > vm->maxFrameCount) {
-      vm->maxFrameCount = vm->frameCount;
+  VMResult result =
+      call(vm, function, 0) ? run(vm, 1) : VM_RESULT_RUNTIME_ERROR;
+  if (result != VM_RESULT_OK) {
+    // Leave a clean stack for the next REPL line; globals survive.
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
   }
-
-  VMResult result = run(vm);
-  fclose(mem_file);
-
   return result;
 }
 
 VMResult runBytecode(VM* vm, const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (!file) {
+  size_t fileSize = 0;
+  uint8_t* image = readBytecodeFile(path, &fileSize);
+  if (image == NULL) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     return VM_RESULT_RUNTIME_ERROR;
   }
 
-  fseek(file, 0L, SEEK_END);
-  long fileSize = ftell(file);
-  rewind(file);
-  vm->bytecode = (uint8_t*)malloc(fileSize + 1);
-  if (vm->bytecode == NULL) exit(74);
-  fread(vm->bytecode, sizeof(uint8_t), fileSize, file);
-  fclose(file);
-  vm->bytecode[fileSize] = 255;
-
-  ObjFunction* topLevelFunc =
-      (ObjFunction*)reallocate(vm, NULL, 0, sizeof(ObjFunction));
-  memset(topLevelFunc, 0, sizeof(ObjFunction));
-  topLevelFunc->obj.type = OBJ_FUNCTION;
-  topLevelFunc->arity = 0;
-  
-  topLevelFunc->code = vm->bytecode;
-  topLevelFunc->owner = NULL;
-  topLevelFunc->code_offset = 0;
-  topLevelFunc->isModule = false; 
+  ObjString* nameString = copyString(vm, "script", 6);
+  *vm->stackTop++ = OBJ_VAL(nameString);
 
-  const char* script_name_literal = "script";
-  int name_len = strlen(script_name_literal);
-  size_t nameSize = sizeof(ObjString) + name_len + 1;
-  ObjString* nameString = (ObjString*)reallocate(vm, NULL, 0, nameSize);
-  nameString->obj.type = OBJ_STRING;
-  nameString->length = name_len;
-  nameString->chars = (char*)(nameString + 1);
-  strcpy(nameString->chars, script_name_literal);
-  topLevelFunc->name = nameString;
+  ObjFunction* topLevelFunc = loadModule(vm, image, fileSize, nameString, path);
+  free(image);
+  if (topLevelFunc == NULL) return VM_RESULT_RUNTIME_ERROR;
 
-  topLevelFunc->obj.isMarked = false;
-  topLevelFunc->obj.next = vm->objects;
-  vm->objects = (Obj*)topLevelFunc;
-  nameString->obj.isMarked = false;
-  nameString->obj.next = vm->objects;
-  vm->objects = (Obj*)nameString;
-  vm->frameCount = 1;
+  // The script function occupies slot 0 of its frame, like any other call.
+  vm->stackTop[-1] = OBJ_VAL(topLevelFunc);
+  call(vm, topLevelFunc, 0);
 
-  if (vm->frameCount > vm->maxFrameCount) {
-      vm->maxFrameCount = vm->frameCount;
-  }
-
-  CallFrame* frame = &vm->frames[0];
-  frame->function = topLevelFunc;
-  frame->ip = vm->bytecode;
-  frame->slots = vm->stack;
   printf("🌴 🦍  OOH-OOH-AAH-AAH!  WELCOME TO THE BANANA JUNGLE  🦍 🌴\n");
   printf("ApesLang VM Output\n");
-  VMResult result = run(vm);
+  vm->registerMode = topLevelFunc->registers > 0;
+  VMResult result = vm->registerMode ? runRegisters(vm) : run(vm, 1);
   return result;
-}
\ No newline at end of file
+}
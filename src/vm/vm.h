@@ -2,6 +2,7 @@
 #define APE_VM_H
 
 #include "../common.h"
+#include "memory.h"
 
 // The result of a VM execution
 typedef enum {
@@ -10,10 +11,22 @@ typedef enum {
   VM_RESULT_RUNTIME_ERROR
 } VMResult;
 
-#define STACK_MAX 256
-#define MEMORY_MAX 256
-#define FRAMES_MAX 64 // Maximum recursion depth
-#define HANDLER_MAX 16 // Max nested tumble blocks
+// GCC and Clang can dispatch through a table of label addresses
+// ("labels as values"); everything else falls back to a switch.
+#if defined(__GNUC__) && !defined(APE_NO_COMPUTED_GOTO)
+#define APE_COMPUTED_GOTO
+#endif
+
+// The value stack and the call frames grow on demand, up to a ceiling that
+// can be lowered or raised with the APE_MAX_STACK and APE_MAX_FRAMES
+// environment variables. The compiler records in each function's prototype
+// the most slots its code ever has in use (ObjFunction.stack), so growth is
+// only checked when a frame starts: on calls and tail calls, which make room
+// for the whole frame, and on summons, which need one slot for the loader.
+#define STACK_INITIAL 2048
+#define STACK_LIMIT_DEFAULT (4 * 1024 * 1024) // Values
+#define FRAMES_INITIAL 64
+#define FRAMES_LIMIT_DEFAULT 200000 // Maximum recursion depth
 
 typedef struct {
     ObjFunction* function;
@@ -21,47 +34,173 @@ typedef struct {
     Value* slots;      // Points to the first stack slot this function can use
 } CallFrame;
 
+// Globals live in one growable array. Each loaded .apb names the globals it
+// uses; the loader maps those names onto indices into this array once and
+// rewrites the slot operands in the code, so a global access at run time is a
+// plain array index.
 typedef struct {
     char* name;
     int nameLen;
     Value value;
-} Variable;
+    bool defined;
+} Global;
 
+#define GLOBALS_MAX (UINT16_MAX + 1) // Slot operands are 16 bits wide
+#define CONSTANTS_MAX (UINT16_MAX + 1)
+
+// The set of every live string, keyed by contents. All strings are created
+// through it, so two strings are equal exactly when they are the same object.
+// The table is weak: the collector drops entries for unmarked strings before
+// it frees them.
 typedef struct {
-    uint8_t* catchIp;     // Instruction pointer of the catch block
-    int frameCount;       // Which call frame this handler belongs to
-    Value* stackTop;      // The stack pointer to restore to
-} TryHandler;
+    ObjString** entries;  // NULL when empty, or a live string, or a tombstone
+    int count;            // live strings plus tombstones
+    int capacity;
+} StringTable;
+
+// Where the major collection is. Marking and sweeping are both done a slice
+// at a time, between which the program runs.
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING
+} GCPhase;
 
+// Pauses are counted in buckets of up to 10 us, 100 us, 1 ms, 10 ms and more.
+#define GC_PAUSE_BUCKETS 5
+
+// Objects that are marked and wait to have what they refer to marked.
 typedef struct {
-    uint8_t* bytecode;
+  Obj** items;
+  int count;
+  int capacity;
+} GrayStack;
+
+// The threads that share big slices of major collection work (see gcThreads).
+typedef struct GCWorkers GCWorkers;
+
+struct VM {
     uint8_t* ip;
 
-    Obj* objects; 
+    Obj* promoted;        // copies a minor collection has yet to scan
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    Value* stackEnd;      // One past the last allocated slot
+    int stackLimit;       // Ceiling for the stack, in values
 
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    int frameLimit;       // Ceiling for the recursion depth
     int maxFrameCount;
-
-    TryHandler tryHandlers[HANDLER_MAX];
-    int tryHandlerCount;
-
-    double loop_counters[STACK_MAX];
-    int loop_counter_top;
-
-    Variable variables[MEMORY_MAX];
-    int variableCount;
+    long framesPushed;    // calls that pushed a frame; tail calls reuse theirs
+    bool registerMode;    // running register code (compiled with --registers)
+    bool jitEnabled;      // compile hot tribes to machine code (see jit.h)
+    int jitDepth;         // compiled tribes and nested interpreter loops on the C stack
+
+    Value lastError;      // The message of the latest runtime error
+
+    // Constants of every loaded file, materialised once at load time and
+    // kept alive for the rest of the run. OP_CONSTANT indexes this array.
+    Value* constants;
+    int constantCount;
+    int constantCapacity;
+
+    StringTable strings;
+
+    Global* globals;
+    int globalCount;
+    int globalCapacity;
+    int* globalIndex;     // open-addressed name hash of index + 1, 0 when empty
+    int globalIndexCapacity;
+
+    // Call sites cache the function they last called (see CallCache). The
+    // epoch moves on whenever a cached function could stop being the one at
+    // its address: when a module loads new functions and when the collector
+    // frees one.
+    uint32_t cacheEpoch;
+
+    // Generations. Strings, bunches and canopies start in the nursery, a
+    // block they are bump-allocated from; a minor collection copies the ones
+    // still reachable to the old generation, the pool, and empties it. Old objects that may point into the nursery are remembered, so a
+    // minor collection finds the young objects they hold without looking at
+    // the rest of the old generation.
+    char* nursery;
+    char* nurseryTop;
+    size_t nurserySize;   // 0 when there is no nursery
+    bool nurseryFull;     // a minor collection is due at the next safe point
+    // Bytes allocated since the last minor collection, arrays included: a
+    // young bunch's values live outside the nursery, so the nursery alone
+    // would let them pile up.
+    size_t youngBytes;
+    int allocateOld;      // nesting of loaders, whose objects start old
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    Pool pool;            // where old objects and all arrays live
+
+    // Incremental major collections. Marking is tri-color: white objects are
+    // unmarked, gray ones are marked and wait in `gray` to have what they
+    // refer to marked, and black ones are marked and done with. Each slice
+    // does at most gcSliceBudget units of work, one per value scanned,
+    // bitmap word swept or object freed. Marks live in the pool's page
+    // bitmaps, not in the objects. While marking, writeBarrier() grays what a
+    // marked object is given, so no black object comes to hold a white one,
+    // and objects made old start gray. The roots take no barrier and are
+    // marked again, along with the nursery, when the gray list first runs
+    // dry. Sweeping then walks the bitmaps of the pages there were at that
+    // point; an object made where it has yet to reach starts marked.
+    GCPhase gcPhase;
+    GrayStack gray;
+    PoolPage* sweepPage;  // the page being swept
+    int sweepWord;        // and the next of its bitmap words to sweep
+    long gcSliceBudget;
+    size_t gcLimit;       // old bytes at which the rest of a cycle runs at once
+    // A slice of at least gcShareMin units, APE_GC_SHARE_MIN, shares its
+    // marking and sweeping among gcThreads threads, APE_GC_THREADS, where
+    // that is more than 1. That is above gcSliceBudget by default, so only
+    // the rest of a cycle run at once and the final marking pause are
+    // shared. It is never below a marking batch per thread, so every thread
+    // gets work. The threads are started the first time and wait between
+    // slices.
+    int gcThreads;
+    long gcShareMin;
+    GCWorkers* gcWorkers;
 
     // Stats
     size_t bytesAllocated;
+    size_t peakBytesAllocated;
     size_t nextGC;
     long objectsAllocated;
-    int gcCycles;
-
-} VM;
+    int gcCycles;            // major collections
+    long gcSlices;           // pauses major collections took
+    long gcSharedSlices;     // slices the gc threads shared
+    int minorCycles;
+    size_t promotedBytes;    // copied out of the nursery by minor collections
+    double majorPauseTotal;  // seconds
+    double majorPauseMax;    // the longest slice
+    double minorPauseTotal;
+    double minorPauseMax;
+    long pauseHistogram[GC_PAUSE_BUCKETS]; // every minor collection and slice
+    long internHits;      // string creations answered by an existing string
+    long internMisses;    // string creations that allocated a new one
+    long callCacheHits;   // calls whose site's cache already held the callee
+    long callCacheMisses; // calls that checked the callee and refilled the cache
+    long quickenings[256];    // generic sites rewritten into this quickened opcode
+    long quickenMisses[256];  // times this quickened opcode's guard failed
+    int jitCompiled;          // tribes compiled to machine code
+    int jitRejected;          // hot tribes the JIT left to the interpreter
+    size_t jitCodeBytes;
+
+#ifdef APE_PROFILE
+    uint64_t instructionCount;
+    uint64_t opcodeCounts[256];
+    uint64_t (*pairCounts)[256];  // [previous][next] executed back to back
+    uint8_t previousOpcode;
+#endif
+
+};
 
 void initVM(VM* vm);
 void freeVM(VM* vm);